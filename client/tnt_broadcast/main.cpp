@@ -1,133 +1,537 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <boost/asio/ip/udp.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/buffer.hpp>
+#include <boost/asio/connect.hpp>
 #include <boost/asio/io_service.hpp>
-#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
 
 #include <boost/program_options.hpp>
 
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/json_parser.hpp>
-
-#include "tclt.h"
-
 namespace asio = boost::asio;
 namespace ip = boost::asio::ip;
 namespace po = boost::program_options;
-namespace pt = boost::property_tree;
+
+typedef std::chrono::steady_clock clock_type;
 
 static const std::string DEFAULT_IP = "255.255.255.255";
 static const std::string DEFAULT_PORT = "3456";
 
 static const std::string DEFAULT_TNT_IP = "127.0.0.1";
 static const std::string DEFAULT_TNT_PORT = "4242";
+static const std::string DEFAULT_TNT_CPORT = "4243";
+
+/*
+ * The daemon tells the commands apart by their brackets, and drops the ones
+ * over 64 KiB (CLIENT_MSG_MAX). Each message is a whole JSON array, so the
+ * batches can be written back to back.
+ */
+static const std::size_t CONTROL_MESSAGE_MAX = 60000;
+
+/* Announcements of larger size are not ours */
+static const std::size_t ANNOUNCE_MAX = 512;
+
+/* Batches waiting for the daemon while it is unreachable */
+static const std::size_t CONTROL_QUEUE_MAX = 64;
+
+static const int RECONNECT_MIN = 1;
+static const int RECONNECT_MAX = 30;
+
+struct settings
+{
+    std::string                 bip;
+    unsigned short              bport;
+    std::string                 tnt_ip;
+    std::string                 tnt_port;
+    std::string                 tnt_cport;
+    std::vector<std::string>    interfaces;
+    int                         interval;   /* Seconds between announcements */
+    int                         expiry;     /* Seconds a peer is remembered */
+    int                         batch_delay;/* Milliseconds */
+    int                         stats;      /* Seconds between reports, 0 for none */
+};
+
+/*
+ * What went through the tool since the last report. The latency is the time
+ * from the announcement of a new peer to the end of the write telling the
+ * daemon about it.
+ */
+struct statistics
+{
+    std::uint64_t   sent = 0;
+    std::uint64_t   received = 0;
+    std::uint64_t   ignored = 0;
+    std::uint64_t   duplicates = 0;
+    std::uint64_t   peers = 0;
+    std::uint64_t   messages = 0;
+    std::uint64_t   bytes = 0;
+    std::uint64_t   dropped = 0;
+    std::uint64_t   reconnects = 0;
+    std::uint64_t   latency_count = 0;
+    double          latency_sum = 0;
+    double          latency_min = 0;
+    double          latency_max = 0;
+
+    void latency(clock_type::time_point since, clock_type::time_point now)
+    {
+        double us = std::chrono::duration<double, std::micro>(now - since).count();
+
+        if (this->latency_count == 0 || us < this->latency_min)
+            this->latency_min = us;
+        if (us > this->latency_max)
+            this->latency_max = us;
+        this->latency_sum += us;
+        ++this->latency_count;
+    }
+};
+
+/* A control message and the time each of its peers was heard */
+struct control_message
+{
+    std::string                         data;
+    std::vector<clock_type::time_point> heard;
+};
+
+static std::string
+json_escape(std::string const &in)
+{
+    std::string out;
+
+    for (char c : in)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char tmp[8];
+
+            std::snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+            out += tmp;
+        }
+        else
+            out += c;
+    }
+    return out;
+}
 
 class broadcaster
 {
-    ip::udp::socket     broadcast;
-    ip::udp::endpoint   local_endpoint;
-    ip::udp::endpoint   sender_endpoint;
+    settings const                  &conf;
+    asio::io_service                &io_service;
 
-    ip::tcp::iostream   tnetacle;
-    ip::tcp::endpoint   tnetacle_endpoint;
+    ip::udp::socket                 receiver;
+    ip::udp::endpoint               sender_endpoint;
+    ip::udp::endpoint               group_endpoint;
+    std::vector<char>               buffer;
 
-    asio::deadline_timer    announce;
+    /* One socket per interface we announce on, and what it says */
+    std::vector<std::unique_ptr<ip::udp::socket>>   announcers;
+    std::vector<std::string>                        announcements;
+    asio::steady_timer              announce;
+
+    /* The peers already reported, and until when */
+    std::unordered_map<std::string, clock_type::time_point> seen;
+    asio::steady_timer              expire;
+
+    /* The new peers not reported yet */
+    std::vector<std::pair<std::string, clock_type::time_point>> pending;
+    asio::steady_timer              batch;
+    bool                            batch_armed;
+
+    ip::tcp::socket                 tnetacle;
+    ip::tcp::resolver               resolver;
+    asio::steady_timer              reconnect;
+    int                             reconnect_delay;
+    bool                            connected;
+    bool                            writing;
+    std::deque<control_message>     queue;
+    std::vector<char>               discard;
+
+    asio::steady_timer              report;
+    statistics                      stats;
+    clock_type::time_point          report_start;
 
-    std::vector<char>  buffer;
-    pt::ptree                   request;
  public:
     broadcaster(asio::io_service &io_service,
-                std::string ip,
-                std::string port,
-                std::string tnt_ip,
-                std::string tnt_port)
-        : broadcast(io_service)
-        , local_endpoint(ip::address::from_string(ip), std::atoi(port.c_str()))
+                settings const &conf)
+        : conf(conf)
+        , io_service(io_service)
+        , receiver(io_service)
         , sender_endpoint{}
-        , tnetacle(tnt_ip, "4243")
-        , tnetacle_endpoint(ip::address::from_string(tnt_ip), std::atoi(tnt_port.c_str()))
+        , group_endpoint(ip::address::from_string(conf.bip), conf.bport)
+        , buffer(ANNOUNCE_MAX + 1)
         , announce(io_service)
-        , buffer(150)
-        , request{}
+        , expire(io_service)
+        , batch(io_service)
+        , batch_armed(false)
+        , tnetacle(io_service)
+        , resolver(io_service)
+        , reconnect(io_service)
+        , reconnect_delay(RECONNECT_MIN)
+        , connected(false)
+        , writing(false)
+        , discard(512)
+        , report(io_service)
+        , report_start(clock_type::now())
+    {
+        /* Everything sent to the port, whatever the interface */
+        this->receiver.open(ip::udp::v4());
+        this->receiver.set_option(asio::socket_base::reuse_address(true));
+        this->receiver.set_option(asio::socket_base::broadcast(true));
+        this->receiver.bind(ip::udp::endpoint(ip::address_v4::any(), conf.bport));
+
+        if (conf.interfaces.empty())
+        {
+            /* The receiving socket announces the node itself */
+            this->announcements.push_back(conf.tnt_ip + ":" + conf.tnt_port);
+        }
+        for (auto const &iface : conf.interfaces)
+        {
+            std::unique_ptr<ip::udp::socket> sock(new ip::udp::socket(io_service));
+
+            sock->open(ip::udp::v4());
+            sock->set_option(asio::socket_base::broadcast(true));
+            sock->bind(ip::udp::endpoint(ip::address::from_string(iface), 0));
+            this->announcers.push_back(std::move(sock));
+            /* The node is reachable on the address of the interface */
+            this->announcements.push_back(iface + ":" + conf.tnt_port);
+        }
+
+        std::cout << "announce to: " << this->group_endpoint << std::endl;
+        for (auto const &a : this->announcements)
+            std::cout << "announcing: " << a << std::endl;
+        std::cout << "tnetacle control: " << conf.tnt_ip << ":"
+                  << conf.tnt_cport << std::endl;
+    }
+
+    void start()
     {
-        broadcast.open(ip::udp::v4());
-        broadcast.set_option(asio::socket_base::broadcast(true));
-        broadcast.set_option(asio::socket_base::reuse_address(true));
+        this->do_announce();
+        this->do_receive();
+        this->do_connect();
+        this->arm_expire();
+        if (this->conf.stats > 0)
+            this->arm_report();
+    }
 
-        std::cout << "local endpoint: " << local_endpoint << std::endl;
-        std::cout << "tnetacle endpoint: " << tnetacle_endpoint << std::endl;
-        
-        broadcast.bind(local_endpoint);
+ private:
+    bool is_ours(std::string const &data) const
+    {
+        return std::find(this->announcements.begin(), this->announcements.end(),
+                         data) != this->announcements.end();
     }
 
-    void handl_recv(boost::system::error_code const &err, size_t bytes)
+    /* Announcements */
+
+    void do_announce()
     {
-        if (this->tnetacle && !err)
+        if (this->announcers.empty())
+        {
+            this->send_announce(this->receiver, this->announcements[0]);
+        }
+        else
         {
-            std::string data;
-            std::string tnetacle_pres;
+            for (std::size_t i = 0; i < this->announcers.size(); ++i)
+                this->send_announce(*this->announcers[i], this->announcements[i]);
+        }
+        this->announce.expires_from_now(std::chrono::seconds(this->conf.interval));
+        this->announce.async_wait([this](boost::system::error_code const &err)
+                                  {
+                                      if (!err)
+                                          this->do_announce();
+                                  });
+    }
 
-            data.assign(this->buffer.data());
-            tnetacle_pres.assign(this->tnetacle_endpoint.address().to_string());
+    void send_announce(ip::udp::socket &sock,
+                       std::string const &data)
+    {
+        auto msg = std::make_shared<std::string>(data);
 
-            if (data.find(tnetacle_pres) == std::string::npos)
+        sock.async_send_to(asio::buffer(*msg), this->group_endpoint,
+                           [this, msg](boost::system::error_code const &err, std::size_t)
+                           {
+                               if (err)
+                                   std::cerr << "announce: " << err.message() << std::endl;
+                               else
+                                   ++this->stats.sent;
+                           });
+    }
+
+    /* Reception, every new peer goes in the next batch */
+
+    void do_receive()
+    {
+        this->receiver.async_receive_from(asio::buffer(this->buffer),
+                                          this->sender_endpoint,
+                                          [this](boost::system::error_code const &err, std::size_t bytes)
+                                          {
+                                              if (!err)
+                                                  this->handle_recv(bytes);
+                                              this->do_receive();
+                                          });
+    }
+
+    void handle_recv(std::size_t bytes)
+    {
+        auto now = clock_type::now();
+
+        ++this->stats.received;
+        /* Truncated, or not an endpoint */
+        if (bytes == 0 || bytes > ANNOUNCE_MAX)
+        {
+            ++this->stats.ignored;
+            return;
+        }
+        std::string data(this->buffer.data(), bytes);
+
+        if (this->is_ours(data))
+        {
+            ++this->stats.ignored;
+            return;
+        }
+        auto until = now + std::chrono::seconds(this->conf.expiry);
+        auto it = this->seen.find(data);
+
+        if (it != this->seen.end() && it->second > now)
+        {
+            it->second = until;
+            ++this->stats.duplicates;
+            return;
+        }
+        this->seen[data] = until;
+        ++this->stats.peers;
+        this->pending.emplace_back(data, now);
+        if (!this->batch_armed)
+        {
+            this->batch_armed = true;
+            this->batch.expires_from_now(std::chrono::milliseconds(this->conf.batch_delay));
+            this->batch.async_wait([this](boost::system::error_code const &err)
+                                   {
+                                       this->batch_armed = false;
+                                       if (!err)
+                                           this->flush();
+                                   });
+        }
+    }
+
+    void arm_expire()
+    {
+        this->expire.expires_from_now(std::chrono::seconds(this->conf.expiry));
+        this->expire.async_wait([this](boost::system::error_code const &err)
+                                {
+                                    if (err)
+                                        return;
+                                    auto now = clock_type::now();
+
+                                    for (auto it = this->seen.begin(); it != this->seen.end();)
+                                    {
+                                        if (it->second <= now)
+                                            it = this->seen.erase(it);
+                                        else
+                                            ++it;
+                                    }
+                                    this->arm_expire();
+                                });
+    }
+
+    /*
+     * The pending peers become as few control messages as possible, a JSON
+     * array of AddContact commands each.
+     */
+    void flush()
+    {
+        control_message msg;
+
+        for (auto const &p : this->pending)
+        {
+            std::string cmd = "{\"AddContact\": {\"Ip\": \"" + json_escape(p.first)
+                + "\", \"Name\": \"" + json_escape(p.first)
+                + "\", \"Key\": \"\"}}";
+
+            if (!msg.data.empty()
+                && msg.data.size() + cmd.size() + 3 > CONTROL_MESSAGE_MAX)
             {
-                std::stringstream ssdata;
-
-                this->request.put("AddContact.Ip", data);
-                this->request.put("AddContact.Name", "bite");
-                this->request.put("AddContact.Key", "bitebitebite");
-                pt::json_parser::write_json(ssdata, this->request);
-                this->tnetacle << ssdata.str();
-                std::cerr << "send to [" << this->tnetacle_endpoint << "]: "
-                    << ssdata.str();
+                msg.data += "]\n";
+                this->enqueue(std::move(msg));
+                msg = control_message();
             }
+            msg.data += msg.data.empty() ? "[" : ", ";
+            msg.data += cmd;
+            msg.heard.push_back(p.second);
+        }
+        this->pending.clear();
+        if (!msg.data.empty())
+        {
+            msg.data += "]\n";
+            this->enqueue(std::move(msg));
         }
-        this->broadcast.async_receive_from(asio::buffer(this->buffer),
-                                           this->sender_endpoint,
-                                           [this](boost::system::error_code const &err, size_t bytes) {
-                                               this->handl_recv(err, bytes);
-                                           });
     }
 
-    void handle_announce(boost::system::error_code const &err)
+    /* The control connexion to the daemon */
+
+    void enqueue(control_message &&msg)
     {
-        if (!err)
+        if (this->queue.size() >= CONTROL_QUEUE_MAX)
         {
-            std::stringstream ss;
-
-            ss << this->tnetacle_endpoint;
-            this->broadcast.send_to(asio::buffer(ss.str()), local_endpoint);
-            this->announce.expires_from_now(boost::posix_time::seconds(5));
-            this->announce.async_wait([this](boost::system::error_code const &err)
-                                      {
-                                          this->handle_announce(err);
-                                      });
+            this->stats.dropped += this->queue.front().heard.size();
+            this->queue.pop_front();
         }
+        this->queue.push_back(std::move(msg));
+        this->do_write();
     }
 
-    void start()
+    void do_write()
     {
-        std::stringstream ss;
-
-        ss << this->tnetacle_endpoint;
-        this->broadcast.send_to(asio::buffer(ss.str()), local_endpoint);
-        this->broadcast.async_receive_from(asio::buffer(this->buffer),
-                                           this->sender_endpoint,
-                                           [this](boost::system::error_code const &err, size_t bytes)
-                                           {
-                                               this->handl_recv(err, bytes);
-                                           });
-        this->announce.expires_from_now(boost::posix_time::seconds(5));
-        this->announce.async_wait([this](boost::system::error_code const &err)
-                                  {
-                                      this->handle_announce(err);
-                                  });
+        if (!this->connected || this->writing || this->queue.empty())
+            return;
+        this->writing = true;
+        asio::async_write(this->tnetacle, asio::buffer(this->queue.front().data),
+                          [this](boost::system::error_code const &err, std::size_t bytes)
+                          {
+                              this->writing = false;
+                              if (err)
+                              {
+                                  this->disconnect(err);
+                                  return;
+                              }
+                              auto now = clock_type::now();
+
+                              for (auto const &t : this->queue.front().heard)
+                                  this->stats.latency(t, now);
+                              ++this->stats.messages;
+                              this->stats.bytes += bytes;
+                              this->queue.pop_front();
+                              this->do_write();
+                          });
+    }
+
+    void do_connect()
+    {
+        this->resolver.async_resolve(ip::tcp::resolver::query(this->conf.tnt_ip,
+                                                              this->conf.tnt_cport),
+                                     [this](boost::system::error_code const &err,
+                                            ip::tcp::resolver::iterator it)
+                                     {
+                                         if (err)
+                                         {
+                                             this->disconnect(err);
+                                             return;
+                                         }
+                                         asio::async_connect(this->tnetacle, it,
+                                                             [this](boost::system::error_code const &err,
+                                                                    ip::tcp::resolver::iterator)
+                                                             {
+                                                                 this->handle_connect(err);
+                                                             });
+                                     });
+    }
+
+    void handle_connect(boost::system::error_code const &err)
+    {
+        if (err)
+        {
+            this->disconnect(err);
+            return;
+        }
+        std::cout << "connected to " << this->tnetacle.remote_endpoint() << std::endl;
+        this->connected = true;
+        this->reconnect_delay = RECONNECT_MIN;
+        this->do_read();
+        this->do_write();
+    }
+
+    /* What the daemon answers is not used, but tells when it goes away */
+    void do_read()
+    {
+        this->tnetacle.async_read_some(asio::buffer(this->discard),
+                                       [this](boost::system::error_code const &err, std::size_t)
+                                       {
+                                           if (err)
+                                               this->disconnect(err);
+                                           else
+                                               this->do_read();
+                                       });
+    }
+
+    void disconnect(boost::system::error_code const &err)
+    {
+        boost::system::error_code ignored;
+
+        if (err == asio::error::operation_aborted)
+            return;
+        if (this->tnetacle.is_open())
+            this->tnetacle.close(ignored);
+        if (this->connected)
+        {
+            /* The daemon may have restarted, it gets everything again */
+            std::cerr << "tnetacle: " << err.message() << std::endl;
+            this->seen.clear();
+            ++this->stats.reconnects;
+        }
+        this->connected = false;
+        this->reconnect.expires_from_now(std::chrono::seconds(this->reconnect_delay));
+        this->reconnect.async_wait([this](boost::system::error_code const &err)
+                                   {
+                                       if (!err)
+                                           this->do_connect();
+                                   });
+        this->reconnect_delay = std::min(this->reconnect_delay * 2, RECONNECT_MAX);
+    }
+
+    /* Statistics */
+
+    void arm_report()
+    {
+        this->report.expires_from_now(std::chrono::seconds(this->conf.stats));
+        this->report.async_wait([this](boost::system::error_code const &err)
+                                {
+                                    if (err)
+                                        return;
+                                    this->print_stats();
+                                    this->arm_report();
+                                });
     }
 
+    void print_stats()
+    {
+        auto now = clock_type::now();
+        double secs = std::chrono::duration<double>(now - this->report_start).count();
+        statistics const &s = this->stats;
+        std::ostringstream out;
+
+        out.setf(std::ios::fixed);
+        out.precision(1);
+        out << "announces: sent " << s.sent
+            << ", received " << s.received << " (" << s.received / secs << "/s)"
+            << ", ignored " << s.ignored
+            << ", duplicates " << s.duplicates << std::endl
+            << "peers: new " << s.peers << ", known " << this->seen.size()
+            << ", dropped " << s.dropped << std::endl
+            << "control: " << s.messages << " messages, " << s.bytes << " bytes ("
+            << s.bytes / secs << " B/s), " << s.reconnects << " reconnects"
+            << (this->connected ? "" : ", disconnected") << std::endl;
+        if (s.latency_count > 0)
+            out << "latency: min " << s.latency_min
+                << "us, avg " << s.latency_sum / s.latency_count
+                << "us, max " << s.latency_max << "us" << std::endl;
+        std::cout << out.str();
+        this->stats = statistics();
+        this->report_start = now;
+    }
 };
 
 int
@@ -136,17 +540,30 @@ main(int argc, char *argv[])
     po::options_description desc("Allowed options");
     asio::io_service io_service;
     po::variables_map vm;
+    settings conf;
 
     desc.add_options()
         ("help", "show this message")
-        ("ip", po::value<std::string>()->default_value(DEFAULT_TNT_IP),
+        ("ip", po::value<std::string>(&conf.tnt_ip)->default_value(DEFAULT_TNT_IP),
              "set the tNETacle node ip")
-        ("port", po::value<std::string>()->default_value(DEFAULT_TNT_PORT),
+        ("port", po::value<std::string>(&conf.tnt_port)->default_value(DEFAULT_TNT_PORT),
              "set the tNETacle port")
-        ("bip", po::value<std::string>()->default_value(DEFAULT_IP),
-             "set the broadcast ip")
-        ("bport", po::value<std::string>()->default_value(DEFAULT_PORT),
+        ("cport", po::value<std::string>(&conf.tnt_cport)->default_value(DEFAULT_TNT_CPORT),
+             "set the tNETacle client port")
+        ("bip", po::value<std::string>(&conf.bip)->default_value(DEFAULT_IP),
              "set the broadcast ip")
+        ("bport", po::value<unsigned short>(&conf.bport)->default_value(std::atoi(DEFAULT_PORT.c_str())),
+             "set the broadcast port")
+        ("iface", po::value<std::vector<std::string>>(&conf.interfaces)->composing(),
+             "announce from this local address, may be repeated")
+        ("interval", po::value<int>(&conf.interval)->default_value(5),
+             "seconds between two announcements")
+        ("expiry", po::value<int>(&conf.expiry)->default_value(60),
+             "seconds a silent peer is remembered")
+        ("batch", po::value<int>(&conf.batch_delay)->default_value(50),
+             "milliseconds the new peers are gathered before being sent")
+        ("stats", po::value<int>(&conf.stats)->default_value(10),
+             "seconds between two statistics reports, 0 for none")
     ;
     po::store(po::parse_command_line(argc, argv, desc), vm);
     po::notify(vm);
@@ -155,15 +572,18 @@ main(int argc, char *argv[])
     {
         std::cout << desc;
     }
+    else if (conf.interval <= 0 || conf.expiry <= 0 || conf.batch_delay < 0
+             || conf.stats < 0)
+    {
+        std::cerr << "the delays must be positive" << std::endl;
+        return (1);
+    }
     else
     {
-        broadcaster b(io_service,
-                      vm["bip"].as<std::string>(),
-                      vm["bport"].as<std::string>(),
-                      vm["ip"].as<std::string>(),
-                      vm["port"].as<std::string>());
-       b.start();
-       io_service.run();
+        broadcaster b(io_service, conf);
+
+        b.start();
+        io_service.run();
     }
     return (0);
 }
@@ -0,0 +1,128 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef BOND_W8FQ3MZE
+#define BOND_W8FQ3MZE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event2/util.h>
+#include "networking.h"
+#include "endpoint.h"
+#include "probe.h"
+
+/*
+ * Multipath peers.
+ *
+ * Every UDP socket of a node is advertised on its meta-connexions. A peer
+ * then gets one path per pair of our socket and its address, the first one
+ * being the path it was registered with. The keepalives probe each path
+ * every BOND_PROBE_INTERVAL ms (see keepalive.h). A path missing PROBE_DEAD
+ * probes in a row is not used until it answers again, the frames go on the
+ * others without any new handshake.
+ *
+ * The frames are scheduled on the paths by the "Multipath" policy:
+ *  - redundant: a copy on every live path, the first one to arrive wins. The
+ *    copies are sealed once, the replay window of the receiver drops the
+ *    others. Peers without data channel keys get the fastest path only.
+ *  - weighted: a smooth weighted round-robin, the weights following the
+ *    round trip time and the losses of the paths.
+ *  - latency: the live path with the lowest round trip time.
+ *
+ * The receiver holds the sealed datagrams arriving ahead of a gap for
+ * "ReorderDelay" us at most, so the paths of different latencies don't
+ * reorder the tunneled flows.
+ *
+ * The path MTU is the one discovered on the first path.
+ */
+#define BOND_PATHS_MAX      8
+#define BOND_PROBE_INTERVAL 250     /* ms between two probes of a path */
+#define BOND_WEIGHT_MAX     100
+#define BOND_REORDER_MAX    64      /* Datagrams held per peer */
+
+struct udp_transport;
+
+struct bond_path
+{
+    struct endpoint         addr;
+    struct udp_transport    *transport;
+    struct probe_metric     metric;
+    int                     weight;
+    int                     current;    /* Round-robin credit */
+};
+
+/* A sealed datagram, opened, waiting for the ones before it */
+struct bond_held
+{
+    uint64_t                seq;
+    unsigned char           *buf;       /* Header included */
+    size_t                  len;
+    struct timeval          deadline;
+};
+
+struct bond_reorder
+{
+    uint64_t                next;       /* Next sequence number expected */
+    int                     started;
+    int                     draining;   /* A fiber is delivering them */
+    size_t                  count;
+    struct bond_held        held[BOND_REORDER_MAX]; /* By sequence number */
+};
+
+struct bond
+{
+    struct bond_path        paths[BOND_PATHS_MAX];
+    size_t                  count;
+    struct bond_reorder     reorder;
+};
+
+struct server;
+struct mc;
+struct udp;
+struct udp_peer;
+
+void bond_free(struct bond *b);
+
+int bond_has_path(struct bond const *b,
+                  struct endpoint const *e);
+
+size_t bond_pick(struct udp_peer *peer,
+                 struct bond_path **paths);
+
+void bond_weigh(struct bond *b);
+
+int bond_paths(struct server *s,
+               struct mc *mc,
+               unsigned char const *value,
+               size_t len);
+
+int bond_reorder_push(struct bond_reorder *r,
+                      uint64_t seq,
+                      unsigned char const *dgram,
+                      size_t len,
+                      struct timeval const *now);
+
+int bond_reorder_pop(struct bond_reorder *r,
+                     struct timeval const *now,
+                     struct bond_held *h);
+
+int bond_reorder_next(struct bond_reorder const *r,
+                      struct timeval *deadline);
+
+void
+server_bond(void *ctx);
+
+#endif /* end of include guard: BOND_W8FQ3MZE */
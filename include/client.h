@@ -28,6 +28,21 @@ struct bufferevent;
 # define ssize_t SSIZE_T
 #endif
 
+/*
+ * The commands of a client are JSON values, sent back to back on the
+ * stream: their brackets tell where each one ends. A command larger than
+ * CLIENT_MSG_MAX bytes is dropped, up to its last bracket.
+ */
+#define CLIENT_MSG_MAX  65536
+
+/* Where the scan of a command stopped, to go on with the next bytes */
+struct client_scan
+{
+    int depth;
+    int string;
+    int escaped;
+};
+
 struct t_internal
 {
     struct bufferevent *bev;
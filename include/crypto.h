@@ -0,0 +1,96 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef CRYPTO_Q8ZK4WTF
+#define CRYPTO_Q8ZK4WTF
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * We include this one after networking.h because openssl includes windows.h
+ * leading to a redifinition of most of the wsaapi symbols on Windows.
+ */
+#include "networking.h"
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+
+#define CRYPTO_KEY_SIZE     32 /* AES-256 */
+#define CRYPTO_SALT_SIZE    4
+#define CRYPTO_SEQ_SIZE     8
+#define CRYPTO_TAG_SIZE     16
+#define CRYPTO_NONCE_SIZE   (CRYPTO_SALT_SIZE + CRYPTO_SEQ_SIZE)
+
+/* Bytes added to every sealed payload: the sequence number and the tag */
+#define CRYPTO_OVERHEAD     (CRYPTO_SEQ_SIZE + CRYPTO_TAG_SIZE)
+
+/* Maximum number of operations handled by a single burst call */
+#define CRYPTO_BURST_MAX    64
+
+/*
+ * The data channel keys of a peer. One AEAD context per direction, keyed and
+ * salted once when the keys are installed: a packet only sets its sequence
+ * number.
+ */
+struct crypto_state
+{
+    EVP_CIPHER_CTX  *enc;
+    EVP_CIPHER_CTX  *dec;
+    uint64_t        tx_seq;
+    int             enabled;
+};
+
+/*
+ * One entry of a burst.
+ *
+ * When sealing, in/in_len is the clear payload and out receives
+ * [seq][ciphertext][tag], out_len being set to in_len + CRYPTO_OVERHEAD.
+ * When opening, in/in_len is the [seq][ciphertext][tag] block, out receives
+ * the clear payload, out_len its size, and seq the sequence number read.
+ *
+ * The aad is authenticated but not encrypted, it is the packet header.
+ * err is set to -1 if the operation failed, 0 otherwise.
+ */
+struct crypto_op
+{
+    struct crypto_state     *cs;
+    unsigned char const     *aad;
+    size_t                  aad_len;
+    unsigned char const     *in;
+    size_t                  in_len;
+    unsigned char           *out;
+    size_t                  out_len;
+    uint64_t                seq;
+    int                     err;
+};
+
+int crypto_init(struct crypto_state *cs,
+                unsigned char const *tx_key,
+                unsigned char const *tx_salt,
+                unsigned char const *rx_key,
+                unsigned char const *rx_salt);
+
+int crypto_init_from_ssl(struct crypto_state *cs,
+                         SSL *ssl);
+
+void crypto_free(struct crypto_state *cs);
+
+size_t crypto_seal_burst(struct crypto_op *ops,
+                         size_t count);
+
+size_t crypto_open_burst(struct crypto_op *ops,
+                         size_t count);
+
+#endif /* end of include guard: CRYPTO_Q8ZK4WTF */
@@ -18,8 +18,17 @@
 
 #include "networking.h"
 
+struct server;
+struct frame;
+
 #define FRAME_DYN_SIZE 1600
 
+/* What a frame may carry besides the packet: ethernet header and VLAN tag */
+#define FRAME_L2_OVERHEAD 18
+
+unsigned int
+device_frame_max(void);
+
 #if defined Windows
 
 void
@@ -28,6 +37,15 @@ send_buffer_to_device_thread(struct server *s,
 
 #endif
 
+void
+device_write(void *async_ctx,
+             struct server *s,
+             struct frame *frame);
+
+void
+device_flush(void *async_ctx,
+             struct server *s);
+
 void
 server_device(void *ctx);
 
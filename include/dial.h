@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef DIAL_Q5NW8JTA
+#define DIAL_Q5NW8JTA
+
+#include <stddef.h>
+
+#include <event2/util.h>
+#include "networking.h"
+
+/*
+ * The meta-connexions to the PeerAddress are kept up by a single fiber.
+ *
+ * A peer we are neither connected nor connecting to is dialed again after a
+ * delay doubling with every failure, from DIAL_BASE seconds up to
+ * "ReconnectMax". Only a random part of the delay, from half of it to all
+ * of it, is waited: the nodes which lost each other at the same time don't
+ * dial back together. No more than "MaxDials" dials are in flight at once,
+ * one taking longer than DIAL_TIMEOUT seconds is abandoned. A peer which
+ * connected to us counts as well.
+ *
+ * The PeerAddress given by name are resolved with evdns, all at once, and
+ * again when their TTL expires. A new address is only used for the next
+ * dial, the meta-connexion to the old one is kept.
+ *
+ * The nodes found by the discovery are dialed the same way, so a flood of
+ * announcements can't get past "MaxDials" and the backoff. No more than
+ * DIAL_DISCOVERED_MAX of them are kept, each one forgotten after
+ * DIAL_FORGET failures in a row: the discovery brings it back if it still
+ * announces itself.
+ *
+ * On reload, the peers still configured and the discovered ones are left as
+ * they are.
+ */
+#define DIAL_BASE           1
+#define DIAL_TIMEOUT        30
+#define DIAL_SHIFT_MAX      16
+#define DIAL_TTL_MIN        10      /* Seconds */
+#define DIAL_TTL_MAX        3600
+#define DIAL_RESOLVE_RETRY  30      /* After a failed resolution */
+#define DIAL_DISCOVERED_MAX 64
+#define DIAL_FORGET         4
+
+enum dial_state
+{
+    DIAL_RESOLVING,     /* Named, no address yet */
+    DIAL_WAITING,       /* Until due */
+    DIAL_PENDING,       /* Connecting, given up at due */
+    DIAL_CONNECTED,
+};
+
+struct dial;
+struct evdns_request;
+
+struct dial_target
+{
+    struct sockaddr_storage addr;   /* Dialed */
+    socklen_t               len;
+    enum dial_state         state;
+    int                     failures;   /* In a row */
+    int                     discovered; /* Not in the configuration */
+    struct timeval          due;
+    /* Only for the named peers */
+    char                    *host;
+    unsigned short          port;
+    struct sockaddr_storage fresh;      /* Resolved, dialed once idle */
+    socklen_t               fresh_len;
+    struct evdns_request    *req;
+    int                     ipv6;       /* req is the AAAA query */
+    struct timeval          expire;     /* Resolved again from then */
+    struct dial             *dial;
+    int                     removed;    /* Freed once req calls back */
+};
+
+/* The addresses of a meta-connexions vector, sorted */
+struct dial_set
+{
+    struct sockaddr         **addrs;
+    size_t                  count;
+    size_t                  size;
+};
+
+struct server;
+struct evdns_base;
+
+struct dial
+{
+    struct server           *s;
+    struct evdns_base       *dns;       /* NULL without named peers */
+    struct dial_target      **targets;
+    size_t                  count;
+    struct dial_set         established;
+    struct dial_set         pending;
+};
+
+struct vector_sockaddr;
+struct vector_peername;
+
+struct dial *dial_new(struct server *s,
+                      struct vector_sockaddr *addrs,
+                      struct vector_peername *names);
+
+void dial_delete(struct dial *d);
+
+int dial_reload(struct dial *d,
+                struct vector_sockaddr *addrs,
+                struct vector_peername *names);
+
+int dial_discovered(struct dial *d,
+                    struct sockaddr const *sa,
+                    socklen_t len);
+
+void dial_wake(struct server *s);
+
+void
+server_dial(void *ctx);
+
+#endif /* end of include guard: DIAL_Q5NW8JTA */
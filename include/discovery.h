@@ -0,0 +1,85 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef DISCOVERY_H8TB3KXV
+#define DISCOVERY_H8TB3KXV
+
+#include <stdint.h>
+
+#include <event2/util.h>
+#include "networking.h"
+
+/*
+ * The nodes of a same link find each other on their own: each one
+ * multicasts a small announcement, at startup then every
+ * DISCOVERY_INTERVAL seconds:
+ *
+ *     [magic:16][version:8][caps:8][node id:64][meta-connexion port:16]
+ *
+ * The node with the lowest id hands the other one to the dialing (see
+ * dial.h), the other answers with its own announcement so that it doesn't
+ * have to wait for the next one, once every DISCOVERY_REPLY_GAP seconds at
+ * most: anyone can send announcements with made up ids. A node is then left
+ * alone for DISCOVERY_HOLD seconds: the announcements of the nodes we know
+ * only cost a cache lookup.
+ */
+#define DISCOVERY_GROUP         "239.255.42.42"
+#define DISCOVERY_PORT          4244
+#define DISCOVERY_MAGIC         0x744e  /* "tN" */
+#define DISCOVERY_VERSION       1
+#define DISCOVERY_SIZE          14
+#define DISCOVERY_INTERVAL      5       /* Seconds */
+#define DISCOVERY_HOLD          30
+#define DISCOVERY_REPLY_GAP     1
+#define DISCOVERY_CACHE_SETS    64
+#define DISCOVERY_CACHE_WAYS    4
+
+/* What the node does, a TLS node and a clear one can't peer */
+#define DISCOVERY_CAP_TLS       0x01
+#define DISCOVERY_CAP_DTLS      0x02
+#define DISCOVERY_CAP_ROUTING   0x04
+#define DISCOVERY_CAP_MULTIPATH 0x08
+#define DISCOVERY_CAP_PUNCH     0x10
+
+struct discovery_entry
+{
+    uint64_t            id;
+    struct timeval      held;       /* Ignored until then */
+};
+
+struct event;
+struct server;
+
+struct discovery
+{
+    struct server           *s;
+    evutil_socket_t         fd;
+    struct sockaddr_in      group;
+    struct event            *read_ev;
+    struct event            *announce_ev;
+    unsigned char           caps;
+    unsigned char           msg[DISCOVERY_SIZE];
+    struct timeval          replied;    /* Last answer to an announcement */
+    struct discovery_entry  cache[DISCOVERY_CACHE_SETS][DISCOVERY_CACHE_WAYS];
+};
+
+struct discovery *discovery_new(struct server *s,
+                                unsigned short port);
+
+void discovery_start(struct discovery *d);
+
+void discovery_delete(struct discovery *d);
+
+#endif /* end of include guard: DISCOVERY_H8TB3KXV */
@@ -16,35 +16,70 @@
 #ifndef DTLS_B4BZSCI2
 #define DTLS_B4BZSCI2
 
+#include "networking.h"
+#include <openssl/ssl.h>
+#include "endpoint.h"
+
+/* Datagrams kept in each direction while a handshake is running */
+#define DTLS_QUEUE_LEN      4
+#define DTLS_DGRAM_MAX      1500
+
 struct udp_peer;
 struct udp;
 
-int dtls_new_peer(SSL_CTX *ctx,
+struct dtls_dgram
+{
+    size_t          len;
+    unsigned char   data[DTLS_DGRAM_MAX];
+};
+
+/*
+ * The state behind the BIO of a peer: the datagrams received for OpenSSL,
+ * and the ones it wants to send. It keeps the datagram boundaries, which a
+ * BIO pair would lose.
+ */
+struct dtls_link
+{
+    struct endpoint     remote;
+    struct dtls_dgram   in[DTLS_QUEUE_LEN];
+    size_t              in_head;
+    size_t              in_count;
+    struct dtls_dgram   out[DTLS_QUEUE_LEN];
+    size_t              out_head;
+    size_t              out_count;
+};
+
+/* A session we can resume with a DTLS server */
+struct dtls_session
+{
+    struct endpoint     remote;
+    SSL_SESSION         *session;
+};
+
+#define VECTOR_TYPE struct dtls_session
+#define VECTOR_PREFIX dtls_sess
+#include "vector.h"
+
+SSL_CTX *create_udp_ctx(SSL_CTX *tls);
+
+int dtls_new_peer(struct udp *udp,
                   struct udp_peer *p);
 
-SSL_CTX *create_udp_ctx(void);
-
-ssize_t dtls_recvfrom(int sockfd,
-              void *buf,
-              size_t len,
-              int flags,
-              struct sockaddr *addr,
-              int *socklen,
-              struct udp *udp,
-              void *async_ctx);
-
-ssize_t dtls_sendto(int sockfd,
-                    void const *buf,
-                    size_t len,
-                    int flags,
-                    struct sockaddr const *addr,
-                    int socklen,
-                    struct udp_peer *perr,
-                    void *async_ctx);
+int dtls_is_record(unsigned char const *buf,
+                   size_t len);
+
+void dtls_input(struct udp *udp,
+                struct endpoint const *remote,
+                unsigned char const *buf,
+                size_t len);
 
 ssize_t dtls_do_handshake(int fd,
                           struct udp *udp,
                           struct udp_peer *peer,
                           void *async_ctx);
 
+void dtls_free(struct udp_peer *p);
+
+void dtls_sessions_free(struct vector_dtls_sess *sessions);
+
 #endif /* end of include guard: DTLS_B4BZSCI2 */
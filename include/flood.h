@@ -0,0 +1,88 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef FLOOD_T6MWQ2RC
+#define FLOOD_T6MWQ2RC
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Flooding of the frames over the mesh.
+ *
+ * Every node tells its peers, over the meta-connexions, its node id and the
+ * ids of its own peers. A frame received from a peer is then only relayed
+ * to the peers which are not its neighbours: the peer sent them the frame
+ * itself, or its upstream did.
+ *
+ * Every frame carries the id of the node it comes from and a sequence
+ * number of this node, see PACKET_ROUTED. The frames seen recently are
+ * remembered by them, a frame which comes back through another path is
+ * dropped instead of looping. Identical frames, such as duplicate TCP ACKs,
+ * still have their own number.
+ */
+#define FLOOD_CACHE_SETS    1024
+#define FLOOD_CACHE_WAYS    4
+
+/* Milliseconds a frame is remembered */
+#define FLOOD_CACHE_TTL     500
+
+struct flood_entry
+{
+    uint64_t        origin;
+    uint32_t        seq;
+    uint32_t        expire;
+};
+
+struct flood
+{
+    uint64_t            self;       /* Our node id */
+    uint32_t            seq;        /* Of our last frame */
+    uint64_t            dropped;    /* Duplicates dropped */
+    struct flood_entry  cache[FLOOD_CACHE_SETS][FLOOD_CACHE_WAYS];
+};
+
+/* What a peer told us about itself, id is 0 until it did */
+struct flood_peer
+{
+    uint64_t        id;
+    uint64_t        *neighbours;    /* Sorted */
+    size_t          count;
+};
+
+struct flood *flood_new(void);
+
+void flood_delete(struct flood *f);
+
+uint64_t flood_hash(void const *data,
+                    size_t len);
+
+uint32_t flood_now(void);
+
+int flood_seen(struct flood *f,
+               uint64_t origin,
+               uint32_t seq,
+               uint32_t now);
+
+int flood_peer_set(struct flood_peer *p,
+                   unsigned char const *value,
+                   size_t len);
+
+int flood_covers(struct flood_peer const *from,
+                 struct flood_peer const *to);
+
+void flood_peer_free(struct flood_peer *p);
+
+#endif /* end of include guard: FLOOD_T6MWQ2RC */
@@ -16,10 +16,17 @@
 #ifndef FRAME_LNIPE9IR
 #define FRAME_LNIPE9IR
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct vector_frame;
 
+/*
+ * raw_packet is where the packet_hdr in front of the frame starts, its length
+ * depends on the size of the frame.
+ */
 struct frame {
-    unsigned short size;
+    unsigned int size;
     void *frame;
     void *raw_packet;
 };
@@ -28,6 +35,14 @@ struct frame {
 #define VECTOR_PREFIX frame
 #include "vector.h"
 
+/* What a routed header says after the size of the frame */
+struct packet_route {
+    uint64_t src;
+    uint64_t dst;
+    unsigned int ttl;
+    uint32_t seq;
+};
+
 void
 frame_free(struct frame const *f);
 
@@ -35,4 +50,38 @@ int
 frame_alloc(struct frame *frame,
             unsigned int size);
 
+void
+frame_set_hdr(struct frame *frame);
+
+void
+frame_set_routed_hdr(struct frame *frame,
+                     struct packet_route const *r);
+
+size_t
+packet_hdr_len(unsigned int size);
+
+size_t
+packet_hdr_write(unsigned char *p,
+                 unsigned int size,
+                 unsigned int flags);
+
+size_t
+packet_hdr_read(unsigned char const *p,
+                size_t len,
+                unsigned int *size,
+                unsigned int *flags);
+
+int
+packet_aggregate_next(unsigned char **p,
+                      unsigned char *end,
+                      struct frame *sub);
+
+void
+packet_route_get(unsigned char const *hdr,
+                 struct packet_route *r);
+
+void
+packet_route_set(unsigned char *hdr,
+                 struct packet_route const *r);
+
 #endif /* end of include guard: FRAME_LNIPE9IR */
@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef HANDSHAKE_T3HW8QCE
+#define HANDSHAKE_T3HW8QCE
+
+#include <event2/util.h>
+#include "networking.h"
+#include <openssl/ssl.h>
+
+/* Handshakes queued or running at once, the others are done inline */
+#define HS_QUEUE_MAX        256
+
+/* Seconds a handshake has to complete, from the connexion */
+#define HS_TIMEOUT          10
+
+/* Handshakes a same address may have in flight */
+#define HS_SOURCE_MAX       4
+
+#define HS_DEFAULT_THREADS  2
+
+struct event_base;
+struct event;
+struct hs_pool;
+
+/*
+ * A TLS handshake run by the pool, connect is set when it connected to addr
+ * first. On completion, err is 0 and fd a non-blocking socket with its SSL
+ * ready for a BUFFEREVENT_SSL_OPEN bufferevent; err is -1 on failure and 1
+ * while it runs.
+ */
+struct hs_job
+{
+    evutil_socket_t         fd;
+    SSL                     *ssl;
+    struct sockaddr_storage addr;
+    socklen_t               addrlen;
+    int                     connect;
+    int                     connecting; /* Until the socket is connected */
+    int                     err;
+    unsigned long           sslerr;
+    short                   want;       /* What the last step waits for */
+    struct timeval          deadline;
+    struct event            *ev;
+    struct hs_pool          *pool;
+    struct hs_job           *next;      /* In the todo or done list */
+    struct hs_job           *all_next;  /* In the jobs of the pool */
+};
+
+typedef void (*hs_done_cb)(struct hs_job *job, void *ctx);
+
+struct hs_pool *hs_pool_new(struct event_base *evbase,
+                            size_t nthreads,
+                            hs_done_cb cb,
+                            void *ctx);
+
+void hs_pool_delete(struct hs_pool *pool);
+
+int hs_pool_busy(struct hs_pool *pool,
+                 struct sockaddr const *addr);
+
+struct hs_job *hs_pool_submit(struct hs_pool *pool,
+                              evutil_socket_t fd,
+                              SSL *ssl,
+                              struct sockaddr const *addr,
+                              socklen_t addrlen);
+
+void hs_job_free(struct hs_job *job);
+
+#endif /* end of include guard: HANDSHAKE_T3HW8QCE */
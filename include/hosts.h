@@ -0,0 +1,72 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef HOSTS_R7DV2KQN
+#define HOSTS_R7DV2KQN
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "endpoint.h"
+
+/*
+ * Behind which peer, or which node, the hosts of the tunnel live. It is
+ * learnt from the source addresses of the frames received, and forgotten
+ * once an address wasn't seen for HOSTS_AGEING ms. The hub keeps the peer,
+ * the routing the node.
+ *
+ * The addresses are the MAC ones on an ethernet tunnel, the IP ones
+ * otherwise.
+ */
+#define HOSTS_SETS          1024
+#define HOSTS_WAYS          4
+#define HOSTS_ADDR_MAX      16
+#define HOSTS_AGEING        300000
+
+struct host_addr
+{
+    unsigned char   bytes[HOSTS_ADDR_MAX];
+    size_t          len;
+    int             group;      /* Broadcast or multicast */
+};
+
+struct host_entry
+{
+    struct host_addr addr;
+    uint32_t        expire;     /* flood_now() ms */
+    struct endpoint peer;       /* Hub: zero addrlen for ours */
+    uint64_t        node;       /* Routing */
+};
+
+struct hosts
+{
+    struct host_entry   table[HOSTS_SETS][HOSTS_WAYS];
+};
+
+int host_addresses(void const *frame,
+                   size_t len,
+                   int layer2,
+                   struct host_addr *src,
+                   struct host_addr *dst);
+
+struct host_entry *hosts_learn(struct hosts *h,
+                               struct host_addr const *src,
+                               uint32_t now);
+
+struct host_entry const *hosts_lookup(struct hosts *h,
+                                      struct host_addr const *dst,
+                                      uint32_t now);
+
+#endif /* end of include guard: HOSTS_R7DV2KQN */
@@ -0,0 +1,49 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef HUB_P3JX8KVE
+#define HUB_P3JX8KVE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "endpoint.h"
+#include "hosts.h"
+
+/*
+ * Hub and spoke mode. The spokes only peer with the hub, which learns
+ * behind which spoke every source address lives and forwards the frames to
+ * their destination only. The unknown destinations, broadcast and multicast
+ * are flooded to every spoke but the source.
+ */
+struct hub
+{
+    struct hosts    hosts;
+};
+
+struct hub *hub_new(void);
+
+void hub_delete(struct hub *h);
+
+void hub_learn(struct hub *h,
+               struct host_addr const *src,
+               struct endpoint const *peer,
+               uint32_t now);
+
+struct endpoint const *hub_lookup(struct hub *h,
+                                  struct host_addr const *dst,
+                                  uint32_t now);
+
+#endif /* end of include guard: HUB_P3JX8KVE */
@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef KEEPALIVE_Z7RM2DWC
+#define KEEPALIVE_Z7RM2DWC
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "networking.h"
+#include "endpoint.h"
+#include "probe.h"
+
+/*
+ * Dead peer detection, and the probing of the paths to the peers.
+ *
+ * The peers are looked after once per round. A peer we heard nothing from
+ * during a round is sent a keepalive. Only its authenticated frames, or the
+ * ack of our last keepalive, prove it alive: a keepalive may come from
+ * anyone. Once silent for "KeepaliveInterval" seconds "KeepaliveMisses"
+ * times, it is dead: it is left out of the fan-out and of the neighbours
+ * we advertise at once, while its meta-connexion may take minutes to
+ * notice. It comes back with the first proof of life.
+ *
+ * The bonding, the routing and the hole punching need more: every path of
+ * every peer is then probed each round, the acks giving their metric (see
+ * probe.h). The rounds are as short as the most demanding of them asks,
+ * BOND_PROBE_INTERVAL, ROUTE_PROBE_INTERVAL or PUNCH_KEEPALIVE. The probes
+ * also tell the peers the endpoint our datagrams come from once through
+ * the NATs.
+ *
+ * A single timer serves every peer: a round is cut in KEEPALIVE_SLOTS
+ * ticks, and the peers spread over them when they are registered. Each tick
+ * only looks after the peers of its slot, so their keepalives don't all
+ * leave at once.
+ *
+ * The keepalives are followed by the [path:8] they were sent on and the
+ * [node id:64] of the sender, the ack being the keepalive echoed.
+ */
+#define KEEPALIVE_CTL_PROBE 9
+#define KEEPALIVE_CTL_ACK   10
+#define KEEPALIVE_CTL_SIZE  (PROBE_CTL_SIZE + 1 + 8)
+
+#define KEEPALIVE_SLOTS     16
+
+struct keepalive_peer
+{
+    unsigned int        slot;   /* Tick it is looked after */
+    struct probe_metric link;   /* Of its address, without bonding */
+    int                 heard;  /* Alive since the last round */
+    int                 misses; /* Rounds it was silent */
+    int                 dead;
+};
+
+struct udp;
+struct udp_peer;
+struct udp_transport;
+
+void keepalive_init(struct keepalive_peer *k,
+                    struct udp *udp);
+
+long keepalive_setup(struct udp *udp);
+
+struct probe_metric *keepalive_path(struct udp_peer *peer,
+                                    size_t path);
+
+int keepalive_is_control(unsigned char const *buf,
+                         size_t len);
+
+void keepalive_input(struct udp_transport *t,
+                     struct endpoint const *from,
+                     unsigned char const *buf,
+                     size_t len);
+
+void keepalive_heard(struct udp_peer *peer);
+
+void
+server_keepalive(void *ctx);
+
+#endif /* end of include guard: KEEPALIVE_Z7RM2DWC */
@@ -16,6 +16,8 @@
 #ifndef MC_ENDPOINT_JU2N66SJ
 #define MC_ENDPOINT_JU2N66SJ
 
+#include <stdint.h>
+
 #include "networking.h"
 
 /*
@@ -32,6 +34,8 @@ struct sockaddr;
 struct server;
 struct frame;
 struct udp;
+struct udp_transport;
+struct hs_job;
 
 enum tls_flags
 {
@@ -48,6 +52,7 @@ struct mc
     struct bufferevent  *bev;
     int                 ssl_flags;
     int                 tunel;
+    struct hs_job       *handshake; /* Not NULL while on the handshake pool */
 };
 
 int mc_init(struct mc *,
@@ -66,9 +71,30 @@ size_t mc_add_raw_data(struct mc *,
 int mc_hello(struct mc *,
              struct udp *);
 
+struct udp_transport *mc_transport(struct mc *,
+                                  struct udp *);
+
 int mc_establish_tunnel(struct mc *,
                         struct udp *);
 
+int mc_neighbours(struct mc *,
+                  struct udp *);
+
+int mc_udp_paths(struct mc *,
+                 struct udp *);
+
+int mc_link_state(struct mc *,
+                  unsigned char const *,
+                  size_t);
+
+int mc_punch_request(struct mc *,
+                     uint64_t);
+
+int mc_punch(struct mc *,
+             uint64_t,
+             uint32_t,
+             struct endpoint const *);
+
 struct mc *mc_peer_accept(struct server *s,
                           struct event_base *evbase,
                           struct sockaddr *sock,
@@ -80,6 +106,9 @@ struct mc *mc_peer_connect(struct server *s,
                            struct sockaddr *sock,
                            int socklen);
 
+void mc_handshake_done(struct hs_job *job,
+                       void *ctx);
+
 int mc_established(struct server *s,
                    struct sockaddr *,
                    int socklen);
@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef METAPROTO_V5NC1ZRB
+#define METAPROTO_V5NC1ZRB
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The meta-connexion protocol: a stream of binary messages, each made of
+ *
+ *   [version:8][type:8][length:16][value:length]
+ *
+ * all in network byte order. Messages of an unknown type are skipped, so
+ * new ones can be added without breaking older peers.
+ */
+
+#define MP_VERSION      1
+#define MP_HDR_SIZE     4
+#define MP_MAX_VALUE    0xffff
+
+enum mp_type
+{
+    MP_HELLO = 1,       /* value: none */
+    MP_UDP_PORT,        /* value: [port:16] */
+    MP_NEIGHBOURS,      /* value: [node id:64][neighbour node id:64]... */
+    MP_PUNCH_REQUEST,   /* value: [node id:64] */
+    MP_PUNCH,           /* value: [node id:64][cookie:32][port:16]
+                                  [family:8][address:32 or 128] */
+    MP_UDP_PATHS,       /* value: [port:16][family:8][address:32 or 128]... */
+    MP_LINK_STATE,      /* value: [origin:64][seq:32]
+                                  [neighbour:64][cost:32]... */
+    MP_TYPE_MAX,
+};
+
+struct evbuffer;
+
+/*
+ * Called with the value of a message, still in the input buffer.
+ * Returns -1 to close the meta-connexion.
+ */
+typedef int (*mp_handler)(void *ctx,
+                          unsigned char const *value,
+                          size_t len);
+
+/* The handler of each type, and the minimal length of its value */
+struct mp_dispatch
+{
+    mp_handler  handler;
+    size_t      min_len;
+};
+
+int mp_add(struct evbuffer *output,
+           enum mp_type type,
+           void const *value,
+           size_t len);
+
+int mp_parse(struct evbuffer *input,
+             struct mp_dispatch const *table,
+             void *ctx);
+
+uint16_t mp_get_u16(unsigned char const *p);
+
+void mp_put_u16(unsigned char *p,
+                uint16_t v);
+
+uint32_t mp_get_u32(unsigned char const *p);
+
+void mp_put_u32(unsigned char *p,
+                uint32_t v);
+
+uint64_t mp_get_u64(unsigned char const *p);
+
+void mp_put_u64(unsigned char *p,
+                uint64_t v);
+
+#endif /* end of include guard: METAPROTO_V5NC1ZRB */
@@ -0,0 +1,32 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef MSS_D4TB8WQN
+#define MSS_D4TB8WQN
+
+#include <stddef.h>
+
+/*
+ * Lower the MSS option of a TCP SYN or SYN-ACK carried by frame, so that the
+ * segments of the connection fit in mtu bytes IP packets.
+ * layer2 tells if the frame starts with an ethernet header.
+ * Returns 1 if the frame was rewritten, 0 otherwise.
+ */
+int mss_clamp(unsigned char *frame,
+              size_t len,
+              int layer2,
+              int mtu);
+
+#endif /* end of include guard: MSS_D4TB8WQN */
@@ -0,0 +1,100 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef OFFLOAD_K7VW3JQA
+#define OFFLOAD_K7VW3JQA
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "device.h"
+
+struct vector_frame;
+
+/*
+ * With the offloads, the device gives and takes packets behind a header
+ * describing their pending work: checksum to complete, segmentation to do.
+ * It has the layout of the virtio_net_hdr, in host byte order.
+ */
+#pragma pack(push, 1)
+struct offload_hdr
+{
+    uint8_t     flags;
+    uint8_t     gso_type;
+    uint16_t    hdr_len;        /* Length of the headers of a segment */
+    uint16_t    gso_size;       /* Payload of a segment */
+    uint16_t    csum_start;     /* Where the checksum computation starts */
+    uint16_t    csum_offset;    /* Where it's stored, from csum_start */
+};
+#pragma pack(pop)
+
+#define OFFLOAD_HDR_SIZE        sizeof(struct offload_hdr)
+
+#define OFFLOAD_F_NEEDS_CSUM    1
+
+#define OFFLOAD_GSO_NONE        0
+#define OFFLOAD_GSO_TCPV4       1
+#define OFFLOAD_GSO_TCPV6       4
+#define OFFLOAD_GSO_UDP_L4      5
+#define OFFLOAD_GSO_ECN         0x80
+
+/* The largest packet the device may give: an IP datagram of 64 KiB */
+#define OFFLOAD_PACKET_MAX      (65535 + FRAME_L2_OVERHEAD)
+
+/*
+ * The TCP segments received in a same burst are coalesced in a single
+ * packet before being written to the device, which splits them again only if
+ * it has to.
+ */
+struct offload_gro
+{
+    unsigned char   *buf;       /* offload_hdr, then the packet */
+    size_t          len;        /* Length of the packet */
+    size_t          l3;         /* Offset of the IP header */
+    size_t          l4;         /* Offset of the TCP header */
+    size_t          hdr_len;    /* Length of all the headers */
+    size_t          gso_size;   /* Payload of the first segment */
+    uint32_t        next_seq;
+    int             family;
+    int             count;      /* Number of segments coalesced */
+    int             open;       /* May the next segment be appended? */
+    unsigned char   *aside;     /* Empty offload_hdr, then a packet alone */
+    int             aside_busy; /* A fiber is writing aside */
+};
+
+int offload_active(intptr_t fd);
+
+int offload_complete_csum(unsigned char *pkt,
+                          size_t len,
+                          struct offload_hdr const *hdr);
+
+int offload_split(unsigned char const *pkt,
+                  size_t len,
+                  struct offload_hdr const *hdr,
+                  int layer2,
+                  struct vector_frame *out);
+
+int offload_gro_init(struct offload_gro *g);
+
+void offload_gro_free(struct offload_gro *g);
+
+int offload_gro_add(struct offload_gro *g,
+                    unsigned char const *frame,
+                    size_t len,
+                    int layer2);
+
+size_t offload_gro_finish(struct offload_gro *g);
+
+#endif /* end of include guard: OFFLOAD_K7VW3JQA */
@@ -38,14 +38,42 @@ struct cfg_sockaddress {
 #define DEFAULT_ALLOC_SIZE 2
 #include "vector.h"
 
+/* A PeerAddress given by name, resolved at runtime */
+struct cfg_peername {
+    char *host;
+    unsigned short port;
+};
+
+#define VECTOR_TYPE struct cfg_peername
+#define VECTOR_PREFIX peername
+#define DEFAULT_ALLOC_SIZE 2
+#include "vector.h"
+
 struct options {
     int tunnel;                    /* Tunnel type: layer 2 or 3 */
     int tunnel_index;              /* Force the device instance number */
-    int mode;                      /* Server mode: router, switch or hub */
+    int mode;                      /* Router, switch, hub or spoke */
 
     int debug;                     /* If true debug is allowed */
     int compression;               /* If true compression is allowed */
     int encryption;                /* If true encryption is allowed */
+    int dtls;                      /* Key the data channel with DTLS */
+    int handshake_threads;         /* TLS handshake workers, 0 for none */
+    int mss_clamp;                 /* Clamp the MSS of the tunneled TCP */
+    int aggregate_delay;           /* Aggregation deadline in us, 0 for none */
+    int tunnel_mtu;                /* MTU of the device, 0 to keep it */
+    int udp_mtu;                   /* Largest datagram sent to the peers */
+    int offload;                   /* Use the device checksum/GSO offloads */
+    int zerocopy_threshold;        /* Smallest zerocopy send, 0 for none */
+    int hole_punching;             /* Reach the peers of our peers directly */
+    int multipath;                 /* Scheduling over the paths of a peer */
+    int reorder_delay;             /* Hold of the early datagrams in us */
+    int routing;                   /* Lowest latency routes over the mesh */
+    int discovery;                 /* Find the nodes of the link by multicast */
+    int keepalive_interval;        /* Seconds of silence, 0 for none */
+    int keepalive_misses;          /* Keepalives lost before a peer is dead */
+    int reconnect_max;             /* Longest wait before redialing, seconds */
+    int max_dials;                 /* Meta-connexions being dialed at once */
 
     int ports[TNETACLE_MAX_PORTS]; /* Port number to listen on */
     int cports[TNETACLE_MAX_PORTS];/* Port number to listen on, for clients */
@@ -56,6 +84,9 @@ struct options {
     struct vector_sockaddr *client_addrs;
     /* Addresses of others tNETacle daemons */
     struct vector_sockaddr *peer_addrs;
+    /* The same, by name */
+    struct vector_peername *peer_names;
+    char *nameserver;              /* Resolver instead of the system ones */
     char *addr;                    /* Address on the VPN */
 
     const char *key_path;
@@ -70,7 +101,15 @@ enum {
 enum {
     TNT_DAEMONMODE_ROUTER,
     TNT_DAEMONMODE_SWITCH,
-    TNT_DAEMONMODE_HUB
+    TNT_DAEMONMODE_HUB,
+    TNT_DAEMONMODE_SPOKE
+};
+
+enum {
+    TNT_MULTIPATH_OFF,
+    TNT_MULTIPATH_REDUNDANT,
+    TNT_MULTIPATH_WEIGHTED,
+    TNT_MULTIPATH_LATENCY
 };
 
 #endif
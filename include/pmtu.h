@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef PMTU_H5QW9EKC
+#define PMTU_H5QW9EKC
+
+#include <stdint.h>
+
+#include <event2/util.h>
+#include "networking.h"
+
+/*
+ * The sizes are the ones of the whole IP datagram, as the PMTU is defined.
+ *
+ * PMTU_MIN is what every path must carry (RFC 791 and RFC 8200), a search
+ * never goes below it. The largest size probed is the "UDPMTU" option,
+ * PMTU_DEFAULT_MAX unless told otherwise.
+ */
+#define PMTU_MIN_INET       576
+#define PMTU_MIN_INET6      1280
+#define PMTU_DEFAULT_MAX    1500
+#define PMTU_LIMIT          65535
+
+/* The largest UDP payload, PMTU_LIMIT less the IPv4 and UDP headers */
+#define PMTU_UDP_MAX        65507
+
+/* The smallest MTU an IPv4 link may have (RFC 791) */
+#define PMTU_LINK_MIN       68
+
+/* Stop the search once the bounds are this close */
+#define PMTU_STEP           8
+
+/* A probe is lost after PMTU_PROBE_TIMEOUT ms, too big after PMTU_TRIES */
+#define PMTU_PROBE_TIMEOUT  500
+#define PMTU_TRIES          3
+
+/* Seconds between two searches, the path may have changed meanwhile */
+#define PMTU_REPROBE        600
+
+/* Headers added by the network to our datagrams */
+#define PMTU_UDP_HDR        8
+#define PMTU_IP_HDR(af)     ((af) == AF_INET6 ? 40 : 20)
+#define PMTU_ETHER_HDR      14
+
+/*
+ * Control messages share the data socket. Their packet_hdr says 0 byte long,
+ * which no frame does, then comes [type:8][cookie:32] and, for the acks,
+ * [size:16]. The probes are padded up to the size they test.
+ */
+#define PMTU_CTL_PROBE      1
+#define PMTU_CTL_ACK        2
+#define PMTU_CTL_SIZE       (1 + 4)
+#define PMTU_ACK_SIZE       (PMTU_CTL_SIZE + 2)
+
+struct pmtu_state
+{
+    unsigned short  mtu;        /* Largest datagram known to go through */
+    unsigned int    lo;         /* Search bounds, lo goes through ... */
+    unsigned int    hi;         /* ... and hi doesn't, up to max + 1 */
+    unsigned short  base;       /* PMTU_MIN for the peer's family */
+    unsigned short  max;        /* Largest size probed */
+    unsigned short  probe;      /* Size in flight, 0 if none */
+    unsigned short  validate;   /* Size to check before a new search */
+    uint32_t        cookie;     /* Echoed by the ack of the probe in flight */
+    int             tries;
+    int             searching;
+    int             answered;   /* The peer acked a probe at least once */
+    int             done;       /* A search completed at least once */
+    struct timeval  deadline;   /* Probe timeout, or the next search */
+    uint64_t        oversize;   /* Frames dropped because they don't fit */
+};
+
+struct udp;
+struct udp_peer;
+struct endpoint;
+
+void pmtu_init(struct pmtu_state *st,
+               int family);
+
+int pmtu_frame_fits(struct pmtu_state const *st,
+                    int family,
+                    size_t wire_len);
+
+size_t pmtu_payload_max(struct pmtu_state const *st,
+                        int family,
+                        size_t overhead);
+
+int pmtu_device_mtu(struct udp const *udp,
+                    struct udp_peer const *peer);
+
+int pmtu_min_device_mtu(struct udp const *udp);
+
+int pmtu_is_control(unsigned char const *buf,
+                    size_t len);
+
+void pmtu_input(struct udp *udp,
+                struct endpoint const *from,
+                unsigned char const *buf,
+                size_t len);
+
+void
+server_pmtu(void *ctx);
+
+#endif /* end of include guard: PMTU_H5QW9EKC */
@@ -0,0 +1,77 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef PROBE_K2WN8TBX
+#define PROBE_K2WN8TBX
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event2/util.h>
+#include "networking.h"
+
+/*
+ * Quality of a link, measured by probing it: the acks give its round trip
+ * time, smoothed as the TCP retransmission timer does (RFC 6298), and the
+ * ones missing its loss rate. A link is dead after PROBE_DEAD probes missed
+ * in a row, and alive again with the next ack. The keepalives measure every
+ * path of the peers (see keepalive.h), the bonding and the routing use it.
+ *
+ * The control messages look like the PMTU ones, [hdr=0][type:8][seq:32],
+ * maybe followed by some more bytes, the ack being the probe echoed. The
+ * sequence numbers are random, so an ack can't be forged without seeing the
+ * probe.
+ */
+#define PROBE_CTL_SIZE      (1 + 4)
+#define PROBE_DEAD          3       /* Probes missed before the link is down */
+
+#define PROBE_LOSS_ONE      1024    /* Fixed point 1 of the loss rates */
+#define PROBE_LOSS_SHIFT    3       /* Loss rate gain, 1/8 per probe */
+#define PROBE_LOSS_MAX      (PROBE_LOSS_ONE - PROBE_LOSS_ONE / 16)
+
+struct probe_metric
+{
+    uint32_t        srtt;       /* us, 0 until the first ack */
+    uint32_t        rttvar;
+    uint32_t        loss;       /* Out of PROBE_LOSS_ONE */
+    uint32_t        seq;        /* Of the last probe sent */
+    struct timeval  sent;
+    int             answered;   /* The last probe was acked */
+    int             misses;
+};
+
+int probe_alive(struct probe_metric const *m);
+
+uint32_t probe_cost(struct probe_metric const *m);
+
+int probe_start(struct probe_metric *m,
+                struct timeval const *now);
+
+int probe_acked(struct probe_metric *m,
+                uint32_t seq);
+
+int probe_is_ctl(unsigned char const *buf,
+                 size_t len,
+                 int probe,
+                 int ack,
+                 size_t extra);
+
+size_t probe_ctl_write(unsigned char *buf,
+                       int type,
+                       uint32_t seq);
+
+uint32_t probe_ctl_seq(unsigned char const *buf);
+
+#endif /* end of include guard: PROBE_K2WN8TBX */
@@ -0,0 +1,117 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef PUNCH_N4HZ7TQB
+#define PUNCH_N4HZ7TQB
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event2/util.h>
+#include "networking.h"
+#include "endpoint.h"
+
+/*
+ * UDP hole punching between the peers of our peers.
+ *
+ * The keepalives probe every peer on the data socket every PUNCH_KEEPALIVE
+ * seconds at least (see keepalive.h), which tells it the endpoint our
+ * datagrams come from once through the NATs.
+ * The node with the lowest id then asks a common peer, over the
+ * meta-connexion, to introduce it to a node two hops away: both ends get the
+ * observed endpoint of the other one and a cookie, and probe each other at
+ * once. After PUNCH_PROMOTE acks the direct path becomes a peer, keyed with
+ * DTLS if the data channel must be sealed, and the relay stops forwarding
+ * our frames to it. A direct path is dropped once the keepalives find it
+ * dead, after PUNCH_MISSES of them without "KeepaliveInterval", the frames
+ * go through the relay again.
+ *
+ * The control messages look like the PMTU ones, [hdr=0][type:8][cookie:32]
+ * followed by the [node id:64] of the sender.
+ */
+#define PUNCH_CTL_PROBE     3
+#define PUNCH_CTL_ACK       4
+#define PUNCH_CTL_SIZE      (1 + 4 + 8)
+
+#define PUNCH_INTERVAL      200     /* ms between two probes of a new path */
+#define PUNCH_TRIES         25
+#define PUNCH_PROMOTE       3       /* Acks before the path is used */
+#define PUNCH_KEEPALIVE     10      /* Seconds between two keepalives */
+#define PUNCH_MISSES        3       /* Silent rounds before it is dead */
+#define PUNCH_RETRY         60      /* Seconds before trying a path again */
+
+enum punch_state
+{
+    PUNCH_REQUESTED,    /* Waiting for the relay to introduce us */
+    PUNCH_TRYING,       /* Probing the other end */
+    PUNCH_READY,        /* Acked enough, to promote */
+    PUNCH_DIRECT,       /* A peer now */
+    PUNCH_FAILED,       /* Until the deadline */
+};
+
+/* A node two hops away we try to reach directly */
+struct punch_cand
+{
+    uint64_t            id;
+    struct endpoint     addr;
+    struct udp_transport *transport; /* The socket probing it */
+    uint32_t            cookie;
+    enum punch_state    state;
+    int                 tries;
+    int                 acks;
+    struct timeval      deadline;
+};
+
+#define VECTOR_TYPE struct punch_cand
+#define VECTOR_PREFIX punch
+#include "vector.h"
+
+/* The NAT traversal state of a peer */
+struct punch_peer
+{
+    struct endpoint     observed;   /* Where its keepalives come from */
+    int                 direct;     /* Punched, no meta-connexion */
+};
+
+struct server;
+struct mc;
+struct udp;
+struct udp_transport;
+
+int punch_is_control(unsigned char const *buf,
+                     size_t len);
+
+void punch_input(struct udp_transport *t,
+                 struct endpoint const *from,
+                 unsigned char const *buf,
+                 size_t len);
+
+void punch_observed(struct udp *udp,
+                    struct endpoint const *from,
+                    uint64_t id);
+
+int punch_introduce(struct server *s,
+                    struct mc *mc,
+                    unsigned char const *value,
+                    size_t len);
+
+int punch_introduced(struct udp *udp,
+                     unsigned char const *value,
+                     size_t len);
+
+void
+server_punch(void *ctx);
+
+#endif /* end of include guard: PUNCH_N4HZ7TQB */
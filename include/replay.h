@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef REPLAY_R2XQ7NBD
+#define REPLAY_R2XQ7NBD
+
+#include <stdint.h>
+
+/*
+ * The window is a ring of 64 bits words. The word holding the highest
+ * sequence number is never fully usable, hence the window size.
+ */
+#define REPLAY_RING_WORDS   64
+#define REPLAY_WINDOW_SIZE  ((REPLAY_RING_WORDS - 1) * 64)
+
+enum replay_verdict
+{
+    REPLAY_OK = 0,
+    REPLAY_LATE,            /* Just behind the window, reordered too much */
+    REPLAY_DUPLICATE,       /* Inside the window, already seen */
+    REPLAY_OUT_OF_WINDOW,   /* Far behind the window, stale or replayed */
+};
+
+struct replay_window
+{
+    uint64_t    top;        /* Highest sequence number accepted */
+    uint64_t    bitmap[REPLAY_RING_WORDS];
+    uint64_t    late;
+    uint64_t    duplicate;
+    uint64_t    out_of_window;
+};
+
+void replay_init(struct replay_window *w);
+
+enum replay_verdict replay_check(struct replay_window *w,
+                                 uint64_t seq);
+
+char const *replay_verdict_str(enum replay_verdict v);
+
+#endif /* end of include guard: REPLAY_R2XQ7NBD */
@@ -0,0 +1,123 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef ROUTE_H4KX9PQM
+#define ROUTE_H4KX9PQM
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event2/util.h>
+#include "networking.h"
+#include "endpoint.h"
+#include "hosts.h"
+
+/*
+ * Link-state routing over the mesh.
+ *
+ * The keepalives probe every peer on the data socket every
+ * ROUTE_PROBE_INTERVAL ms (see keepalive.h), which gives the round trip time
+ * and the loss rate of the link. Each node floods over the meta-connexions
+ * the cost of its live links, the round trip time inflated by the losses,
+ * when one of them changed by more than 1/2^ROUTE_CHANGE_SHIFT or every
+ * ROUTE_REFRESH seconds. A node keeps the latest state of every other one,
+ * the ones not refreshed for ROUTE_MAX_AGE seconds are forgotten, and
+ * computes the lowest latency next hop towards each of them. A link is only
+ * used if both of its ends advertise it.
+ *
+ * The frames carry the node ids of their source and of their destination in
+ * a routed header. The source addresses of the frames received teach behind
+ * which node the hosts are. A frame for a known host goes to the next hop
+ * towards its node only, which relays it the same way. The others are
+ * flooded with a 0 destination. Every node of the mesh must enable it.
+ *
+ * The link states are [origin:64][seq:32] then [neighbour:64][cost:32] for
+ * every link, the cost in microseconds.
+ */
+#define ROUTE_PROBE_INTERVAL 1000   /* ms between two probes of a peer */
+#define ROUTE_CHANGE_SHIFT  3
+#define ROUTE_REFRESH       10      /* Seconds between two link states */
+#define ROUTE_MAX_AGE       35
+#define ROUTE_TTL           16      /* Hops a frame may take */
+#define ROUTE_LSA_HDR       (8 + 4)
+#define ROUTE_LSA_LINK      (8 + 4)
+
+/* What we told the others of the link to a peer */
+struct route_metric
+{
+    uint32_t        advertised; /* Cost in our link state, 0 if none */
+};
+
+/* The link state of a node, as it was flooded */
+struct route_lsa
+{
+    uint64_t        origin;
+    uint32_t        seq;
+    uint32_t        expire;     /* flood_now() ms */
+    unsigned char   *value;
+    size_t          len;
+};
+
+#define VECTOR_TYPE struct route_lsa
+#define VECTOR_PREFIX lsa
+#include "vector.h"
+
+struct route_entry
+{
+    uint64_t        dst;
+    uint64_t        next;       /* The peer to give its frames to */
+    uint32_t        cost;
+};
+
+struct route
+{
+    uint64_t            self;
+    uint32_t            seq;        /* Of our last link state */
+    uint32_t            refresh;    /* flood_now() ms of the next one */
+    size_t              links;      /* In our last link state */
+    struct vector_lsa   *lsas;      /* Ours included */
+    struct route_entry  *table;     /* Sorted by destination */
+    size_t              count;
+    struct hosts        hosts;      /* Which node the hosts are behind */
+};
+
+struct server;
+struct udp;
+struct udp_transport;
+
+struct route *route_new(uint64_t self);
+
+void route_delete(struct route *r);
+
+int route_lsa_input(struct route *r,
+                    unsigned char const *value,
+                    size_t len);
+
+uint64_t route_next_hop(struct route const *r,
+                        uint64_t dst);
+
+void route_learn(struct route *r,
+                 struct host_addr const *src,
+                 uint64_t node,
+                 uint32_t now);
+
+uint64_t route_lookup(struct route *r,
+                      struct host_addr const *dst,
+                      uint32_t now);
+
+void
+server_route(void *ctx);
+
+#endif /* end of include guard: ROUTE_H4KX9PQM */
@@ -28,6 +28,7 @@
 
 #include "udp.h"
 #include "mc.h"
+#include "client.h"
 
 struct evconnlistener;
 struct bufferevent;
@@ -38,6 +39,9 @@ struct sockaddr;
 struct fiber;
 struct frame;
 struct mc;
+struct hs_pool;
+struct dial;
+struct discovery;
 
 #define VECTOR_TYPE struct mc
 #define VECTOR_PREFIX mc
@@ -59,6 +63,36 @@ struct packet_hdr
 };
 #pragma pack(pop)
 
+/*
+ * An aggregate carries several frames, each one behind its own packet_hdr.
+ * Its size has the top bit set, no frame is that large.
+ */
+#define PACKET_AGGREGATE    0x8000
+#define PACKET_SIZE_MASK    0x7fff
+
+/*
+ * Frames of PACKET_SHORT_MAX bytes or more use the extended header: a first
+ * word with PACKET_EXTENDED set, holding the high bits of the size, then a
+ * second one with its low 16 bits. This way the first byte of a header never
+ * falls in the DTLS content types range (20 to 63).
+ */
+#define PACKET_EXTENDED     0x4000
+#define PACKET_SHORT_MAX    0x1400
+#define PACKET_HDR_EXT      4
+
+/*
+ * In a mesh, the frames carry the node id of their source and a sequence
+ * number of its own, the copies coming through another path are known by
+ * them. With routing, they also carry the id of their destination, 0 to
+ * flood them, and the hops they may still take: an extended header with
+ * PACKET_ROUTED set, then [src:64][dst:64][ttl:8][seq:32].
+ */
+#define PACKET_ROUTED       0x2000
+#define PACKET_ROUTE_SIZE   (8 + 8 + 1 + 4)
+#define PACKET_HDR_MAX      (PACKET_HDR_EXT + PACKET_ROUTE_SIZE)
+
+struct offload_gro;
+
 struct server 
 {
   struct vector_evl     *srv_list; /*list of the listenners*/
@@ -69,9 +103,16 @@ struct server
   struct event_base     *evbase;
   struct fiber          *device_fib;
   SSL_CTX               *server_ctx;
+  struct hs_pool        *hs_pool; /* TLS handshakes workers, may be NULL */
   struct sched          *ev_sched;
   struct mc             mc_client;
+  struct client_scan    client_drop; /* The rest of a command too large */
   evutil_socket_t       tap_fd;
+  struct offload_gro    *gro; /* Coalesced device writes, NULL if no offloads */
+  int                   gro_writing; /* A fiber is writing gro->buf */
+  struct dial           *dial; /* Keeps the PeerAddress connected */
+  struct fiber          *dial_fib;
+  struct discovery      *discovery; /* NULL unless "Discovery" */
 #if defined Windows
   struct bufferevent    *pipe_endpoint;
 #endif
@@ -84,6 +125,13 @@ int server_init(struct server *,
 
 void server_delete(struct server *);
 
+int server_reload(struct server *,
+                  char *buf,
+                  size_t len);
+
+void server_mc_close(struct server *,
+                     struct mc *);
+
 #if defined Windows
 void broadcast_udp_to_peers(struct server *s);
 
@@ -91,6 +139,13 @@ int frame_alloc(struct frame *,
                 unsigned int size);
 #endif
 
+void server_advertise_neighbours(struct server *);
+
+void server_advertise_link_state(struct server *,
+                                 struct mc *skip,
+                                 unsigned char const *value,
+                                 size_t len);
+
 /* I didn't want to do this */
 void server_mc_event_cb(struct bufferevent *bev,
                         short events,
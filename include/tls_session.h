@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#ifndef TLS_SESSION_K7DM2PXA
+#define TLS_SESSION_K7DM2PXA
+
+#include "networking.h"
+#include <openssl/ssl.h>
+#include "endpoint.h"
+
+/* A ticket key issues tickets during this time, and opens them twice as long */
+#define TLS_TICKET_KEY_LIFETIME 3600
+
+/* Sessions kept on the server side, when the peer doesn't support tickets */
+#define TLS_SESSION_CACHE_SIZE  1024
+
+/* A session we can resume with a peer we connect to */
+struct tls_session
+{
+    struct endpoint     remote;
+    SSL_SESSION         *session;
+};
+
+#define VECTOR_TYPE struct tls_session
+#define VECTOR_PREFIX tls_sess
+#include "vector.h"
+
+int tls_session_init(SSL_CTX *ctx);
+
+void tls_session_resume(SSL *ssl,
+                        struct sockaddr const *remote,
+                        socklen_t len);
+
+void tls_session_exit(void);
+
+#endif /* end of include guard: TLS_SESSION_K7DM2PXA */
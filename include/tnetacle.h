@@ -53,17 +53,26 @@ enum imsg_type {
 	IMSG_NONE,
 	IMSG_CREATE_DEV,
 	IMSG_SET_IP,
+	IMSG_SET_MTU,
+	IMSG_RELOAD_DATA,	/* A part of the configuration file */
+	IMSG_RELOAD_END,	/* It was the last one, apply it */
 };
 
 char 		*tnt_getprogname(void);
 void    	 tnt_setproctitle(const char *);
 int		 tnt_fork(int [2]);
 int		 tnt_daemonize(void);
+void		 tnt_set_device_mtu(int);
 
 /* src/conf.c */
+struct options;
+
 int	 tnt_parse_buf(char *, size_t);
+int	 tnt_parse_options(struct options *, char *, size_t);
+void	 free_options(struct options *);
 /* and sys/ specific call */
 int	 tnt_parse_file(const char *);
+char	*tnt_read_file(const char *, size_t *);
 
 #endif
 
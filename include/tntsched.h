@@ -31,6 +31,8 @@ enum sched_operation
     ACCEPT,
     RECVFROM,
     SENDTO,
+    SENDMSG,
+    RECVMSG,
     SEND,
     RECV,
     YIELD,
@@ -62,6 +64,7 @@ struct fiber
     struct map_fd_ev    *map_fe;
     void                (*dtor)(struct fiber *, intptr_t);
     intptr_t            dtor_ctx;
+    int                 wake_pending; /* Woken while blocked on a syscall */
 };
 
 struct sched
@@ -95,6 +98,11 @@ struct fiber * sched_get_fiber(struct fiber_args *args);
 void async_sleep(struct fiber_args *args,
                  int sec);
 
+struct timeval;
+
+void async_wait(struct fiber_args *args,
+                struct timeval const *tv);
+
 int async_event(struct fiber_args *s,
                 evutil_socket_t fd,
                 short flag);
@@ -152,5 +160,19 @@ evutil_socket_t async_accept(struct fiber_args *s,
                  struct sockaddr *sock,
                  socklen_t *socklen);
 
+#if !defined Windows
+struct msghdr;
+
+ssize_t async_sendmsg(struct fiber_args *s,
+                      evutil_socket_t fd,
+                      struct msghdr const *msg,
+                      int flags);
+
+ssize_t async_recvmsg(struct fiber_args *s,
+                      evutil_socket_t fd,
+                      struct msghdr *msg,
+                      int flags);
+#endif
+
 
 #endif /* end of include guard: SCHED_O6L1KITS */
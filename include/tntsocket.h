@@ -32,5 +32,27 @@
 
 evutil_socket_t tnt_tcp_socket(sa_family_t);
 evutil_socket_t tnt_udp_socket(sa_family_t);
+int tnt_udp_set_dontfrag(evutil_socket_t, sa_family_t);
+int tnt_udp_enable_gso(evutil_socket_t);
+int tnt_udp_enable_gro(evutil_socket_t);
+int tnt_udp_enable_zerocopy(evutil_socket_t);
+int tnt_udp_join_multicast(evutil_socket_t, struct in_addr const *);
+
+#if !defined Windows
+/* Room for the control message of a segmented send or receive */
+# define TNT_UDP_CONTROL_SIZE 32
+
+struct msghdr;
+
+int tnt_udp_gso_control(struct msghdr *, void *, size_t, unsigned short);
+unsigned int tnt_udp_gro_segment(struct msghdr const *);
+int tnt_udp_zerocopy_done(evutil_socket_t, unsigned int *, unsigned int *);
+
+# if defined MSG_ZEROCOPY
+#  define TNT_MSG_ZEROCOPY MSG_ZEROCOPY
+# else
+#  define TNT_MSG_ZEROCOPY 0
+# endif
+#endif
 
 #endif /* end of include guard: TNTSOCKET_UUQ1C5JM */
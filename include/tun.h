@@ -33,6 +33,8 @@ int		 tnt_ttc_up(struct device *);
 int		 tnt_ttc_down(struct device *);
 intptr_t	 tnt_ttc_get_fd(struct device *);
 int		 tnt_ttc_get_mtu(struct device *dev);
+int		 tnt_ttc_set_mtu(struct device *dev, int);
+int		 tnt_ttc_set_offload(struct device *dev);
 
 #endif
 
@@ -23,9 +23,17 @@
 #include "coro.h"
 #include "tntsched.h"
 #include "endpoint.h"
+#include "crypto.h"
+#include "replay.h"
+#include "pmtu.h"
+#include "flood.h"
+#include "hub.h"
+#include "punch.h"
+#include "bond.h"
+#include "route.h"
+#include "keepalive.h"
 
 #define TNETACLE_UDP_PORT   7676
-#define UDP_MTU             1500
 
 enum udp_ssl_flags
 {
@@ -41,58 +49,217 @@ struct frame;
 struct sockaddr;
 struct event;
 struct vector_frame;
+struct vector_dtls_sess;
+struct dtls_link;
+struct udp_transport;
+
+/*
+ * The small frames waiting to be sent to a peer, as a single datagram:
+ * [packet_hdr][packet_hdr][frame][packet_hdr][frame]...
+ * buf is allocated along with the structure, "UDPMTU" bytes long.
+ */
+struct udp_agg
+{
+    unsigned char           *buf;
+    size_t                  len;        /* Bytes after the first header */
+    size_t                  count;      /* Frames held */
+    struct timeval          deadline;
+};
 
 struct udp_peer
 {
     struct endpoint         peer_addr;
-    BIO                     *bio;
-    BIO                     *_bio_backend;
-    SSL                     *ssl;
+    struct udp_transport    *transport; /* The socket it is reached through */
+    SSL                     *ssl;       /* Owns the BIO and the link */
+    struct dtls_link        *link;
+    SSL                     *next_ssl;  /* Replaces ssl once it succeeds */
+    struct dtls_link        *next_link;
     enum udp_ssl_flags      ssl_flags;
+    struct crypto_state     crypto;
+    struct replay_window    replay;
+    struct pmtu_state       pmtu;
+    struct udp_agg          *agg;       /* NULL until aggregation is used */
+    struct flood_peer       flood;      /* Its node id and neighbours */
+    struct punch_peer       punch;      /* NAT traversal */
+    struct bond             *bond;      /* NULL with a single path */
+    struct route_metric     route;      /* Cost of the link advertised */
+    struct keepalive_peer   keepalive;  /* Dead ones get no frame */
 };
 
 #define VECTOR_TYPE struct udp_peer
 #define VECTOR_PREFIX udp
 #include "vector.h"
 
-struct udp
+/*
+ * A burst of datagrams handled at once by the data path.
+ * slots holds the datagrams as seen on the wire, plain the clear frames,
+ * both are CRYPTO_BURST_MAX slots of slot_size bytes long.
+ * When sending, an operation without crypto state is a datagram to send as
+ * is, in/in_len. The copy of the datagram j for another path has its mirror
+ * set to j + 1, the others 0. When receiving, seqs holds the sequence number
+ * of the opened datagrams.
+ */
+struct udp_burst
+{
+    struct crypto_op        ops[CRYPTO_BURST_MAX];
+    struct endpoint         peers[CRYPTO_BURST_MAX];
+    struct udp_transport    *via[CRYPTO_BURST_MAX];
+    size_t                  lens[CRYPTO_BURST_MAX];
+    size_t                  mirror[CRYPTO_BURST_MAX];
+    uint64_t                seqs[CRYPTO_BURST_MAX];
+    unsigned char           *slots;
+    unsigned char           *plain;
+    size_t                  slot_size;
+    size_t                  count;
+    int                     zc_buf;     /* Slots index in the zerocopy pool */
+};
+
+/*
+ * Zerocopy sends. The kernel reads the slots after the send returned, until
+ * it reports it's done on the error queue: the slots of a flushed burst are
+ * then swapped for free ones of the pool.
+ * Each socket numbers its sends on its own, owner maps the id of a send in
+ * flight to its buffer, plus one.
+ */
+#define UDP_ZC_BUFS_MAX     16
+#define UDP_ZC_INFLIGHT     1024
+
+struct udp_zc_buf
+{
+    unsigned char           *slots;
+    size_t                  pending;    /* Sends the kernel holds */
+    int                     used;       /* Attached to a burst */
+};
+
+struct udp_zc
+{
+    size_t                  threshold;  /* Smaller sends are copied */
+    size_t                  count;
+    struct udp_zc_buf       bufs[UDP_ZC_BUFS_MAX];
+};
+
+struct udp_zc_ring
+{
+    unsigned int            next_id;
+    unsigned short          owner[UDP_ZC_INFLIGHT];
+};
+
+/*
+ * The datagrams coalesced by the receive offload, all from a same peer.
+ * They are segment bytes long, but the last one. buf is UDP_GRO_BUF_SIZE
+ * bytes long.
+ */
+#define UDP_GRO_BUF_SIZE    65535
+
+struct udp_gro
+{
+    unsigned char           *buf;
+    size_t                  len;
+    size_t                  off;        /* Start of the next datagram */
+    size_t                  segment;
+    struct endpoint         from;
+};
+
+/*
+ * A socket bound on one of the listen addresses, with its own receive fiber.
+ * The peers and the fibers sending to them are shared by all of them.
+ */
+struct udp_transport
 {
     evutil_socket_t         fd;
+    struct endpoint         endpoint;
+    struct udp              *udp;
+    struct server           *server;
+    struct fiber            *recv_fib;
+    struct udp_burst        *fwd_burst;  /* Used by recv_fib to forward */
+    struct udp_burst        *rx_burst;   /* Used by recv_fib to receive */
+    int                     gso;         /* Send the trains at once */
+    struct timeval          gso_retry;   /* Offload suspended until then */
+    struct udp_gro          *gro;        /* NULL without receive offload */
+    struct udp_zc_ring      *zc;         /* NULL without zerocopy */
+};
+
+#define VECTOR_TYPE struct udp_transport*
+#define VECTOR_PREFIX transport
+#define VECTOR_TYPE_SCALAR
+#include "vector.h"
+
+struct udp
+{
     SSL_CTX                 *ctx;
-    struct fiber            *udp_recv_fib;
     struct fiber            *udp_brd_fib;
     struct vector_udp       *udp_peers;
-    struct endpoint         udp_endpoint;
+    unsigned int            peers_gen;  /* Bumped when udp_peers changes */
+    struct vector_transport *transports;
+    struct vector_frame     *brd_frames; /* Frames owned by udp_brd_fib */
+    struct udp_burst        *tx_burst;   /* Used by udp_brd_fib */
+    struct fiber            *udp_dtls_fib;
+    int                     dtls_running;
+    struct vector_dtls_sess *dtls_sessions;
+    int                     require_keys; /* Drop the clear frames */
+    struct fiber            *udp_pmtu_fib;
+    int                     pmtu_running;
+    int                     device_mtu;   /* Last MTU given to the device */
+    struct udp_zc           *zc;          /* NULL without zerocopy */
+    struct flood            *flood;       /* Node id and seen frames */
+    struct hub              *hub;         /* NULL but on a hub */
+    struct vector_punch     *punch_cands; /* Nodes two hops away */
+    struct fiber            *udp_punch_fib; /* NULL without hole punching */
+    int                     punch_running;
+    struct fiber            *udp_bond_fib;  /* NULL without multipath */
+    int                     bond_running;
+    struct udp_burst        *bond_burst;  /* Used by udp_bond_fib to forward */
+    struct route            *route;       /* NULL without routing */
+    struct fiber            *udp_route_fib;
+    int                     route_running;
+    struct fiber            *udp_keepalive_fib; /* NULL without keepalives */
+    int                     keepalive_running;
+    unsigned int            keepalive_next; /* Slot of the next peer */
+    long                    keepalive_period; /* ms between two rounds */
+    int                     keepalive_dead; /* Silent rounds, 0 for never */
+    int                     keepalive_measure; /* Probe every round */
 };
 
-struct udp *server_udp_new(struct server *s,
-                           struct endpoint *e);
+struct udp *server_udp_new(struct server *s);
 
 int server_udp_init(struct server *s,
-                    struct udp *u,
-                    struct endpoint *e);
+                    struct udp *u);
+
+struct udp_transport *udp_transport_add(struct udp *u,
+                                        struct server *s,
+                                        struct endpoint *e);
+
+struct udp_transport *udp_transport_find(struct udp *u,
+                                         struct sockaddr const *local);
+
+struct udp_transport *udp_transport_for(struct udp *u,
+                                        struct sockaddr const *local,
+                                        int family);
 
 void server_udp_launch(struct udp *u);
 
 void server_udp_exit(struct udp *);
 
 struct udp_peer *udp_register_new_peer(struct udp *s,
+                                       struct udp_transport *t,
                                        struct endpoint *remote,
                                        int ssl_flags);
 
-void forward_udp_frame_to_other_peers(void *ctx,
-                                      struct udp *s,
-                                      struct frame *current_frame,
-                                      struct sockaddr *current_sockaddr,
-                                      socklen_t current_socklen);
+struct udp_peer *udp_find_peer(struct udp *s,
+                               struct endpoint const *remote);
+
+void udp_peer_free(struct udp_peer const *);
+
+void udp_remove_peer(struct udp *s,
+                     struct udp_peer *peer);
+
+int udp_routed_frames(struct udp const *udp);
 
 void broadcast_udp_to_peers(struct server *s);
 
-int frame_recvfrom(void *ctx,
-                   evutil_socket_t fd,
-                   struct frame *frame,
-                   struct sockaddr *saddr,
-                   socklen_t *socklen);
+int udp_bond_release(void *ctx,
+                     struct server *s,
+                     struct timeval *next);
 
 void
 server_udp(void *ctx);
@@ -101,7 +268,7 @@ void
 server_dtls(void *ctx);
 
 unsigned short
-udp_get_port(struct udp *);
+udp_get_port(struct udp_transport *);
 
 #endif /* end of include guard: UDP_US4EZ32H */
 
@@ -0,0 +1,455 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/util.h>
+
+#include "networking.h"
+
+#include "tnetacle.h"
+#include "tntsched.h"
+#include "endpoint.h"
+#include "options.h"
+#include "server.h"
+#include "udp.h"
+#include "mc.h"
+#include "bond.h"
+#include "metaproto.h"
+#include "subset.h"
+#include "log.h"
+
+extern struct options serv_opts;
+
+/* So far behind, the sender started over with new keys */
+#define BOND_REORDER_RESTART    ((uint64_t)1 << 16)
+
+void
+bond_free(struct bond *b)
+{
+    size_t i;
+
+    if (b == NULL)
+        return;
+    for (i = 0; i < b->reorder.count; ++i)
+        free(b->reorder.held[i].buf);
+    free(b);
+}
+
+int
+bond_has_path(struct bond const *b,
+              struct endpoint const *e)
+{
+    size_t i;
+
+    for (i = 0; i < b->count; ++i)
+    {
+        if (endpoint_cmp(&b->paths[i].addr, e) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int
+bond_path_alive(struct bond_path const *p)
+{
+    return probe_alive(&p->metric);
+}
+
+/* The faster and the less lossy, the larger the share of a path */
+void
+bond_weigh(struct bond *b)
+{
+    uint32_t best = 0;
+    size_t i;
+
+    for (i = 0; i < b->count; ++i)
+    {
+        if (bond_path_alive(&b->paths[i])
+            && (best == 0 || b->paths[i].metric.srtt < best))
+            best = b->paths[i].metric.srtt;
+    }
+    for (i = 0; i < b->count; ++i)
+    {
+        struct bond_path *p = &b->paths[i];
+        uint64_t w;
+
+        if (!bond_path_alive(p))
+        {
+            p->weight = 0;
+            p->current = 0;
+            continue;
+        }
+        w = (uint64_t)BOND_WEIGHT_MAX * best / p->metric.srtt;
+        w = w * (PROBE_LOSS_ONE - p->metric.loss) / PROBE_LOSS_ONE;
+        p->weight = (w > 0) ? (int)w : 1;
+    }
+}
+
+/* The live path with the lowest round trip time, the lossy ones last */
+static struct bond_path *
+bond_fastest(struct bond *b)
+{
+    struct bond_path *best = NULL;
+    size_t i;
+
+    for (i = 0; i < b->count; ++i)
+    {
+        struct bond_path *p = &b->paths[i];
+        int good;
+        int best_good;
+
+        if (!bond_path_alive(p))
+            continue;
+        good = p->metric.loss < PROBE_LOSS_ONE / 2;
+        best_good = (best != NULL) && best->metric.loss < PROBE_LOSS_ONE / 2;
+        if (best == NULL || good > best_good
+            || (good == best_good && p->metric.srtt < best->metric.srtt))
+            best = p;
+    }
+    return best;
+}
+
+/* Smooth weighted round-robin */
+static struct bond_path *
+bond_next_weighted(struct bond *b)
+{
+    struct bond_path *best = NULL;
+    int total = 0;
+    size_t i;
+
+    for (i = 0; i < b->count; ++i)
+    {
+        struct bond_path *p = &b->paths[i];
+
+        if (p->weight == 0)
+            continue;
+        p->current += p->weight;
+        total += p->weight;
+        if (best == NULL || p->current > best->current)
+            best = p;
+    }
+    if (best != NULL)
+        best->current -= total;
+    return best;
+}
+
+/*
+ * The paths a datagram for the peer goes through, following the policy.
+ * Returns their number, 0 if the peer has a single path.
+ */
+size_t
+bond_pick(struct udp_peer *peer,
+          struct bond_path **paths)
+{
+    struct bond *b = peer->bond;
+    struct bond_path *best = NULL;
+    size_t n = 0;
+    size_t i;
+
+    if (b == NULL || b->count < 2)
+        return 0;
+    switch (serv_opts.multipath)
+    {
+        case TNT_MULTIPATH_REDUNDANT:
+            /* The copies of a clear frame could not be told apart */
+            if (!peer->crypto.enabled)
+                break;
+            for (i = 0; i < b->count; ++i)
+            {
+                if (bond_path_alive(&b->paths[i]))
+                    paths[n++] = &b->paths[i];
+            }
+            break;
+        case TNT_MULTIPATH_WEIGHTED:
+            best = bond_next_weighted(b);
+            break;
+        default:
+            break;
+    }
+    if (n > 0)
+        return n;
+    if (best == NULL)
+        best = bond_fastest(b);
+    /* None answers, keep trying the one it was registered with */
+    paths[0] = (best != NULL) ? best : &b->paths[0];
+    return 1;
+}
+
+static int
+find_peer_host(struct udp_peer const *p, void *ctx)
+{
+    struct sockaddr *s = ctx;
+
+    return evutil_sockaddr_cmp(endpoint_addr(&p->peer_addr), s, 0) == 0;
+}
+
+static void
+bond_add_path(struct bond *b,
+              struct endpoint const *e,
+              struct udp_transport *t)
+{
+    struct bond_path *p;
+    size_t i;
+
+    for (i = 0; i < b->count; ++i)
+    {
+        if (b->paths[i].transport == t
+            && endpoint_cmp(&b->paths[i].addr, e) == 0)
+            return;
+    }
+    if (b->count == BOND_PATHS_MAX)
+        return;
+    p = &b->paths[b->count++];
+    memset(p, 0, sizeof(*p));
+    endpoint_copy(&p->addr, e);
+    p->transport = t;
+}
+
+/*
+ * The UDP sockets of the peer: [port:16][family:8][address:32 or 128]...
+ * It gets a path from each of our sockets of the same family to each of
+ * them. An unspecified address is the one of the meta-connexion.
+ * Returns -1 if the message is malformed, 0 otherwise.
+ */
+int
+bond_paths(struct server *s,
+           struct mc *mc,
+           unsigned char const *value,
+           size_t len)
+{
+    struct udp *udp = s->udp;
+    struct udp_peer *peer;
+    struct bond *b;
+    char name[INET6_ADDRSTRLEN];
+
+    if (serv_opts.multipath == TNT_MULTIPATH_OFF)
+        return 0;
+    peer = v_udp_find_if(udp->udp_peers, find_peer_host, mc->p.address);
+    if (peer == v_udp_end(udp->udp_peers))
+        return 0;
+    b = peer->bond;
+    if (b == NULL)
+    {
+        b = tnt_new(struct bond);
+        if (b == NULL)
+            return 0;
+        endpoint_copy(&b->paths[0].addr, &peer->peer_addr);
+        b->paths[0].transport = peer->transport;
+        /* What the keepalives measured so far */
+        b->paths[0].metric = peer->keepalive.link;
+        b->count = 1;
+        peer->bond = b;
+    }
+    while (len > 0)
+    {
+        struct sockaddr_storage ss;
+        struct udp_transport **it = NULL;
+        struct udp_transport **ite = NULL;
+        struct endpoint e;
+        socklen_t sslen;
+        size_t alen;
+
+        if (len < 3)
+            return -1;
+        alen = (value[2] == 4) ? 4 : (value[2] == 6) ? 16 : 0;
+        if (alen == 0 || len < 3 + alen)
+            return -1;
+        memset(&ss, 0, sizeof(ss));
+        if (alen == 4)
+        {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+            sin->sin_family = AF_INET;
+            memcpy(&sin->sin_addr, value + 3, 4);
+            if (sin->sin_addr.s_addr == htonl(INADDR_ANY)
+                && mc->p.address->sa_family == AF_INET)
+                sin->sin_addr = ((struct sockaddr_in *)mc->p.address)->sin_addr;
+            sslen = sizeof(*sin);
+        }
+        else
+        {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+            sin6->sin6_family = AF_INET6;
+            memcpy(&sin6->sin6_addr, value + 3, 16);
+            if (IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr)
+                && mc->p.address->sa_family == AF_INET6)
+                sin6->sin6_addr =
+                    ((struct sockaddr_in6 *)mc->p.address)->sin6_addr;
+            sslen = sizeof(*sin6);
+        }
+        endpoint_init(&e, (struct sockaddr *)&ss, sslen);
+        endpoint_set_port(&e, mp_get_u16(value));
+        value += 3 + alen;
+        len -= 3 + alen;
+
+        for (it = v_transport_begin(udp->transports),
+             ite = v_transport_end(udp->transports);
+             it != ite;
+             it = v_transport_next(it))
+        {
+            if (endpoint_addr(&(*it)->endpoint)->sa_family == ss.ss_family)
+                bond_add_path(b, &e, *it);
+        }
+    }
+    log_info("[BOND] %s: %d paths", mc_presentation(mc, name, sizeof name),
+             (int)b->count);
+    return 0;
+}
+
+/*
+ * Hold the opened datagram seq if some before it are still on their way.
+ * Returns 0 if it was held, 1 if it must be delivered now, 2 if there is no
+ * room left: the oldest gap is given up on, the held datagrams which may go
+ * must be delivered before seq is pushed again.
+ */
+int
+bond_reorder_push(struct bond_reorder *r,
+                  uint64_t seq,
+                  unsigned char const *dgram,
+                  size_t len,
+                  struct timeval const *now)
+{
+    struct bond_held *h;
+    struct timeval delay;
+    size_t i;
+
+    if (!r->started || seq + BOND_REORDER_RESTART < r->next)
+    {
+        r->started = 1;
+        r->next = seq + 1;
+        return 1;
+    }
+    /* Too late, its gap was given up on */
+    if (seq < r->next)
+        return 1;
+    if (seq == r->next && !r->draining)
+    {
+        ++r->next;
+        return 1;
+    }
+    if (r->count == BOND_REORDER_MAX)
+    {
+        /* Ahead of all of them, it goes first */
+        if (seq < r->held[0].seq)
+        {
+            r->next = seq + 1;
+            return 1;
+        }
+        /* Give up on the oldest gap */
+        r->next = r->held[0].seq;
+        return 2;
+    }
+    for (i = r->count; i > 0 && r->held[i - 1].seq > seq; --i)
+        ;
+    memmove(&r->held[i + 1], &r->held[i], (r->count - i) * sizeof(*h));
+    h = &r->held[i];
+    h->buf = malloc(len);
+    if (h->buf == NULL)
+    {
+        memmove(&r->held[i], &r->held[i + 1], (r->count - i) * sizeof(*h));
+        return 1;
+    }
+    memcpy(h->buf, dgram, len);
+    h->len = len;
+    h->seq = seq;
+    delay.tv_sec = serv_opts.reorder_delay / 1000000;
+    delay.tv_usec = serv_opts.reorder_delay % 1000000;
+    evutil_timeradd(now, &delay, &h->deadline);
+    ++r->count;
+    return 0;
+}
+
+/*
+ * Take the first held datagram if it is the next one, or if one of them
+ * waited long enough. The caller frees h->buf.
+ * Returns 1 if h was set, 0 otherwise.
+ */
+int
+bond_reorder_pop(struct bond_reorder *r,
+                 struct timeval const *now,
+                 struct bond_held *h)
+{
+    size_t i;
+
+    if (r->count == 0)
+        return 0;
+    if (r->held[0].seq > r->next)
+    {
+        for (i = 0; i < r->count; ++i)
+        {
+            if (!evutil_timercmp(now, &r->held[i].deadline, <))
+                break;
+        }
+        if (i == r->count)
+            return 0;
+    }
+    *h = r->held[0];
+    if (h->seq >= r->next)
+        r->next = h->seq + 1;
+    --r->count;
+    memmove(&r->held[0], &r->held[1], r->count * sizeof(*h));
+    return 1;
+}
+
+/*
+ * The earliest deadline of the held datagrams.
+ * Returns 0 if there is none.
+ */
+int
+bond_reorder_next(struct bond_reorder const *r,
+                  struct timeval *deadline)
+{
+    size_t i;
+
+    for (i = 0; i < r->count; ++i)
+    {
+        if (i == 0 || evutil_timercmp(&r->held[i].deadline, deadline, <))
+            *deadline = r->held[i].deadline;
+    }
+    return r->count > 0;
+}
+
+/*
+ * The bonding fiber: it delivers the held datagrams whose gap was not
+ * filled in time. It is woken up when the first datagram of a peer is held.
+ */
+void
+server_bond(void *ctx)
+{
+    struct server *s = (struct server *)sched_get_userptr(ctx);
+
+    while (1)
+    {
+        struct timeval now;
+        struct timeval next;
+        int armed;
+
+        armed = udp_bond_release(ctx, s, &next);
+        if (armed)
+        {
+            /* Delivering may have taken a while */
+            evutil_gettimeofday(&now, NULL);
+            if (evutil_timercmp(&next, &now, <))
+                evutil_timerclear(&next);
+            else
+                evutil_timersub(&next, &now, &next);
+        }
+        async_wait(ctx, armed ? &next : NULL);
+    }
+    sched_fiber_exit(ctx, 0);
+}
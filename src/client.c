@@ -16,6 +16,7 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
@@ -43,13 +44,46 @@
 #include "tclt_command.h"
 #include "server.h"
 
+/*
+ * Go on with the scan of a JSON value over the len bytes of buf.
+ * Returns the offset just past its end, 0 if it goes on after buf.
+ */
+static size_t
+client_scan(struct client_scan *st,
+            char const *buf,
+            size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+    {
+        char c = buf[i];
+
+        if (st->string)
+        {
+            if (st->escaped)
+                st->escaped = 0;
+            else if (c == '\\')
+                st->escaped = 1;
+            else if (c == '"')
+                st->string = 0;
+            continue;
+        }
+        if (c == '"')
+            st->string = 1;
+        else if (c == '{' || c == '[')
+            ++st->depth;
+        else if ((c == '}' || c == ']') && --st->depth == 0)
+            return i + 1;
+    }
+    return 0;
+}
+
 void
 client_mc_read_cb(struct bufferevent *bev, void *ctx)
 {
     struct server *s = (struct server *)ctx;
-    size_t size;
     struct evbuffer *buf = NULL;
-    char buff[4096];
     struct t_internal internal;
 
     internal.bev = bev;
@@ -57,12 +91,63 @@ client_mc_read_cb(struct bufferevent *bev, void *ctx)
     buf = bufferevent_get_input(bev);
     while (evbuffer_get_length(buf) != 0)
     {
-        size = bufferevent_read(bev, buff, 4095);
-        if (size != 0)
+        size_t avail = evbuffer_get_length(buf);
+        size_t scan = (avail < CLIENT_MSG_MAX) ? avail : CLIENT_MSG_MAX;
+        char *data = (char *)evbuffer_pullup(buf, (ev_ssize_t)scan);
+        struct client_scan st;
+        size_t skip = 0;
+        size_t size;
+        char *cmd;
+
+        if (data == NULL)
+            return;
+        /* The end of a command too large */
+        if (s->client_drop.depth != 0)
+        {
+            size = client_scan(&s->client_drop, data, scan);
+            evbuffer_drain(buf, (size != 0) ? size : scan);
+            continue;
+        }
+        /* Between two commands */
+        while (skip < scan && (data[skip] == ' ' || data[skip] == '\t'
+                               || data[skip] == '\r' || data[skip] == '\n'))
+            ++skip;
+        if (skip != 0)
+        {
+            evbuffer_drain(buf, skip);
+            continue;
+        }
+        if (data[0] != '{' && data[0] != '[')
+        {
+            /* Up to the next command */
+            while (skip < scan && data[skip] != '{' && data[skip] != '[')
+                ++skip;
+            log_warnx("[CLIENT] not a command, %u bytes dropped",
+                      (unsigned int)skip);
+            evbuffer_drain(buf, skip);
+            continue;
+        }
+        memset(&st, 0, sizeof(st));
+        size = client_scan(&st, data, scan);
+        if (size == 0)
         {
-            buff[size] = '\0';
-            tclt_dispatch_command(buff, &internal);
+            /* The rest of it is on its way */
+            if (scan < CLIENT_MSG_MAX)
+                return;
+            log_warnx("[CLIENT] command over %d bytes, dropped",
+                      CLIENT_MSG_MAX);
+            s->client_drop = st;
+            evbuffer_drain(buf, scan);
+            continue;
         }
+        cmd = malloc(size + 1);
+        if (cmd == NULL)
+            return;
+        memcpy(cmd, data, size);
+        cmd[size] = '\0';
+        evbuffer_drain(buf, size);
+        tclt_dispatch_command(cmd, &internal);
+        free(cmd);
     }
 }
 
@@ -41,6 +41,8 @@
 
 #include "tnetacle.h"
 #include "options.h"
+#include "handshake.h"
+#include "pmtu.h"
 
 extern int debug;
 struct options serv_opts;
@@ -48,6 +50,7 @@ struct options serv_opts;
 struct ctx {
     const unsigned char *map;
     size_t               len;
+    struct options      *opts;  /* Filled by the parsing */
 };
 
 void
@@ -63,6 +66,21 @@ init_options(struct options *opt) {
     opt->debug = 0;
     opt->compression = 1;
     opt->encryption = 1;
+    opt->handshake_threads = HS_DEFAULT_THREADS;
+    opt->mss_clamp = 1;
+    opt->tunnel_mtu = 0;
+    opt->udp_mtu = PMTU_DEFAULT_MAX;
+    opt->offload = 0;
+    opt->zerocopy_threshold = 0;
+    opt->hole_punching = 0;
+    opt->multipath = TNT_MULTIPATH_OFF;
+    opt->reorder_delay = 10000;
+    opt->routing = 0;
+    opt->discovery = 0;
+    opt->keepalive_interval = 10;
+    opt->keepalive_misses = 3;
+    opt->reconnect_max = 300;
+    opt->max_dials = 4;
 
     for (i = 0; i < TNETACLE_MAX_PORTS; ++i) {
         opt->ports[i] = -1;
@@ -70,9 +88,11 @@ init_options(struct options *opt) {
     }
 
     opt->addr_family = AF_UNSPEC;
-    serv_opts.listen_addrs = v_sockaddr_new();
-	serv_opts.client_addrs = v_sockaddr_new();
-    serv_opts.peer_addrs = v_sockaddr_new();
+    opt->listen_addrs = v_sockaddr_new();
+	opt->client_addrs = v_sockaddr_new();
+    opt->peer_addrs = v_sockaddr_new();
+    opt->peer_names = v_peername_new();
+    opt->nameserver = NULL;
 
     opt->addr = NULL;
 
@@ -98,8 +118,43 @@ add_sockaddr(struct vector_sockaddr *vsp, char *bufaddr) {
     return 0;
 }
 
+/*
+ * A PeerAddress which is not an IP address is a host name, with an optional
+ * port. It is resolved later on, by the dialing fiber.
+ */
 static int
-add_listen_addrs_ports(int family, int *ports) {
+add_peername(struct vector_peername *vpn, char *bufaddr) {
+    struct cfg_peername out;
+    char *port;
+    long ret = TNETACLE_DEFAULT_PORT;
+
+    port = strrchr(bufaddr, ':');
+    if (port != NULL) {
+        char *errstr;
+
+        *port++ = '\0';
+        ret = strtol(port, &errstr, 10);
+        if (*port == '\0' || *errstr != '\0' || ret <= 0 || ret > 65535) {
+            (void)fprintf(stderr, "%s: not a valid port\n", port);
+            return -1;
+        }
+    }
+    if (*bufaddr == '\0' || strchr(bufaddr, ':') != NULL) {
+        (void)fprintf(stderr, "%s: not a valid address\n", bufaddr);
+        return -1;
+    }
+    out.host = strdup(bufaddr);
+    if (out.host == NULL) {
+        perror(__func__);
+        return -1;
+    }
+    out.port = (unsigned short)ret;
+    v_peername_push(vpn, &out);
+    return 0;
+}
+
+static int
+add_listen_addrs_ports(struct options *opt, int family, int *ports) {
     unsigned int i;
     struct cfg_sockaddress tmp_store;
     struct sockaddr_in *sin = (struct sockaddr_in *)&tmp_store.sockaddr;
@@ -115,7 +170,7 @@ add_listen_addrs_ports(int family, int *ports) {
               &sin->sin_addr.s_addr) == -1)
                 return -1;
             tmp_store.len = sizeof *sin;
-            v_sockaddr_push(serv_opts.listen_addrs, &tmp_store);
+            v_sockaddr_push(opt->listen_addrs, &tmp_store);
             if (debug == 1)
                 fprintf(stderr, "ListenAddr: Added %s:%i\n",
                   TNETACLE_DEFAULT_LISTEN_IPV4, ports[i]);
@@ -127,7 +182,7 @@ add_listen_addrs_ports(int family, int *ports) {
               &sin6->sin6_addr.s6_addr) == -1)
                 return -1;
             tmp_store.len = sizeof *sin6;
-            v_sockaddr_push(serv_opts.listen_addrs, &tmp_store);
+            v_sockaddr_push(opt->listen_addrs, &tmp_store);
             if (debug == 1)
                 fprintf(stderr, "ListenAddr: Added [%s]:%i\n",
                   TNETACLE_DEFAULT_LISTEN_IPV6, ports[i]);
@@ -137,7 +192,7 @@ add_listen_addrs_ports(int family, int *ports) {
 }
 
 static int
-add_client_addrs_ports(int family, int *ports) {
+add_client_addrs_ports(struct options *opt, int family, int *ports) {
     unsigned int i;
     struct cfg_sockaddress tmp_store;
     struct sockaddr_in *sin = (struct sockaddr_in *)&tmp_store.sockaddr;
@@ -153,7 +208,7 @@ add_client_addrs_ports(int family, int *ports) {
               &sin->sin_addr.s_addr) == -1)
                 return -1;
             tmp_store.len = sizeof *sin;
-            v_sockaddr_push(serv_opts.client_addrs, &tmp_store);
+            v_sockaddr_push(opt->client_addrs, &tmp_store);
             if (debug == 1)
                 fprintf(stderr, "ListenClient: Added %s:%i\n",
                   TNETACLE_DEFAULT_LISTEN_IPV4, ports[i]);
@@ -165,7 +220,7 @@ add_client_addrs_ports(int family, int *ports) {
               &sin6->sin6_addr.s6_addr) == -1)
                 return -1;
             tmp_store.len = sizeof *sin6;
-            v_sockaddr_push(serv_opts.client_addrs, &tmp_store);
+            v_sockaddr_push(opt->client_addrs, &tmp_store);
             if (debug == 1)
                 fprintf(stderr, "ListenClient: Added [%s]:%i\n",
                   TNETACLE_DEFAULT_LISTEN_IPV6, ports[i]);
@@ -186,11 +241,23 @@ int yajl_boolean(void *lctx, int val) {
         return -1;
 
     if (strncmp("Compression", (const char *)ctx->map, ctx->len) == 0) {
-        serv_opts.compression = val;
+        ctx->opts->compression = val;
     } else if (strncmp("Encryption", (const char *)ctx->map, ctx->len) == 0) {
-        serv_opts.encryption = val;
+        ctx->opts->encryption = val;
     } else if (strncmp("Debug", (const char *)ctx->map, ctx->len) == 0) {
-        serv_opts.debug = val;
+        ctx->opts->debug = val;
+    } else if (strncmp("DTLS", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->dtls = val;
+    } else if (strncmp("MSSClamp", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->mss_clamp = val;
+    } else if (strncmp("Offload", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->offload = val;
+    } else if (strncmp("HolePunching", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->hole_punching = val;
+    } else if (strncmp("Routing", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->routing = val;
+    } else if (strncmp("Discovery", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->discovery = val;
     } else {
         char *s;
 
@@ -241,19 +308,62 @@ int yajl_number(void *lctx, const char *num, size_t len) {
     }
 
     if (strncmp("TunnelIndex", (const char *)ctx->map, ctx->len) == 0) {
-        serv_opts.tunnel_index = ret;
+        ctx->opts->tunnel_index = ret;
     } else if (strncmp("Port", (const char *)ctx->map, ctx->len) == 0) {
         unsigned int i;
 
-        for (i = 0; i < TNETACLE_MAX_PORTS && serv_opts.ports[i] != -1; ++i)
+        for (i = 0; i < TNETACLE_MAX_PORTS && ctx->opts->ports[i] != -1; ++i)
             ;
-        serv_opts.ports[i] = ret;
+        ctx->opts->ports[i] = ret;
+    } else if (strncmp("HandshakeThreads", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->handshake_threads = ret;
+    } else if (strncmp("AggregationDelay", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->aggregate_delay = ret;
+    } else if (strncmp("TunnelMTU", (const char *)ctx->map, ctx->len) == 0) {
+        if (ret != 0 && (ret < PMTU_LINK_MIN || ret > PMTU_UDP_MAX)) {
+            fprintf(stderr, "TunnelMTU: must be 0 or between %d and %d\n",
+              PMTU_LINK_MIN, PMTU_UDP_MAX);
+            return -1;
+        }
+        ctx->opts->tunnel_mtu = ret;
+    } else if (strncmp("UDPMTU", (const char *)ctx->map, ctx->len) == 0) {
+        /* A datagram of PMTU_LIMIT bytes carries PMTU_UDP_MAX over IPv4 */
+        if (ret < PMTU_MIN_INET || ret > PMTU_LIMIT) {
+            fprintf(stderr, "UDPMTU: must be between %d and %d\n",
+              PMTU_MIN_INET, PMTU_LIMIT);
+            return -1;
+        }
+        ctx->opts->udp_mtu = ret;
+    } else if (strncmp("ZeroCopyThreshold", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->zerocopy_threshold = ret;
+    } else if (strncmp("ReorderDelay", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->reorder_delay = ret;
+    } else if (strncmp("KeepaliveInterval", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->keepalive_interval = ret;
+    } else if (strncmp("KeepaliveMisses", (const char *)ctx->map, ctx->len) == 0) {
+        if (ret == 0) {
+            fprintf(stderr, "KeepaliveMisses: must be at least 1\n");
+            return -1;
+        }
+        ctx->opts->keepalive_misses = ret;
+    } else if (strncmp("ReconnectMax", (const char *)ctx->map, ctx->len) == 0) {
+        if (ret == 0) {
+            fprintf(stderr, "ReconnectMax: must be at least 1\n");
+            return -1;
+        }
+        ctx->opts->reconnect_max = ret;
+    } else if (strncmp("MaxDials", (const char *)ctx->map, ctx->len) == 0) {
+        if (ret == 0) {
+            fprintf(stderr, "MaxDials: must be at least 1\n");
+            return -1;
+        }
+        ctx->opts->max_dials = ret;
     } else if (strncmp("ClientPort", (const char *)ctx->map, ctx->len) == 0) {
         unsigned int i;
 
-        for (i = 0; i < TNETACLE_MAX_PORTS && serv_opts.cports[i] != -1; ++i)
+        for (i = 0; i < TNETACLE_MAX_PORTS && ctx->opts->cports[i] != -1; ++i)
             ;
-        serv_opts.cports[i] = ret;
+        ctx->opts->cports[i] = ret;
     } else {
        char *s;
 
@@ -276,18 +386,18 @@ int yajl_string(void *lctx, const unsigned char *str, size_t len) {
 
     if (strncmp("Address", (const char *)ctx->map, ctx->len) == 0) {
         /* XXX: Address validation */
-        serv_opts.addr = strndup((const char *)str, len);
-        if (serv_opts.addr == NULL) {
+        ctx->opts->addr = strndup((const char *)str, len);
+        if (ctx->opts->addr == NULL) {
             perror(__func__);
             return -1;
         }
     } else if (strncmp("AddressFamily", (const char *)ctx->map, ctx->len) == 0) {
         if (strncmp("inet6", (const char *)str, len) == 0) {
-            serv_opts.addr_family = AF_INET;
+            ctx->opts->addr_family = AF_INET;
         } else if (strncmp("inet", (const char *)str, len) == 0) {
-            serv_opts.addr_family = AF_INET6;
+            ctx->opts->addr_family = AF_INET6;
         } else if (strncmp("any", (const char *)str, len) == 0) {
-            serv_opts.addr_family = AF_UNSPEC;
+            ctx->opts->addr_family = AF_UNSPEC;
         } else {
             fprintf(stderr, "AddressFamily: bad value, should be "
               "\"inet6\", \"inet\" or \"any\"\n");
@@ -295,21 +405,37 @@ int yajl_string(void *lctx, const unsigned char *str, size_t len) {
         }
     } else if (strncmp("Mode", (const char *)ctx->map, ctx->len) == 0) {
         if (strncmp("router", (const char *)str, len) == 0) {
-            serv_opts.tunnel = TNT_DAEMONMODE_ROUTER;
+            ctx->opts->mode = TNT_DAEMONMODE_ROUTER;
         } else if (strncmp("switch", (const char *)str, len) == 0) {
-            serv_opts.tunnel = TNT_DAEMONMODE_SWITCH;
+            ctx->opts->mode = TNT_DAEMONMODE_SWITCH;
         } else if (strncmp("hub", (const char *)str, len) == 0) {
-            serv_opts.tunnel = TNT_DAEMONMODE_HUB;
+            ctx->opts->mode = TNT_DAEMONMODE_HUB;
+        } else if (strncmp("spoke", (const char *)str, len) == 0) {
+            ctx->opts->mode = TNT_DAEMONMODE_SPOKE;
         } else {
             fprintf(stderr, "Mode: bad value, should be "
-              "\"router\", \"switch\" or \"hub\"\n");
+              "\"router\", \"switch\", \"hub\" or \"spoke\"\n");
+            return -1;
+        }
+    } else if (strncmp("Multipath", (const char *)ctx->map, ctx->len) == 0) {
+        if (strncmp("off", (const char *)str, len) == 0) {
+            ctx->opts->multipath = TNT_MULTIPATH_OFF;
+        } else if (strncmp("redundant", (const char *)str, len) == 0) {
+            ctx->opts->multipath = TNT_MULTIPATH_REDUNDANT;
+        } else if (strncmp("weighted", (const char *)str, len) == 0) {
+            ctx->opts->multipath = TNT_MULTIPATH_WEIGHTED;
+        } else if (strncmp("latency", (const char *)str, len) == 0) {
+            ctx->opts->multipath = TNT_MULTIPATH_LATENCY;
+        } else {
+            fprintf(stderr, "Multipath: bad value, should be \"off\", "
+              "\"redundant\", \"weighted\" or \"latency\"\n");
             return -1;
         }
     } else if (strncmp("Tunnel", (const char *)ctx->map, ctx->len) == 0) {
          if (strncmp("point-to-point", (const char *)str, len) == 0) {
-            serv_opts.tunnel = TNT_TUNMODE_TUNNEL;
+            ctx->opts->tunnel = TNT_TUNMODE_TUNNEL;
         } else if (strncmp("ethernet", (const char *)str, len) == 0) {
-            serv_opts.tunnel = TNT_TUNMODE_ETHERNET;
+            ctx->opts->tunnel = TNT_TUNMODE_ETHERNET;
         } else {
             fprintf(stderr, "Tunnel: bad value, should be "
               "\"ethernet\" or \"point-to-point\"\n");
@@ -317,34 +443,53 @@ int yajl_string(void *lctx, const unsigned char *str, size_t len) {
         }
     } else if (strncmp("PrivateKey", (const char *)ctx->map, ctx->len) == 0) {
         /* XXX: Should we check for the existence of the key now ? */
-        serv_opts.key_path = strndup((const char *)str, len);
-        if (serv_opts.key_path == NULL) {
+        ctx->opts->key_path = strndup((const char *)str, len);
+        if (ctx->opts->key_path == NULL) {
             perror(__func__);
             return -1;
         }
     } else if (strncmp("CertFile", (const char *)ctx->map, ctx->len) == 0) {
         /* XXX: Should we check for the existence of the key now ? */
-        serv_opts.cert_path = strndup((const char *)str, len);
-        if (serv_opts.cert_path == NULL) {
+        ctx->opts->cert_path = strndup((const char *)str, len);
+        if (ctx->opts->cert_path == NULL) {
             perror(__func__);
             return -1;
         }
     } else if (strncmp("PeerAddress", (const char *)ctx->map, ctx->len) == 0) {
-        char bufaddr[INET6_ADDRSTRLEN]; /* IPv6 with IPv4 tunnelling */
+        struct sockaddr_storage ss;
+        int sslen = sizeof(ss);
+        char bufaddr[256 + sizeof(":65535")]; /* Longest DNS name and port */
+
+        if (len >= sizeof bufaddr) {
+            (void)fprintf(stderr, "PeerAddress: name too long\n");
+            return -1;
+        }
         (void)memset(bufaddr, '\0', sizeof bufaddr);
         (void)memcpy(bufaddr, str, len);
 
-        add_sockaddr(serv_opts.peer_addrs, bufaddr);
+        if (evutil_parse_sockaddr_port(bufaddr, (struct sockaddr *)&ss,
+          &sslen) == 0)
+            add_sockaddr(ctx->opts->peer_addrs, bufaddr);
+        else if (add_peername(ctx->opts->peer_names, bufaddr) == -1)
+            return -1;
+    } else if (strncmp("Nameserver", (const char *)ctx->map, ctx->len) == 0) {
+        ctx->opts->nameserver = strndup((const char *)str, len);
+        if (ctx->opts->nameserver == NULL) {
+            perror(__func__);
+            return -1;
+        }
     } else if (strncmp("ListenAddress", (const char *)ctx->map, ctx->len) == 0) {
         char bufaddr[INET6_ADDRSTRLEN]; /* IPv6 with IPv4 tunnelling */
         (void)memset(bufaddr, '\0', sizeof bufaddr);
         (void)memcpy(bufaddr, str, len);
 
         if (strncmp("any", (const char *)str, len) == 0) {
-	    add_listen_addrs_ports(serv_opts.addr_family, serv_opts.ports);
+	    add_listen_addrs_ports(ctx->opts, ctx->opts->addr_family,
+              ctx->opts->ports);
         } else
-            add_sockaddr(serv_opts.listen_addrs, bufaddr);
-        add_client_addrs_ports(serv_opts.addr_family, serv_opts.cports);
+            add_sockaddr(ctx->opts->listen_addrs, bufaddr);
+        add_client_addrs_ports(ctx->opts, ctx->opts->addr_family,
+          ctx->opts->cports);
     } else {
         char *s;
 
@@ -405,16 +550,20 @@ static yajl_callbacks callbacks = {
 	yajl_end_array
 };
 
+/*
+ * Parse a configuration into opt, which is initialised first. A SIGHUP
+ * parses into a fresh one, to compare it with the running configuration.
+ */
 int
-tnt_parse_buf(char *p, size_t size) {
+tnt_parse_options(struct options *opt, char *p, size_t size) {
 	yajl_handle parse;
 	yajl_status status;
 	struct ctx ctx;
 
-        /* Overwrite previous configuration in case of SIGHUP */
-        init_options(&serv_opts);
+        init_options(opt);
 	ctx.map = NULL;
 	ctx.len = 0;
+	ctx.opts = opt;
 
 	parse = yajl_alloc(&callbacks, NULL, &ctx);
 	yajl_config(parse, yajl_allow_comments, 1);
@@ -439,11 +588,39 @@ tnt_parse_buf(char *p, size_t size) {
 		return -1;
 	}
 
+    if (opt->ports[0] == -1)
+        opt->ports[0] = TNETACLE_DEFAULT_PORT;
+    if (opt->cports[0] == -1)
+        opt->cports[0] = CLIENT_DEFAULT_PORT;
+    return 0;
+}
+
+int
+tnt_parse_buf(char *p, size_t size) {
+    /* Overwrite previous configuration */
+    if (tnt_parse_options(&serv_opts, p, size) == -1)
+        return -1;
     debug = serv_opts.debug;
-    if (serv_opts.ports[0] == -1)
-        serv_opts.ports[0] = TNETACLE_DEFAULT_PORT;
-    if (serv_opts.cports[0] == -1)
-        serv_opts.cports[0] = CLIENT_DEFAULT_PORT;
     return 0;
 }
 
+/* Release what the parsing allocated */
+void
+free_options(struct options *opt) {
+    struct cfg_peername *it = NULL;
+    struct cfg_peername *ite = NULL;
+
+    for (it = v_peername_begin(opt->peer_names),
+      ite = v_peername_end(opt->peer_names); it != ite;
+      it = v_peername_next(it))
+        free(it->host);
+    v_peername_delete(opt->peer_names);
+    v_sockaddr_delete(opt->peer_addrs);
+    v_sockaddr_delete(opt->client_addrs);
+    v_sockaddr_delete(opt->listen_addrs);
+    free(opt->nameserver);
+    free(opt->addr);
+    free((char *)opt->key_path);
+    free((char *)opt->cert_path);
+    (void)memset(opt, '\0', sizeof(*opt));
+}
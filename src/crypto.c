@@ -0,0 +1,238 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "networking.h"
+
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/crypto.h>
+
+#include "crypto.h"
+#include "log.h"
+
+/*
+ * The data channel uses AES-256-GCM. OpenSSL selects its stitched
+ * AES-NI/PCLMULQDQ (AVX2 or AVX-512 when available) implementation by itself,
+ * which encrypts and authenticates in a single pass over the payload.
+ *
+ * The keys are derived from the meta-connection TLS session with the keying
+ * material exporter (RFC 5705), so the two ends agree on them without any
+ * extra round trip.
+ *
+ * The nonce is [salt:32][seq:64]. Like the TLS records, the salt is fixed
+ * once in each context and a packet only sets its sequence number: the
+ * context isn't initialised again for every packet. OpenSSL has no
+ * multi-buffer GCM, the bursts still handle their packets one after the
+ * other; util/bench/crypto.c measures both paths.
+ */
+
+#define CRYPTO_EXPORTER_LABEL "EXPORTER-tNETacle-data"
+
+/* The salt is fixed, the sequence number is the invocation field */
+static int
+crypto_fix_salt(EVP_CIPHER_CTX *ctx,
+                unsigned char const *salt)
+{
+    unsigned char nonce[CRYPTO_NONCE_SIZE];
+
+    memcpy(nonce, salt, CRYPTO_SALT_SIZE);
+    memset(nonce + CRYPTO_SALT_SIZE, 0, CRYPTO_SEQ_SIZE);
+    return EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IV_FIXED, -1, nonce);
+}
+
+static uint64_t
+crypto_read_seq(unsigned char const *p)
+{
+    uint64_t seq = 0;
+    int i;
+
+    for (i = 0; i < CRYPTO_SEQ_SIZE; ++i)
+        seq = (seq << 8) | p[i];
+    return seq;
+}
+
+int
+crypto_init(struct crypto_state *cs,
+            unsigned char const *tx_key,
+            unsigned char const *tx_salt,
+            unsigned char const *rx_key,
+            unsigned char const *rx_salt)
+{
+    memset(cs, 0, sizeof(*cs));
+    cs->enc = EVP_CIPHER_CTX_new();
+    cs->dec = EVP_CIPHER_CTX_new();
+    if (cs->enc == NULL || cs->dec == NULL)
+    {
+        crypto_free(cs);
+        return -1;
+    }
+
+    /* Key schedules are computed once, here */
+    if (EVP_EncryptInit_ex(cs->enc, EVP_aes_256_gcm(), NULL, tx_key, NULL) != 1
+        || EVP_DecryptInit_ex(cs->dec, EVP_aes_256_gcm(), NULL, rx_key, NULL) != 1
+        || crypto_fix_salt(cs->enc, tx_salt) != 1
+        || crypto_fix_salt(cs->dec, rx_salt) != 1)
+    {
+        log_warnx("[CRYPTO] unable to initialise the AEAD contexts");
+        crypto_free(cs);
+        return -1;
+    }
+    cs->tx_seq = 0;
+    cs->enabled = 1;
+    return 0;
+}
+
+int
+crypto_init_from_ssl(struct crypto_state *cs,
+                     SSL *ssl)
+{
+    unsigned char km[2 * (CRYPTO_KEY_SIZE + CRYPTO_SALT_SIZE)];
+    unsigned char *client_part = km;
+    unsigned char *server_part = km + CRYPTO_KEY_SIZE + CRYPTO_SALT_SIZE;
+    int err;
+
+    err = SSL_export_keying_material(ssl, km, sizeof(km),
+                                     CRYPTO_EXPORTER_LABEL,
+                                     sizeof(CRYPTO_EXPORTER_LABEL) - 1,
+                                     NULL, 0, 0);
+    if (err != 1)
+    {
+        log_warnx("[CRYPTO] unable to export the keying material");
+        return -1;
+    }
+
+    /* Each side sends with its own half, and receives with the other one */
+    if (SSL_is_server(ssl))
+    {
+        err = crypto_init(cs,
+                          server_part, server_part + CRYPTO_KEY_SIZE,
+                          client_part, client_part + CRYPTO_KEY_SIZE);
+    }
+    else
+    {
+        err = crypto_init(cs,
+                          client_part, client_part + CRYPTO_KEY_SIZE,
+                          server_part, server_part + CRYPTO_KEY_SIZE);
+    }
+    OPENSSL_cleanse(km, sizeof(km));
+    return err;
+}
+
+void
+crypto_free(struct crypto_state *cs)
+{
+    if (cs->enc != NULL)
+        EVP_CIPHER_CTX_free(cs->enc);
+    if (cs->dec != NULL)
+        EVP_CIPHER_CTX_free(cs->dec);
+    cs->enc = NULL;
+    cs->dec = NULL;
+    cs->enabled = 0;
+}
+
+/*
+ * Seal a whole burst. The operations may target different peers.
+ * The operations without state are left untouched.
+ * Returns the number of operations that succeeded.
+ */
+size_t
+crypto_seal_burst(struct crypto_op *ops,
+                  size_t count)
+{
+    size_t i;
+    size_t done = 0;
+
+    for (i = 0; i < count; ++i)
+    {
+        struct crypto_op *op = &ops[i];
+        struct crypto_state *cs = op->cs;
+        unsigned char *ct = op->out + CRYPTO_SEQ_SIZE;
+        int len;
+        int flen;
+
+        if (cs == NULL)
+            continue;
+        op->err = -1;
+        /* Writes the sequence number, and increments the context's one */
+        if (EVP_CIPHER_CTX_ctrl(cs->enc, EVP_CTRL_GCM_IV_GEN,
+                                CRYPTO_SEQ_SIZE, op->out) != 1)
+            continue;
+        op->seq = cs->tx_seq++;
+        if (EVP_EncryptUpdate(cs->enc, NULL, &len,
+                                 op->aad, (int)op->aad_len) != 1
+            || EVP_EncryptUpdate(cs->enc, ct, &len,
+                                 op->in, (int)op->in_len) != 1
+            || EVP_EncryptFinal_ex(cs->enc, ct + len, &flen) != 1
+            || EVP_CIPHER_CTX_ctrl(cs->enc, EVP_CTRL_GCM_GET_TAG,
+                                   CRYPTO_TAG_SIZE, ct + len + flen) != 1)
+        {
+            continue;
+        }
+        op->out_len = CRYPTO_SEQ_SIZE + len + flen + CRYPTO_TAG_SIZE;
+        op->err = 0;
+        ++done;
+    }
+    return done;
+}
+
+/*
+ * Open a whole burst, the tag of every operation is verified. An operation
+ * failing the authentication doesn't stop the others.
+ * Returns the number of operations that succeeded.
+ */
+size_t
+crypto_open_burst(struct crypto_op *ops,
+                  size_t count)
+{
+    size_t i;
+    size_t done = 0;
+
+    for (i = 0; i < count; ++i)
+    {
+        struct crypto_op *op = &ops[i];
+        struct crypto_state *cs = op->cs;
+        unsigned char const *ct = op->in + CRYPTO_SEQ_SIZE;
+        size_t ct_len;
+        int len;
+        int flen;
+
+        op->err = -1;
+        if (op->in_len < CRYPTO_OVERHEAD)
+            continue;
+        ct_len = op->in_len - CRYPTO_OVERHEAD;
+        op->seq = crypto_read_seq(op->in);
+
+        if (EVP_CIPHER_CTX_ctrl(cs->dec, EVP_CTRL_GCM_SET_IV_INV,
+                                CRYPTO_SEQ_SIZE, (void *)op->in) != 1
+            || EVP_DecryptUpdate(cs->dec, NULL, &len,
+                                 op->aad, (int)op->aad_len) != 1
+            || EVP_DecryptUpdate(cs->dec, op->out, &len,
+                                 ct, (int)ct_len) != 1
+            || EVP_CIPHER_CTX_ctrl(cs->dec, EVP_CTRL_GCM_SET_TAG,
+                                   CRYPTO_TAG_SIZE,
+                                   (void *)(ct + ct_len)) != 1
+            || EVP_DecryptFinal_ex(cs->dec, op->out + len, &flen) != 1)
+        {
+            continue;
+        }
+        op->out_len = len + flen;
+        op->err = 0;
+        ++done;
+    }
+    return done;
+}
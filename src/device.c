@@ -14,6 +14,7 @@
 **/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
@@ -49,6 +50,29 @@
 #include "device.h"
 #include "frame.h"
 #include "endpoint.h"
+#include "pmtu.h"
+#include "mss.h"
+#include "offload.h"
+#include "subset.h"
+#include "discovery.h"
+
+extern struct options serv_opts;
+
+/*
+ * The largest frame the device can give us, given the MTUs it may be
+ * configured with.
+ */
+unsigned int
+device_frame_max(void)
+{
+    unsigned int mtu = (unsigned int)serv_opts.udp_mtu;
+
+    if ((unsigned int)serv_opts.tunnel_mtu > mtu)
+        mtu = (unsigned int)serv_opts.tunnel_mtu;
+    if (mtu + FRAME_L2_OVERHEAD < FRAME_DYN_SIZE)
+        return FRAME_DYN_SIZE;
+    return mtu + FRAME_L2_OVERHEAD;
+}
 
 #if defined Windows
 
@@ -57,12 +81,30 @@ send_buffer_to_device_thread(struct server *s,
                              struct frame *frame)
 {
     struct evbuffer *output = bufferevent_get_output(s->pipe_endpoint);
+    unsigned short size = (unsigned short)frame->size;
 
     /*No need to networkize the size, we are in local !*/
-    evbuffer_add(output, &frame->size, sizeof frame->size);
+    evbuffer_add(output, &size, sizeof size);
     evbuffer_add(output, frame->frame, frame->size);
 }
 
+void
+device_write(void *async_ctx,
+             struct server *s,
+             struct frame *frame)
+{
+    (void)async_ctx;
+    send_buffer_to_device_thread(s, frame);
+}
+
+void
+device_flush(void *async_ctx,
+             struct server *s)
+{
+    (void)async_ctx;
+    (void)s;
+}
+
 void
 server_set_device(struct server *s,
                   intptr_t fd)
@@ -86,6 +128,7 @@ server_set_device(struct server *s,
         free(listen_endp);
     }
     server_udp_launch(s->udp);
+    discovery_start(s->discovery);
     log_info("listeners started");
 }
 
@@ -103,6 +146,15 @@ server_set_device(struct server *s,
     if (err == -1)
         log_debug("fuck !");
 
+    /* The privileged process may have enabled the offloads */
+    if (offload_active(fd))
+    {
+        s->gro = tnt_new(struct offload_gro);
+        if (s->gro == NULL || offload_gro_init(s->gro) == -1)
+            log_err(1, "[TAP] unable to allocate the offload buffers");
+        log_info("[TAP] offloads enabled on the device");
+    }
+
     log_info("event handler for the device sucessfully configured");
 
     it = v_evl_begin(s->srv_list);
@@ -123,56 +175,210 @@ server_set_device(struct server *s,
     s->tap_fd = fd;
     s->device_fib = sched_new_fiber(s->ev_sched, server_device, (intptr_t)s);
     server_udp_launch(s->udp);
+    discovery_start(s->discovery);
     sched_fiber_launch(s->device_fib);
     log_info("listener started");
 }
 
+/*
+ * Write a frame on its own while the offloads are enabled: the device
+ * expects an offload_hdr in front of every packet, an empty one says there
+ * is nothing to do. It goes through the aside buffer of the device, or a
+ * copy of its own if another fiber is writing from it.
+ */
+static void
+device_write_alone(void *async_ctx,
+                   struct server *s,
+                   struct frame const *frame)
+{
+    struct offload_gro *g = s->gro;
+    unsigned char *buf = g->aside;
+
+    if (frame->size > OFFLOAD_PACKET_MAX)
+    {
+        log_debug("[TAP] drop a %d bytes frame, too big for the device",
+                  frame->size);
+        return ;
+    }
+    if (g->aside_busy)
+        buf = calloc(1, OFFLOAD_HDR_SIZE + frame->size);
+    if (buf == NULL)
+    {
+        log_warn("[TAP] drop a %d bytes frame", frame->size);
+        return ;
+    }
+    memcpy(buf + OFFLOAD_HDR_SIZE, frame->frame, frame->size);
+    if (buf == g->aside)
+        g->aside_busy = 1;
+    if (async_write(async_ctx, s->tap_fd, buf,
+                    OFFLOAD_HDR_SIZE + frame->size) == -1)
+        log_warn("[TAP] write on the device failed");
+    if (buf == g->aside)
+        g->aside_busy = 0;
+    else
+        free(buf);
+}
+
+/*
+ * Coalesce the frame with the previous ones when the offloads are enabled,
+ * device_flush writes what is pending. Every UDP socket has its own receive
+ * fiber: while one of them is writing the pending packet, the others write
+ * their frames as they are.
+ */
+void
+device_write(void *async_ctx,
+             struct server *s,
+             struct frame *frame)
+{
+    int layer2 = (serv_opts.tunnel == TNT_TUNMODE_ETHERNET);
+
+    if (s->gro == NULL)
+    {
+        async_write(async_ctx, s->tap_fd, frame->frame, frame->size);
+        return ;
+    }
+    if (s->gro_writing)
+    {
+        device_write_alone(async_ctx, s, frame);
+        return ;
+    }
+    if (offload_gro_add(s->gro, frame->frame, frame->size, layer2) == 0)
+        return ;
+    device_flush(async_ctx, s);
+    if (offload_gro_add(s->gro, frame->frame, frame->size, layer2) == -1)
+        log_debug("[TAP] drop a %d bytes frame, too big for the device",
+                  frame->size);
+}
+
+void
+device_flush(void *async_ctx,
+             struct server *s)
+{
+    size_t len;
+
+    if (s->gro == NULL || s->gro_writing)
+        return ;
+    len = offload_gro_finish(s->gro);
+    if (len == 0)
+        return ;
+    s->gro_writing = 1;
+    if (async_write(async_ctx, s->tap_fd, s->gro->buf, len) == -1)
+        log_warn("[TAP] write on the device failed");
+    s->gro_writing = 0;
+}
+
+static void
+device_read(struct server *s,
+            unsigned int frame_max,
+            int layer2,
+            int mtu)
+{
+    ssize_t n;
+    struct frame tmp;
+
+    /*
+     * Now, we pre-alloc frame_max, waiting for a portable way to do
+     * a sort of fioread
+     */
+    frame_alloc(&tmp, frame_max);
+    while ((n = read(s->tap_fd, tmp.frame, frame_max)) != -1)
+    {
+        tmp.size = (unsigned int)n;
+        if (mtu != 0)
+            (void)mss_clamp(tmp.frame, tmp.size, layer2, mtu);
+        v_frame_push(s->frames_to_send, &tmp);
+        frame_alloc(&tmp, frame_max);
+    }
+
+    /* Don't forget to free the last allocated frame */
+    /* As we are out of the loop, the last call to frame alloc is useless */
+    frame_free(&tmp);
+}
+
+/*
+ * With the offloads, a read may give a superpacket of up to 64 KiB. It's
+ * split here, the rest of the daemon only sees frames fitting the MTU.
+ */
+static void
+device_read_offload(struct server *s,
+                    unsigned char *buf,
+                    int layer2,
+                    int mtu)
+{
+    unsigned char *pkt = buf + OFFLOAD_HDR_SIZE;
+    ssize_t n;
+
+    while ((n = read(s->tap_fd, buf, OFFLOAD_HDR_SIZE + OFFLOAD_PACKET_MAX))
+           != -1)
+    {
+        struct offload_hdr hdr;
+        struct frame tmp;
+        size_t len;
+
+        if ((size_t)n < OFFLOAD_HDR_SIZE)
+            continue;
+        memcpy(&hdr, buf, sizeof(hdr));
+        len = (size_t)n - OFFLOAD_HDR_SIZE;
+        if ((hdr.gso_type & ~OFFLOAD_GSO_ECN) != OFFLOAD_GSO_NONE)
+        {
+            /* A superpacket never carries a SYN, no MSS to clamp */
+            if (offload_split(pkt, len, &hdr, layer2, s->frames_to_send) <= 0)
+                log_debug("[TAP] drop a malformed %d bytes superpacket", len);
+            continue;
+        }
+        if (offload_complete_csum(pkt, len, &hdr) == -1)
+        {
+            log_debug("[TAP] drop a %d bytes frame, bad checksum offsets", len);
+            continue;
+        }
+        if (frame_alloc(&tmp, (unsigned int)len) == -1)
+            break;
+        memcpy(tmp.frame, pkt, len);
+        if (mtu != 0)
+            (void)mss_clamp(tmp.frame, tmp.size, layer2, mtu);
+        v_frame_push(s->frames_to_send, &tmp);
+    }
+}
+
 void
 server_device(void *async_ctx)
 {
     struct server *s = (struct server *)sched_get_userptr(async_ctx);
     evutil_socket_t tap_fd = s->tap_fd;
-    ssize_t n;
-    struct frame tmp;
+    int layer2 = (serv_opts.tunnel == TNT_TUNMODE_ETHERNET);
+    unsigned int frame_max = device_frame_max();
+    unsigned char *offload_buf = NULL;
 
     /* I know it sucks. I'm waiting for libtuntap to handle*/
     /* a FIONREAD-like api.*/
 
+    if (s->gro != NULL)
+    {
+        offload_buf = malloc(OFFLOAD_HDR_SIZE + OFFLOAD_PACKET_MAX);
+        if (offload_buf == NULL)
+            log_err(1, "[TAP] unable to allocate the offload buffers");
+    }
+
     do
     {
-        /* 
-         * Alloc the memory for a new frame
-         *
-         * Now, we pre-alloc FRAME_DYN_SIZE, waiting for a portable way to do
-         * a sort of fioread
-         */
-
-        frame_alloc(&tmp, FRAME_DYN_SIZE);
+        int mtu = 0;
+
         async_event(async_ctx, tap_fd, EV_READ);
-        while ((n = read(tap_fd, tmp.frame, FRAME_DYN_SIZE)) != -1)
-        {
-            if (n == -1)
-            {
-                log_warn("[TAP] read on the device failed");
-                break;
-            }
-            /* Can we read more than a ushort ? */
-            tmp.size = (unsigned short)n;
-            v_frame_push(s->frames_to_send, &tmp);
-            frame_alloc(&tmp, FRAME_DYN_SIZE);
-        }
+        /* The frames are broadcast, they must fit the narrowest path */
+        if (serv_opts.mss_clamp)
+            mtu = pmtu_min_device_mtu(s->udp);
+        if (offload_buf != NULL)
+            device_read_offload(s, offload_buf, layer2, mtu);
+        else
+            device_read(s, frame_max, layer2, mtu);
 
         if (v_frame_size(s->frames_to_send) > 0)
         {
             broadcast_udp_to_peers(s);
         }
-
-        /* Don't forget to free the last allocated frame */
-        /* As we are out of the loop, the last call to frame alloc is useless */
-        frame_free(&tmp);
-
     } while(1);
 
+    free(offload_buf);
     sched_fiber_exit(async_ctx, -1);
 }
 
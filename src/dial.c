@@ -0,0 +1,734 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/util.h>
+#include <event2/dns.h>
+
+#include "networking.h"
+
+#include <openssl/rand.h>
+
+#include "tnetacle.h"
+#include "tntsched.h"
+#include "options.h"
+#include "server.h"
+#include "mc.h"
+#include "dial.h"
+#include "subset.h"
+#include "log.h"
+
+extern struct options serv_opts;
+
+/* Wait before the next dial, longer after every failure */
+static void
+dial_schedule(struct dial_target *t,
+              struct timeval const *now)
+{
+    int shift = (t->failures < DIAL_SHIFT_MAX) ? t->failures : DIAL_SHIFT_MAX;
+    long delay = (DIAL_BASE * 1000L) << shift;
+    long max = serv_opts.reconnect_max * 1000L;
+    uint32_t r = 0;
+    struct timeval tv;
+
+    if (delay > max)
+        delay = max;
+    (void)RAND_bytes((unsigned char *)&r, sizeof(r));
+    delay = delay / 2 + (long)(r % (uint32_t)(delay / 2 + 1));
+    tv.tv_sec = delay / 1000;
+    tv.tv_usec = (delay % 1000) * 1000;
+    evutil_timeradd(now, &tv, &t->due);
+    /* The address resolved meanwhile is the one to dial now */
+    if (t->fresh_len != 0)
+    {
+        memcpy(&t->addr, &t->fresh, t->fresh_len);
+        t->len = t->fresh_len;
+        t->fresh_len = 0;
+    }
+    t->state = (t->len != 0) ? DIAL_WAITING : DIAL_RESOLVING;
+}
+
+/*
+ * Sort on the family and the address, the port is ignored like
+ * mc_established does: a peer which dialed us comes from another port than
+ * the one it listens on, and there is a single meta-connexion per address.
+ */
+static int
+dial_addr_cmp(void const *a,
+              void const *b)
+{
+    struct sockaddr const *sa = *(struct sockaddr * const *)a;
+    struct sockaddr const *sb = *(struct sockaddr * const *)b;
+
+    if (sa->sa_family != sb->sa_family)
+        return (sa->sa_family < sb->sa_family) ? -1 : 1;
+    if (sa->sa_family == AF_INET)
+        return memcmp(&((struct sockaddr_in const *)sa)->sin_addr,
+                      &((struct sockaddr_in const *)sb)->sin_addr,
+                      sizeof(struct in_addr));
+    if (sa->sa_family == AF_INET6)
+        return memcmp(&((struct sockaddr_in6 const *)sa)->sin6_addr,
+                      &((struct sockaddr_in6 const *)sb)->sin6_addr,
+                      sizeof(struct in6_addr));
+    return 0;
+}
+
+/*
+ * Take the addresses of the meta-connexions once per pass: looking every
+ * target up costs a log instead of a walk over all the peers.
+ */
+static int
+dial_set_fill(struct dial_set *set,
+              struct vector_mc *v)
+{
+    struct mc *it = NULL;
+    struct mc *ite = NULL;
+
+    if (v_mc_size(v) > set->size)
+    {
+        struct sockaddr **tmp;
+
+        tmp = realloc(set->addrs, v_mc_size(v) * sizeof(*tmp));
+        if (tmp == NULL)
+            return -1;
+        set->addrs = tmp;
+        set->size = v_mc_size(v);
+    }
+    set->count = 0;
+    for (it = v_mc_begin(v), ite = v_mc_end(v); it != ite; it = v_mc_next(it))
+        set->addrs[set->count++] = it->p.address;
+    if (set->count > 1)
+        qsort(set->addrs, set->count, sizeof(*set->addrs), dial_addr_cmp);
+    return 0;
+}
+
+static int
+dial_set_has(struct dial_set const *set,
+             struct sockaddr *sa)
+{
+    if (set->count == 0)
+        return 0;
+    return bsearch(&sa, set->addrs, set->count, sizeof(*set->addrs),
+                   dial_addr_cmp) != NULL;
+}
+
+static void
+dial_resolved(int result,
+              char type,
+              int count,
+              int ttl,
+              void *addresses,
+              void *arg)
+{
+    struct dial_target *t = (struct dial_target *)arg;
+    struct dial *d = t->dial;
+    struct sockaddr_storage ss;
+    socklen_t len;
+    struct timeval now;
+    struct timeval tv = {0, 0};
+
+    t->req = NULL;
+    /* No longer in the configuration */
+    if (t->removed)
+    {
+        free(t->host);
+        free(t);
+        return;
+    }
+    if (result == DNS_ERR_CANCEL || result == DNS_ERR_SHUTDOWN)
+        return;
+    /* No IPv4 address, maybe an IPv6 one. The type is 0 on errors */
+    if ((result != DNS_ERR_NONE || count == 0) && !t->ipv6)
+    {
+        t->ipv6 = 1;
+        t->req = evdns_base_resolve_ipv6(d->dns, t->host, 0, dial_resolved, t);
+        if (t->req != NULL)
+            return;
+    }
+    evutil_gettimeofday(&now, NULL);
+    if (result != DNS_ERR_NONE || count == 0)
+    {
+        /* We keep dialing the last address we had, if any */
+        log_notice("[DIAL] unable to resolve %s: %s", t->host,
+                   evdns_err_to_string(result));
+        tv.tv_sec = DIAL_RESOLVE_RETRY;
+        evutil_timeradd(&now, &tv, &t->expire);
+        dial_wake(d->s);
+        return;
+    }
+
+    memset(&ss, 0, sizeof(ss));
+    if (type == DNS_IPv4_A)
+    {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(t->port);
+        memcpy(&sin->sin_addr, addresses, sizeof(sin->sin_addr));
+        len = sizeof(*sin);
+    }
+    else
+    {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(t->port);
+        memcpy(&sin6->sin6_addr, addresses, sizeof(sin6->sin6_addr));
+        len = sizeof(*sin6);
+    }
+
+    if (ttl < DIAL_TTL_MIN)
+        ttl = DIAL_TTL_MIN;
+    else if (ttl > DIAL_TTL_MAX)
+        ttl = DIAL_TTL_MAX;
+    tv.tv_sec = ttl;
+    evutil_timeradd(&now, &tv, &t->expire);
+
+    if (t->len == len && memcmp(&t->addr, &ss, len) == 0)
+    {
+        t->fresh_len = 0;
+        return;
+    }
+    {
+        char name[INET6_ADDRSTRLEN + 8];
+
+        log_info("[DIAL] %s is %s", t->host,
+                 address_presentation((struct sockaddr *)&ss, (int)len,
+                                      name, sizeof(name)));
+    }
+    memcpy(&t->fresh, &ss, len);
+    t->fresh_len = len;
+    /* Not dialed or connected yet, the new one can be used right away */
+    if (t->state == DIAL_RESOLVING || t->state == DIAL_WAITING)
+    {
+        memcpy(&t->addr, &t->fresh, t->fresh_len);
+        t->len = t->fresh_len;
+        t->fresh_len = 0;
+        t->state = DIAL_WAITING;
+    }
+    dial_wake(d->s);
+}
+
+static void
+dial_resolve(struct dial *d,
+             struct dial_target *t)
+{
+    t->ipv6 = 0;
+    t->req = evdns_base_resolve_ipv4(d->dns, t->host, 0, dial_resolved, t);
+    if (t->req == NULL)
+    {
+        struct timeval now;
+        struct timeval tv = {DIAL_RESOLVE_RETRY, 0};
+
+        log_notice("[DIAL] unable to start the resolution of %s", t->host);
+        evutil_gettimeofday(&now, NULL);
+        evutil_timeradd(&now, &tv, &t->expire);
+    }
+}
+
+/* A local stub resolver if we have one, the system ones otherwise */
+static int
+dial_resolver(struct dial *d)
+{
+    if (d->dns != NULL)
+        return 0;
+    d->dns = evdns_base_new(d->s->evbase, serv_opts.nameserver == NULL);
+    if (d->dns == NULL
+        || (serv_opts.nameserver != NULL
+            && evdns_base_nameserver_ip_add(d->dns, serv_opts.nameserver) != 0))
+    {
+        log_warnx("[DIAL] unable to set up the resolver");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+dial_target_free(struct dial_target *t)
+{
+    /* The resolution in flight calls us back, it frees it then */
+    if (t->req != NULL)
+    {
+        t->removed = 1;
+        evdns_cancel_request(t->dial->dns, t->req);
+        return;
+    }
+    free(t->host);
+    free(t);
+}
+
+/* Take the target of addr, or of host:port, out of old */
+static struct dial_target *
+dial_target_take(struct dial_target **old,
+                 size_t count,
+                 struct cfg_sockaddress const *addr,
+                 struct cfg_peername const *name)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+    {
+        struct dial_target *t = old[i];
+
+        if (t == NULL)
+            continue;
+        if (addr != NULL && t->host == NULL && t->len == (socklen_t)addr->len
+            && evutil_sockaddr_cmp((struct sockaddr *)&t->addr,
+                                   (struct sockaddr *)&addr->sockaddr, 1) == 0)
+        {
+            /* A discovered node may be configured now */
+            t->discovered = 0;
+            old[i] = NULL;
+            return t;
+        }
+        if (name != NULL && t->host != NULL && t->port == name->port
+            && strcmp(t->host, name->host) == 0)
+        {
+            old[i] = NULL;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The targets of the configured peers. The ones already in old are kept as
+ * they are, with their meta-connexion, old is left with the others.
+ */
+static int
+dial_targets(struct dial *d,
+             struct vector_sockaddr *addrs,
+             struct vector_peername *names,
+             struct dial_target **old,
+             size_t oldcount)
+{
+    struct cfg_sockaddress *it = NULL;
+    struct cfg_sockaddress *ite = NULL;
+    struct cfg_peername *nit = NULL;
+    struct cfg_peername *nite = NULL;
+    struct dial_target **targets;
+    struct timeval now;
+    size_t count = 0;
+
+    if (v_peername_size(names) != 0 && dial_resolver(d) == -1)
+        return -1;
+    targets = calloc(v_sockaddr_size(addrs) + v_peername_size(names) + 1,
+                     sizeof(*targets));
+    if (targets == NULL)
+        return -1;
+    /* Not all at once, even at startup */
+    evutil_gettimeofday(&now, NULL);
+    for (it = v_sockaddr_begin(addrs), ite = v_sockaddr_end(addrs);
+         it != ite;
+         it = v_sockaddr_next(it))
+    {
+        struct dial_target *t = dial_target_take(old, oldcount, it, NULL);
+
+        if (t == NULL && (t = tnt_new(struct dial_target)) != NULL)
+        {
+            memcpy(&t->addr, &it->sockaddr, it->len);
+            t->len = it->len;
+            t->dial = d;
+            dial_schedule(t, &now);
+        }
+        if (t != NULL)
+            targets[count++] = t;
+    }
+    /* The names are resolved by the next pass of the fiber */
+    for (nit = v_peername_begin(names), nite = v_peername_end(names);
+         nit != nite;
+         nit = v_peername_next(nit))
+    {
+        struct dial_target *t = dial_target_take(old, oldcount, NULL, nit);
+
+        if (t == NULL && (t = tnt_new(struct dial_target)) != NULL)
+        {
+            if ((t->host = strdup(nit->host)) == NULL)
+            {
+                free(t);
+                continue;
+            }
+            t->port = nit->port;
+            t->dial = d;
+            t->expire = now;
+            dial_schedule(t, &now);
+        }
+        if (t != NULL)
+            targets[count++] = t;
+    }
+    d->targets = targets;
+    d->count = count;
+    return 0;
+}
+
+struct dial *
+dial_new(struct server *s,
+         struct vector_sockaddr *addrs,
+         struct vector_peername *names)
+{
+    struct dial *d = tnt_new(struct dial);
+
+    if (d == NULL)
+        return NULL;
+    d->s = s;
+    if (dial_targets(d, addrs, names, NULL, 0) == -1)
+    {
+        dial_delete(d);
+        return NULL;
+    }
+    return d;
+}
+
+void
+dial_delete(struct dial *d)
+{
+    size_t i;
+
+    if (d == NULL)
+        return;
+    /* Drops the requests in flight without calling us back */
+    if (d->dns != NULL)
+        evdns_base_free(d->dns, 0);
+    for (i = 0; i < d->count; ++i)
+    {
+        free(d->targets[i]->host);
+        free(d->targets[i]);
+    }
+    free(d->established.addrs);
+    free(d->pending.addrs);
+    free(d->targets);
+    free(d);
+}
+
+/* Something happened to a meta-connexion, look at the peers again */
+void
+dial_wake(struct server *s)
+{
+    if (s->dial_fib != NULL)
+        async_wake(s->dial_fib, /*unused*/0);
+}
+
+/*
+ * A node found by the discovery, dialed as soon as there is a free slot.
+ * Returns -1 if it can't be taken, 0 otherwise.
+ */
+int
+dial_discovered(struct dial *d,
+                struct sockaddr const *sa,
+                socklen_t len)
+{
+    struct dial_target **targets;
+    struct dial_target *t;
+    size_t discovered = 0;
+    size_t i;
+
+    for (i = 0; i < d->count; ++i)
+    {
+        t = d->targets[i];
+        if (t->len == len
+            && evutil_sockaddr_cmp((struct sockaddr *)&t->addr, sa, 1) == 0)
+            return 0;
+        if (t->discovered)
+            ++discovered;
+    }
+    if (discovered >= DIAL_DISCOVERED_MAX)
+        return -1;
+    t = tnt_new(struct dial_target);
+    if (t == NULL)
+        return -1;
+    targets = realloc(d->targets, (d->count + 1) * sizeof(*targets));
+    if (targets == NULL)
+    {
+        free(t);
+        return -1;
+    }
+    d->targets = targets;
+    memcpy(&t->addr, sa, len);
+    t->len = len;
+    t->dial = d;
+    t->discovered = 1;
+    t->state = DIAL_WAITING;
+    evutil_gettimeofday(&t->due, NULL);
+    d->targets[d->count++] = t;
+    dial_wake(d->s);
+    return 0;
+}
+
+/* The discovered nodes which keep failing are left to the discovery */
+static void
+dial_forget(struct dial *d)
+{
+    size_t i = 0;
+
+    while (i < d->count)
+    {
+        struct dial_target *t = d->targets[i];
+        char name[INET6_ADDRSTRLEN + 8];
+
+        if (!t->discovered || t->failures < DIAL_FORGET
+            || t->state != DIAL_WAITING)
+        {
+            ++i;
+            continue;
+        }
+        log_info("[DIAL] forget %s, found by the discovery",
+                 address_presentation((struct sockaddr *)&t->addr,
+                                      (int)t->len, name, sizeof(name)));
+        free(t);
+        d->targets[i] = d->targets[--d->count];
+    }
+}
+
+/*
+ * The meta-connexion we dialed to a target, port included: another peer may
+ * be behind the same address, and one which dialed us may stay.
+ */
+static int
+dial_find_mc(struct mc const *mc, void *ctx)
+{
+    return evutil_sockaddr_cmp(mc->p.address, (struct sockaddr *)ctx, 1) == 0;
+}
+
+static void
+dial_abort(struct server *s,
+           struct dial_target *t)
+{
+    struct mc *it;
+
+    it = v_mc_find_if(s->pending_peers, dial_find_mc, &t->addr);
+    if (it != v_mc_end(s->pending_peers))
+    {
+        mc_close(it);
+        v_mc_erase(s->pending_peers, it);
+    }
+}
+
+/*
+ * Follow a new configuration. The peers still configured keep their target,
+ * their meta-connexion and their backoff; only the others are hung up.
+ */
+int
+dial_reload(struct dial *d,
+            struct vector_sockaddr *addrs,
+            struct vector_peername *names)
+{
+    struct dial_target **old = d->targets;
+    struct dial_target **targets;
+    size_t count = d->count;
+    size_t i;
+
+    if (dial_targets(d, addrs, names, old, count) == -1)
+        return -1;
+    /* Room for the discovered nodes, at worst they are all left */
+    targets = realloc(d->targets, (d->count + count + 1) * sizeof(*targets));
+    if (targets != NULL)
+        d->targets = targets;
+    for (i = 0; i < count; ++i)
+    {
+        struct dial_target *t = old[i];
+        struct mc *mc;
+
+        if (t == NULL)
+            continue;
+        if (t->discovered && targets != NULL)
+        {
+            d->targets[d->count++] = t;
+            continue;
+        }
+        if (t->host != NULL)
+            log_info("[DIAL] %s:%u is no longer a peer", t->host,
+                     (unsigned int)t->port);
+        else
+        {
+            char name[INET6_ADDRSTRLEN + 8];
+
+            address_presentation((struct sockaddr *)&t->addr, (int)t->len,
+                                 name, sizeof(name));
+            log_info("[DIAL] %s is no longer a peer", name);
+        }
+        if (t->state == DIAL_CONNECTED)
+        {
+            mc = v_mc_find_if(d->s->peers, dial_find_mc, &t->addr);
+            if (mc != v_mc_end(d->s->peers))
+                server_mc_close(d->s, mc);
+        }
+        else if (t->state == DIAL_PENDING)
+            dial_abort(d->s, t);
+        dial_target_free(t);
+    }
+    free(old);
+    dial_wake(d->s);
+    return 0;
+}
+
+/*
+ * Follow what became of every peer since the last look.
+ * Returns the dials in flight.
+ */
+static size_t
+dial_update(struct server *s,
+            struct timeval const *now)
+{
+    struct dial *d = s->dial;
+    size_t inflight = 0;
+    size_t i;
+
+    if (dial_set_fill(&d->established, s->peers) == -1
+        || dial_set_fill(&d->pending, s->pending_peers) == -1)
+    {
+        log_warnx("[DIAL] unable to allocate the peers addresses");
+        return (size_t)serv_opts.max_dials;
+    }
+    for (i = 0; i < d->count; ++i)
+    {
+        struct dial_target *t = d->targets[i];
+        struct sockaddr *sa = (struct sockaddr *)&t->addr;
+        char name[INET6_ADDRSTRLEN + 8];
+
+        if (t->state == DIAL_RESOLVING)
+            continue;
+        address_presentation(sa, (int)t->len, name, sizeof(name));
+        if (dial_set_has(&d->established, sa))
+        {
+            if (t->state != DIAL_CONNECTED && t->failures > 0)
+                log_info("[DIAL] %s is back after %d failures", name,
+                         t->failures);
+            t->state = DIAL_CONNECTED;
+            t->failures = 0;
+            continue;
+        }
+        if (dial_set_has(&d->pending, sa))
+        {
+            /* It may be the peer connecting to us */
+            if (t->state != DIAL_PENDING)
+            {
+                struct timeval tv = {DIAL_TIMEOUT, 0};
+
+                evutil_timeradd(now, &tv, &t->due);
+                t->state = DIAL_PENDING;
+            }
+            if (evutil_timercmp(now, &t->due, <))
+            {
+                ++inflight;
+                continue;
+            }
+            log_notice("[DIAL] %s doesn't answer, giving up", name);
+            dial_abort(s, t);
+            ++t->failures;
+            dial_schedule(t, now);
+            continue;
+        }
+        if (t->state == DIAL_CONNECTED)
+        {
+            log_notice("[DIAL] lost %s, dialing it again", name);
+            t->failures = 0;
+            dial_schedule(t, now);
+        }
+        else if (t->state == DIAL_PENDING)
+        {
+            ++t->failures;
+            dial_schedule(t, now);
+            log_debug("[DIAL] %s failed %d times, next try in %lds", name,
+                      t->failures, (long)(t->due.tv_sec - now->tv_sec));
+        }
+    }
+    dial_forget(d);
+    return inflight;
+}
+
+/*
+ * The dialing fiber. It is woken up when a meta-connexion is established or
+ * lost, or a name resolved, and sleeps until the next dial, timeout or
+ * resolution otherwise.
+ */
+void
+server_dial(void *ctx)
+{
+    struct server *s = (struct server *)sched_get_userptr(ctx);
+    struct dial *d = s->dial;
+
+    while (1)
+    {
+        struct timeval now;
+        struct timeval next;
+        int armed = 0;
+        size_t inflight;
+        size_t i;
+
+        evutil_gettimeofday(&now, NULL);
+        inflight = dial_update(s, &now);
+        for (i = 0; i < d->count; ++i)
+        {
+            struct dial_target *t = d->targets[i];
+
+            /* Every name is resolved in parallel, evdns queues them */
+            if (t->host != NULL && t->req == NULL)
+            {
+                if (!evutil_timercmp(&now, &t->expire, <))
+                    dial_resolve(d, t);
+                if (t->req == NULL
+                    && (armed == 0 || evutil_timercmp(&t->expire, &next, <)))
+                {
+                    next = t->expire;
+                    armed = 1;
+                }
+            }
+            if (t->state == DIAL_CONNECTED || t->state == DIAL_RESOLVING)
+                continue;
+            if (t->state == DIAL_WAITING && !evutil_timercmp(&now, &t->due, <))
+            {
+                /* The others wait for a free slot */
+                if (inflight >= (size_t)serv_opts.max_dials)
+                    continue;
+                if (mc_peer_connect(s, s->evbase, (struct sockaddr *)&t->addr,
+                                    (int)t->len) == NULL)
+                {
+                    ++t->failures;
+                    dial_schedule(t, &now);
+                }
+                else
+                {
+                    struct timeval tv = {DIAL_TIMEOUT, 0};
+
+                    evutil_timeradd(&now, &tv, &t->due);
+                    t->state = DIAL_PENDING;
+                    ++inflight;
+                }
+            }
+            if (armed == 0 || evutil_timercmp(&t->due, &next, <))
+            {
+                next = t->due;
+                armed = 1;
+            }
+        }
+        if (!armed)
+        {
+            async_wait(ctx, NULL);
+            continue;
+        }
+        if (evutil_timercmp(&next, &now, <))
+        {
+            /* Waiting for a slot, a dial ending wakes us up */
+            next.tv_sec = DIAL_BASE;
+            next.tv_usec = 0;
+        }
+        else
+            evutil_timersub(&next, &now, &next);
+        async_wait(ctx, &next);
+    }
+    sched_fiber_exit(ctx, 0);
+}
@@ -0,0 +1,293 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "networking.h"
+
+#include "tnetacle.h"
+#include "options.h"
+#include "tntsocket.h"
+#include "server.h"
+#include "udp.h"
+#include "mc.h"
+#include "metaproto.h"
+#include "discovery.h"
+#include "dial.h"
+#include "subset.h"
+#include "log.h"
+
+extern struct options serv_opts;
+
+static unsigned char
+discovery_caps(void)
+{
+    unsigned char caps = 0;
+
+    if (serv_opts.encryption)
+        caps |= DISCOVERY_CAP_TLS;
+    if (serv_opts.dtls)
+        caps |= DISCOVERY_CAP_DTLS;
+    if (serv_opts.routing)
+        caps |= DISCOVERY_CAP_ROUTING;
+    if (serv_opts.multipath != TNT_MULTIPATH_OFF)
+        caps |= DISCOVERY_CAP_MULTIPATH;
+    if (serv_opts.hole_punching)
+        caps |= DISCOVERY_CAP_PUNCH;
+    return caps;
+}
+
+static void
+discovery_announce(struct discovery *d)
+{
+    if (sendto(d->fd, (char const *)d->msg, sizeof(d->msg), 0,
+               (struct sockaddr *)&d->group, sizeof(d->group)) == -1)
+        log_debug("[DISCOVERY] can't announce ourself: %s",
+                  evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+}
+
+/*
+ * Find the entry of a node, or the one to replace with it: a free one, or
+ * the one held for the shortest time.
+ */
+static struct discovery_entry *
+discovery_lookup(struct discovery *d,
+                 uint64_t id)
+{
+    struct discovery_entry *set = d->cache[id % DISCOVERY_CACHE_SETS];
+    struct discovery_entry *victim = &set[0];
+    int i;
+
+    for (i = 0; i < DISCOVERY_CACHE_WAYS; ++i)
+    {
+        if (set[i].id == id)
+            return &set[i];
+        if (set[i].id == 0)
+            victim = &set[i];
+        else if (victim->id != 0 && evutil_timercmp(&set[i].held,
+                                                    &victim->held, <))
+            victim = &set[i];
+    }
+    return victim;
+}
+
+/*
+ * Do we already peer with it, or are we about to ? Past its id, a node is
+ * known by its address alone: mc_peer_connect would refuse a second
+ * meta-connexion to an address anyway.
+ */
+static int
+discovery_known(struct server *s,
+                uint64_t id,
+                struct sockaddr *sa,
+                int len)
+{
+    struct udp_peer *it = NULL;
+    struct udp_peer *ite = NULL;
+
+    for (it = v_udp_begin(s->udp->udp_peers), ite = v_udp_end(s->udp->udp_peers);
+         it != ite;
+         it = v_udp_next(it))
+    {
+        if (it->flood.id == id)
+            return 1;
+    }
+    return mc_established(s, sa, len) || mc_pending(s, sa, len);
+}
+
+static void
+discovery_input(struct discovery *d,
+                unsigned char const *p,
+                size_t len,
+                struct sockaddr_in *from)
+{
+    struct server *s = d->s;
+    struct discovery_entry *e;
+    struct timeval now;
+    struct timeval hold = {DISCOVERY_HOLD, 0};
+    uint64_t self = s->udp->flood->self;
+    uint64_t id;
+    unsigned char caps;
+    char name[INET6_ADDRSTRLEN + 8];
+
+    if (len < DISCOVERY_SIZE || ((p[0] << 8) | p[1]) != DISCOVERY_MAGIC
+        || p[2] != DISCOVERY_VERSION)
+        return;
+    caps = p[3];
+    id = mp_get_u64(p + 4);
+    /* Our own announcements come back to us */
+    if (id == 0 || id == self)
+        return;
+    event_base_gettimeofday_cached(s->evbase, &now);
+    e = discovery_lookup(d, id);
+    if (e->id == id && evutil_timercmp(&now, &e->held, <))
+        return;
+    e->id = id;
+    evutil_timeradd(&now, &hold, &e->held);
+
+    from->sin_port = htons((unsigned short)((p[12] << 8) | p[13]));
+    address_presentation((struct sockaddr *)from, sizeof(*from),
+                         name, sizeof(name));
+    if ((caps & DISCOVERY_CAP_TLS) != (d->caps & DISCOVERY_CAP_TLS))
+    {
+        log_debug("[DISCOVERY] ignore %s, %s encryption", name,
+                  (caps & DISCOVERY_CAP_TLS) ? "with" : "without");
+        return;
+    }
+    if (discovery_known(s, id, (struct sockaddr *)from, sizeof(*from)))
+        return;
+    log_info("[DISCOVERY] found node %016llx at %s (caps 0x%02x)",
+             (unsigned long long)id, name, caps);
+    /* Only one of the two dials, the other one tells it we are here */
+    if (self < id)
+    {
+        if (dial_discovered(s->dial, (struct sockaddr *)from,
+                            sizeof(*from)) == -1)
+            log_debug("[DISCOVERY] too many nodes to dial, %s ignored", name);
+    }
+    else if (!evutil_timercmp(&now, &d->replied, <))
+    {
+        struct timeval gap = {DISCOVERY_REPLY_GAP, 0};
+
+        evutil_timeradd(&now, &gap, &d->replied);
+        discovery_announce(d);
+    }
+}
+
+static void
+discovery_read_cb(evutil_socket_t fd,
+                  short events,
+                  void *ctx)
+{
+    struct discovery *d = (struct discovery *)ctx;
+    unsigned char buf[64];
+    struct sockaddr_in from;
+    ev_socklen_t len;
+    ssize_t n;
+
+    (void)events;
+    for (;;)
+    {
+        len = sizeof(from);
+        n = recvfrom(fd, (char *)buf, sizeof(buf), 0,
+                     (struct sockaddr *)&from, &len);
+        if (n == -1)
+            break;
+        if (from.sin_family == AF_INET)
+            discovery_input(d, buf, (size_t)n, &from);
+    }
+}
+
+static void
+discovery_announce_cb(evutil_socket_t fd,
+                      short events,
+                      void *ctx)
+{
+    (void)fd;
+    (void)events;
+    discovery_announce((struct discovery *)ctx);
+}
+
+struct discovery *
+discovery_new(struct server *s,
+              unsigned short port)
+{
+    struct discovery *d = tnt_new(struct discovery);
+    struct sockaddr_in sin;
+
+    if (d == NULL)
+        return NULL;
+    d->s = s;
+    d->fd = tnt_udp_socket(AF_INET);
+    if (d->fd == -1)
+    {
+        free(d);
+        return NULL;
+    }
+    memset(&d->group, 0, sizeof(d->group));
+    d->group.sin_family = AF_INET;
+    d->group.sin_port = htons(DISCOVERY_PORT);
+    (void)evutil_inet_pton(AF_INET, DISCOVERY_GROUP, &d->group.sin_addr);
+
+    /* Every daemon of the host listens to the group */
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(DISCOVERY_PORT);
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (evutil_make_listen_socket_reuseable(d->fd) == -1
+        || bind(d->fd, (struct sockaddr *)&sin, sizeof(sin)) == -1
+        || tnt_udp_join_multicast(d->fd, &d->group.sin_addr) == -1
+        || evutil_make_socket_nonblocking(d->fd) == -1)
+    {
+        log_warn("[DISCOVERY] unable to join %s:%d", DISCOVERY_GROUP,
+                 DISCOVERY_PORT);
+        evutil_closesocket(d->fd);
+        free(d);
+        return NULL;
+    }
+
+    d->caps = discovery_caps();
+    d->msg[0] = (DISCOVERY_MAGIC >> 8) & 0xff;
+    d->msg[1] = DISCOVERY_MAGIC & 0xff;
+    d->msg[2] = DISCOVERY_VERSION;
+    d->msg[3] = d->caps;
+    mp_put_u64(d->msg + 4, s->udp->flood->self);
+    d->msg[12] = (port >> 8) & 0xff;
+    d->msg[13] = port & 0xff;
+
+    d->read_ev = event_new(s->evbase, d->fd, EV_READ | EV_PERSIST,
+                           discovery_read_cb, d);
+    d->announce_ev = event_new(s->evbase, -1, EV_PERSIST,
+                               discovery_announce_cb, d);
+    if (d->read_ev == NULL || d->announce_ev == NULL)
+    {
+        discovery_delete(d);
+        return NULL;
+    }
+    return d;
+}
+
+/* Once we accept the meta-connexions */
+void
+discovery_start(struct discovery *d)
+{
+    struct timeval tv = {DISCOVERY_INTERVAL, 0};
+
+    if (d == NULL)
+        return;
+    event_add(d->read_ev, NULL);
+    event_add(d->announce_ev, &tv);
+    discovery_announce(d);
+    log_info("[DISCOVERY] announcing ourself on %s:%d", DISCOVERY_GROUP,
+             DISCOVERY_PORT);
+}
+
+void
+discovery_delete(struct discovery *d)
+{
+    if (d == NULL)
+        return;
+    if (d->read_ev != NULL)
+        event_free(d->read_ev);
+    if (d->announce_ev != NULL)
+        event_free(d->announce_ev);
+    evutil_closesocket(d->fd);
+    free(d);
+}
@@ -14,6 +14,7 @@
 **/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
@@ -22,21 +23,53 @@
 #endif
 
 #include <event2/event.h>
+#include <event2/util.h>
+
+#include "networking.h"
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/rand.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
 
-#include "networking.h"
 #include "tntsched.h"
 #include "endpoint.h"
 #include "options.h"
+#include "subset.h"
+#include "server.h"
 #include "dtls.h"
 #include "udp.h"
+#include "crypto.h"
+#include "replay.h"
 #include "log.h"
 
+/*
+ * The DTLS handshake engine.
+ *
+ * Every DTLS peer owns an SSL object plugged on a dtls_link BIO: the receive
+ * fiber queues the records it gets for the peer, and OpenSSL queues the ones
+ * it wants to send. A single fiber (server_dtls) then drives all the
+ * handshakes in flight and sleeps until a record arrives or the earliest
+ * retransmission timer expires.
+ *
+ * Once a handshake is over, the data channel keys are exported from the DTLS
+ * session, exactly like we do with the meta-connexion session otherwise.
+ *
+ * A peer starting a new handshake on an established association gets a
+ * second SSL object, next_ssl. The association and its keys are kept until
+ * the new handshake went through the cookie exchange and completed with the
+ * same client certificate; a spoofed datagram can't tear them down.
+ */
+
+#define DTLS_CT_HANDSHAKE   22
+#define DTLS_RECORD_HDR_LEN 13
+
 extern struct options serv_opts;
 
+static BIO_METHOD       *dtls_link_method = NULL;
+static unsigned char    dtls_cookie_secret[32];
+
 void
 log_ssl(char const *msg, ...)
 {
@@ -59,90 +92,356 @@ log_ssl(char const *msg, ...)
 #endif
 }
 
+/* The dtls_link BIO */
+
+static int
+dtls_link_write(BIO *b, char const *buf, int len)
+{
+    struct dtls_link *link = BIO_get_data(b);
+    struct dtls_dgram *d;
+
+    BIO_clear_retry_flags(b);
+    if (len > DTLS_DGRAM_MAX || link->out_count == DTLS_QUEUE_LEN)
+    {
+        /* Dropped, the retransmission timer will take care of it */
+        return len;
+    }
+    d = &link->out[(link->out_head + link->out_count) % DTLS_QUEUE_LEN];
+    memcpy(d->data, buf, len);
+    d->len = len;
+    ++link->out_count;
+    return len;
+}
+
+static int
+dtls_link_read(BIO *b, char *buf, int len)
+{
+    struct dtls_link *link = BIO_get_data(b);
+    struct dtls_dgram *d;
+    int n;
+
+    BIO_clear_retry_flags(b);
+    if (link->in_count == 0)
+    {
+        BIO_set_retry_read(b);
+        return -1;
+    }
+    /* One datagram per read, as a datagram socket would do */
+    d = &link->in[link->in_head];
+    n = (int)d->len < len ? (int)d->len : len;
+    memcpy(buf, d->data, n);
+    link->in_head = (link->in_head + 1) % DTLS_QUEUE_LEN;
+    --link->in_count;
+    return n;
+}
+
+static long
+dtls_link_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+    struct dtls_link *link = BIO_get_data(b);
+
+    (void)num;
+    (void)ptr;
+    switch (cmd)
+    {
+        case BIO_CTRL_FLUSH:
+        case BIO_CTRL_DGRAM_SET_NEXT_TIMEOUT:
+            return 1;
+        case BIO_CTRL_PENDING:
+            if (link->in_count == 0)
+                return 0;
+            return (long)link->in[link->in_head].len;
+        case BIO_CTRL_DGRAM_GET_MTU_OVERHEAD:
+            /* IP and UDP headers */
+            if (endpoint_addr(&link->remote)->sa_family == AF_INET6)
+                return 48;
+            return 28;
+        default:
+            return 0;
+    }
+}
+
+static int
+dtls_link_create(BIO *b)
+{
+    BIO_set_init(b, 1);
+    return 1;
+}
+
+static int
+dtls_link_destroy(BIO *b)
+{
+    if (b == NULL)
+        return 0;
+    free(BIO_get_data(b));
+    BIO_set_data(b, NULL);
+    return 1;
+}
+
+static BIO_METHOD *
+dtls_link_get_method(void)
+{
+    if (dtls_link_method != NULL)
+        return dtls_link_method;
+
+    dtls_link_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+                                    "tNETacle dtls link");
+    if (dtls_link_method == NULL)
+        return NULL;
+    BIO_meth_set_write(dtls_link_method, dtls_link_write);
+    BIO_meth_set_read(dtls_link_method, dtls_link_read);
+    BIO_meth_set_ctrl(dtls_link_method, dtls_link_ctrl);
+    BIO_meth_set_create(dtls_link_method, dtls_link_create);
+    BIO_meth_set_destroy(dtls_link_method, dtls_link_destroy);
+    return dtls_link_method;
+}
+
+/* HelloVerifyRequest cookies, bound to the address of the client */
+
+static int
+dtls_cookie_generate(SSL *ssl,
+                     unsigned char *cookie,
+                     unsigned int *cookie_len)
+{
+    struct dtls_link *link = BIO_get_data(SSL_get_rbio(ssl));
+
+    if (link == NULL)
+        return 0;
+    if (HMAC(EVP_sha256(),
+             dtls_cookie_secret, sizeof(dtls_cookie_secret),
+             (unsigned char const *)endpoint_addr(&link->remote),
+             endpoint_addrlen(&link->remote),
+             cookie, cookie_len) == NULL)
+    {
+        return 0;
+    }
+    return 1;
+}
+
+static int
+dtls_cookie_verify(SSL *ssl,
+                   unsigned char const *cookie,
+                   unsigned int cookie_len)
+{
+    unsigned char expected[EVP_MAX_MD_SIZE];
+    unsigned int expected_len;
+
+    if (dtls_cookie_generate(ssl, expected, &expected_len) == 0)
+        return 0;
+    return cookie_len == expected_len
+        && CRYPTO_memcmp(expected, cookie, cookie_len) == 0;
+}
+
+/* Self-signed certificates, they are compared on a new handshake instead */
+static int
+dtls_verify(int preverify_ok,
+            X509_STORE_CTX *xs)
+{
+    (void)preverify_ok;
+    (void)xs;
+    return 1;
+}
+
+/*
+ * We are chrooted by now, the key and certificate files are out of reach:
+ * the ones of tls, the meta-connexions context, are used.
+ */
 SSL_CTX *
-create_udp_ctx(void)
+create_udp_ctx(SSL_CTX *tls)
 {
     int err;
-    char const *key_path;
-    char const *certfile_path;
+    X509 *cert;
+    EVP_PKEY *key;
+    STACK_OF(X509) *chain = NULL;
+    int i;
+    static char const sid_ctx[] = "tNETacle-dtls";
 
-    SSL_CTX *ctx = SSL_CTX_new(DTLSv1_method());
+    SSL_CTX *ctx = SSL_CTX_new(DTLS_method());
     if (ctx == NULL)
     {
         log_ssl("[DTLS] unable to create the dtls context");
         return NULL;
     }
 
-    err = SSL_CTX_set_cipher_list(ctx, "HIGH:MEDIUM:aNULL");
+    err = SSL_CTX_set_cipher_list(ctx, "HIGH:!aNULL:!MD5");
     if (err != 1)
     {
         log_ssl("[DTLS] Unable to load ciphers, exiting");
+        SSL_CTX_free(ctx);
         return NULL;
     }
 
-    key_path = serv_opts.key_path;
-    if (key_path == NULL)
+    cert = (tls != NULL) ? SSL_CTX_get0_certificate(tls) : NULL;
+    key = (tls != NULL) ? SSL_CTX_get0_privatekey(tls) : NULL;
+    if (cert == NULL || key == NULL)
     {
-        log_warnx("[DTLS] Unable to load private key file");
+        log_warnx("[DTLS] no certificate, the encryption is off");
+        SSL_CTX_free(ctx);
         return NULL;
     }
 
-    err = SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM);
-    if (err == -1)
+    err = SSL_CTX_use_certificate(ctx, cert);
+    if (err == 1)
+        err = SSL_CTX_use_PrivateKey(ctx, key);
+    if (err == 1 && SSL_CTX_get0_chain_certs(tls, &chain) == 1)
     {
-        log_ssl("[DTLS] unable to load the private key file");
-        return NULL;
+        for (i = 0; err == 1 && chain != NULL && i < sk_X509_num(chain); ++i)
+            err = SSL_CTX_add1_chain_cert(ctx, sk_X509_value(chain, i));
     }
-
-    certfile_path = serv_opts.cert_path;
-    if (certfile_path == NULL)
+    if (err != 1)
     {
-        log_warnx("[DTLS] Unable to load certificate file");
+        log_ssl("[DTLS] unable to use the certificate");
+        SSL_CTX_free(ctx);
         return NULL;
     }
 
-    err = SSL_CTX_use_certificate_chain_file(ctx, certfile_path);
-    if (err == -1)
+    if (RAND_bytes(dtls_cookie_secret, sizeof(dtls_cookie_secret)) != 1)
     {
-        log_ssl("[DTLS] unable to load the certificate chain file");
+        log_ssl("[DTLS] unable to generate the cookie secret");
+        SSL_CTX_free(ctx);
         return NULL;
     }
+    SSL_CTX_set_cookie_generate_cb(ctx, dtls_cookie_generate);
+    SSL_CTX_set_cookie_verify_cb(ctx, dtls_cookie_verify);
+    SSL_CTX_set_options(ctx, SSL_OP_COOKIE_EXCHANGE | SSL_OP_NO_QUERY_MTU);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+                       dtls_verify);
+
+    /* Servers keep the sessions, clients resume them (see dtls_sessions) */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (unsigned char const *)sid_ctx,
+                                   sizeof(sid_ctx) - 1);
     return ctx;
 }
 
-int
-dtls_new_peer(SSL_CTX *ctx, struct udp_peer *p)
+/* Client side session cache, keyed by the address of the server */
+
+static int
+find_session(struct dtls_session const *ds, void *ctx)
 {
-    int err;
-    SSL *ssl;
+    struct endpoint const *remote = ctx;
 
-    err = BIO_new_bio_pair(&p->bio, UDP_MTU, &p->_bio_backend, UDP_MTU);
-    if (err != 1)
+    /* The port of a restarted peer is random, only match the address */
+    return evutil_sockaddr_cmp(endpoint_addr(&ds->remote),
+                               endpoint_addr(remote), 0) == 0;
+}
+
+static void
+dtls_save_session(struct udp *udp,
+                  struct udp_peer *peer)
+{
+    struct dtls_session *it;
+    struct dtls_session ds;
+    SSL_SESSION *session = SSL_get1_session(peer->ssl);
+
+    if (session == NULL)
+        return ;
+    it = v_dtls_sess_find_if(udp->dtls_sessions, find_session,
+                             &peer->peer_addr);
+    if (it != v_dtls_sess_end(udp->dtls_sessions))
     {
-        log_ssl("[DTLS] unable to create the Buffered IO needed for dtls multiplexing");
-        return -1;
+        SSL_SESSION_free(it->session);
+        it->session = session;
+        return ;
     }
+    endpoint_copy(&ds.remote, &peer->peer_addr);
+    ds.session = session;
+    v_dtls_sess_push(udp->dtls_sessions, &ds);
+}
 
-    ssl = SSL_new(ctx);
-    if (ssl == NULL)
+static void
+free_session(struct dtls_session const *ds)
+{
+    SSL_SESSION_free(ds->session);
+}
+
+void
+dtls_sessions_free(struct vector_dtls_sess *sessions)
+{
+    v_dtls_sess_foreach(sessions, free_session);
+    v_dtls_sess_delete(sessions);
+}
+
+static void
+dtls_free_next(struct udp_peer *p)
+{
+    if (p->next_ssl == NULL)
+        return ;
+    SSL_free(p->next_ssl);
+    p->next_ssl = NULL;
+    p->next_link = NULL;
+}
+
+void
+dtls_free(struct udp_peer *p)
+{
+    dtls_free_next(p);
+    if (p->ssl == NULL)
+        return ;
+    /*
+     * Freeing an established SSL without a shutdown marks its session as not
+     * resumable. We are not in a hurry to close: flag it as done.
+     */
+    if (p->ssl_flags & DTLS_CONNECTED)
+        SSL_set_shutdown(p->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(p->ssl);
+    p->ssl = NULL;
+    p->link = NULL;
+}
+
+static SSL *
+dtls_new_ssl(struct udp *udp,
+             struct udp_peer *p,
+             struct dtls_link **linkp)
+{
+    struct dtls_link *link;
+    BIO *bio;
+    SSL *ssl;
+
+    link = tnt_new(struct dtls_link);
+    bio = BIO_new(dtls_link_get_method());
+    ssl = SSL_new(udp->ctx);
+    if (link == NULL || bio == NULL || ssl == NULL)
     {
         log_ssl("[DTLS] unable to instanciate SSL for the current peer");
-        return -1;
+        free(link);
+        if (bio != NULL)
+            BIO_free(bio);
+        if (ssl != NULL)
+            SSL_free(ssl);
+        return NULL;
     }
+    endpoint_copy(&link->remote, &p->peer_addr);
+    BIO_set_data(bio, link);
+    SSL_set_bio(ssl, bio, bio);
+    DTLS_set_link_mtu(ssl, DTLS_DGRAM_MAX);
+    *linkp = link;
+    return ssl;
+}
 
-    SSL_set_bio(ssl, p->bio, p->bio);
+int
+dtls_new_peer(struct udp *udp,
+              struct udp_peer *p)
+{
+    struct dtls_link *link;
+    SSL *ssl = dtls_new_ssl(udp, p, &link);
 
-    ssl = SSL_new(ctx);
     if (ssl == NULL)
-    {
-        BIO_free(p->bio);
-        BIO_free(p->_bio_backend);
         return -1;
-    }
+    /* Restarting an handshake, forget the previous one */
+    dtls_free(p);
     p->ssl = ssl;
+    p->link = link;
+    p->ssl_flags &= ~DTLS_CONNECTED;
 
     if (p->ssl_flags & DTLS_CLIENT)
     {
+        struct dtls_session *ds;
+
+        ds = v_dtls_sess_find_if(udp->dtls_sessions, find_session,
+                                 &p->peer_addr);
+        if (ds != v_dtls_sess_end(udp->dtls_sessions))
+            SSL_set_session(ssl, ds->session);
         SSL_set_connect_state(ssl);
     }
     else
@@ -152,144 +451,293 @@ dtls_new_peer(SSL_CTX *ctx, struct udp_peer *p)
     return 0;
 }
 
-ssize_t
-dtls_do_handshake(int fd,
-                  struct udp *udp,
-                  struct udp_peer *peer,
-                  void *async_ctx)
+int
+dtls_is_record(unsigned char const *buf,
+               size_t len)
 {
-    (void)fd;
-    (void)udp;
-    (void)peer;
-    (void)async_ctx;
-    return -1;
+    /* RFC 7983: the first byte of a DTLS record is within [20, 63] */
+    return len >= DTLS_RECORD_HDR_LEN && buf[0] >= 20 && buf[0] <= 63;
 }
 
-ssize_t
-dtls_sendto(int sockfd,
-            void const *buf,
-            size_t len,
-            int flags,
-            struct sockaddr const *addr,
-            int socklen,
-            struct udp_peer *peer,
-            void *async_ctx)
+void
+dtls_input(struct udp *udp,
+           struct endpoint const *remote,
+           unsigned char const *buf,
+           size_t len)
 {
-    int err;
+    struct udp_peer *peer;
+    struct dtls_link *link;
+    struct dtls_dgram *d;
 
-    err = SSL_write(peer->ssl, buf, (int)len);
-    if (err != (int)len)
+    peer = udp_find_peer(udp, remote);
+    if (peer == NULL || (peer->ssl_flags & DTLS_ENABLE) == 0)
     {
-        /*SSL_write return less bytes written than expected */
-        log_ssl("[DTLS] failed to write on the ssl endpoint");
+        /* We only shake hands with peers announced on a meta-connexion */
+        log_debug("[DTLS] drop %d bytes from unknown peer %s",
+                  len, endpoint_presentation(remote));
+        return ;
     }
-    else
+
+    /*
+     * An epoch 0 handshake on an established association: it may have
+     * restarted. Shake hands aside, the association stays until then.
+     */
+    if ((peer->ssl_flags & (DTLS_CONNECTED | DTLS_SERVER))
+        == (DTLS_CONNECTED | DTLS_SERVER)
+        && peer->next_ssl == NULL
+        && buf[0] == DTLS_CT_HANDSHAKE && buf[3] == 0 && buf[4] == 0)
     {
-        unsigned char tbuf[UDP_MTU];
-        int ret;
+        log_debug("[DTLS] %s may start a new handshake",
+                  endpoint_presentation(remote));
+        peer->next_ssl = dtls_new_ssl(udp, peer, &peer->next_link);
+        if (peer->next_ssl == NULL)
+            return ;
+        SSL_set_accept_state(peer->next_ssl);
+    }
 
-        ret = BIO_read(peer->bio, tbuf, sizeof(tbuf));
-        if (ret == 0)
-        {
-            /* Nothing  was read, and it is normal to quit */
-            return 0;
-        }
-        else if (ret < 0)
-        {
-            /* Something wrong happend */
-            /*XXX: check the error code*/
-            log_ssl("[DTLS] dtls_sendto: BIO_read error");
-        }
+    /* Every record goes to the new handshake while it runs */
+    link = (peer->next_link != NULL) ? peer->next_link : peer->link;
+    if (link == NULL || len > DTLS_DGRAM_MAX
+        || link->in_count == DTLS_QUEUE_LEN)
+    {
+        /* Dropped, the peer will retransmit */
+        return ;
+    }
+    d = &link->in[(link->in_head + link->in_count) % DTLS_QUEUE_LEN];
+    memcpy(d->data, buf, len);
+    d->len = len;
+    ++link->in_count;
 
-        err = async_sendto(async_ctx,
-                           sockfd,
-                           tbuf,
-                           ret,
-                           flags,
-                           addr,
-                           socklen);
-        /* If we didn't send all the bytes: */
-        if (err != ret)
-        {
-            log_warn("[DTLS] sendto");
-            return -1;
-        }
-        return err;
+    if (udp->dtls_running)
+        async_wake(udp->udp_dtls_fib, /*unused*/0);
+}
+
+/*
+ * Send what OpenSSL queued. We don't yield here: the peers vector could move
+ * under our feet, and a lost handshake datagram is retransmitted anyway.
+ */
+static void
+dtls_flush(int fd,
+           struct dtls_link *link)
+{
+    while (link->out_count > 0)
+    {
+        struct dtls_dgram *d = &link->out[link->out_head];
+        ssize_t n;
+
+        n = sendto(fd, (char const *)d->data, d->len, 0,
+                   endpoint_addr(&link->remote),
+                   endpoint_addrlen(&link->remote));
+        if (n == -1)
+            log_debug("[DTLS] sendto %s failed",
+                      endpoint_presentation(&link->remote));
+        link->out_head = (link->out_head + 1) % DTLS_QUEUE_LEN;
+        --link->out_count;
     }
-    return -1;
 }
 
+static void
+dtls_handshake_done(struct udp *udp,
+                    struct udp_peer *peer)
+{
+    int resumed = SSL_session_reused(peer->ssl);
+
+    peer->ssl_flags |= DTLS_CONNECTED;
+    crypto_free(&peer->crypto);
+    replay_init(&peer->replay);
+    if (crypto_init_from_ssl(&peer->crypto, peer->ssl) == -1)
+    {
+        log_warnx("[DTLS] unable to derive the data keys for %s",
+                  endpoint_presentation(&peer->peer_addr));
+        return ;
+    }
+    if (peer->ssl_flags & DTLS_CLIENT)
+        dtls_save_session(udp, peer);
+    log_info("[DTLS] %s handshake with %s",
+             resumed ? "resumed" : "full",
+             endpoint_presentation(&peer->peer_addr));
+}
+
+/* Only the client of the association may replace it */
 static int
-find_peer(struct udp_peer const *P, void *ctx) 
+dtls_same_client(SSL *ssl,
+                 SSL *next)
+{
+    X509 *cert = SSL_get_peer_certificate(ssl);
+    X509 *next_cert = SSL_get_peer_certificate(next);
+    int same = (cert != NULL && next_cert != NULL
+                && X509_cmp(cert, next_cert) == 0);
+
+    X509_free(cert);
+    X509_free(next_cert);
+    return same;
+}
+
+/*
+ * Drive the new handshake of an established association. The association
+ * is replaced once it is over, and kept if it fails.
+ * Returns 1 if it is over, 0 if it is still running and -1 if it failed.
+ */
+static ssize_t
+dtls_do_next_handshake(int fd,
+                       struct udp *udp,
+                       struct udp_peer *peer)
 {
-    struct sockaddr *addr = ctx;
-    return !evutil_sockaddr_cmp((struct sockaddr *)&P->peer_addr.addr, addr, 1);
+    struct timeval tv;
+    int err;
+
+    if (DTLSv1_get_timeout(peer->next_ssl, &tv) == 1
+        && tv.tv_sec == 0 && tv.tv_usec == 0)
+        DTLSv1_handle_timeout(peer->next_ssl);
+    err = SSL_do_handshake(peer->next_ssl);
+    dtls_flush(fd, peer->next_link);
+    if (err == 1)
+    {
+        if (!dtls_same_client(peer->ssl, peer->next_ssl))
+        {
+            log_notice("[DTLS] new handshake from %s with another "
+                       "certificate, ignored",
+                       endpoint_presentation(&peer->peer_addr));
+            dtls_free_next(peer);
+            return -1;
+        }
+        log_info("[DTLS] %s restarted its association",
+                 endpoint_presentation(&peer->peer_addr));
+        SSL_set_shutdown(peer->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        SSL_free(peer->ssl);
+        peer->ssl = peer->next_ssl;
+        peer->link = peer->next_link;
+        peer->next_ssl = NULL;
+        peer->next_link = NULL;
+        dtls_handshake_done(udp, peer);
+        return 1;
+    }
+    switch (SSL_get_error(peer->next_ssl, err))
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return 0;
+        default:
+            /* Most likely a cookie which never came back */
+            log_debug("[DTLS] new handshake with %s failed",
+                      endpoint_presentation(&peer->peer_addr));
+            ERR_clear_error();
+            dtls_free_next(peer);
+            return -1;
+    }
 }
 
-/* Not functional */
+/*
+ * Drive the handshake of a peer as far as possible without blocking.
+ * Returns 1 if the handshake is over, 0 if it is still running and -1 if it
+ * failed.
+ */
 ssize_t
-dtls_recvfrom(int sockfd,
-              void *buf,
-              size_t len,
-              int flags,
-              struct sockaddr *addr,
-              int *socklen,
-              struct udp *udp,
-              void *async_ctx)
+dtls_do_handshake(int fd,
+                  struct udp *udp,
+                  struct udp_peer *peer,
+                  void *async_ctx)
 {
-    int nread;
-    unsigned char tbuf[UDP_MTU];
-
-    nread = async_recvfrom(async_ctx,
-                         sockfd,
-                         (char *)tbuf,
-                         sizeof(tbuf),
-                         flags,
-                         addr,
-                         socklen);
-    if (nread == -1)
+    struct timeval tv;
+    int err;
+
+    (void)async_ctx;
+    if (DTLSv1_get_timeout(peer->ssl, &tv) == 1
+        && tv.tv_sec == 0 && tv.tv_usec == 0)
     {
-        log_warn("[DTLS] async_recvfrom");
-        return -1;
+        /* Retransmit our last flight */
+        DTLSv1_handle_timeout(peer->ssl);
     }
-    else
+
+    if (peer->ssl_flags & DTLS_CONNECTED)
     {
-        int err;
-        struct udp_peer *peer;
-        size_t pending;
+        char buf[64];
 
-        peer = v_udp_find_if(udp->udp_peers, find_peer, (void *)addr);
-        if (peer == NULL)
-        {
-            struct endpoint e;
+        /* Lets OpenSSL answer to a retransmission of the peer last flight */
+        while (SSL_read(peer->ssl, buf, sizeof(buf)) > 0)
+            ;
+        dtls_flush(fd, peer->link);
+        return 1;
+    }
 
-            endpoint_init(&e, addr, *socklen);
-            peer = udp_register_new_peer(udp,
-                                         &e,
-                                         DTLS_ENABLE | DTLS_SERVER);
-        }
-        BIO_write(peer->bio, tbuf, nread);
-        err = SSL_read(peer->ssl, buf, (int)len);
-        if (err < 0)
-        {
-            log_ssl("[DTLS] unable to read on the ssl endpoint");
-        }
-        if ((pending = BIO_ctrl_pending(peer->bio)) > 0)
-        /* Some data are pending */
-        {
-            int size;
+    err = SSL_do_handshake(peer->ssl);
+    dtls_flush(fd, peer->link);
+    if (err == 1)
+    {
+        dtls_handshake_done(udp, peer);
+        return 1;
+    }
+    switch (SSL_get_error(peer->ssl, err))
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return 0;
+        default:
+            log_ssl("[DTLS] handshake with %s failed",
+                    endpoint_presentation(&peer->peer_addr));
+            return -1;
+    }
+}
 
-            size = BIO_read(peer->bio, tbuf, UDP_MTU);
-            async_sendto(async_ctx,
-                         sockfd,
-                         tbuf,
-                         size,
-                         flags,
-                         addr,
-                         *socklen);
+/*
+ * The handshake engine fiber. It is woken up by dtls_input, or by the
+ * earliest retransmission timer of the handshakes in flight.
+ */
+void
+server_dtls(void *ctx)
+{
+    struct server *s = (struct server *)sched_get_userptr(ctx);
+    struct udp *udp = s->udp;
 
+    while (1)
+    {
+        struct udp_peer *it = NULL;
+        struct udp_peer *ite = NULL;
+        struct timeval next;
+        int armed = 0;
+
+        for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+             it != ite;
+             it = v_udp_next(it))
+        {
+            struct timeval tv;
+
+            if ((it->ssl_flags & DTLS_ENABLE) == 0 || it->ssl == NULL)
+                continue;
+            if (it->next_ssl != NULL)
+            {
+                if (dtls_do_next_handshake(it->transport->fd, udp, it) == 0
+                    && DTLSv1_get_timeout(it->next_ssl, &tv) == 1
+                    && (armed == 0 || evutil_timercmp(&tv, &next, <)))
+                {
+                    next = tv;
+                    armed = 1;
+                }
+                continue;
+            }
+            /* Nothing new for an established association */
+            if ((it->ssl_flags & DTLS_CONNECTED) && it->link->in_count == 0)
+                continue;
+
+            if (dtls_do_handshake(it->transport->fd, udp, it, ctx) == -1)
+            {
+                /* Start over in a second */
+                if (dtls_new_peer(udp, it) == -1)
+                    continue;
+                tv.tv_sec = 1;
+                tv.tv_usec = 0;
+            }
+            else if (DTLSv1_get_timeout(it->ssl, &tv) != 1)
+            {
+                continue;
+            }
+            if (armed == 0 || evutil_timercmp(&tv, &next, <))
+            {
+                next = tv;
+                armed = 1;
+            }
         }
-        return err;
+        async_wait(ctx, armed ? &next : NULL);
     }
-    return -1;
+    sched_fiber_exit(ctx, 0);
 }
@@ -0,0 +1,213 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/util.h>
+#include <openssl/rand.h>
+
+#include "flood.h"
+#include "metaproto.h"
+#include "subset.h"
+#include "log.h"
+
+#define FLOOD_M1    0x9e3779b97f4a7c15ULL
+#define FLOOD_M2    0xbf58476d1ce4e5b9ULL
+
+struct flood *
+flood_new(void)
+{
+    struct flood *f = tnt_new(struct flood);
+
+    if (f == NULL)
+        return NULL;
+    memset(f, 0, sizeof(*f));
+    /* 0 means unknown, never use it */
+    while (f->self == 0)
+    {
+        if (RAND_bytes((unsigned char *)&f->self, sizeof(f->self)) != 1)
+        {
+            free(f);
+            return NULL;
+        }
+    }
+    return f;
+}
+
+void
+flood_delete(struct flood *f)
+{
+    if (f != NULL && f->dropped > 0)
+    {
+        log_info("[FLOOD] %llu duplicate frames dropped",
+                 (unsigned long long)f->dropped);
+    }
+    free(f);
+}
+
+static uint64_t
+flood_mix(uint64_t h)
+{
+    h ^= h >> 31;
+    h *= FLOOD_M2;
+    h ^= h >> 29;
+    return h;
+}
+
+/*
+ * A fast non cryptographic hash, eight bytes at a time. The cache only
+ * needs the copies of a frame to collide.
+ */
+uint64_t
+flood_hash(void const *data,
+           size_t len)
+{
+    unsigned char const *p = data;
+    uint64_t h = len * FLOOD_M1;
+    uint64_t w;
+
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ flood_mix(w * FLOOD_M1)) * FLOOD_M2;
+    }
+    if (len > 0)
+    {
+        w = 0;
+        memcpy(&w, p, len);
+        h = (h ^ flood_mix(w * FLOOD_M1)) * FLOOD_M2;
+    }
+    return flood_mix(h);
+}
+
+/* Milliseconds, only differences matter */
+uint32_t
+flood_now(void)
+{
+    struct timeval tv;
+
+    evutil_gettimeofday(&tv, NULL);
+    return (uint32_t)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+/*
+ * Returns 1 if the frame seq of origin was seen in the last FLOOD_CACHE_TTL
+ * ms, otherwise remember it and return 0. A free or expired entry of the set
+ * makes room, or else the oldest one.
+ */
+int
+flood_seen(struct flood *f,
+           uint64_t origin,
+           uint32_t seq,
+           uint32_t now)
+{
+    uint64_t h = flood_mix((origin ^ seq) * FLOOD_M1);
+    struct flood_entry *set = f->cache[h % FLOOD_CACHE_SETS];
+    struct flood_entry *victim = &set[0];
+    int32_t victim_left = FLOOD_CACHE_TTL + 1;
+    int i;
+
+    for (i = 0; i < FLOOD_CACHE_WAYS; ++i)
+    {
+        int32_t left = (int32_t)(set[i].expire - now);
+
+        /*
+         * The clock wraps: a free entry, expire 0, or a long expired one
+         * may look ahead of now, none is ever more than a TTL ahead.
+         */
+        if (set[i].origin == 0 || left <= 0 || left > FLOOD_CACHE_TTL)
+            left = 0;
+        if (set[i].origin == origin && set[i].seq == seq && left > 0)
+        {
+            ++f->dropped;
+            return 1;
+        }
+        if (left < victim_left)
+        {
+            victim = &set[i];
+            victim_left = left;
+        }
+    }
+    victim->origin = origin;
+    victim->seq = seq;
+    victim->expire = now + FLOOD_CACHE_TTL;
+    return 0;
+}
+
+static int
+flood_id_cmp(void const *a,
+             void const *b)
+{
+    uint64_t x = *(uint64_t const *)a;
+    uint64_t y = *(uint64_t const *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Read what a peer told us about itself: [id:64][neighbour id:64]...
+ * Returns -1 on error, 0 otherwise.
+ */
+int
+flood_peer_set(struct flood_peer *p,
+               unsigned char const *value,
+               size_t len)
+{
+    uint64_t *neighbours = NULL;
+    size_t count;
+    size_t i;
+
+    if (len < 8 || len % 8 != 0)
+        return -1;
+    count = len / 8 - 1;
+    if (count > 0)
+    {
+        neighbours = malloc(count * sizeof(*neighbours));
+        if (neighbours == NULL)
+            return -1;
+        for (i = 0; i < count; ++i)
+            neighbours[i] = mp_get_u64(value + 8 * (i + 1));
+        qsort(neighbours, count, sizeof(*neighbours), flood_id_cmp);
+    }
+    free(p->neighbours);
+    p->id = mp_get_u64(value);
+    p->neighbours = neighbours;
+    p->count = count;
+    return 0;
+}
+
+/*
+ * Did the frames from "from" already reach "to" without us? Unknown peers
+ * are never covered, they get the frames.
+ */
+int
+flood_covers(struct flood_peer const *from,
+             struct flood_peer const *to)
+{
+    if (to->id == 0 || from->count == 0)
+        return 0;
+    return bsearch(&to->id, from->neighbours, from->count,
+                   sizeof(*from->neighbours), flood_id_cmp) != NULL;
+}
+
+void
+flood_peer_free(struct flood_peer *p)
+{
+    free(p->neighbours);
+    p->neighbours = NULL;
+    p->count = 0;
+    p->id = 0;
+}
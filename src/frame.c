@@ -19,36 +19,180 @@
 
 #include "server.h"
 #include "frame.h"
+#include "metaproto.h"
 
+/*
+ * Frames are allocated with room for the largest header in front of them,
+ * raw_packet is only known once the header is written.
+ */
 void
 frame_free(struct frame const *f)
 {
-    free(f->raw_packet);
+    free((unsigned char *)f->frame - PACKET_HDR_MAX);
 }
 
 int
 frame_alloc(struct frame *frame,
             unsigned int size)
 {
-    void *tmp_raw_packet = NULL;
-    void *tmp_frame_ptr = NULL;
+    unsigned char *tmp_raw_packet = NULL;
 
     /* Alloc the size of the whole packet, plus the size of the header */
-    tmp_raw_packet = (void *)malloc(size
-                                    + sizeof(struct packet_hdr));
+    tmp_raw_packet = malloc(size + PACKET_HDR_MAX);
     if (tmp_raw_packet == NULL)
     {
         return -1;
     }
-    /* Shift the frame to pointer to just behind the header */
-    tmp_frame_ptr = (void *)((intptr_t)tmp_raw_packet
-                             + sizeof(struct packet_hdr));
 
     /* Commit the results */
     frame->raw_packet = tmp_raw_packet;
-    frame->frame = tmp_frame_ptr;
+    frame->frame = tmp_raw_packet + PACKET_HDR_MAX;
     frame->size = size;
     return 0;
 }
 
+/* Write the header of an allocated frame, just in front of it */
+void
+frame_set_hdr(struct frame *frame)
+{
+    size_t len = packet_hdr_len(frame->size);
+
+    frame->raw_packet = (unsigned char *)frame->frame - len;
+    (void)packet_hdr_write(frame->raw_packet, frame->size, 0);
+}
+
+/* Write the routed header of an allocated frame, just in front of it */
+void
+frame_set_routed_hdr(struct frame *frame,
+                     struct packet_route const *r)
+{
+    frame->raw_packet = (unsigned char *)frame->frame - PACKET_HDR_MAX;
+    (void)packet_hdr_write(frame->raw_packet, frame->size, PACKET_ROUTED);
+    packet_route_set(frame->raw_packet, r);
+}
+
+size_t
+packet_hdr_len(unsigned int size)
+{
+    return (size < PACKET_SHORT_MAX) ? 2 : PACKET_HDR_EXT;
+}
 
+/*
+ * Write the header of a frame, or of an aggregate if flags is
+ * PACKET_AGGREGATE. Returns its length, the route of a PACKET_ROUTED one is
+ * left to packet_route_set.
+ */
+size_t
+packet_hdr_write(unsigned char *p,
+                 unsigned int size,
+                 unsigned int flags)
+{
+    unsigned int word;
+
+    if (flags & PACKET_AGGREGATE)
+        word = PACKET_AGGREGATE | (size & PACKET_SIZE_MASK);
+    else if (size < PACKET_SHORT_MAX && !(flags & PACKET_ROUTED))
+        word = size;
+    else
+    {
+        word = PACKET_EXTENDED | (flags & PACKET_ROUTED) | (size >> 16);
+        p[2] = (unsigned char)(size >> 8);
+        p[3] = (unsigned char)size;
+    }
+    p[0] = (unsigned char)(word >> 8);
+    p[1] = (unsigned char)word;
+    /* The size of an aggregate may have any of the other bits set */
+    if (word & PACKET_AGGREGATE)
+        return 2;
+    if (word & PACKET_ROUTED)
+        return PACKET_HDR_MAX;
+    return (word & PACKET_EXTENDED) ? PACKET_HDR_EXT : 2;
+}
+
+/*
+ * Read the header at the start of a len bytes buffer.
+ * Returns its length, 0 if it doesn't fit in the buffer.
+ */
+size_t
+packet_hdr_read(unsigned char const *p,
+                size_t len,
+                unsigned int *size,
+                unsigned int *flags)
+{
+    unsigned int word;
+
+    if (len < 2)
+        return 0;
+    word = ((unsigned int)p[0] << 8) | p[1];
+    *flags = 0;
+    if (word & PACKET_AGGREGATE)
+    {
+        *flags = PACKET_AGGREGATE;
+        *size = word & PACKET_SIZE_MASK;
+        return 2;
+    }
+    if (word & PACKET_EXTENDED)
+    {
+        size_t hdr_len = (word & PACKET_ROUTED) ? PACKET_HDR_MAX
+                                                : PACKET_HDR_EXT;
+
+        if (len < hdr_len)
+            return 0;
+        *flags = word & PACKET_ROUTED;
+        *size = ((word & ~(PACKET_EXTENDED | PACKET_ROUTED)) << 16)
+              | ((unsigned int)p[2] << 8) | p[3];
+        return hdr_len;
+    }
+    *size = word;
+    return 2;
+}
+
+/*
+ * Split the next frame off an aggregate, *p walking up to its end.
+ * Returns 1 with sub set, 0 once the aggregate is all read, -1 if it is
+ * malformed.
+ */
+int
+packet_aggregate_next(unsigned char **p,
+                      unsigned char *end,
+                      struct frame *sub)
+{
+    unsigned int flags;
+    size_t hdr_len;
+
+    if (*p >= end)
+        return 0;
+    hdr_len = packet_hdr_read(*p, (size_t)(end - *p), &sub->size, &flags);
+    if (hdr_len == 0 || sub->size == 0 || (flags & PACKET_AGGREGATE)
+        || sub->size > (size_t)(end - *p) - hdr_len)
+        return -1;
+    sub->raw_packet = *p;
+    sub->frame = *p + hdr_len;
+    *p += hdr_len + sub->size;
+    return 1;
+}
+
+/* Read the route of a PACKET_ROUTED header */
+void
+packet_route_get(unsigned char const *hdr,
+                 struct packet_route *r)
+{
+    unsigned char const *p = hdr + PACKET_HDR_EXT;
+
+    r->src = mp_get_u64(p);
+    r->dst = mp_get_u64(p + 8);
+    r->ttl = p[16];
+    r->seq = mp_get_u32(p + 17);
+}
+
+void
+packet_route_set(unsigned char *hdr,
+                 struct packet_route const *r)
+{
+    unsigned char *p = hdr + PACKET_HDR_EXT;
+
+    mp_put_u64(p, r->src);
+    mp_put_u64(p + 8, r->dst);
+    p[16] = (unsigned char)r->ttl;
+    mp_put_u32(p + 17, r->seq);
+}
@@ -0,0 +1,505 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined Unix
+# include <unistd.h>
+# include <fcntl.h>
+# include <pthread.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "networking.h"
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "handshake.h"
+#include "subset.h"
+#include "log.h"
+
+/*
+ * The TLS handshakes of the meta-connexions are run by a few worker threads,
+ * so the RSA/ECDHE work of a reconnection storm doesn't stall the event loop
+ * and the data path it runs.
+ *
+ * The sockets stay non-blocking and are watched by the event loop: a worker
+ * only gets a job once its socket is ready, runs one step of the handshake
+ * on it, the crypto of a flight, and hands it back through a socketpair.
+ * No worker ever waits on a peer. A handshake has HS_TIMEOUT seconds to
+ * complete, and a same address can't hold more than HS_SOURCE_MAX of them.
+ * The bufferevent is only created once it is over, in the
+ * BUFFEREVENT_SSL_OPEN state.
+ */
+
+#if defined Unix
+
+struct hs_pool
+{
+    pthread_t       *threads;
+    size_t          nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    struct hs_job   *todo_head; /* Ready, for the workers */
+    struct hs_job   *todo_tail;
+    struct hs_job   *done;      /* Stepped, for the event loop */
+    struct hs_job   *jobs;      /* Every job not handed back yet */
+    size_t          count;
+    int             stop;
+    evutil_socket_t notify[2];
+    struct event    *notify_ev;
+    struct event_base *evbase;
+    hs_done_cb      cb;
+    void            *ctx;
+};
+
+/* Called with the lock held */
+static void
+hs_queue(struct hs_pool *pool,
+         struct hs_job *job)
+{
+    job->next = NULL;
+    if (pool->todo_tail != NULL)
+        pool->todo_tail->next = job;
+    else
+        pool->todo_head = job;
+    pool->todo_tail = job;
+    pthread_cond_signal(&pool->cond);
+}
+
+/* One step of the handshake, it never blocks */
+static void
+hs_step(struct hs_job *job)
+{
+    int err;
+
+    if (job->connect)
+        err = SSL_connect(job->ssl);
+    else
+        err = SSL_accept(job->ssl);
+    if (err == 1)
+    {
+        job->err = 0;
+        return ;
+    }
+    switch (SSL_get_error(job->ssl, err))
+    {
+        case SSL_ERROR_WANT_READ:
+            job->want = EV_READ;
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            job->want = EV_WRITE;
+            break;
+        default:
+            job->err = -1;
+            /* The error queue is per thread, keep the reason */
+            job->sslerr = ERR_get_error();
+            break;
+    }
+    ERR_clear_error();
+}
+
+static void *
+hs_worker(void *arg)
+{
+    struct hs_pool *pool = arg;
+    struct hs_job *job;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop)
+    {
+        if (pool->todo_head == NULL)
+        {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        job = pool->todo_head;
+        pool->todo_head = job->next;
+        if (pool->todo_head == NULL)
+            pool->todo_tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        hs_step(job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->next = pool->done;
+        pool->done = job;
+        (void)send(pool->notify[1], "", 1, 0);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Hand a job back to its owner, in the event loop */
+static void
+hs_finish(struct hs_pool *pool,
+          struct hs_job *job)
+{
+    struct hs_job **it;
+
+    if (job->ev != NULL)
+        event_del(job->ev);
+    for (it = &pool->jobs; *it != NULL; it = &(*it)->all_next)
+    {
+        if (*it == job)
+        {
+            *it = job->all_next;
+            break;
+        }
+    }
+    job->all_next = NULL;
+    --pool->count;
+    pool->cb(job, pool->ctx);
+}
+
+static void hs_io_cb(evutil_socket_t fd, short events, void *ctx);
+
+/*
+ * Wait for the socket, until the deadline of the handshake.
+ * Returns -1 if the handshake failed.
+ */
+static int
+hs_wait(struct hs_pool *pool,
+        struct hs_job *job,
+        short what)
+{
+    struct timeval now;
+    struct timeval left;
+
+    evutil_gettimeofday(&now, NULL);
+    if (!evutil_timercmp(&now, &job->deadline, <))
+        return -1;
+    evutil_timersub(&job->deadline, &now, &left);
+    if (job->ev == NULL)
+        job->ev = event_new(pool->evbase, job->fd, what, hs_io_cb, job);
+    else
+        (void)event_assign(job->ev, pool->evbase, job->fd, what, hs_io_cb,
+                           job);
+    if (job->ev == NULL || event_add(job->ev, &left) == -1)
+        return -1;
+    return 0;
+}
+
+/* The socket of a job is ready, or its deadline passed */
+static void
+hs_io_cb(evutil_socket_t fd,
+         short events,
+         void *ctx)
+{
+    struct hs_job *job = ctx;
+    struct hs_pool *pool = job->pool;
+
+    if (events & EV_TIMEOUT)
+    {
+        job->err = -1;
+        hs_finish(pool, job);
+        return ;
+    }
+    if (job->connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) == -1
+            || err != 0)
+        {
+            job->err = -1;
+            hs_finish(pool, job);
+            return ;
+        }
+        job->connecting = 0;
+    }
+    pthread_mutex_lock(&pool->lock);
+    hs_queue(pool, job);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Back in the event loop: wait for the sockets, or hand the jobs over */
+static void
+hs_notify_cb(evutil_socket_t fd,
+             short events,
+             void *ctx)
+{
+    struct hs_pool *pool = ctx;
+    struct hs_job *job;
+    char buf[64];
+
+    (void)events;
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+        ;
+    pthread_mutex_lock(&pool->lock);
+    job = pool->done;
+    pool->done = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    while (job != NULL)
+    {
+        struct hs_job *next = job->next;
+
+        job->next = NULL;
+        if (job->err == 1 && hs_wait(pool, job, job->want) == -1)
+            job->err = -1;
+        if (job->err != 1)
+            hs_finish(pool, job);
+        job = next;
+    }
+}
+
+struct hs_pool *
+hs_pool_new(struct event_base *evbase,
+            size_t nthreads,
+            hs_done_cb cb,
+            void *ctx)
+{
+    struct hs_pool *pool;
+    size_t i;
+
+    if (nthreads == 0)
+        return NULL;
+    pool = tnt_new(struct hs_pool);
+    if (pool == NULL)
+        return NULL;
+    pool->threads = calloc(nthreads, sizeof(*pool->threads));
+    if (pool->threads == NULL
+        || evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pool->notify) == -1)
+    {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    (void)evutil_make_socket_nonblocking(pool->notify[0]);
+    (void)evutil_make_socket_nonblocking(pool->notify[1]);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->evbase = evbase;
+    pool->cb = cb;
+    pool->ctx = ctx;
+    pool->notify_ev = event_new(evbase, pool->notify[0], EV_READ | EV_PERSIST,
+                                hs_notify_cb, pool);
+    event_add(pool->notify_ev, NULL);
+
+    for (i = 0; i < nthreads; ++i)
+    {
+        if (pthread_create(&pool->threads[i], NULL, hs_worker, pool) != 0)
+        {
+            log_warnx("[TLS] only %d handshake workers started", i);
+            break;
+        }
+    }
+    pool->nthreads = i;
+    if (pool->nthreads == 0)
+    {
+        hs_pool_delete(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/* The workers only ever wait for a job, they are joined at once */
+void
+hs_pool_delete(struct hs_pool *pool)
+{
+    size_t i;
+
+    if (pool == NULL)
+        return ;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    while (pool->jobs != NULL)
+    {
+        struct hs_job *job = pool->jobs;
+
+        pool->jobs = job->all_next;
+        hs_job_free(job);
+    }
+    event_free(pool->notify_ev);
+    evutil_closesocket(pool->notify[0]);
+    evutil_closesocket(pool->notify[1]);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+/* A same address can't hold the workers */
+int
+hs_pool_busy(struct hs_pool *pool,
+             struct sockaddr const *addr)
+{
+    struct hs_job *job;
+    size_t n = 0;
+
+    if (pool == NULL)
+        return 0;
+    for (job = pool->jobs; job != NULL; job = job->all_next)
+    {
+        if (evutil_sockaddr_cmp((struct sockaddr *)&job->addr, addr, 0) == 0
+            && ++n >= HS_SOURCE_MAX)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Queue a handshake, connecting to addr first if fd is -1. The pool owns
+ * the socket and the SSL from now on, until they are handed back.
+ * Returns NULL if the pool is full, or busy with addr: the caller keeps
+ * them, and the socket if it gave one.
+ */
+struct hs_job *
+hs_pool_submit(struct hs_pool *pool,
+               evutil_socket_t fd,
+               SSL *ssl,
+               struct sockaddr const *addr,
+               socklen_t addrlen)
+{
+    struct hs_job *job;
+    struct timeval tv = {HS_TIMEOUT, 0};
+
+    if (pool == NULL || addrlen > sizeof(job->addr)
+        || pool->count >= HS_QUEUE_MAX || hs_pool_busy(pool, addr))
+        return NULL;
+    job = tnt_new(struct hs_job);
+    if (job == NULL)
+        return NULL;
+    job->pool = pool;
+    job->ssl = ssl;
+    job->connect = (fd == -1);
+    job->err = 1;
+    memcpy(&job->addr, addr, addrlen);
+    job->addrlen = addrlen;
+    if (fd == -1)
+    {
+        fd = socket(addr->sa_family, SOCK_STREAM, 0);
+        if (fd == -1)
+        {
+            free(job);
+            return NULL;
+        }
+    }
+    job->fd = fd;
+    if (evutil_make_socket_nonblocking(fd) == -1
+        || SSL_set_fd(ssl, (int)fd) != 1)
+    {
+        job->ssl = NULL;
+        if (job->connect)
+            evutil_closesocket(fd);
+        free(job);
+        return NULL;
+    }
+    if (job->connect
+        && connect(fd, (struct sockaddr *)&job->addr, addrlen) == -1)
+    {
+        if (errno != EINPROGRESS && errno != EINTR)
+        {
+            job->ssl = NULL;
+            evutil_closesocket(fd);
+            free(job);
+            return NULL;
+        }
+        job->connecting = 1;
+    }
+    evutil_gettimeofday(&job->deadline, NULL);
+    evutil_timeradd(&job->deadline, &tv, &job->deadline);
+    if (job->connecting && hs_wait(pool, job, EV_WRITE) == -1)
+    {
+        if (job->ev != NULL)
+            event_free(job->ev);
+        job->ssl = NULL;
+        evutil_closesocket(fd);
+        free(job);
+        return NULL;
+    }
+    job->all_next = pool->jobs;
+    pool->jobs = job;
+    ++pool->count;
+    if (job->connecting)
+        return job;
+    pthread_mutex_lock(&pool->lock);
+    hs_queue(pool, job);
+    pthread_mutex_unlock(&pool->lock);
+    return job;
+}
+
+#else /* !Unix */
+
+/* Without the workers, the handshakes are done by the event loop */
+
+struct hs_pool *
+hs_pool_new(struct event_base *evbase,
+            size_t nthreads,
+            hs_done_cb cb,
+            void *ctx)
+{
+    (void)evbase;
+    (void)nthreads;
+    (void)cb;
+    (void)ctx;
+    return NULL;
+}
+
+void
+hs_pool_delete(struct hs_pool *pool)
+{
+    (void)pool;
+}
+
+int
+hs_pool_busy(struct hs_pool *pool,
+             struct sockaddr const *addr)
+{
+    (void)pool;
+    (void)addr;
+    return 0;
+}
+
+struct hs_job *
+hs_pool_submit(struct hs_pool *pool,
+               evutil_socket_t fd,
+               SSL *ssl,
+               struct sockaddr const *addr,
+               socklen_t addrlen)
+{
+    (void)pool;
+    (void)fd;
+    (void)ssl;
+    (void)addr;
+    (void)addrlen;
+    return NULL;
+}
+
+#endif
+
+void
+hs_job_free(struct hs_job *job)
+{
+    if (job->ev != NULL)
+        event_free(job->ev);
+    if (job->ssl != NULL)
+        SSL_free(job->ssl);
+    if (job->fd != -1)
+        evutil_closesocket(job->fd);
+    free(job);
+}
@@ -0,0 +1,139 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <string.h>
+
+#include "hosts.h"
+#include "flood.h"
+
+#define HOSTS_ETHER_HDR 14
+
+static void
+host_addr_set(struct host_addr *a,
+              unsigned char const *bytes,
+              size_t len,
+              int group)
+{
+    memset(a->bytes, 0, sizeof(a->bytes));
+    memcpy(a->bytes, bytes, len);
+    a->len = len;
+    a->group = group;
+}
+
+/*
+ * Read the source and destination addresses of a frame.
+ * Returns -1 if it carries none we know of, 0 otherwise.
+ */
+int
+host_addresses(void const *frame,
+               size_t len,
+               int layer2,
+               struct host_addr *src,
+               struct host_addr *dst)
+{
+    unsigned char const *p = frame;
+
+    if (layer2)
+    {
+        if (len < HOSTS_ETHER_HDR)
+            return -1;
+        /* The group bit is the low one of the first byte */
+        host_addr_set(dst, p, 6, p[0] & 1);
+        host_addr_set(src, p + 6, 6, p[6] & 1);
+        return 0;
+    }
+    if (len >= 20 && (p[0] >> 4) == 4)
+    {
+        host_addr_set(dst, p + 16, 4, (p[16] & 0xf0) == 0xe0
+                      || memcmp(p + 16, "\xff\xff\xff\xff", 4) == 0);
+        host_addr_set(src, p + 12, 4, 0);
+        return 0;
+    }
+    if (len >= 40 && (p[0] >> 4) == 6)
+    {
+        host_addr_set(dst, p + 24, 16, p[24] == 0xff);
+        host_addr_set(src, p + 8, 16, 0);
+        return 0;
+    }
+    return -1;
+}
+
+static struct host_entry *
+hosts_set(struct hosts *h,
+          struct host_addr const *a)
+{
+    return h->table[flood_hash(a->bytes, a->len) % HOSTS_SETS];
+}
+
+/*
+ * The entry of src, refreshed, for the caller to tell where it lives now.
+ * The oldest entry of the set makes room. Returns NULL for a group address.
+ */
+struct host_entry *
+hosts_learn(struct hosts *h,
+            struct host_addr const *src,
+            uint32_t now)
+{
+    struct host_entry *set;
+    struct host_entry *victim;
+    int i;
+
+    if (src->group)
+        return NULL;
+    set = hosts_set(h, src);
+    victim = &set[0];
+    for (i = 0; i < HOSTS_WAYS; ++i)
+    {
+        if (set[i].addr.len == src->len
+            && memcmp(set[i].addr.bytes, src->bytes, src->len) == 0)
+        {
+            victim = &set[i];
+            break;
+        }
+        if ((int32_t)(set[i].expire - now) < (int32_t)(victim->expire - now))
+            victim = &set[i];
+    }
+    if (victim->addr.len != src->len
+        || memcmp(victim->addr.bytes, src->bytes, src->len) != 0)
+    {
+        memset(&victim->peer, 0, sizeof(victim->peer));
+        victim->node = 0;
+    }
+    victim->addr = *src;
+    victim->expire = now + HOSTS_AGEING;
+    return victim;
+}
+
+/* The entry of dst, NULL if it is unknown and the frame must be flooded */
+struct host_entry const *
+hosts_lookup(struct hosts *h,
+             struct host_addr const *dst,
+             uint32_t now)
+{
+    struct host_entry *set;
+    int i;
+
+    if (dst->group)
+        return NULL;
+    set = hosts_set(h, dst);
+    for (i = 0; i < HOSTS_WAYS; ++i)
+    {
+        if (set[i].addr.len == dst->len
+            && memcmp(set[i].addr.bytes, dst->bytes, dst->len) == 0
+            && (int32_t)(set[i].expire - now) > 0)
+            return &set[i];
+    }
+    return NULL;
+}
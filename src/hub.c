@@ -0,0 +1,68 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hub.h"
+#include "subset.h"
+
+struct hub *
+hub_new(void)
+{
+    struct hub *h = tnt_new(struct hub);
+
+    if (h != NULL)
+        memset(h, 0, sizeof(*h));
+    return h;
+}
+
+void
+hub_delete(struct hub *h)
+{
+    free(h);
+}
+
+/* The frames to src go to peer from now on, to us if peer is NULL */
+void
+hub_learn(struct hub *h,
+          struct host_addr const *src,
+          struct endpoint const *peer,
+          uint32_t now)
+{
+    struct host_entry *e = hosts_learn(&h->hosts, src, now);
+
+    if (e == NULL)
+        return;
+    /* A host may have moved to another spoke */
+    if (peer != NULL)
+        endpoint_copy(&e->peer, peer);
+    else
+        memset(&e->peer, 0, sizeof(e->peer));
+}
+
+/*
+ * Returns the peer the address was learnt from, NULL if the frame must be
+ * flooded. Our own addresses have a zero addrlen.
+ */
+struct endpoint const *
+hub_lookup(struct hub *h,
+           struct host_addr const *dst,
+           uint32_t now)
+{
+    struct host_entry const *e = hosts_lookup(&h->hosts, dst, now);
+
+    return (e != NULL) ? &e->peer : NULL;
+}
@@ -0,0 +1,283 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/util.h>
+
+#include "networking.h"
+
+#include "tnetacle.h"
+#include "tntsched.h"
+#include "endpoint.h"
+#include "options.h"
+#include "server.h"
+#include "udp.h"
+#include "bond.h"
+#include "route.h"
+#include "punch.h"
+#include "probe.h"
+#include "keepalive.h"
+#include "metaproto.h"
+#include "log.h"
+
+extern struct options serv_opts;
+
+/* Spread the peers over the slots, in the order they come */
+void
+keepalive_init(struct keepalive_peer *k,
+               struct udp *udp)
+{
+    memset(k, 0, sizeof(*k));
+    k->slot = udp->keepalive_next++ % KEEPALIVE_SLOTS;
+}
+
+static void
+keepalive_faster(long *period,
+                 long ms)
+{
+    if (*period == 0 || ms < *period)
+        *period = ms;
+}
+
+/*
+ * Pick the period of the rounds, once the other fibers are set up.
+ * Returns it in ms, 0 if the peers need no looking after.
+ */
+long
+keepalive_setup(struct udp *udp)
+{
+    long period = (long)serv_opts.keepalive_interval * 1000;
+    long dead = period * serv_opts.keepalive_misses;
+
+    udp->keepalive_measure = 0;
+    if (udp->udp_punch_fib != NULL)
+    {
+        keepalive_faster(&period, PUNCH_KEEPALIVE * 1000L);
+        /* The direct paths must be dropped once dead, whatever the user says */
+        if (dead == 0)
+            dead = PUNCH_KEEPALIVE * 1000L * PUNCH_MISSES;
+        udp->keepalive_measure = 1;
+    }
+    if (udp->route != NULL)
+    {
+        keepalive_faster(&period, ROUTE_PROBE_INTERVAL);
+        udp->keepalive_measure = 1;
+    }
+    if (udp->udp_bond_fib != NULL)
+    {
+        keepalive_faster(&period, BOND_PROBE_INTERVAL);
+        udp->keepalive_measure = 1;
+    }
+    udp->keepalive_period = period;
+    udp->keepalive_dead = 0;
+    if (period > 0 && dead > 0)
+        udp->keepalive_dead = (int)((dead + period - 1) / period);
+    return period;
+}
+
+/* The metric of a path to the peer, the first one being its address */
+struct probe_metric *
+keepalive_path(struct udp_peer *peer,
+               size_t path)
+{
+    if (peer->bond != NULL)
+        return &peer->bond->paths[path].metric;
+    return &peer->keepalive.link;
+}
+
+int
+keepalive_is_control(unsigned char const *buf,
+                     size_t len)
+{
+    return probe_is_ctl(buf, len, KEEPALIVE_CTL_PROBE, KEEPALIVE_CTL_ACK,
+                        KEEPALIVE_CTL_SIZE - PROBE_CTL_SIZE);
+}
+
+static void
+keepalive_send(struct udp_transport *t,
+               int type,
+               uint32_t seq,
+               unsigned char path,
+               struct endpoint const *to)
+{
+    unsigned char buf[sizeof(struct packet_hdr) + KEEPALIVE_CTL_SIZE];
+    size_t n = probe_ctl_write(buf, type, seq);
+
+    buf[n] = path;
+    mp_put_u64(buf + n + 1, t->udp->flood->self);
+    if (sendto(t->fd, (char const *)buf, sizeof(buf), 0,
+               endpoint_addr(to), endpoint_addrlen(to)) == -1)
+    {
+        log_debug("[KEEPALIVE] can't reach %s: %s", endpoint_presentation(to),
+                  evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    }
+}
+
+/* The peer proved it is alive */
+void
+keepalive_heard(struct udp_peer *peer)
+{
+    struct keepalive_peer *k = &peer->keepalive;
+
+    k->heard = 1;
+    if (k->dead)
+    {
+        k->dead = 0;
+        log_info("[KEEPALIVE] %s is back",
+                 endpoint_presentation(&peer->peer_addr));
+        server_advertise_neighbours(peer->transport->server);
+    }
+}
+
+/*
+ * Handle a control message from the receive fiber. Only our peers are
+ * answered, with a message of the same size. Only the ack of the last
+ * keepalive of a path counts, the others may be forged or very late.
+ */
+void
+keepalive_input(struct udp_transport *t,
+                struct endpoint const *from,
+                unsigned char const *buf,
+                size_t len)
+{
+    struct udp *udp = t->udp;
+    unsigned char const *p = buf + sizeof(struct packet_hdr);
+    struct udp_peer *peer = udp_find_peer(udp, from);
+    unsigned char path = p[PROBE_CTL_SIZE];
+    uint32_t seq = probe_ctl_seq(buf);
+    int up;
+
+    (void)len;
+    if (p[0] == KEEPALIVE_CTL_PROBE)
+    {
+        if (udp->udp_punch_fib != NULL)
+            punch_observed(udp, from, mp_get_u64(p + PROBE_CTL_SIZE + 1));
+        if (peer != NULL)
+            keepalive_send(t, KEEPALIVE_CTL_ACK, seq, path, from);
+        return;
+    }
+
+    if (peer == NULL)
+        return;
+    if (peer->bond != NULL && (path >= peer->bond->count
+        || endpoint_cmp(&peer->bond->paths[path].addr, from) != 0))
+        return;
+    if (peer->bond == NULL && path != 0)
+        return;
+    up = probe_acked(keepalive_path(peer, path), seq);
+    if (up == -1)
+        return;
+    if (up == 1 && udp->keepalive_measure)
+        log_info("[KEEPALIVE] path to %s is up", endpoint_presentation(from));
+    keepalive_heard(peer);
+}
+
+/* Account for the last keepalive of every path, and send the next one */
+static void
+keepalive_probe(struct udp *udp,
+                struct udp_peer *peer,
+                struct timeval const *now)
+{
+    struct bond *b = peer->bond;
+    size_t count = (b != NULL) ? b->count : 1;
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+    {
+        struct probe_metric *m = keepalive_path(peer, i);
+        struct udp_transport *t = (b != NULL) ? b->paths[i].transport
+                                              : peer->transport;
+        struct endpoint const *to = (b != NULL) ? &b->paths[i].addr
+                                                : &peer->peer_addr;
+
+        if (probe_start(m, now) && udp->keepalive_measure)
+            log_notice("[KEEPALIVE] path to %s is down",
+                       endpoint_presentation(to));
+        keepalive_send(t, KEEPALIVE_CTL_PROBE, m->seq, (unsigned char)i, to);
+    }
+    if (b != NULL)
+        bond_weigh(b);
+}
+
+/* Look after the peers of a slot */
+static void
+keepalive_tick(struct server *s,
+               struct udp *udp,
+               unsigned int slot,
+               struct timeval const *now)
+{
+    struct udp_peer *it = NULL;
+    struct udp_peer *ite = NULL;
+    int changed = 0;
+    int direct = 0;
+
+    for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+         it != ite;
+         it = v_udp_next(it))
+    {
+        struct keepalive_peer *k = &it->keepalive;
+        int heard = k->heard;
+
+        if (k->slot != slot)
+            continue;
+        if (heard)
+        {
+            k->heard = 0;
+            k->misses = 0;
+        }
+        else if (!k->dead && udp->keepalive_dead != 0
+                 && ++k->misses > udp->keepalive_dead)
+        {
+            k->dead = 1;
+            changed = 1;
+            direct |= it->punch.direct;
+            log_notice("[KEEPALIVE] %s is dead, no more frames for it",
+                       endpoint_presentation(&it->peer_addr));
+        }
+        if (udp->keepalive_measure || !heard)
+            keepalive_probe(udp, it, now);
+    }
+    if (changed)
+        server_advertise_neighbours(s);
+    /* It drops the dead direct paths */
+    if (direct && udp->punch_running)
+        async_wake(udp->udp_punch_fib, /*unused*/0);
+}
+
+/* The keepalive fiber, one tick every round / KEEPALIVE_SLOTS */
+void
+server_keepalive(void *ctx)
+{
+    struct server *s = (struct server *)sched_get_userptr(ctx);
+    struct udp *udp = s->udp;
+    long tick = udp->keepalive_period * 1000 / KEEPALIVE_SLOTS;
+    unsigned int slot = 0;
+    struct timeval tv;
+
+    tv.tv_sec = tick / 1000000;
+    tv.tv_usec = tick % 1000000;
+    while (1)
+    {
+        struct timeval now;
+
+        async_wait(ctx, &tv);
+        evutil_gettimeofday(&now, NULL);
+        keepalive_tick(s, udp, slot, &now);
+        slot = (slot + 1) % KEEPALIVE_SLOTS;
+    }
+    sched_fiber_exit(ctx, 0);
+}
@@ -31,6 +31,9 @@
 #include "tnetacle.h"
 #include "options.h"
 #include "udp.h"
+#include "tls_session.h"
+#include "handshake.h"
+#include "metaproto.h"
 
 extern struct options serv_opts;
 
@@ -105,6 +108,9 @@ mc_init(struct mc *self,
     if (server_ctx != NULL)
     {
         SSL *client_ctx = SSL_new(server_ctx);
+
+        if (client_ctx != NULL && self->ssl_flags == BUFFEREVENT_SSL_CONNECTING)
+            tls_session_resume(client_ctx, s, len);
         self->bev = bufferevent_openssl_socket_new(evb, fd, client_ctx,
                                                    self->ssl_flags,
                                                    BEV_OPT_CLOSE_ON_FREE);
@@ -132,6 +138,103 @@ mc_init(struct mc *self,
     return 0;
 }
 
+/*
+ * Hand the TLS handshake of a new meta-connexion to the handshake pool.
+ * The struct mc waits in the pending peers, without bufferevent, until
+ * mc_handshake_done. Returns NULL if the pool can't take it.
+ */
+static struct mc *
+mc_peer_offload(struct server *s,
+                evutil_socket_t fd,
+                struct sockaddr *sock,
+                socklen_t socklen)
+{
+    struct mc tmp;
+    SSL *ssl;
+
+    if (s->hs_pool == NULL)
+        return NULL;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.p.address = malloc(socklen);
+    ssl = SSL_new(s->server_ctx);
+    if (tmp.p.address == NULL || ssl == NULL)
+    {
+        free(tmp.p.address);
+        if (ssl != NULL)
+            SSL_free(ssl);
+        return NULL;
+    }
+    if (fd == -1)
+        tls_session_resume(ssl, sock, socklen);
+    tmp.handshake = hs_pool_submit(s->hs_pool, fd, ssl, sock, socklen);
+    if (tmp.handshake == NULL)
+    {
+        free(tmp.p.address);
+        SSL_free(ssl);
+        return NULL;
+    }
+    memcpy(tmp.p.address, sock, socklen);
+    tmp.p.len = socklen;
+    tmp.ssl_flags = TLS_ENABLE;
+    return v_mc_insert(s->pending_peers, &tmp);
+}
+
+static int
+find_handshake(struct mc const *mc, void *ctx)
+{
+    return mc->handshake == ctx;
+}
+
+/*
+ * Called in the event loop when the handshake pool is done with a
+ * meta-connexion: it goes on as if the bufferevent did the handshake.
+ */
+void
+mc_handshake_done(struct hs_job *job,
+                  void *ctx)
+{
+    struct server *s = ctx;
+    struct mc *mc;
+    char peername[INET6_ADDRSTRLEN];
+
+    mc = v_mc_find_if(s->pending_peers, find_handshake, job);
+    if (mc == v_mc_end(s->pending_peers))
+    {
+        /* Closed in the meantime */
+        hs_job_free(job);
+        return ;
+    }
+    mc->handshake = NULL;
+    mc_presentation(mc, peername, sizeof(peername));
+    if (job->err == 0)
+    {
+        mc->bev = bufferevent_openssl_socket_new(s->evbase, job->fd, job->ssl,
+                                                 BUFFEREVENT_SSL_OPEN,
+                                                 BEV_OPT_CLOSE_ON_FREE);
+        if (mc->bev != NULL)
+        {
+            /* The bufferevent owns them now */
+            job->fd = -1;
+            job->ssl = NULL;
+        }
+    }
+    if (job->err == -1 || mc->bev == NULL)
+    {
+        char errstr[150];
+
+        ERR_error_string_n(job->sslerr, errstr, sizeof(errstr));
+        log_notice("[META] [TLS] handshake with %s failed (%s)",
+                   peername, errstr);
+        hs_job_free(job);
+        mc_close(mc);
+        v_mc_erase(s->pending_peers, mc);
+        return ;
+    }
+    hs_job_free(job);
+    bufferevent_setcb(mc->bev, server_mc_read_cb, NULL, server_mc_event_cb, s);
+    server_mc_event_cb(mc->bev, BEV_EVENT_CONNECTED, s);
+}
+
 struct mc *
 mc_peer_connect(struct server *s,
                 struct event_base *evbase,
@@ -140,6 +243,7 @@ mc_peer_connect(struct server *s,
 {
     int err;
     struct mc tmp;
+    struct mc *mc;
     char peername[INET6_ADDRSTRLEN];
 
     address_presentation(sock, socklen, peername, sizeof(peername));
@@ -150,6 +254,11 @@ mc_peer_connect(struct server *s,
         log_notice("[META] [CONNECT] connexion already established with %s", peername);
         return NULL;
     }
+    if ((mc = mc_peer_offload(s, -1, sock, socklen)) != NULL)
+    {
+        log_debug("[META] [TLS] connecting to %s", peername);
+        return mc;
+    }
     err = mc_init(&tmp, evbase, -1, sock, socklen, s->server_ctx);
     if (err == -1) {
         log_warn("[META] [CONNECT] unable to allocate a socket for connecting to %s",
@@ -175,6 +284,7 @@ mc_peer_accept(struct server *s,
 {
     int errcode;
     struct mc mc;
+    struct mc *offloaded;
     char peername[INET6_ADDRSTRLEN];
 
     memset(&mc, 0, sizeof mc);
@@ -189,6 +299,17 @@ mc_peer_accept(struct server *s,
         close((int)fd);
         return NULL;
     }
+    if (hs_pool_busy(s->hs_pool, sock))
+    {
+        log_notice("[META] [ACCEPT] too many handshakes with %s", peername);
+        close((int)fd);
+        return NULL;
+    }
+    if ((offloaded = mc_peer_offload(s, fd, sock, socklen)) != NULL)
+    {
+        log_debug("[META] [TLS] waiting for the ssl handshake with %s", peername);
+        return offloaded;
+    }
     errcode = mc_init(&mc, evbase, fd, sock, socklen, s->server_ctx);
     if (errcode == -1)
     {
@@ -216,6 +337,12 @@ mc_peer_accept(struct server *s,
 void
 mc_close(struct mc *self)
 {
+    /* Still on the handshake pool, which will free it */
+    if (self->bev == NULL)
+    {
+        free(self->p.address);
+        return ;
+    }
     if (self->ssl_flags & TLS_ENABLE)
     {
         SSL *ssl = bufferevent_openssl_get_ssl(self->bev);
@@ -265,18 +392,167 @@ mc_hello(struct mc *self, struct udp *udp)
 
     (void)udp;
     bufferevent_enable(self->bev, EV_READ|EV_WRITE);
-    evbuffer_add_printf(output, "Hello ~!\r\n");
-    return 0;
+    return mp_add(output, MP_HELLO, NULL, 0);
+}
+
+/*
+ * The UDP socket going with the meta-connexion: the one on the same local
+ * address, or at least of the same family.
+ */
+struct udp_transport *
+mc_transport(struct mc *self, struct udp *udp)
+{
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    evutil_socket_t fd = bufferevent_getfd(self->bev);
+
+    if (fd == -1 || getsockname(fd, (struct sockaddr *)&local, &len) == -1)
+        return udp_transport_for(udp, NULL, self->p.address->sa_family);
+    return udp_transport_for(udp, (struct sockaddr *)&local,
+                             local.ss_family);
 }
 
 int
 mc_establish_tunnel(struct mc *self, struct udp *udp)
 {
     struct evbuffer *output = bufferevent_get_output(self->bev);
-    unsigned short port = udp_get_port(udp);
+    struct udp_transport *t = mc_transport(self, udp);
+    unsigned char value[2];
 
-    evbuffer_add_printf(output, "udp_port:%d\r\n", port);
-    return 0;
+    if (t == NULL)
+        return -1;
+    mp_put_u16(value, udp_get_port(t));
+    return mp_add(output, MP_UDP_PORT, value, sizeof(value));
+}
+
+/*
+ * Tell the peer who we are and who our live peers are, so it doesn't relay
+ * them the frames we send it.
+ */
+int
+mc_neighbours(struct mc *self, struct udp *udp)
+{
+    struct evbuffer *output = bufferevent_get_output(self->bev);
+    struct udp_peer *it = NULL;
+    struct udp_peer *ite = NULL;
+    unsigned char *value;
+    size_t len = 8;
+    int err;
+
+    value = malloc(8 * (v_udp_size(udp->udp_peers) + 1));
+    if (value == NULL)
+        return -1;
+    mp_put_u64(value, udp->flood->self);
+    for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+         it != ite && len + 8 <= MP_MAX_VALUE;
+         it = v_udp_next(it))
+    {
+        if (it->flood.id == 0 || it->keepalive.dead)
+            continue;
+        mp_put_u64(value + len, it->flood.id);
+        len += 8;
+    }
+    err = mp_add(output, MP_NEIGHBOURS, value, len);
+    free(value);
+    return err;
+}
+
+/*
+ * Tell the peer about every UDP socket we have, each one is a path to us.
+ * A socket bound on the unspecified address is reached at the address of the
+ * meta-connexion.
+ */
+int
+mc_udp_paths(struct mc *self, struct udp *udp)
+{
+    struct evbuffer *output = bufferevent_get_output(self->bev);
+    struct udp_transport **it = NULL;
+    struct udp_transport **ite = NULL;
+    unsigned char *value;
+    size_t len = 0;
+    int err;
+
+    value = malloc(v_transport_size(udp->transports) * (2 + 1 + 16));
+    if (value == NULL)
+        return -1;
+    for (it = v_transport_begin(udp->transports),
+         ite = v_transport_end(udp->transports);
+         it != ite && len + 2 + 1 + 16 <= MP_MAX_VALUE;
+         it = v_transport_next(it))
+    {
+        struct sockaddr *sa = endpoint_addr(&(*it)->endpoint);
+
+        mp_put_u16(value + len, udp_get_port(*it));
+        if (sa->sa_family == AF_INET)
+        {
+            value[len + 2] = 4;
+            memcpy(value + len + 3, &((struct sockaddr_in *)sa)->sin_addr, 4);
+            len += 3 + 4;
+        }
+        else if (sa->sa_family == AF_INET6)
+        {
+            value[len + 2] = 6;
+            memcpy(value + len + 3, &((struct sockaddr_in6 *)sa)->sin6_addr,
+                   16);
+            len += 3 + 16;
+        }
+    }
+    err = mp_add(output, MP_UDP_PATHS, value, len);
+    free(value);
+    return err;
+}
+
+/* Give the peer a link state, ours or one to relay */
+int
+mc_link_state(struct mc *self, unsigned char const *value, size_t len)
+{
+    struct evbuffer *output = bufferevent_get_output(self->bev);
+
+    return mp_add(output, MP_LINK_STATE, value, len);
+}
+
+/* Ask a peer to introduce us to one of its own peers */
+int
+mc_punch_request(struct mc *self, uint64_t id)
+{
+    struct evbuffer *output = bufferevent_get_output(self->bev);
+    unsigned char value[8];
+
+    mp_put_u64(value, id);
+    return mp_add(output, MP_PUNCH_REQUEST, value, sizeof(value));
+}
+
+/* Introduce the node id, reachable at e, to the peer */
+int
+mc_punch(struct mc *self, uint64_t id, uint32_t cookie,
+         struct endpoint const *e)
+{
+    struct evbuffer *output = bufferevent_get_output(self->bev);
+    struct sockaddr *sa = endpoint_addr(e);
+    unsigned char value[8 + 4 + 2 + 1 + 16];
+    size_t len = 15;
+
+    mp_put_u64(value, id);
+    value[8] = (unsigned char)(cookie >> 24);
+    value[9] = (unsigned char)(cookie >> 16);
+    value[10] = (unsigned char)(cookie >> 8);
+    value[11] = (unsigned char)cookie;
+    mp_put_u16(value + 12, (uint16_t)endpoint_port(e));
+    if (sa->sa_family == AF_INET)
+    {
+        value[14] = 4;
+        memcpy(value + len, &((struct sockaddr_in *)sa)->sin_addr, 4);
+        len += 4;
+    }
+    else if (sa->sa_family == AF_INET6)
+    {
+        value[14] = 6;
+        memcpy(value + len, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+        len += 16;
+    }
+    else
+        return -1;
+    return mp_add(output, MP_PUNCH, value, len);
 }
 
 static int
@@ -0,0 +1,151 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <string.h>
+
+#include <event2/buffer.h>
+
+#include "metaproto.h"
+#include "log.h"
+
+uint16_t
+mp_get_u16(unsigned char const *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+void
+mp_put_u16(unsigned char *p,
+           uint16_t v)
+{
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)(v & 0xff);
+}
+
+uint32_t
+mp_get_u32(unsigned char const *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+         | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+void
+mp_put_u32(unsigned char *p,
+           uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+uint64_t
+mp_get_u64(unsigned char const *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < 8; ++i)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+void
+mp_put_u64(unsigned char *p,
+           uint64_t v)
+{
+    int i;
+
+    for (i = 7; i >= 0; --i, v >>= 8)
+        p[i] = (unsigned char)(v & 0xff);
+}
+
+/*
+ * Queue a message on output. The header and the value are added together,
+ * without any intermediate allocation.
+ * Returns -1 on error, 0 otherwise.
+ */
+int
+mp_add(struct evbuffer *output,
+       enum mp_type type,
+       void const *value,
+       size_t len)
+{
+    unsigned char hdr[MP_HDR_SIZE];
+
+    if (len > MP_MAX_VALUE)
+        return -1;
+    hdr[0] = MP_VERSION;
+    hdr[1] = (unsigned char)type;
+    mp_put_u16(hdr + 2, (uint16_t)len);
+    if (evbuffer_add(output, hdr, sizeof(hdr)) == -1)
+        return -1;
+    if (len > 0 && evbuffer_add(output, value, len) == -1)
+        return -1;
+    return 0;
+}
+
+/*
+ * Dispatch every complete message of input through table, which has
+ * MP_TYPE_MAX entries. The value is read in place, then drained: nothing
+ * is allocated, a partial message is left for the next call.
+ * Returns -1 if the peer speaks something else, or if a handler asked to
+ * close, 0 otherwise.
+ */
+int
+mp_parse(struct evbuffer *input,
+         struct mp_dispatch const *table,
+         void *ctx)
+{
+    unsigned char hdr[MP_HDR_SIZE];
+
+    while (evbuffer_copyout(input, hdr, sizeof(hdr)) == sizeof(hdr))
+    {
+        size_t len = mp_get_u16(hdr + 2);
+        unsigned char const *value;
+        struct mp_dispatch const *d;
+
+        if (hdr[0] != MP_VERSION)
+        {
+            log_notice("[META] unsupported protocol version %d", hdr[0]);
+            return -1;
+        }
+        if (evbuffer_get_length(input) < MP_HDR_SIZE + len)
+            break;
+
+        /* Only linearize when the message spans several chains */
+        value = evbuffer_pullup(input, MP_HDR_SIZE + len);
+        if (value == NULL)
+            return -1;
+        value += MP_HDR_SIZE;
+
+        d = hdr[1] < MP_TYPE_MAX ? &table[hdr[1]] : NULL;
+        if (d == NULL || d->handler == NULL)
+        {
+            log_debug("[META] skip unknown message type %d", hdr[1]);
+        }
+        else if (len < d->min_len)
+        {
+            log_notice("[META] truncated message type %d", hdr[1]);
+            return -1;
+        }
+        else if (d->handler(ctx, value, len) == -1)
+        {
+            return -1;
+        }
+        evbuffer_drain(input, MP_HDR_SIZE + len);
+    }
+    return 0;
+}
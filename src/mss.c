@@ -0,0 +1,188 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mss.h"
+
+/*
+ * TCP MSS clamping: the peers of a connection going through the tunnel
+ * advertise an MSS computed from the MTU of their own link, which is often
+ * larger than what the tunnel can carry. Rewriting the option of the SYN and
+ * SYN-ACK makes them send segments that fit from the start.
+ *
+ * Only the option value changes, so the checksum is patched incrementally
+ * (RFC 1624) rather than recomputed over the whole segment.
+ */
+
+#define MSS_ETHERTYPE_IPV4  0x0800
+#define MSS_ETHERTYPE_IPV6  0x86dd
+#define MSS_ETHERTYPE_VLAN  0x8100
+
+#define MSS_IPPROTO_TCP     6
+#define MSS_TCP_HDR_MIN     20
+#define MSS_TCP_SYN         0x02
+
+#define MSS_OPT_END         0
+#define MSS_OPT_NOP         1
+#define MSS_OPT_MSS         2
+
+static uint16_t
+mss_get16(unsigned char const *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void
+mss_put16(unsigned char *p,
+          uint16_t v)
+{
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+/*
+ * HC' = ~(~HC + ~m + m'), from RFC 1624, m being from and m' to.
+ * The one's complement sum doesn't care about the byte order, a field sitting
+ * at an odd offset is handled by swapping both of its values.
+ */
+static void
+mss_csum_replace(unsigned char *csum,
+                 uint16_t from,
+                 uint16_t to,
+                 int odd)
+{
+    uint32_t sum;
+
+    if (odd)
+    {
+        from = (uint16_t)((from << 8) | (from >> 8));
+        to = (uint16_t)((to << 8) | (to >> 8));
+    }
+    sum = (uint16_t)~mss_get16(csum);
+    sum += (uint16_t)~from;
+    sum += to;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    mss_put16(csum, (uint16_t)~sum);
+}
+
+static int
+mss_clamp_tcp(unsigned char *tcp,
+              size_t len,
+              uint16_t mss)
+{
+    size_t doff;
+    size_t i;
+
+    if (len < MSS_TCP_HDR_MIN || (tcp[13] & MSS_TCP_SYN) == 0)
+        return 0;
+    doff = (size_t)(tcp[12] >> 4) * 4;
+    if (doff < MSS_TCP_HDR_MIN || doff > len)
+        return 0;
+
+    for (i = MSS_TCP_HDR_MIN; i < doff; )
+    {
+        size_t optlen;
+
+        if (tcp[i] == MSS_OPT_END)
+            break;
+        if (tcp[i] == MSS_OPT_NOP)
+        {
+            ++i;
+            continue;
+        }
+        if (i + 1 >= doff)
+            break;
+        optlen = tcp[i + 1];
+        if (optlen < 2 || i + optlen > doff)
+            break;
+        if (tcp[i] == MSS_OPT_MSS && optlen == 4)
+        {
+            uint16_t old = mss_get16(tcp + i + 2);
+
+            if (old <= mss)
+                return 0;
+            mss_put16(tcp + i + 2, mss);
+            mss_csum_replace(tcp + 16, old, mss, (i + 2) & 1);
+            return 1;
+        }
+        i += optlen;
+    }
+    return 0;
+}
+
+int
+mss_clamp(unsigned char *frame,
+          size_t len,
+          int layer2,
+          int mtu)
+{
+    unsigned char *ip = frame;
+    uint16_t type;
+
+    if (layer2)
+    {
+        if (len < 14)
+            return 0;
+        type = mss_get16(frame + 12);
+        ip = frame + 14;
+        if (type == MSS_ETHERTYPE_VLAN)
+        {
+            if (len < 18)
+                return 0;
+            type = mss_get16(frame + 16);
+            ip = frame + 18;
+        }
+    }
+    else
+    {
+        if (len < 1)
+            return 0;
+        type = ((frame[0] >> 4) == 6) ? MSS_ETHERTYPE_IPV6 : MSS_ETHERTYPE_IPV4;
+    }
+    len -= (size_t)(ip - frame);
+
+    if (type == MSS_ETHERTYPE_IPV4)
+    {
+        size_t ihl;
+        size_t total;
+
+        if (len < 20 || (ip[0] >> 4) != 4 || ip[9] != MSS_IPPROTO_TCP)
+            return 0;
+        /* Only the first fragment carries the TCP header */
+        if ((mss_get16(ip + 6) & 0x1fff) != 0)
+            return 0;
+        ihl = (size_t)(ip[0] & 0x0f) * 4;
+        total = mss_get16(ip + 2);
+        if (ihl < 20 || total < ihl || total > len || mtu <= 40)
+            return 0;
+        return mss_clamp_tcp(ip + ihl, total - ihl, (uint16_t)(mtu - 40));
+    }
+    if (type == MSS_ETHERTYPE_IPV6)
+    {
+        size_t payload;
+
+        /* The extension headers are not walked, they are rare on a SYN */
+        if (len < 40 || (ip[0] >> 4) != 6 || ip[6] != MSS_IPPROTO_TCP)
+            return 0;
+        payload = mss_get16(ip + 4);
+        if (40 + payload > len || mtu <= 60)
+            return 0;
+        return mss_clamp_tcp(ip + 40, payload, (uint16_t)(mtu - 60));
+    }
+    return 0;
+}
@@ -0,0 +1,537 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined Linux
+# include <sys/ioctl.h>
+# include <net/if.h>
+# include <linux/if_tun.h>
+#endif
+
+#include "frame.h"
+#include "offload.h"
+
+/*
+ * TUN/TAP offloads. The kernel hands us TCP and UDP superpackets of up to
+ * 64 KiB in a single read, with the checksums left to complete. They are
+ * split into MTU sized frames here, just before entering the tunnel.
+ *
+ * On the other way, consecutive segments of a same TCP connection are
+ * coalesced back and written in one go: the kernel then handles them as a
+ * single packet, and only splits them again if the route requires it.
+ */
+
+#define OFFLOAD_ETHERTYPE_IPV4  0x0800
+#define OFFLOAD_ETHERTYPE_IPV6  0x86dd
+#define OFFLOAD_ETHERTYPE_VLAN  0x8100
+
+#define OFFLOAD_IPPROTO_TCP     6
+#define OFFLOAD_IPPROTO_UDP     17
+
+#define OFFLOAD_TCP_FIN         0x01
+#define OFFLOAD_TCP_PSH         0x08
+#define OFFLOAD_TCP_ACK         0x10
+#define OFFLOAD_TCP_CWR         0x80
+
+#define OFFLOAD_TCP_CSUM        16
+#define OFFLOAD_UDP_CSUM        6
+
+static uint16_t
+offload_get16(unsigned char const *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t
+offload_get32(unsigned char const *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+         | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void
+offload_put16(unsigned char *p,
+              uint16_t v)
+{
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+static void
+offload_put32(unsigned char *p,
+              uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+/* One's complement sum of a buffer, folded by offload_fold */
+static uint64_t
+offload_sum(unsigned char const *p,
+            size_t len,
+            uint64_t sum)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2)
+        sum += offload_get16(p + i);
+    if (len & 1)
+        sum += (uint64_t)p[len - 1] << 8;
+    return sum;
+}
+
+static uint16_t
+offload_fold(uint64_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+static uint64_t
+offload_pseudo(unsigned char const *ip,
+               int family,
+               int proto,
+               size_t l4_len)
+{
+    uint64_t sum;
+
+    if (family == 4)
+        sum = offload_sum(ip + 12, 8, 0);
+    else
+        sum = offload_sum(ip + 8, 32, 0);
+    return sum + (uint64_t)proto + l4_len;
+}
+
+/*
+ * Find the IP header of a frame.
+ * Returns its offset and sets family to 4 or 6, -1 if it's not IP.
+ */
+static int
+offload_parse_l3(unsigned char const *pkt,
+                 size_t len,
+                 int layer2,
+                 int *family)
+{
+    size_t l3 = 0;
+    uint16_t type;
+
+    if (layer2)
+    {
+        if (len < 14)
+            return -1;
+        type = offload_get16(pkt + 12);
+        l3 = 14;
+        if (type == OFFLOAD_ETHERTYPE_VLAN)
+        {
+            if (len < 18)
+                return -1;
+            type = offload_get16(pkt + 16);
+            l3 = 18;
+        }
+        if (type == OFFLOAD_ETHERTYPE_IPV4)
+            *family = 4;
+        else if (type == OFFLOAD_ETHERTYPE_IPV6)
+            *family = 6;
+        else
+            return -1;
+    }
+    else
+    {
+        if (len < 1)
+            return -1;
+        *family = pkt[0] >> 4;
+    }
+    if (*family == 4 && len >= l3 + 20 && (pkt[l3] >> 4) == 4)
+        return (int)l3;
+    if (*family == 6 && len >= l3 + 40 && (pkt[l3] >> 4) == 6)
+        return (int)l3;
+    return -1;
+}
+
+/*
+ * Tell if the device was opened with the offloads, the packets then come
+ * with an offload_hdr.
+ */
+int
+offload_active(intptr_t fd)
+{
+#if defined Linux
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    if (ioctl((int)fd, TUNGETIFF, &ifr) == -1)
+        return 0;
+    return (ifr.ifr_flags & IFF_VNET_HDR) != 0;
+#else
+    (void)fd;
+    return 0;
+#endif
+}
+
+/*
+ * Complete the checksum the kernel left to us: the field holds the sum of
+ * the pseudo header, the rest is summed from csum_start.
+ * Returns -1 if the header doesn't match the packet.
+ */
+int
+offload_complete_csum(unsigned char *pkt,
+                      size_t len,
+                      struct offload_hdr const *hdr)
+{
+    size_t start = hdr->csum_start;
+    size_t field = start + hdr->csum_offset;
+    uint16_t csum;
+
+    if ((hdr->flags & OFFLOAD_F_NEEDS_CSUM) == 0)
+        return 0;
+    if (field + 2 > len)
+        return -1;
+    csum = (uint16_t)~offload_fold(offload_sum(pkt + start, len - start, 0));
+    if (csum == 0 && hdr->csum_offset == OFFLOAD_UDP_CSUM)
+        csum = 0xffff;
+    offload_put16(pkt + field, csum);
+    return 0;
+}
+
+/*
+ * Split a TCP or UDP superpacket in segments of gso_size bytes of payload.
+ * Every segment gets its own copy of the headers, with the lengths, the
+ * sequence numbers and the checksums fixed.
+ * Returns the number of frames pushed on out, -1 on error.
+ */
+int
+offload_split(unsigned char const *pkt,
+              size_t len,
+              struct offload_hdr const *hdr,
+              int layer2,
+              struct vector_frame *out)
+{
+    int type = hdr->gso_type & ~OFFLOAD_GSO_ECN;
+    size_t mss = hdr->gso_size;
+    size_t l4 = hdr->csum_start;
+    size_t hlen;
+    size_t payload;
+    size_t off;
+    size_t ihl = 40;
+    uint32_t seq = 0;
+    uint16_t ip_id = 0;
+    int proto;
+    int family;
+    int l3;
+    int i;
+
+    l3 = offload_parse_l3(pkt, len, layer2, &family);
+    if (l3 == -1 || mss == 0)
+        return -1;
+    if (family == 4)
+    {
+        ihl = (size_t)(pkt[l3] & 0x0f) * 4;
+        ip_id = offload_get16(pkt + l3 + 4);
+        if (ihl < 20 || l4 != (size_t)l3 + ihl)
+            return -1;
+    }
+    else if (l4 < (size_t)l3 + ihl)
+        return -1;
+
+    if ((type == OFFLOAD_GSO_TCPV4 || type == OFFLOAD_GSO_TCPV6)
+        && l4 + 20 <= len)
+    {
+        size_t doff = (size_t)(pkt[l4 + 12] >> 4) * 4;
+
+        /* The options are copied in every segment, they must be there */
+        if (doff < 20 || l4 + doff > len)
+            return -1;
+        proto = OFFLOAD_IPPROTO_TCP;
+        hlen = l4 + doff;
+        seq = offload_get32(pkt + l4 + 4);
+    }
+    else if (type == OFFLOAD_GSO_UDP_L4)
+    {
+        proto = OFFLOAD_IPPROTO_UDP;
+        hlen = l4 + 8;
+    }
+    else
+        return -1;
+    if (hlen > len)
+        return -1;
+    payload = len - hlen;
+
+    for (off = 0, i = 0; off < payload; off += mss, ++i)
+    {
+        size_t plen = (payload - off < mss) ? payload - off : mss;
+        size_t l4_len = hlen - l4 + plen;
+        struct frame f;
+        unsigned char *p;
+        size_t csum;
+        uint16_t sum;
+
+        if (frame_alloc(&f, (unsigned int)(hlen + plen)) == -1)
+            return -1;
+        p = f.frame;
+        memcpy(p, pkt, hlen);
+        memcpy(p + hlen, pkt + hlen + off, plen);
+
+        if (family == 4)
+        {
+            offload_put16(p + l3 + 2, (uint16_t)(hlen - l3 + plen));
+            offload_put16(p + l3 + 4, (uint16_t)(ip_id + i));
+            offload_put16(p + l3 + 10, 0);
+            offload_put16(p + l3 + 10,
+                          (uint16_t)~offload_fold(offload_sum(p + l3, ihl, 0)));
+        }
+        else
+            offload_put16(p + l3 + 4, (uint16_t)(hlen - l3 - 40 + plen));
+
+        if (proto == OFFLOAD_IPPROTO_TCP)
+        {
+            offload_put32(p + l4 + 4, seq + (uint32_t)off);
+            /* The flags closing the data only belong to the last segment */
+            if (off + plen < payload)
+                p[l4 + 13] &= ~(OFFLOAD_TCP_FIN | OFFLOAD_TCP_PSH);
+            if (i > 0)
+                p[l4 + 13] &= ~OFFLOAD_TCP_CWR;
+            csum = l4 + OFFLOAD_TCP_CSUM;
+        }
+        else
+        {
+            offload_put16(p + l4 + 4, (uint16_t)l4_len);
+            csum = l4 + OFFLOAD_UDP_CSUM;
+        }
+        offload_put16(p + csum, 0);
+        sum = (uint16_t)~offload_fold(offload_sum(p + l4, l4_len,
+                                      offload_pseudo(p + l3, family,
+                                                     proto, l4_len)));
+        if (sum == 0 && proto == OFFLOAD_IPPROTO_UDP)
+            sum = 0xffff;
+        offload_put16(p + csum, sum);
+        v_frame_push(out, &f);
+    }
+    return i;
+}
+
+int
+offload_gro_init(struct offload_gro *g)
+{
+    memset(g, 0, sizeof(*g));
+    g->buf = malloc(OFFLOAD_HDR_SIZE + OFFLOAD_PACKET_MAX);
+    g->aside = calloc(1, OFFLOAD_HDR_SIZE + OFFLOAD_PACKET_MAX);
+    if (g->buf == NULL || g->aside == NULL)
+    {
+        offload_gro_free(g);
+        return -1;
+    }
+    return 0;
+}
+
+void
+offload_gro_free(struct offload_gro *g)
+{
+    free(g->buf);
+    g->buf = NULL;
+    free(g->aside);
+    g->aside = NULL;
+}
+
+/*
+ * Start a new packet with frame. Only the plain TCP segments, without IP
+ * options nor extension headers, may get others appended.
+ */
+static void
+offload_gro_start(struct offload_gro *g,
+                  unsigned char const *frame,
+                  size_t len,
+                  int layer2)
+{
+    unsigned char *pkt = g->buf + OFFLOAD_HDR_SIZE;
+    int l3;
+
+    memcpy(pkt, frame, len);
+    g->len = len;
+    g->count = 1;
+    g->open = 0;
+
+    l3 = offload_parse_l3(pkt, len, layer2, &g->family);
+    if (l3 == -1)
+        return;
+    g->l3 = (size_t)l3;
+    if (g->family == 4)
+    {
+        if (pkt[l3] != 0x45 || pkt[l3 + 9] != OFFLOAD_IPPROTO_TCP
+            || (offload_get16(pkt + l3 + 6) & 0x3fff) != 0
+            || offload_get16(pkt + l3 + 2) != len - g->l3)
+            return;
+        g->l4 = g->l3 + 20;
+    }
+    else
+    {
+        if (pkt[l3 + 6] != OFFLOAD_IPPROTO_TCP
+            || offload_get16(pkt + l3 + 4) != len - g->l3 - 40)
+            return;
+        g->l4 = g->l3 + 40;
+    }
+    if (g->l4 + 20 > len || pkt[g->l4 + 13] != OFFLOAD_TCP_ACK)
+        return;
+    g->hdr_len = g->l4 + (size_t)(pkt[g->l4 + 12] >> 4) * 4;
+    if (g->hdr_len < g->l4 + 20 || g->hdr_len >= len)
+        return;
+    g->gso_size = len - g->hdr_len;
+    g->next_seq = offload_get32(pkt + g->l4 + 4) + (uint32_t)g->gso_size;
+    g->open = 1;
+}
+
+/*
+ * Tell if frame is the next segment of the packet being built: same
+ * connection and headers, the sequence number following, and no larger than
+ * the first segment.
+ */
+static int
+offload_gro_match(struct offload_gro const *g,
+                  unsigned char const *frame,
+                  size_t len)
+{
+    unsigned char const *pkt = g->buf + OFFLOAD_HDR_SIZE;
+    unsigned char const *ip = frame + g->l3;
+    unsigned char const *tcp = frame + g->l4;
+    unsigned char flags;
+
+    if (len <= g->hdr_len || len - g->hdr_len > g->gso_size)
+        return 0;
+    if (g->len + len - g->hdr_len > OFFLOAD_PACKET_MAX
+        || g->len - g->l3 + len - g->hdr_len > 65535)
+        return 0;
+    /* Link header, addresses, ports, then all the TCP header but the seq */
+    if (memcmp(pkt, frame, g->l3) != 0)
+        return 0;
+    if (g->family == 4)
+    {
+        if (ip[0] != 0x45 || ip[1] != pkt[g->l3 + 1]
+            || offload_get16(ip + 2) != len - g->l3
+            || (offload_get16(ip + 6) & 0x3fff) != 0
+            || memcmp(ip + 6, pkt + g->l3 + 6, 4) != 0
+            || memcmp(ip + 12, pkt + g->l3 + 12, 8) != 0)
+            return 0;
+    }
+    else
+    {
+        if (memcmp(ip, pkt + g->l3, 4) != 0
+            || offload_get16(ip + 4) != len - g->l3 - 40
+            || memcmp(ip + 6, pkt + g->l3 + 6, 34) != 0)
+            return 0;
+    }
+    flags = tcp[13];
+    if (memcmp(tcp, pkt + g->l4, 4) != 0
+        || offload_get32(tcp + 4) != g->next_seq
+        || memcmp(tcp + 8, pkt + g->l4 + 8, 5) != 0
+        || (flags != OFFLOAD_TCP_ACK
+            && flags != (OFFLOAD_TCP_ACK | OFFLOAD_TCP_PSH))
+        || memcmp(tcp + 14, pkt + g->l4 + 14, 2) != 0
+        || memcmp(tcp + 20, pkt + g->l4 + 20, g->hdr_len - g->l4 - 20) != 0)
+        return 0;
+    return 1;
+}
+
+/*
+ * Add a frame to the packet to write.
+ * Returns -1 if it can't be coalesced with it, the packet must then be
+ * written and the frame added again.
+ */
+int
+offload_gro_add(struct offload_gro *g,
+                unsigned char const *frame,
+                size_t len,
+                int layer2)
+{
+    unsigned char *pkt = g->buf + OFFLOAD_HDR_SIZE;
+    size_t plen;
+
+    if (g->count == 0)
+    {
+        if (len > OFFLOAD_PACKET_MAX)
+            return -1;
+        offload_gro_start(g, frame, len, layer2);
+        return 0;
+    }
+    if (!g->open || !offload_gro_match(g, frame, len))
+        return -1;
+    plen = len - g->hdr_len;
+    memcpy(pkt + g->len, frame + g->hdr_len, plen);
+    g->len += plen;
+    g->next_seq += (uint32_t)plen;
+    ++g->count;
+    /* A shorter segment or a push ends the data of the burst */
+    if (plen < g->gso_size || (frame[g->l4 + 13] & OFFLOAD_TCP_PSH))
+    {
+        pkt[g->l4 + 13] |= frame[g->l4 + 13] & OFFLOAD_TCP_PSH;
+        g->open = 0;
+    }
+    return 0;
+}
+
+/*
+ * Write the headers of the packet being built.
+ * Returns the number of bytes to write from buf, 0 if there is nothing.
+ * The packet is emptied.
+ */
+size_t
+offload_gro_finish(struct offload_gro *g)
+{
+    struct offload_hdr hdr;
+    unsigned char *pkt = g->buf + OFFLOAD_HDR_SIZE;
+    size_t len = g->len;
+
+    if (g->count == 0)
+        return 0;
+    memset(&hdr, 0, sizeof(hdr));
+    if (g->count > 1)
+    {
+        size_t l4_len = len - g->l4;
+        size_t csum = g->l4 + OFFLOAD_TCP_CSUM;
+
+        if (g->family == 4)
+        {
+            offload_put16(pkt + g->l3 + 2, (uint16_t)(len - g->l3));
+            offload_put16(pkt + g->l3 + 10, 0);
+            offload_put16(pkt + g->l3 + 10,
+                          (uint16_t)~offload_fold(offload_sum(pkt + g->l3,
+                                                              20, 0)));
+            hdr.gso_type = OFFLOAD_GSO_TCPV4;
+        }
+        else
+        {
+            offload_put16(pkt + g->l3 + 4, (uint16_t)(len - g->l3 - 40));
+            hdr.gso_type = OFFLOAD_GSO_TCPV6;
+        }
+        /* The kernel completes the checksum from the pseudo header sum */
+        offload_put16(pkt + csum,
+                      offload_fold(offload_pseudo(pkt + g->l3, g->family,
+                                                  OFFLOAD_IPPROTO_TCP,
+                                                  l4_len)));
+        hdr.flags = OFFLOAD_F_NEEDS_CSUM;
+        hdr.hdr_len = (uint16_t)g->hdr_len;
+        hdr.gso_size = (uint16_t)g->gso_size;
+        hdr.csum_start = (uint16_t)g->l4;
+        hdr.csum_offset = OFFLOAD_TCP_CSUM;
+    }
+    memcpy(g->buf, &hdr, sizeof(hdr));
+    g->count = 0;
+    g->len = 0;
+    g->open = 0;
+    return OFFLOAD_HDR_SIZE + len;
+}
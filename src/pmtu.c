@@ -0,0 +1,441 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "networking.h"
+
+#include <openssl/rand.h>
+
+#include "tnetacle.h"
+#include "tntsched.h"
+#include "endpoint.h"
+#include "options.h"
+#include "server.h"
+#include "udp.h"
+#include "pmtu.h"
+#include "crypto.h"
+#include "log.h"
+
+extern struct options serv_opts;
+
+/*
+ * Path MTU discovery, in the spirit of RFC 8899 (DPLPMTUD).
+ *
+ * The data socket sends everything with the DF bit set, so a datagram larger
+ * than the path is dropped instead of being fragmented. A single fiber
+ * (server_pmtu) probes every peer with padded datagrams: an ack moves the
+ * lower bound up, a probe lost PMTU_TRIES times moves the upper bound down,
+ * and the search stops once both are PMTU_STEP bytes apart. Another search
+ * starts every PMTU_REPROBE seconds, it checks the current value first so a
+ * path that shrank is caught by the very first probe.
+ *
+ * Until a peer acked a probe, we can't tell an old daemon from a black hole:
+ * its frames are sent as before, whatever their size.
+ */
+
+static void
+pmtu_deadline(struct pmtu_state *st,
+              struct timeval const *now,
+              long ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    evutil_timeradd(now, &tv, &st->deadline);
+}
+
+void
+pmtu_init(struct pmtu_state *st,
+          int family)
+{
+    memset(st, 0, sizeof(*st));
+    st->base = (family == AF_INET6) ? PMTU_MIN_INET6 : PMTU_MIN_INET;
+    st->max = st->base;
+    if (serv_opts.udp_mtu > st->base)
+        st->max = (unsigned short)serv_opts.udp_mtu;
+    st->mtu = st->base;
+    st->lo = st->base;
+    st->hi = st->max + 1;
+    st->searching = 1;
+}
+
+/* The size of the next probe of the search, 0 once it is over */
+static unsigned short
+pmtu_pick(struct pmtu_state const *st)
+{
+    if (st->validate != 0)
+        return st->validate;
+    if (st->lo >= st->max)
+        return 0;
+    if (st->hi > st->max)
+        return st->max;
+    if (st->hi - st->lo <= PMTU_STEP)
+        return 0;
+    return (unsigned short)((st->lo + st->hi) / 2);
+}
+
+static void
+pmtu_fail(struct pmtu_state *st,
+          unsigned short size)
+{
+    st->probe = 0;
+    if (st->validate == size)
+        st->validate = 0;
+    if (size < st->hi)
+        st->hi = size;
+    if (st->lo >= st->hi)
+        st->lo = st->base;
+    st->mtu = st->lo;
+}
+
+static int
+pmtu_ack(struct pmtu_state *st,
+         uint32_t cookie,
+         unsigned short size)
+{
+    if (st->probe == 0 || st->probe != size || st->cookie != cookie)
+        return -1;
+    st->probe = 0;
+    if (st->validate == size)
+        st->validate = 0;
+    st->answered = 1;
+    if (size > st->lo)
+        st->lo = size;
+    if (st->hi <= st->lo)
+        st->hi = st->max + 1;
+    st->mtu = st->lo;
+    return 0;
+}
+
+/*
+ * Advance the search of a peer.
+ * Returns the size of the probe to send now, 0 if there is none. In both
+ * cases st->deadline is when it needs to be looked at again.
+ */
+static unsigned short
+pmtu_next(struct pmtu_state *st,
+          struct timeval const *now,
+          char const *name)
+{
+    unsigned short size;
+
+    if (st->probe != 0)
+    {
+        if (evutil_timercmp(now, &st->deadline, <))
+            return 0;
+        if (++st->tries < PMTU_TRIES)
+        {
+            pmtu_deadline(st, now, PMTU_PROBE_TIMEOUT);
+            return st->probe;
+        }
+        pmtu_fail(st, st->probe);
+    }
+
+    if (!st->searching)
+    {
+        if (evutil_timercmp(now, &st->deadline, <))
+            return 0;
+        st->searching = 1;
+        st->lo = st->base;
+        st->hi = st->max + 1;
+        st->validate = (st->mtu > st->base) ? st->mtu : 0;
+    }
+
+    size = pmtu_pick(st);
+    if (size == 0)
+    {
+        st->searching = 0;
+        st->done = 1;
+        pmtu_deadline(st, now, PMTU_REPROBE * 1000L);
+        if (st->answered)
+            log_info("[PMTU] %s: path MTU is %d", name, st->mtu);
+        else
+            log_notice("[PMTU] %s doesn't answer the probes", name);
+        return 0;
+    }
+    st->probe = size;
+    st->tries = 0;
+    (void)RAND_bytes((unsigned char *)&st->cookie, sizeof(st->cookie));
+    pmtu_deadline(st, now, PMTU_PROBE_TIMEOUT);
+    return size;
+}
+
+/* Can a datagram with a wire_len bytes UDP payload reach the peer ? */
+int
+pmtu_frame_fits(struct pmtu_state const *st,
+                int family,
+                size_t wire_len)
+{
+    if (!st->answered)
+        return 1;
+    return wire_len + PMTU_IP_HDR(family) + PMTU_UDP_HDR <= st->mtu;
+}
+
+/* The largest frame we can send to the peer, given our own overhead */
+size_t
+pmtu_payload_max(struct pmtu_state const *st,
+                 int family,
+                 size_t overhead)
+{
+    return st->mtu - PMTU_IP_HDR(family) - PMTU_UDP_HDR - overhead;
+}
+
+int
+pmtu_is_control(unsigned char const *buf,
+                size_t len)
+{
+    return len >= sizeof(struct packet_hdr) + PMTU_CTL_SIZE
+        && buf[0] == 0 && buf[1] == 0;
+}
+
+static size_t
+pmtu_ctl_write(unsigned char *buf,
+               int type,
+               uint32_t cookie)
+{
+    struct packet_hdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(buf, &hdr, sizeof(hdr));
+    buf += sizeof(hdr);
+    buf[0] = (unsigned char)type;
+    buf[1] = (unsigned char)(cookie >> 24);
+    buf[2] = (unsigned char)(cookie >> 16);
+    buf[3] = (unsigned char)(cookie >> 8);
+    buf[4] = (unsigned char)cookie;
+    return sizeof(hdr) + PMTU_CTL_SIZE;
+}
+
+/*
+ * Handle a control message from the receive fiber.
+ * Only the known peers are answered, and an ack is much smaller than the
+ * probe it answers: we can't be used to amplify anything.
+ */
+void
+pmtu_input(struct udp *udp,
+           struct endpoint const *from,
+           unsigned char const *buf,
+           size_t len)
+{
+    struct udp_peer *peer = udp_find_peer(udp, from);
+    unsigned char const *p = buf + sizeof(struct packet_hdr);
+    int family = endpoint_addr(from)->sa_family;
+    uint32_t cookie;
+
+    if (peer == NULL)
+        return;
+    cookie = ((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16)
+           | ((uint32_t)p[3] << 8) | (uint32_t)p[4];
+
+    if (p[0] == PMTU_CTL_PROBE)
+    {
+        unsigned char ack[sizeof(struct packet_hdr) + PMTU_ACK_SIZE];
+        size_t size = len + PMTU_IP_HDR(family) + PMTU_UDP_HDR;
+        size_t n = pmtu_ctl_write(ack, PMTU_CTL_ACK, cookie);
+
+        ack[n] = (unsigned char)(size >> 8);
+        ack[n + 1] = (unsigned char)size;
+        if (sendto(peer->transport->fd, (char const *)ack, n + 2, 0,
+                   endpoint_addr(from), endpoint_addrlen(from)) == -1)
+        {
+            log_debug("[PMTU] can't ack a probe of %s",
+                      endpoint_presentation(from));
+        }
+    }
+    else if (p[0] == PMTU_CTL_ACK && len >= sizeof(struct packet_hdr)
+                                            + PMTU_ACK_SIZE)
+    {
+        unsigned short size = (unsigned short)((p[5] << 8) | p[6]);
+
+        if (pmtu_ack(&peer->pmtu, cookie, size) == -1)
+            return;
+        log_debug("[PMTU] %s: %d bytes went through",
+                  endpoint_presentation(from), size);
+        /* Send the next probe right away */
+        if (udp->pmtu_running)
+            async_wake(udp->udp_pmtu_fib, /*unused*/0);
+    }
+}
+
+/*
+ * Send a probe of size bytes, IP and UDP headers included.
+ * Returns -1 if the local stack already knows it is too big.
+ */
+static int
+pmtu_send_probe(struct udp_peer *peer,
+                unsigned short size)
+{
+    static unsigned char buf[PMTU_LIMIT];
+    int family = endpoint_addr(&peer->peer_addr)->sa_family;
+    size_t len = size - PMTU_IP_HDR(family) - PMTU_UDP_HDR;
+    size_t n;
+
+    n = pmtu_ctl_write(buf, PMTU_CTL_PROBE, peer->pmtu.cookie);
+    memset(buf + n, 0, len - n);
+    if (sendto(peer->transport->fd, (char const *)buf, len, 0,
+               endpoint_addr(&peer->peer_addr),
+               endpoint_addrlen(&peer->peer_addr)) == -1)
+    {
+        int err = EVUTIL_SOCKET_ERROR();
+
+#if defined Windows
+        if (err == WSAEMSGSIZE)
+#else
+        if (err == EMSGSIZE)
+#endif
+            return -1;
+        log_debug("[PMTU] can't probe %s: %s",
+                  endpoint_presentation(&peer->peer_addr),
+                  evutil_socket_error_to_string(err));
+    }
+    return 0;
+}
+
+/*
+ * The MTU the device would need for its packets to reach peer in a single
+ * datagram, 0 while it is unknown.
+ */
+int
+pmtu_device_mtu(struct udp const *udp,
+                struct udp_peer const *peer)
+{
+    int family = endpoint_addr(&peer->peer_addr)->sa_family;
+    size_t overhead = sizeof(struct packet_hdr);
+
+    /* The routed frames carry their route */
+    if (udp_routed_frames(udp))
+        overhead = PACKET_HDR_MAX;
+    if (!peer->pmtu.answered)
+        return 0;
+    if (udp->require_keys || peer->crypto.enabled)
+        overhead += CRYPTO_OVERHEAD;
+    if (serv_opts.tunnel == TNT_TUNMODE_ETHERNET)
+        overhead += PMTU_ETHER_HDR;
+    return (int)pmtu_payload_max(&peer->pmtu, family, overhead);
+}
+
+/* The device MTU fitting every known path, 0 if none is known */
+int
+pmtu_min_device_mtu(struct udp const *udp)
+{
+    struct udp_peer *it = NULL;
+    struct udp_peer *ite = NULL;
+    int mtu = 0;
+
+    for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+         it != ite;
+         it = v_udp_next(it))
+    {
+        int n = pmtu_device_mtu(udp, it);
+
+        if (n != 0 && (mtu == 0 || n < mtu))
+            mtu = n;
+    }
+    return mtu;
+}
+
+/*
+ * Size the device after the narrowest path, so the system doesn't give us
+ * frames we would have to drop.
+ */
+static void
+pmtu_update_device(struct udp *udp)
+{
+    struct udp_peer *it = NULL;
+    struct udp_peer *ite = NULL;
+    int mtu = 0;
+
+    for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+         it != ite;
+         it = v_udp_next(it))
+    {
+        int n;
+
+        /* Don't follow the intermediate values of a search */
+        if (!it->pmtu.done)
+            continue;
+        n = pmtu_device_mtu(udp, it);
+        if (n != 0 && (mtu == 0 || n < mtu))
+            mtu = n;
+    }
+    /* Never more than what the device was configured for */
+    if (serv_opts.tunnel_mtu != 0 && mtu > serv_opts.tunnel_mtu)
+        mtu = serv_opts.tunnel_mtu;
+    if (mtu == 0 || mtu == udp->device_mtu)
+        return;
+    log_notice("[PMTU] device MTU set to %d", mtu);
+    udp->device_mtu = mtu;
+    tnt_set_device_mtu(mtu);
+}
+
+/*
+ * The discovery fiber. It is woken up by pmtu_input when a probe is acked,
+ * by udp_register_new_peer, or by the earliest deadline of the peers.
+ */
+void
+server_pmtu(void *ctx)
+{
+    struct server *s = (struct server *)sched_get_userptr(ctx);
+    struct udp *udp = s->udp;
+
+    while (1)
+    {
+        struct udp_peer *it = NULL;
+        struct udp_peer *ite = NULL;
+        struct timeval now;
+        struct timeval next;
+        int armed = 0;
+
+        evutil_gettimeofday(&now, NULL);
+        for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+             it != ite;
+             it = v_udp_next(it))
+        {
+            char const *name = endpoint_presentation(&it->peer_addr);
+            unsigned short size;
+
+            while ((size = pmtu_next(&it->pmtu, &now, name)) != 0)
+            {
+                if (pmtu_send_probe(it, size) == 0)
+                    break;
+                /* Bigger than our own interface, no need to wait */
+                pmtu_fail(&it->pmtu, size);
+            }
+            if (armed == 0 || evutil_timercmp(&it->pmtu.deadline, &next, <))
+            {
+                next = it->pmtu.deadline;
+                armed = 1;
+            }
+        }
+        pmtu_update_device(udp);
+
+        if (armed)
+        {
+            if (evutil_timercmp(&next, &now, <))
+                evutil_timerclear(&next);
+            else
+                evutil_timersub(&next, &now, &next);
+        }
+        async_wait(ctx, armed ? &next : NULL);
+    }
+    sched_fiber_exit(ctx, 0);
+}
@@ -0,0 +1,151 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <string.h>
+
+#include <event2/util.h>
+
+#include "networking.h"
+
+#include <openssl/rand.h>
+
+#include "server.h"
+#include "probe.h"
+#include "metaproto.h"
+
+int
+probe_alive(struct probe_metric const *m)
+{
+    return m->srtt != 0 && m->misses < PROBE_DEAD;
+}
+
+/*
+ * The cost of a link, its round trip time divided by its delivery rate.
+ * 0 while it is down.
+ */
+uint32_t
+probe_cost(struct probe_metric const *m)
+{
+    uint32_t loss = m->loss;
+    uint64_t cost;
+
+    if (!probe_alive(m))
+        return 0;
+    if (loss > PROBE_LOSS_MAX)
+        loss = PROBE_LOSS_MAX;
+    cost = (uint64_t)m->srtt * PROBE_LOSS_ONE / (PROBE_LOSS_ONE - loss);
+    if (cost > UINT32_MAX)
+        cost = UINT32_MAX;
+    return (uint32_t)cost;
+}
+
+/*
+ * Account for the last probe, lost if it wasn't acked, and start the next
+ * one: the caller sends it with m->seq, drawn at random.
+ * Returns 1 if the link just went down, 0 otherwise.
+ */
+int
+probe_start(struct probe_metric *m,
+            struct timeval const *now)
+{
+    int down = 0;
+
+    if (evutil_timerisset(&m->sent) && !m->answered)
+    {
+        m->loss += (PROBE_LOSS_ONE - m->loss) >> PROBE_LOSS_SHIFT;
+        if (m->misses < PROBE_DEAD && ++m->misses == PROBE_DEAD && m->srtt != 0)
+            down = 1;
+    }
+    m->answered = 0;
+    m->sent = *now;
+    if (RAND_bytes((unsigned char *)&m->seq, sizeof(m->seq)) != 1)
+        ++m->seq;
+    return down;
+}
+
+/*
+ * Account for the ack of probe seq. Only the last probe counts, the others
+ * may be forged or very late.
+ * Returns -1 if it doesn't count, 1 if the link just came up, 0 otherwise.
+ */
+int
+probe_acked(struct probe_metric *m,
+            uint32_t seq)
+{
+    struct timeval now;
+    struct timeval tv;
+    uint32_t rtt;
+    int up;
+
+    if (m->answered || seq != m->seq || !evutil_timerisset(&m->sent))
+        return -1;
+    evutil_gettimeofday(&now, NULL);
+    evutil_timersub(&now, &m->sent, &tv);
+    rtt = (uint32_t)(tv.tv_sec * 1000000 + tv.tv_usec);
+    if (rtt == 0)
+        rtt = 1;
+    up = !probe_alive(m);
+    if (m->srtt == 0)
+    {
+        m->srtt = rtt;
+        m->rttvar = rtt / 2;
+    }
+    else
+    {
+        uint32_t delta = (m->srtt > rtt) ? m->srtt - rtt : rtt - m->srtt;
+
+        m->rttvar = m->rttvar - m->rttvar / 4 + delta / 4;
+        m->srtt = m->srtt - m->srtt / 8 + rtt / 8;
+    }
+    m->loss -= m->loss >> PROBE_LOSS_SHIFT;
+    m->answered = 1;
+    m->misses = 0;
+    return up;
+}
+
+/* Is it a probe or an ack of types probe and ack, with extra more bytes? */
+int
+probe_is_ctl(unsigned char const *buf,
+             size_t len,
+             int probe,
+             int ack,
+             size_t extra)
+{
+    unsigned char const *p = buf + sizeof(struct packet_hdr);
+
+    return len >= sizeof(struct packet_hdr) + PROBE_CTL_SIZE + extra
+        && buf[0] == 0 && buf[1] == 0
+        && (p[0] == probe || p[0] == ack);
+}
+
+/* Returns the length written, the extra bytes follow */
+size_t
+probe_ctl_write(unsigned char *buf,
+                int type,
+                uint32_t seq)
+{
+    unsigned char *p = buf + sizeof(struct packet_hdr);
+
+    memset(buf, 0, sizeof(struct packet_hdr));
+    p[0] = (unsigned char)type;
+    mp_put_u32(p + 1, seq);
+    return sizeof(struct packet_hdr) + PROBE_CTL_SIZE;
+}
+
+uint32_t
+probe_ctl_seq(unsigned char const *buf)
+{
+    return mp_get_u32(buf + sizeof(struct packet_hdr) + 1);
+}
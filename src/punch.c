@@ -0,0 +1,548 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "networking.h"
+
+#include <openssl/rand.h>
+
+#include "tnetacle.h"
+#include "tntsched.h"
+#include "endpoint.h"
+#include "options.h"
+#include "server.h"
+#include "udp.h"
+#include "mc.h"
+#include "punch.h"
+#include "metaproto.h"
+#include "log.h"
+
+extern struct options serv_opts;
+
+static void
+punch_deadline(struct timeval *deadline,
+               struct timeval const *now,
+               long ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    evutil_timeradd(now, &tv, deadline);
+}
+
+static struct udp_peer *
+punch_find_peer(struct udp *udp,
+                uint64_t id)
+{
+    struct udp_peer *it = NULL;
+    struct udp_peer *ite = NULL;
+
+    for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+         it != ite;
+         it = v_udp_next(it))
+    {
+        if (it->flood.id == id)
+            return it;
+    }
+    return NULL;
+}
+
+static int
+find_cand(struct punch_cand const *c, void *ctx)
+{
+    uint64_t const *id = ctx;
+
+    return c->id == *id;
+}
+
+static struct punch_cand *
+punch_find_cand(struct udp *udp,
+                uint64_t id)
+{
+    struct punch_cand *c;
+
+    c = v_punch_find_if(udp->punch_cands, find_cand, &id);
+    if (c == v_punch_end(udp->punch_cands))
+        return NULL;
+    return c;
+}
+
+static int
+find_peer_addr(struct udp_peer const *p, void *ctx)
+{
+    struct sockaddr *s = ctx;
+
+    return evutil_sockaddr_cmp(endpoint_addr(&p->peer_addr), s, 0) == 0;
+}
+
+static int
+find_mc_addr(struct mc const *mc, void *ctx)
+{
+    struct endpoint const *e = ctx;
+
+    return evutil_sockaddr_cmp(mc->p.address, endpoint_addr(e), 0) == 0;
+}
+
+/* The meta-connexion going with a peer, NULL for a punched one */
+static struct mc *
+punch_find_mc(struct server *s,
+              struct udp_peer const *peer)
+{
+    struct mc *mc;
+
+    if (peer->punch.direct)
+        return NULL;
+    mc = v_mc_find_if(s->peers, find_mc_addr, (void *)&peer->peer_addr);
+    if (mc == v_mc_end(s->peers))
+        return NULL;
+    return mc;
+}
+
+int
+punch_is_control(unsigned char const *buf,
+                 size_t len)
+{
+    unsigned char const *p = buf + sizeof(struct packet_hdr);
+
+    return len >= sizeof(struct packet_hdr) + PUNCH_CTL_SIZE
+        && buf[0] == 0 && buf[1] == 0
+        && (p[0] == PUNCH_CTL_PROBE || p[0] == PUNCH_CTL_ACK);
+}
+
+static void
+punch_send(struct udp_transport *t,
+           int type,
+           uint32_t cookie,
+           struct endpoint const *to)
+{
+    unsigned char buf[sizeof(struct packet_hdr) + PUNCH_CTL_SIZE];
+    unsigned char *p = buf + sizeof(struct packet_hdr);
+
+    memset(buf, 0, sizeof(struct packet_hdr));
+    p[0] = (unsigned char)type;
+    p[1] = (unsigned char)(cookie >> 24);
+    p[2] = (unsigned char)(cookie >> 16);
+    p[3] = (unsigned char)(cookie >> 8);
+    p[4] = (unsigned char)cookie;
+    mp_put_u64(p + 5, t->udp->flood->self);
+    if (sendto(t->fd, (char const *)buf, sizeof(buf), 0,
+               endpoint_addr(to), endpoint_addrlen(to)) == -1)
+    {
+        log_debug("[PUNCH] can't probe %s: %s", endpoint_presentation(to),
+                  evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    }
+}
+
+/*
+ * Handle a control message from the receive fiber.
+ * Only the nodes we were introduced to are answered, with a message of the
+ * same size.
+ */
+void
+punch_input(struct udp_transport *t,
+            struct endpoint const *from,
+            unsigned char const *buf,
+            size_t len)
+{
+    struct udp *udp = t->udp;
+    unsigned char const *p = buf + sizeof(struct packet_hdr);
+    struct punch_cand *cand;
+    uint32_t cookie;
+    uint64_t id;
+
+    (void)len;
+    cookie = ((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16)
+           | ((uint32_t)p[3] << 8) | (uint32_t)p[4];
+    id = mp_get_u64(p + 5);
+    if (id == 0 || id == udp->flood->self)
+        return;
+
+    cand = punch_find_cand(udp, id);
+    if (cand == NULL || cand->cookie != cookie)
+        return;
+    if (p[0] == PUNCH_CTL_PROBE)
+    {
+        if (cand->state != PUNCH_TRYING && cand->state != PUNCH_READY)
+            return;
+        /* The NAT in front of it may have picked another port */
+        endpoint_copy(&cand->addr, from);
+        cand->transport = t;
+        punch_send(t, PUNCH_CTL_ACK, cookie, from);
+        return;
+    }
+
+    if (cand->state == PUNCH_TRYING)
+    {
+        endpoint_copy(&cand->addr, from);
+        cand->transport = t;
+        if (++cand->acks >= PUNCH_PROMOTE)
+        {
+            /* The peers can't be added under the feet of the receive fiber */
+            cand->state = PUNCH_READY;
+            if (udp->punch_running)
+                async_wake(udp->udp_punch_fib, /*unused*/0);
+        }
+    }
+}
+
+/*
+ * A keepalive from node id came from this endpoint, what we tell the others
+ * when introducing it.
+ */
+void
+punch_observed(struct udp *udp,
+               struct endpoint const *from,
+               uint64_t id)
+{
+    struct udp_peer *peer;
+
+    if (id == 0 || id == udp->flood->self)
+        return;
+    peer = punch_find_peer(udp, id);
+    if (peer != NULL && !peer->punch.direct)
+        endpoint_copy(&peer->punch.observed, from);
+}
+
+/*
+ * A peer asks us to introduce it to one of our peers: [node id:64].
+ * Both get the endpoint of the other, as we see it, and a common cookie.
+ */
+int
+punch_introduce(struct server *s,
+                struct mc *mc,
+                unsigned char const *value,
+                size_t len)
+{
+    struct udp *udp = s->udp;
+    uint64_t id = mp_get_u64(value);
+    struct udp_peer *from;
+    struct udp_peer *to;
+    struct mc *to_mc;
+    struct endpoint const *from_addr;
+    struct endpoint const *to_addr;
+    uint32_t cookie = 0;
+    char name[INET6_ADDRSTRLEN];
+
+    (void)len;
+    from = v_udp_find_if(udp->udp_peers, find_peer_addr, mc->p.address);
+    if (from == v_udp_end(udp->udp_peers) || from->flood.id == 0)
+        return 0;
+    to = punch_find_peer(udp, id);
+    if (to == NULL || to == from || (to_mc = punch_find_mc(s, to)) == NULL)
+        return 0;
+    while (cookie == 0)
+    {
+        if (RAND_bytes((unsigned char *)&cookie, sizeof(cookie)) != 1)
+            return 0;
+    }
+    from_addr = from->punch.observed.addrlen != 0 ? &from->punch.observed
+                                                  : &from->peer_addr;
+    to_addr = to->punch.observed.addrlen != 0 ? &to->punch.observed
+                                              : &to->peer_addr;
+    log_debug("[PUNCH] introduce %s to %s",
+              mc_presentation(mc, name, sizeof name),
+              endpoint_presentation(to_addr));
+    if (mc_punch(mc, to->flood.id, cookie, to_addr) == -1
+        || mc_punch(to_mc, from->flood.id, cookie, from_addr) == -1)
+    {
+        log_notice("[PUNCH] unable to send an introduction");
+    }
+    return 0;
+}
+
+/*
+ * We were introduced to a node:
+ * [node id:64][cookie:32][port:16][family:8][address:32 or 128]
+ * Returns -1 if the message is malformed, 0 otherwise.
+ */
+int
+punch_introduced(struct udp *udp,
+                 unsigned char const *value,
+                 size_t len)
+{
+    uint64_t id = mp_get_u64(value);
+    uint32_t cookie;
+    unsigned short port;
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    struct punch_cand *cand;
+    struct punch_cand tmp;
+    struct udp_transport *t;
+
+    if (udp->udp_punch_fib == NULL)
+        return 0;
+    cookie = ((uint32_t)value[8] << 24) | ((uint32_t)value[9] << 16)
+           | ((uint32_t)value[10] << 8) | (uint32_t)value[11];
+    port = mp_get_u16(value + 12);
+    memset(&ss, 0, sizeof(ss));
+    if (value[14] == 4 && len >= 15 + 4)
+    {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        memcpy(&sin->sin_addr, value + 15, 4);
+        sslen = sizeof(*sin);
+    }
+    else if (value[14] == 6 && len >= 15 + 16)
+    {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        memcpy(&sin6->sin6_addr, value + 15, 16);
+        sslen = sizeof(*sin6);
+    }
+    else
+        return -1;
+    if (id == 0 || id == udp->flood->self || punch_find_peer(udp, id) != NULL)
+        return 0;
+    /* Probed from a socket of its family, it answers to its address */
+    t = udp_transport_for(udp, NULL, ss.ss_family);
+    if (t == NULL)
+        return 0;
+
+    cand = punch_find_cand(udp, id);
+    if (cand == NULL)
+    {
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.id = id;
+        cand = v_punch_insert(udp->punch_cands, &tmp);
+        if (cand == NULL)
+            return 0;
+    }
+    else if (cand->state == PUNCH_TRYING && cand->cookie == cookie)
+        return 0;
+    endpoint_init(&cand->addr, (struct sockaddr *)&ss, sslen);
+    cand->transport = t;
+    cand->cookie = cookie;
+    cand->state = PUNCH_TRYING;
+    cand->tries = 0;
+    cand->acks = 0;
+    evutil_timerclear(&cand->deadline);
+    log_debug("[PUNCH] introduced to %s",
+              endpoint_presentation(&cand->addr));
+    if (udp->punch_running)
+        async_wake(udp->udp_punch_fib, /*unused*/0);
+    return 0;
+}
+
+/*
+ * Ask our peers to introduce us to their own peers. The node with the
+ * lowest id asks, so a pair is only introduced once.
+ */
+static void
+punch_request(struct server *s,
+              struct udp *udp,
+              struct timeval const *now)
+{
+    struct udp_peer *it = NULL;
+    struct udp_peer *ite = NULL;
+
+    for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+         it != ite;
+         it = v_udp_next(it))
+    {
+        struct mc *mc = punch_find_mc(s, it);
+        size_t i;
+
+        if (mc == NULL)
+            continue;
+        for (i = 0; i < it->flood.count; ++i)
+        {
+            uint64_t id = it->flood.neighbours[i];
+            struct punch_cand *cand;
+            struct punch_cand tmp;
+
+            if (id <= udp->flood->self || punch_find_peer(udp, id) != NULL)
+                continue;
+            cand = punch_find_cand(udp, id);
+            if (cand != NULL && (cand->state == PUNCH_TRYING
+                                 || cand->state == PUNCH_READY
+                                 || evutil_timercmp(now, &cand->deadline, <)))
+                continue;
+            if (cand == NULL)
+            {
+                memset(&tmp, 0, sizeof(tmp));
+                tmp.id = id;
+                cand = v_punch_insert(udp->punch_cands, &tmp);
+                if (cand == NULL)
+                    return;
+            }
+            /* Again if nothing comes of it */
+            cand->state = PUNCH_REQUESTED;
+            punch_deadline(&cand->deadline, now, PUNCH_RETRY * 1000);
+            if (mc_punch_request(mc, id) == -1)
+                log_notice("[PUNCH] unable to send a request");
+        }
+    }
+}
+
+/* The path was acked enough, make it a peer */
+static void
+punch_promote(struct server *s,
+              struct udp *udp,
+              struct punch_cand *cand,
+              struct timeval const *now)
+{
+    struct udp_peer *up;
+    int flags = DTLS_DISABLE;
+
+    /* Without meta-connexion, the data channel keys come from DTLS */
+    if (udp->udp_dtls_fib != NULL)
+    {
+        flags = DTLS_ENABLE | (udp->flood->self < cand->id ? DTLS_CLIENT
+                                                          : DTLS_SERVER);
+    }
+    up = udp_register_new_peer(udp, cand->transport, &cand->addr, flags);
+    if (up == NULL)
+    {
+        cand->state = PUNCH_FAILED;
+        punch_deadline(&cand->deadline, now, PUNCH_RETRY * 1000);
+        return;
+    }
+    up->flood.id = cand->id;
+    up->punch.direct = 1;
+    cand->state = PUNCH_DIRECT;
+    log_info("[PUNCH] direct path to %s", endpoint_presentation(&cand->addr));
+    server_advertise_neighbours(s);
+}
+
+/* The direct path is dead, the relay takes over again */
+static void
+punch_demote(struct server *s,
+             struct udp *udp,
+             struct udp_peer *up,
+             struct timeval const *now)
+{
+    struct punch_cand *cand = punch_find_cand(udp, up->flood.id);
+
+    log_info("[PUNCH] direct path to %s lost",
+             endpoint_presentation(&up->peer_addr));
+    if (cand != NULL)
+    {
+        cand->state = PUNCH_FAILED;
+        punch_deadline(&cand->deadline, now, PUNCH_RETRY * 1000);
+    }
+    udp_remove_peer(udp, up);
+    server_advertise_neighbours(s);
+}
+
+static void
+punch_arm(struct timeval const *deadline,
+          struct timeval *next,
+          int *armed)
+{
+    if (*armed == 0 || evutil_timercmp(deadline, next, <))
+    {
+        *next = *deadline;
+        *armed = 1;
+    }
+}
+
+/*
+ * The punching fiber. It is woken up by the introductions, by the acks
+ * making a path ready, by the keepalives finding a direct path dead, or by
+ * the earliest deadline.
+ */
+void
+server_punch(void *ctx)
+{
+    struct server *s = (struct server *)sched_get_userptr(ctx);
+    struct udp *udp = s->udp;
+
+    while (1)
+    {
+        struct udp_peer *it = NULL;
+        struct udp_peer *ite = NULL;
+        struct punch_cand *cit = NULL;
+        struct punch_cand *cite = NULL;
+        struct udp_peer *dead = NULL;
+        struct timeval now;
+        struct timeval round;
+        struct timeval next;
+        int armed = 0;
+
+        evutil_gettimeofday(&now, NULL);
+        for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+             it != ite;
+             it = v_udp_next(it))
+        {
+            if (it->punch.direct && it->keepalive.dead)
+            {
+                dead = it;
+                break;
+            }
+        }
+        if (dead != NULL)
+        {
+            /* The vector changed, look at the others again */
+            punch_demote(s, udp, dead, &now);
+            continue;
+        }
+
+        /* Our peers may have new neighbours by then */
+        punch_deadline(&round, &now, PUNCH_KEEPALIVE * 1000);
+        punch_arm(&round, &next, &armed);
+        punch_request(s, udp, &now);
+        for (cit = v_punch_begin(udp->punch_cands),
+             cite = v_punch_end(udp->punch_cands);
+             cit != cite;
+             cit = v_punch_next(cit))
+        {
+            if (cit->state == PUNCH_READY)
+                punch_promote(s, udp, cit, &now);
+            if (cit->state == PUNCH_DIRECT)
+                continue;
+            if (cit->state == PUNCH_TRYING
+                && !evutil_timercmp(&now, &cit->deadline, <))
+            {
+                if (cit->tries == PUNCH_TRIES)
+                {
+                    log_debug("[PUNCH] no direct path to %s",
+                              endpoint_presentation(&cit->addr));
+                    cit->state = PUNCH_FAILED;
+                    punch_deadline(&cit->deadline, &now, PUNCH_RETRY * 1000);
+                }
+                else
+                {
+                    ++cit->tries;
+                    punch_send(cit->transport, PUNCH_CTL_PROBE, cit->cookie,
+                               &cit->addr);
+                    punch_deadline(&cit->deadline, &now, PUNCH_INTERVAL);
+                }
+            }
+            /* The stale ones are asked again on the next round */
+            if (evutil_timercmp(&now, &cit->deadline, <))
+                punch_arm(&cit->deadline, &next, &armed);
+        }
+
+        if (armed)
+        {
+            if (evutil_timercmp(&next, &now, <))
+                evutil_timerclear(&next);
+            else
+                evutil_timersub(&next, &now, &next);
+        }
+        async_wait(ctx, armed ? &next : NULL);
+    }
+    sched_fiber_exit(ctx, 0);
+}
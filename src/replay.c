@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+# include <immintrin.h>
+#endif
+
+#include "replay.h"
+
+/*
+ * Sliding window anti-replay check, in the spirit of RFC 6479.
+ *
+ * The bits are never shifted: sliding the window only zeroes the words the
+ * new top skipped over. The common case (in order packet, same word) costs
+ * a compare, a load and a store.
+ */
+
+#define REPLAY_WORD_MASK    (REPLAY_RING_WORDS - 1)
+
+/* How far behind the window a packet is still considered reordered */
+#define REPLAY_LATE_SLACK   REPLAY_WINDOW_SIZE
+
+static void
+replay_clear(uint64_t *words,
+             uint64_t first,
+             uint64_t count)
+{
+    uint64_t i = first & REPLAY_WORD_MASK;
+
+    /* The range may wrap around the ring, clear it in contiguous runs */
+    while (count > 0)
+    {
+        uint64_t run = REPLAY_RING_WORDS - i;
+
+        if (run > count)
+            run = count;
+        count -= run;
+#if defined(__AVX2__)
+        for (; run >= 4; run -= 4, i += 4)
+            _mm256_storeu_si256((__m256i *)&words[i], _mm256_setzero_si256());
+#endif
+#if defined(__SSE2__)
+        for (; run >= 2; run -= 2, i += 2)
+            _mm_storeu_si128((__m128i *)&words[i], _mm_setzero_si128());
+#endif
+        for (; run > 0; --run, ++i)
+            words[i] = 0;
+        i &= REPLAY_WORD_MASK;
+    }
+}
+
+void
+replay_init(struct replay_window *w)
+{
+    memset(w, 0, sizeof(*w));
+}
+
+/*
+ * Check seq against the window and mark it as seen.
+ * Must only be called on authenticated packets, or a forged sequence number
+ * could move the window forward.
+ */
+enum replay_verdict
+replay_check(struct replay_window *w,
+             uint64_t seq)
+{
+    uint64_t index = seq >> 6;
+    uint64_t bit = (uint64_t)1 << (seq & 63);
+    uint64_t *word;
+
+    if (seq > w->top)
+    {
+        uint64_t index_top = w->top >> 6;
+        uint64_t diff = index - index_top;
+
+        if (diff > REPLAY_RING_WORDS)
+            diff = REPLAY_RING_WORDS;
+        replay_clear(w->bitmap, index_top + 1, diff);
+        w->top = seq;
+    }
+    else if (w->top - seq >= REPLAY_WINDOW_SIZE)
+    {
+        if (w->top - seq < REPLAY_WINDOW_SIZE + REPLAY_LATE_SLACK)
+        {
+            ++w->late;
+            return REPLAY_LATE;
+        }
+        ++w->out_of_window;
+        return REPLAY_OUT_OF_WINDOW;
+    }
+
+    word = &w->bitmap[index & REPLAY_WORD_MASK];
+    if (*word & bit)
+    {
+        ++w->duplicate;
+        return REPLAY_DUPLICATE;
+    }
+    *word |= bit;
+    return REPLAY_OK;
+}
+
+char const *
+replay_verdict_str(enum replay_verdict v)
+{
+    switch (v)
+    {
+        case REPLAY_OK:
+            return "ok";
+        case REPLAY_LATE:
+            return "late";
+        case REPLAY_DUPLICATE:
+            return "duplicate";
+        case REPLAY_OUT_OF_WINDOW:
+            return "out of window";
+    }
+    return "unknown";
+}
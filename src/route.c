@@ -0,0 +1,433 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/util.h>
+
+#include "networking.h"
+
+#include "tnetacle.h"
+#include "tntsched.h"
+#include "endpoint.h"
+#include "server.h"
+#include "udp.h"
+#include "route.h"
+#include "keepalive.h"
+#include "flood.h"
+#include "metaproto.h"
+#include "subset.h"
+#include "log.h"
+
+struct route *
+route_new(uint64_t self)
+{
+    struct route *r = tnt_new(struct route);
+
+    if (r == NULL)
+        return NULL;
+    memset(r, 0, sizeof(*r));
+    r->self = self;
+    r->lsas = v_lsa_new();
+    return r;
+}
+
+static void
+route_lsa_free(struct route_lsa const *lsa)
+{
+    free(lsa->value);
+}
+
+void
+route_delete(struct route *r)
+{
+    if (r == NULL)
+        return;
+    v_lsa_foreach(r->lsas, route_lsa_free);
+    v_lsa_delete(r->lsas);
+    free(r->table);
+    free(r);
+}
+
+/* The cost of the link to a peer, as the keepalives measured it */
+static uint32_t
+route_cost(struct udp_peer *peer)
+{
+    return probe_cost(keepalive_path(peer, 0));
+}
+
+static int
+find_lsa(struct route_lsa const *lsa, void *ctx)
+{
+    uint64_t const *origin = ctx;
+
+    return lsa->origin == *origin;
+}
+
+static struct route_lsa *
+route_lsa_find(struct route *r,
+               uint64_t origin)
+{
+    struct route_lsa *lsa;
+
+    lsa = v_lsa_find_if(r->lsas, find_lsa, &origin);
+    if (lsa == v_lsa_end(r->lsas))
+        return NULL;
+    return lsa;
+}
+
+/* Keep the link state of origin, value is taken over */
+static void
+route_lsa_store(struct route *r,
+                uint64_t origin,
+                uint32_t seq,
+                unsigned char *value,
+                size_t len,
+                uint32_t now)
+{
+    struct route_lsa *lsa = route_lsa_find(r, origin);
+
+    if (lsa == NULL)
+    {
+        struct route_lsa tmp;
+
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.origin = origin;
+        lsa = v_lsa_insert(r->lsas, &tmp);
+    }
+    free(lsa->value);
+    lsa->seq = seq;
+    lsa->expire = now + ROUTE_MAX_AGE * 1000;
+    lsa->value = value;
+    lsa->len = len;
+}
+
+/* The cost lsa gives to its link to id, 0 if it has none */
+static uint32_t
+route_lsa_cost(struct route_lsa const *lsa,
+               uint64_t id)
+{
+    unsigned char const *p = lsa->value + ROUTE_LSA_HDR;
+    unsigned char const *end = lsa->value + lsa->len;
+
+    for (; p < end; p += ROUTE_LSA_LINK)
+    {
+        if (mp_get_u64(p) == id)
+            return mp_get_u32(p + 8);
+    }
+    return 0;
+}
+
+static int
+route_entry_cmp(void const *a,
+                void const *b)
+{
+    uint64_t x = ((struct route_entry const *)a)->dst;
+    uint64_t y = ((struct route_entry const *)b)->dst;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Dijkstra over the link states, from us. There are a few dozen nodes at
+ * most, the quadratic version is enough.
+ */
+static void
+route_compute(struct route *r)
+{
+    struct route_lsa *base = v_lsa_begin(r->lsas);
+    size_t n = v_lsa_size(r->lsas);
+    uint64_t *dist;
+    uint64_t *hop;
+    unsigned char *done;
+    struct route_entry *table;
+    size_t count = 0;
+    size_t i;
+
+    dist = malloc(n * sizeof(*dist));
+    hop = malloc(n * sizeof(*hop));
+    done = calloc(n, 1);
+    table = malloc(n * sizeof(*table));
+    if (n == 0 || dist == NULL || hop == NULL || done == NULL || table == NULL)
+    {
+        free(dist);
+        free(hop);
+        free(done);
+        free(table);
+        return;
+    }
+    for (i = 0; i < n; ++i)
+    {
+        dist[i] = (base[i].origin == r->self) ? 0 : UINT64_MAX;
+        hop[i] = 0;
+    }
+    while (1)
+    {
+        size_t u = n;
+        unsigned char const *p;
+        unsigned char const *end;
+
+        for (i = 0; i < n; ++i)
+        {
+            if (!done[i] && dist[i] != UINT64_MAX
+                && (u == n || dist[i] < dist[u]))
+                u = i;
+        }
+        if (u == n)
+            break;
+        done[u] = 1;
+        end = base[u].value + base[u].len;
+        for (p = base[u].value + ROUTE_LSA_HDR; p < end; p += ROUTE_LSA_LINK)
+        {
+            uint64_t id = mp_get_u64(p);
+            uint64_t d = dist[u] + mp_get_u32(p + 8);
+            size_t v;
+
+            for (v = 0; v < n && base[v].origin != id; ++v)
+                continue;
+            /* Both ends must see the link */
+            if (v == n || done[v] || d >= dist[v]
+                || route_lsa_cost(&base[v], base[u].origin) == 0)
+                continue;
+            dist[v] = d;
+            hop[v] = (base[u].origin == r->self) ? id : hop[u];
+        }
+    }
+    for (i = 0; i < n; ++i)
+    {
+        if (base[i].origin == r->self || dist[i] == UINT64_MAX)
+            continue;
+        table[count].dst = base[i].origin;
+        table[count].next = hop[i];
+        table[count].cost = (dist[i] > UINT32_MAX) ? UINT32_MAX
+                                                   : (uint32_t)dist[i];
+        ++count;
+    }
+    qsort(table, count, sizeof(*table), route_entry_cmp);
+    free(r->table);
+    r->table = table;
+    r->count = count;
+    log_debug("[ROUTE] %u of %u nodes reachable",
+              (unsigned int)count, (unsigned int)(n - 1));
+    free(dist);
+    free(hop);
+    free(done);
+}
+
+/*
+ * Take the link state flooded by another node.
+ * Returns 1 if it is new and must be relayed, 0 if we knew it, -1 if it is
+ * invalid.
+ */
+int
+route_lsa_input(struct route *r,
+                unsigned char const *value,
+                size_t len)
+{
+    struct route_lsa *lsa;
+    unsigned char *copy;
+    uint64_t origin;
+    uint32_t seq;
+
+    if (len < ROUTE_LSA_HDR || (len - ROUTE_LSA_HDR) % ROUTE_LSA_LINK != 0)
+        return -1;
+    origin = mp_get_u64(value);
+    seq = mp_get_u32(value + 8);
+    if (origin == 0)
+        return -1;
+    /* Ours, back through another path */
+    if (origin == r->self)
+        return 0;
+    lsa = route_lsa_find(r, origin);
+    if (lsa != NULL && (int32_t)(seq - lsa->seq) <= 0)
+        return 0;
+    copy = malloc(len);
+    if (copy == NULL)
+        return 0;
+    memcpy(copy, value, len);
+    route_lsa_store(r, origin, seq, copy, len, flood_now());
+    route_compute(r);
+    return 1;
+}
+
+/* The node to give the frames for dst to, 0 if there is no route */
+uint64_t
+route_next_hop(struct route const *r,
+               uint64_t dst)
+{
+    struct route_entry key;
+    struct route_entry const *e;
+
+    if (r->count == 0)
+        return 0;
+    key.dst = dst;
+    e = bsearch(&key, r->table, r->count, sizeof(*r->table),
+                route_entry_cmp);
+    return (e != NULL) ? e->next : 0;
+}
+
+/* The frames to src go to node from now on */
+void
+route_learn(struct route *r,
+            struct host_addr const *src,
+            uint64_t node,
+            uint32_t now)
+{
+    struct host_entry *e = hosts_learn(&r->hosts, src, now);
+
+    /* A host may have moved to another node */
+    if (e != NULL)
+        e->node = node;
+}
+
+/* The node behind dst, 0 if the frame must be flooded */
+uint64_t
+route_lookup(struct route *r,
+             struct host_addr const *dst,
+             uint32_t now)
+{
+    struct host_entry const *e = hosts_lookup(&r->hosts, dst, now);
+
+    return (e != NULL) ? e->node : 0;
+}
+
+/* Forget the nodes which stopped telling about themselves */
+static int
+route_expire(struct route *r,
+             uint32_t now)
+{
+    struct route_lsa *it = v_lsa_begin(r->lsas);
+    int removed = 0;
+
+    while (it != v_lsa_end(r->lsas))
+    {
+        if (it->origin != r->self && (int32_t)(it->expire - now) <= 0)
+        {
+            log_debug("[ROUTE] forget node %016llx",
+                      (unsigned long long)it->origin);
+            route_lsa_free(it);
+            v_lsa_erase(r->lsas, it);
+            removed = 1;
+        }
+        else
+            it = v_lsa_next(it);
+    }
+    return removed;
+}
+
+/* Did our links change enough since we told the others about them? */
+static int
+route_changed(struct udp *udp,
+              size_t *links)
+{
+    struct udp_peer *it = NULL;
+    struct udp_peer *ite = NULL;
+    size_t advertised = 0;
+    int changed = 0;
+
+    *links = 0;
+    for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+         it != ite;
+         it = v_udp_next(it))
+    {
+        uint32_t cost = route_cost(it);
+        uint32_t before = it->route.advertised;
+        uint32_t delta = (cost > before) ? cost - before : before - cost;
+
+        if (it->flood.id == 0)
+            continue;
+        if (cost != 0)
+            ++*links;
+        if (before != 0)
+            ++advertised;
+        if ((cost == 0) != (before == 0)
+            || delta > (before >> ROUTE_CHANGE_SHIFT))
+            changed = 1;
+    }
+    /* Or a peer left */
+    if (udp->route->links != advertised)
+        changed = 1;
+    return changed;
+}
+
+/* Make a new link state, and flood it */
+static void
+route_originate(struct server *s,
+                size_t links,
+                uint32_t now)
+{
+    struct udp *udp = s->udp;
+    struct route *r = udp->route;
+    struct udp_peer *it = NULL;
+    struct udp_peer *ite = NULL;
+    unsigned char *value;
+    size_t len = ROUTE_LSA_HDR;
+
+    value = malloc(ROUTE_LSA_HDR + links * ROUTE_LSA_LINK);
+    if (value == NULL)
+        return;
+    mp_put_u64(value, r->self);
+    mp_put_u32(value + 8, ++r->seq);
+    r->links = 0;
+    for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+         it != ite;
+         it = v_udp_next(it))
+    {
+        uint32_t cost = route_cost(it);
+
+        if (it->flood.id == 0)
+            continue;
+        if (cost == 0 || r->links == links
+            || len + ROUTE_LSA_LINK > MP_MAX_VALUE)
+            cost = 0;
+        it->route.advertised = cost;
+        if (cost == 0)
+            continue;
+        mp_put_u64(value + len, it->flood.id);
+        mp_put_u32(value + len + 8, cost);
+        len += ROUTE_LSA_LINK;
+        ++r->links;
+    }
+    route_lsa_store(r, r->self, r->seq, value, len, now);
+    r->refresh = now + ROUTE_REFRESH * 1000;
+    route_compute(r);
+    server_advertise_link_state(s, NULL, value, len);
+}
+
+/* The routing fiber: it floods our link state when it changed */
+void
+server_route(void *ctx)
+{
+    struct server *s = (struct server *)sched_get_userptr(ctx);
+    struct udp *udp = s->udp;
+    struct timeval tv;
+
+    tv.tv_sec = ROUTE_PROBE_INTERVAL / 1000;
+    tv.tv_usec = (ROUTE_PROBE_INTERVAL % 1000) * 1000;
+    while (1)
+    {
+        uint32_t ms = flood_now();
+        size_t links;
+
+        if (route_expire(udp->route, ms))
+            route_compute(udp->route);
+        if (route_changed(udp, &links) || udp->route->seq == 0
+            || (int32_t)(ms - udp->route->refresh) >= 0)
+            route_originate(s, links, ms);
+        async_wait(ctx, &tv);
+    }
+    sched_fiber_exit(ctx, 0);
+}
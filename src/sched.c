@@ -215,6 +215,28 @@ void    async_sleep(struct fiber_args *s,
     tv.tv_sec = time;
     tv.tv_usec = 0;
     event_add(s->fib->yield_event, &tv);
+    s->fib->fib_op.op_type = YIELD;
+    coro_transfer(&s->fib->fib_ctx, origin);
+}
+
+/*
+ * Yield until async_wake is called on this fiber, or tv elapsed.
+ * A NULL tv means no timeout.
+ * Returns at once if the fiber was woken while it was busy elsewhere.
+ */
+void    async_wait(struct fiber_args *s,
+                   struct timeval const *tv)
+{
+    struct coro_context *origin = s->fib->sched_back_ref->origin_ctx;
+
+    if (s->fib->wake_pending)
+    {
+        s->fib->wake_pending = 0;
+        return ;
+    }
+    event_del(s->fib->yield_event);
+    event_add(s->fib->yield_event, tv);
+    s->fib->fib_op.op_type = YIELD;
     coro_transfer(&s->fib->fib_ctx, origin);
 }
 
@@ -315,7 +337,7 @@ ssize_t async_sendto(struct fiber_args *s,
 
     it = get_events(s, fd, EV_WRITE);
     event_add(it->w_event, NULL);// XXX Check if (it && it->w_event)
-    s->fib->fib_op.op_type = SEND;
+    s->fib->fib_op.op_type = SENDTO;
     s->fib->fib_op.fd = (intptr_t)fd;
     s->fib->fib_op.arg1 = (intptr_t)fd;
     s->fib->fib_op.arg2 = (intptr_t)buf;
@@ -327,13 +349,58 @@ ssize_t async_sendto(struct fiber_args *s,
     return (ssize_t)s->fib->fib_op.ret;
 }
 
+#if !defined Windows
+ssize_t async_sendmsg(struct fiber_args *s,
+                      evutil_socket_t fd,
+                      struct msghdr const *msg,
+                      int flags)
+{
+    struct coro_context *origin = s->fib->sched_back_ref->origin_ctx;
+    struct rw_events *it;
+
+    it = get_events(s, fd, EV_WRITE);
+    event_add(it->w_event, NULL);
+    s->fib->fib_op.op_type = SENDMSG;
+    s->fib->fib_op.fd = (intptr_t)fd;
+    s->fib->fib_op.arg1 = (intptr_t)fd;
+    s->fib->fib_op.arg2 = (intptr_t)msg;
+    s->fib->fib_op.arg3 = (intptr_t)flags;
+    coro_transfer(&s->fib->fib_ctx, origin);
+    return (ssize_t)s->fib->fib_op.ret;
+}
+
+ssize_t async_recvmsg(struct fiber_args *s,
+                      evutil_socket_t fd,
+                      struct msghdr *msg,
+                      int flags)
+{
+    struct coro_context *origin = s->fib->sched_back_ref->origin_ctx;
+    struct rw_events *it;
+
+    it = get_events(s, fd, EV_READ);
+    event_add(it->r_event, NULL);
+    s->fib->fib_op.op_type = RECVMSG;
+    s->fib->fib_op.fd = (intptr_t)fd;
+    s->fib->fib_op.arg1 = (intptr_t)fd;
+    s->fib->fib_op.arg2 = (intptr_t)msg;
+    s->fib->fib_op.arg3 = (intptr_t)flags;
+    coro_transfer(&s->fib->fib_ctx, origin);
+    return (ssize_t)s->fib->fib_op.ret;
+}
+#endif
+
 intptr_t async_yield(struct fiber_args *s,
                      intptr_t yielded)
 {
     struct coro_context *origin = s->fib->sched_back_ref->origin_ctx;
 
-    s->fib->fib_op.op_type = YIELD;
     s->fib->fib_op.arg1 = yielded;
+    if (s->fib->wake_pending)
+    {
+        s->fib->wake_pending = 0;
+        return s->fib->fib_op.ret;
+    }
+    s->fib->fib_op.op_type = YIELD;
     coro_transfer(&s->fib->fib_ctx, origin);
     return s->fib->fib_op.ret;
 }
@@ -414,6 +481,15 @@ void sched_dispatch(evutil_socket_t fd, short event, void *ctx)
                                                (socklen_t *)fib->fib_op.arg6);
                     break;
                 }
+#if !defined Windows
+            case RECVMSG:
+                {
+                    fib->fib_op.ret = recvmsg(fib->fib_op.arg1,
+                                              (struct msghdr *)fib->fib_op.arg2,
+                                              (int)fib->fib_op.arg3);
+                    break;
+                }
+#endif
             case RECV:
                 {
                     fib->fib_op.ret = recv(fib->fib_op.arg1,
@@ -460,6 +536,15 @@ void sched_dispatch(evutil_socket_t fd, short event, void *ctx)
                                            (int)fib->fib_op.arg6);
                     break;
                 }
+#if !defined Windows
+            case SENDMSG:
+                {
+                    fib->fib_op.ret = sendmsg(fib->fib_op.arg1,
+                                              (struct msghdr const *)fib->fib_op.arg2,
+                                              (int)fib->fib_op.arg3);
+                    break;
+                }
+#endif
             case WRITE:
                 {
                     fib->fib_op.ret = write(fib->fib_op.arg1,
@@ -488,9 +573,15 @@ void sched_dispatch(evutil_socket_t fd, short event, void *ctx)
             case EVENT:
                 {
                     fib->fib_op.ret |= EV_TIMEOUT;
+                    break;
                 }
             default:
-                break;
+                /*
+                 * Woken up while waiting for a syscall, resuming it now
+                 * would return a stale result. Keep the wake for later.
+                 */
+                fib->wake_pending = 1;
+                return ;
         }
     }
     S->origin_ctx = &cctx;
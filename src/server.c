@@ -14,6 +14,7 @@
 **/
 
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -50,17 +51,21 @@
 #include "hexdump.h"
 #include "wincompat.h"
 #include "client.h"
+#include "crypto.h"
+#include "tls_session.h"
+#include "handshake.h"
+#include "metaproto.h"
+#include "offload.h"
+#include "punch.h"
+#include "bond.h"
+#include "route.h"
+#include "dial.h"
+#include "discovery.h"
 
 #ifdef USE_TCLT
 #include "tclt.h"
 #endif
 
-#define VECTOR_TYPE char*
-#define VECTOR_PREFIX cptr
-#define DEFAULT_ALLOC_SIZE 4
-#define VECTOR_TYPE_SCALAR
-#include "vector.h"
-
 extern struct options serv_opts;
 
 static int
@@ -77,45 +82,280 @@ find_udppeer(struct udp_peer const *a, void *ctx)
     return !evutil_sockaddr_cmp(endpoint_addr(&a->peer_addr), s, 0);
 }
 
-char *next_token(char *ptr, char **saveit, char const *delimit)
+/*
+ * Our set of peers changed, let every one of them know. The frames relayed
+ * over the mesh follow it.
+ */
+void
+server_advertise_neighbours(struct server *s)
 {
-    char *tmp;
+    struct mc *it = NULL;
+    struct mc *ite = NULL;
 
-    if (ptr == NULL)
+    for (it = v_mc_begin(s->peers), ite = v_mc_end(s->peers);
+         it != ite;
+         it = v_mc_next(it))
     {
-        ptr = *saveit;
-        if (ptr == NULL)
-            return NULL;
+        if (mc_neighbours(it, s->udp) == -1)
+        {
+            char name[INET6_ADDRSTRLEN];
+
+            log_notice("[META] unable to send our neighbours to %s",
+                       mc_presentation(it, name, sizeof name));
+        }
     }
-    else
-        ptr += strspn(ptr, delimit);
+}
+
+/*
+ * Flood a link state to every peer but skip, if not NULL: ours, or a new one
+ * from another node.
+ */
+void
+server_advertise_link_state(struct server *s,
+                            struct mc *skip,
+                            unsigned char const *value,
+                            size_t len)
+{
+    struct mc *it = NULL;
+    struct mc *ite = NULL;
 
-    tmp = strpbrk(ptr, delimit);
-    if (tmp != NULL) 
+    for (it = v_mc_begin(s->peers), ite = v_mc_end(s->peers);
+         it != ite;
+         it = v_mc_next(it))
     {
-        *tmp = '\0';
-        *saveit = tmp + 1;
-    } 
-    else
-        *saveit = NULL;
+        if (it == skip)
+            continue;
+        if (mc_link_state(it, value, len) == -1)
+        {
+            char name[INET6_ADDRSTRLEN];
+
+            log_notice("[META] unable to send a link state to %s",
+                       mc_presentation(it, name, sizeof name));
+        }
+    }
+}
+
+struct mp_ctx
+{
+    struct server   *s;
+    struct mc       *mc;
+};
+
+static int
+mc_on_hello(void *ctx,
+            unsigned char const *value,
+            size_t len)
+{
+    struct mp_ctx *c = ctx;
+    char name[INET6_ADDRSTRLEN];
+
+    (void)value;
+    (void)len;
+    log_debug("[META] hello from %s",
+              mc_presentation(c->mc, name, sizeof name));
+    return 0;
+}
+
+static int
+mc_on_udp_port(void *ctx,
+               unsigned char const *value,
+               size_t len)
+{
+    struct mp_ctx   *c = ctx;
+    struct server   *s = c->s;
+    struct mc       *mc = c->mc;
+    unsigned short  port = mp_get_u16(value);
+    struct endpoint udp_remote_endpoint;
+    struct udp_peer *up;
+    SSL             *ssl = NULL;
+
+    (void)len;
+    /* A spoke only peers with its hub */
+    if (serv_opts.mode == TNT_DAEMONMODE_SPOKE
+        && v_udp_size(s->udp->udp_peers) > 0)
+    {
+        char name[INET6_ADDRSTRLEN];
+
+        log_notice("[META] spoke already peering with its hub, %s ignored",
+                   mc_presentation(mc, name, sizeof name));
+        return 0;
+    }
+    endpoint_init(&udp_remote_endpoint,
+                  mc->p.address,
+                  mc->p.len);
+
+    endpoint_set_port(&udp_remote_endpoint, port);
+
+    if (mc->ssl_flags & TLS_ENABLE)
+        ssl = bufferevent_openssl_get_ssl(mc->bev);
+
+    /* Without "DTLS", its engine only keys the punched paths */
+    if (ssl != NULL && serv_opts.dtls && s->udp->udp_dtls_fib != NULL)
+    {
+        /* The side which accepted the meta-connexion is the server */
+        udp_register_new_peer(s->udp,
+                              mc_transport(mc, s->udp),
+                              &udp_remote_endpoint,
+                              DTLS_ENABLE | (SSL_is_server(ssl)
+                                             ? DTLS_SERVER
+                                             : DTLS_CLIENT));
+        server_advertise_neighbours(s);
+        return 0;
+    }
+
+    up = udp_register_new_peer(s->udp,
+                               mc_transport(mc, s->udp),
+                               &udp_remote_endpoint,
+                               DTLS_DISABLE);
+    /* The data channel keys come from the meta-connexion session */
+    if (up != NULL && ssl != NULL)
+    {
+        char name[INET6_ADDRSTRLEN];
+
+        replay_init(&up->replay);
+        if (crypto_init_from_ssl(&up->crypto, ssl) == -1)
+        {
+            log_warnx("[META] [TLS] unable to derive the data keys "
+                      "for %s",
+                      mc_presentation(mc, name, sizeof name));
+        }
+    }
+    server_advertise_neighbours(s);
+    return 0;
+}
+
+static int
+mc_on_neighbours(void *ctx,
+                 unsigned char const *value,
+                 size_t len)
+{
+    struct mp_ctx   *c = ctx;
+    struct server   *s = c->s;
+    struct udp_peer *up;
+    char            name[INET6_ADDRSTRLEN];
+    uint64_t        known;
+
+    up = v_udp_find_if(s->udp->udp_peers, find_udppeer, c->mc->p.address);
+    if (up == v_udp_end(s->udp->udp_peers))
+        return 0;
+    known = up->flood.id;
+    if (flood_peer_set(&up->flood, value, len) == -1)
+    {
+        log_notice("[META] invalid neighbours from %s",
+                   mc_presentation(c->mc, name, sizeof name));
+        return 0;
+    }
+    log_debug("[META] %s has %u neighbours",
+              mc_presentation(c->mc, name, sizeof name),
+              (unsigned int)up->flood.count);
+    /* Its id is part of what we tell the others */
+    if (known != up->flood.id)
+        server_advertise_neighbours(s);
+    return 0;
+}
+
+static int
+mc_on_punch_request(void *ctx,
+                    unsigned char const *value,
+                    size_t len)
+{
+    struct mp_ctx *c = ctx;
+
+    return punch_introduce(c->s, c->mc, value, len);
+}
+
+static int
+mc_on_punch(void *ctx,
+            unsigned char const *value,
+            size_t len)
+{
+    struct mp_ctx *c = ctx;
+    char name[INET6_ADDRSTRLEN];
 
-    return ptr;
+    if (punch_introduced(c->s->udp, value, len) == -1)
+    {
+        log_notice("[META] invalid introduction from %s",
+                   mc_presentation(c->mc, name, sizeof name));
+    }
+    return 0;
 }
 
-struct vector_cptr *
-split(char *line)
+static int
+mc_on_udp_paths(void *ctx,
+                unsigned char const *value,
+                size_t len)
 {
-    char *ptr;
-    char *saveptr = NULL;
-    struct vector_cptr *tmp = v_cptr_new();
+    struct mp_ctx *c = ctx;
+    char name[INET6_ADDRSTRLEN];
 
-    for (ptr = next_token(line, &saveptr, " :");
-         ptr != NULL;
-         ptr = next_token(NULL, &saveptr, " :"))
+    if (bond_paths(c->s, c->mc, value, len) == -1)
     {
-        v_cptr_push(tmp, ptr);
+        log_notice("[META] invalid udp paths from %s",
+                   mc_presentation(c->mc, name, sizeof name));
     }
-    return tmp;
+    return 0;
+}
+
+static int
+mc_on_link_state(void *ctx,
+                 unsigned char const *value,
+                 size_t len)
+{
+    struct mp_ctx *c = ctx;
+    char name[INET6_ADDRSTRLEN];
+    int fresh;
+
+    if (c->s->udp->route == NULL)
+        return 0;
+    fresh = route_lsa_input(c->s->udp->route, value, len);
+    if (fresh == -1)
+    {
+        log_notice("[META] invalid link state from %s",
+                   mc_presentation(c->mc, name, sizeof name));
+    }
+    else if (fresh == 1)
+        server_advertise_link_state(c->s, c->mc, value, len);
+    return 0;
+}
+
+/* Indexed by enum mp_type */
+static struct mp_dispatch const mc_dispatch[MP_TYPE_MAX] =
+{
+    {NULL, 0},
+    {mc_on_hello, 0},       /* MP_HELLO */
+    {mc_on_udp_port, 2},    /* MP_UDP_PORT */
+    {mc_on_neighbours, 8},  /* MP_NEIGHBOURS */
+    {mc_on_punch_request, 8}, /* MP_PUNCH_REQUEST */
+    {mc_on_punch, 19},      /* MP_PUNCH */
+    {mc_on_udp_paths, 7},   /* MP_UDP_PATHS */
+    {mc_on_link_state, 12}, /* MP_LINK_STATE */
+};
+
+/*
+ * Stop the meta-connexion with a peer, and the udp peering going with it.
+ */
+void
+server_mc_close(struct server *s,
+                struct mc *mc)
+{
+    char name[INET6_ADDRSTRLEN];
+    struct sockaddr *sock = mc->p.address;
+    struct udp_peer *up;
+
+    up = v_udp_find_if(s->udp->udp_peers, find_udppeer, sock);
+    if (up != v_udp_end(s->udp->udp_peers))
+    {
+        log_debug("[%s] stop peering with %s",
+                  (up->ssl_flags & DTLS_ENABLE) ? "DTLS" : "UDP",
+                  endpoint_presentation(&up->peer_addr));
+        udp_remove_peer(s->udp, up);
+    }
+    log_debug("[META] stop the meta-connexion with %s",
+              mc_presentation(mc, name, sizeof(name)));
+    mc_close(mc);
+    v_mc_erase(s->peers, mc);
+    server_advertise_neighbours(s);
+    dial_wake(s);
 }
 
 void
@@ -124,40 +364,16 @@ server_mc_read_cb(struct bufferevent *bev, void *ctx)
     struct server *s = (struct server *)ctx;
     struct evbuffer *in = bufferevent_get_input(bev);
     struct mc       *mc = v_mc_find_if(s->peers, (void *)find_bev, bev);
-    size_t len;
-    char *line;
+    struct mp_ctx   c;
 
     /* Do nothing: this peer seems to exists, but we didn't approve it yet*/
     if (mc == v_mc_end(s->peers))
         return ;
 
-    while ((line = evbuffer_readln(in, &len, EVBUFFER_EOL_CRLF)) != NULL)
-    {
-        struct vector_cptr *splited;
-        char *cmd_name;
-
-        log_debug("[META] [%s]", line);
-        splited = split(line);
-        cmd_name = v_cptr_at(splited, 0);
-        if (strncmp(cmd_name, "udp_port", strlen(cmd_name)) == 0)
-        {
-            char            *s_udp_port = v_cptr_at(splited, 1);
-            unsigned short  port = atoi(s_udp_port);
-            struct endpoint udp_remote_endpoint;
-
-            endpoint_init(&udp_remote_endpoint,
-                          mc->p.address,
-                          mc->p.len);
-
-            endpoint_set_port(&udp_remote_endpoint, port);
-
-            udp_register_new_peer(s->udp,
-                                  &udp_remote_endpoint,
-                                  DTLS_DISABLE);
-        }
-        v_cptr_delete(splited);
-        free(line);
-    }
+    c.s = s;
+    c.mc = mc;
+    if (mp_parse(in, mc_dispatch, &c) == -1)
+        server_mc_close(s, mc);
 }
 
 static void
@@ -193,6 +409,7 @@ server_mc_event_cb(struct bufferevent *bev, short events, void *ctx)
         {
             struct mc tmp;
             struct endpoint e;
+            int resumed = 0;
 
             endpoint_init(&e, mc->p.address, mc->p.len);
             /* Check for certificate */
@@ -214,43 +431,42 @@ server_mc_event_cb(struct bufferevent *bev, short events, void *ctx)
                     return ;
                 }
                 pubkey = X509_get_pubkey(cert); //UNUSED ?
+                resumed = SSL_session_reused(ssl);
             }
-            log_info("[META] [%s] connexion established with %s",
+            log_info("[META] [%s] connexion established with %s%s",
                      mc->ssl_flags & TLS_ENABLE ? "TLS" : "TCP",
-                     endpoint_presentation(&e));
+                     endpoint_presentation(&e),
+                     resumed ? " (resumed)" : "");
             memcpy(&tmp, mc, sizeof(tmp));
             v_mc_erase(s->pending_peers, mc);
             mc = v_mc_insert(s->peers, &tmp);
             mc_hello(mc, s->udp);
             mc_establish_tunnel(mc, s->udp);
+            if (serv_opts.multipath != TNT_MULTIPATH_OFF)
+                mc_udp_paths(mc, s->udp);
+            /* It computes its routes as soon as it knows the mesh */
+            if (s->udp->route != NULL)
+            {
+                struct route_lsa *lsa = NULL;
+                struct route_lsa *lsae = NULL;
+
+                for (lsa = v_lsa_begin(s->udp->route->lsas),
+                     lsae = v_lsa_end(s->udp->route->lsas);
+                     lsa != lsae;
+                     lsa = v_lsa_next(lsa))
+                    mc_link_state(mc, lsa->value, lsa->len);
+            }
+            dial_wake(s);
         }
     }
     else if (events & BEV_EVENT_EOF)
     {
         /* Disconnected */
         struct mc *mc;
-        struct udp_peer *up;
 
         mc = v_mc_find_if(s->peers, (void *)find_bev, bev);
         if (mc != v_mc_end(s->peers))
-        {
-            char name[INET6_ADDRSTRLEN];
-            struct sockaddr *sock = mc->p.address;
-
-            up = v_udp_find_if(s->udp->udp_peers, find_udppeer, sock);
-            if (up != v_udp_end(s->udp->udp_peers))
-            {
-                v_udp_erase(s->udp->udp_peers, up);
-                log_debug("[%s] stop peering with %s",
-                          (up->ssl_flags & DTLS_ENABLE) ? "DTLS" : "UDP",
-                          endpoint_presentation(&up->peer_addr));
-            }
-            log_debug("[META] stop the meta-connexion with %s",
-                      mc_presentation(mc, name, sizeof(name)));
-            mc_close(mc);
-            v_mc_erase(s->peers, mc);
-        }
-
+            server_mc_close(s, mc);
     }
     else if (events & BEV_EVENT_ERROR)
     {
@@ -285,16 +501,13 @@ server_mc_event_cb(struct bufferevent *bev, short events, void *ctx)
                       mc_presentation(mc, name, sizeof name));
             mc_close(mc);
             v_mc_erase(s->pending_peers, mc);
+            dial_wake(s);
         }
         else
         {
             mc = v_mc_find_if(s->peers, (void *)find_bev, bev);
             if (mc != v_mc_end(s->peers))
-            {
-                mc_close(mc);
-                v_mc_erase(s->peers, mc);
-                log_debug("[META] socket removed from the peer list");
-            }
+                server_mc_close(s, mc);
         }
     }
 }
@@ -326,7 +539,7 @@ listen_callback(struct evconnlistener *evl,
      * This is highly _HACKISH_ but it's the cleaner way I found by this time.
      */
     mc = mc_peer_accept(s, base, sock, len, fd);
-    if ((mc->ssl_flags & TLS_ENABLE) == 0)
+    if (mc != NULL && (mc->ssl_flags & TLS_ENABLE) == 0)
     {
         server_mc_event_cb(mc->bev, BEV_EVENT_CONNECTED, s);
     }
@@ -380,6 +593,8 @@ evssl_init(void)
     SSL_CTX_set_verify(server_ctx,
                        SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
                        server_preverify_cert);
+    if (tls_session_init(server_ctx) == -1)
+        log_notice("[INIT] [TLS] session resumption disabled");
     return server_ctx;
 }
 
@@ -395,6 +610,7 @@ void listen_client_callback(struct evconnlistener *evl, evutil_socket_t fd,
 	log_debug("A client is connecting");
     client_init_callback();
     memset(&s->mc_client, 0, sizeof(s->mc_client));
+    memset(&s->client_drop, 0, sizeof(s->client_drop));
     /* Notifiy the mc_init that we are in an SSL_ACCEPTING state*/
     /* Even if we are not in a SSL context, mc_init know what to do anyway*/
     s->mc_client.ssl_flags = BUFFEREVENT_SSL_ACCEPTING;
@@ -412,6 +628,81 @@ void listen_client_callback(struct evconnlistener *evl, evutil_socket_t fd,
 }
 #endif
 
+/*
+ * Listen on a ListenAddress: TCP for the meta-connexions, and a udp socket
+ * on the same address. The listener is only enabled if running is set.
+ */
+static struct evconnlistener *
+server_listen(struct server *s,
+              struct cfg_sockaddress *addr,
+              int running)
+{
+    struct evconnlistener *evl = NULL;
+    struct udp_transport *t;
+    char listenname[INET6_ADDRSTRLEN];
+    struct endpoint endp;
+
+    evl = evconnlistener_new_bind(s->evbase, listen_callback,
+        s, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+        (struct sockaddr *)&addr->sockaddr, addr->len);
+    if (evl == NULL) {
+        log_warnx("[INIT] failed to allocate the listener to listen to %s",
+            address_presentation((struct sockaddr *)&addr->sockaddr,
+            addr->len, listenname, sizeof listenname));
+        return NULL;
+    }
+    evconnlistener_set_error_cb(evl, NULL);
+    evconnlistener_disable(evl);
+
+    /* udp endpoint init */
+
+    /*
+     * We listen on the same address for the udp socket, each address has
+     * its own. An address removed then added again by a reload still has
+     * its socket, running, since its peers may use it.
+     */
+    t = udp_transport_find(s->udp, (struct sockaddr *)&addr->sockaddr);
+    if (t != NULL)
+    {
+        if (running)
+            evconnlistener_enable(evl);
+        return evl;
+    }
+    endpoint_init(&endp, (struct sockaddr *)&addr->sockaddr, addr->len);
+    t = udp_transport_add(s->udp, s, &endp);
+    if (t == NULL)
+    {
+        log_warnx("[INIT] [UDP] failed to init the udp socket on %s",
+                  address_presentation((struct sockaddr *)&addr->sockaddr,
+                                       addr->len, listenname,
+                                       sizeof listenname));
+        evconnlistener_free(evl);
+        return NULL;
+    }
+    if (running)
+    {
+        evconnlistener_enable(evl);
+        sched_fiber_launch(t->recv_fib);
+    }
+    return evl;
+}
+
+static int
+server_dial_start(struct server *s,
+                  struct vector_sockaddr *addrs,
+                  struct vector_peername *names)
+{
+    s->dial = dial_new(s, addrs, names);
+    if (s->dial == NULL)
+    {
+        log_warnx("[INIT] unable to allocate the dialing state");
+        return -1;
+    }
+    s->dial_fib = sched_new_fiber(s->ev_sched, server_dial, (intptr_t)s);
+    sched_fiber_launch(s->dial_fib);
+    return 0;
+}
+
 int
 server_init(struct server *s, struct event_base *evbase)
 {
@@ -419,8 +710,6 @@ server_init(struct server *s, struct event_base *evbase)
     struct cfg_sockaddress *ite_listen = NULL;
     struct cfg_sockaddress *it_client = NULL;
     struct cfg_sockaddress *ite_client = NULL;
-    struct cfg_sockaddress *it_peer = NULL;
-    struct cfg_sockaddress *ite_peer = NULL;
     size_t i = 0;
 
     s->peers = v_mc_new();
@@ -432,44 +721,41 @@ server_init(struct server *s, struct event_base *evbase)
     it_listen = v_sockaddr_begin(serv_opts.listen_addrs);
     ite_listen = v_sockaddr_end(serv_opts.listen_addrs);
     s->ev_sched = sched_new(evbase);
+    s->hs_pool = NULL;
+    s->gro = NULL;
+    s->gro_writing = 0;
+    s->device_fib = NULL;
+    s->dial = NULL;
+    s->dial_fib = NULL;
+    s->discovery = NULL;
+    if (s->server_ctx != NULL && serv_opts.handshake_threads > 0)
+    {
+        s->hs_pool = hs_pool_new(evbase, serv_opts.handshake_threads,
+                                 mc_handshake_done, s);
+        if (s->hs_pool == NULL)
+            log_notice("[INIT] [TLS] handshakes are done by the event loop");
+    }
+
+    /* The peers are shared by the UDP sockets of every ListenAddress */
+    s->udp = server_udp_new(s);
+    if (s->udp == NULL)
+    {
+        log_warnx("[INIT] [UDP] unable to allocate the udp state");
+        return -1;
+    }
 
     /* Listen on all ListenAddress */
     for (; it_listen != ite_listen; it_listen = v_sockaddr_next(it_listen), ++i)
     {
-        struct evconnlistener *evl = NULL;
-        char listenname[INET6_ADDRSTRLEN];
-        struct endpoint endp;
-
-        evl = evconnlistener_new_bind(evbase, listen_callback,
-            s, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
-            (struct sockaddr *)&it_listen->sockaddr, it_listen->len);
-        if (evl == NULL) {
-            log_warnx("[INIT] failed to allocate the listener to listen to %s",
-                address_presentation((struct sockaddr *)&it_listen->sockaddr,
-                it_listen->len, listenname, sizeof listenname));
-             continue;
-        }
-        evconnlistener_set_error_cb(evl, NULL);
-        evconnlistener_disable(evl);
+        struct evconnlistener *evl = server_listen(s, it_listen, 0);
 
-        /* udp endpoint init */
-
-        /*
-         * We listen on the same address for the udp socket
-         */
-        endpoint_init(&endp, (struct sockaddr *)&it_listen->sockaddr,
-                      it_listen->len);
-        s->udp = server_udp_new(s, &endp);
-        if (s->udp == NULL)
-        {
-            log_warnx("[INIT] [UDP] failed to init the udp socket on %s",
-                  address_presentation((struct sockaddr *)&it_listen->sockaddr,
-                                           it_listen->len, listenname,
-                                           sizeof listenname));
-            continue;
-        }
-
-        v_evl_push(s->srv_list, evl);
+        if (evl != NULL)
+            v_evl_push(s->srv_list, evl);
+    }
+    if (v_transport_size(s->udp->transports) == 0)
+    {
+        log_warnx("[INIT] [UDP] no udp socket could be opened");
+        return -1;
     }
 
 	// Listen enable for client in the ports registered
@@ -498,36 +784,222 @@ server_init(struct server *s, struct event_base *evbase)
 	}
 #endif
 
-    /* If we don't have any PeerAddress it's finished */
-    if (v_sockaddr_size(serv_opts.peer_addrs) == 0)
+    /* The spokes only peer with their hub */
+    if (serv_opts.discovery && serv_opts.mode != TNT_DAEMONMODE_HUB
+        && serv_opts.mode != TNT_DAEMONMODE_SPOKE
+        && v_sockaddr_size(serv_opts.listen_addrs) != 0)
+    {
+        struct cfg_sockaddress *la = v_sockaddr_begin(serv_opts.listen_addrs);
+        unsigned short port;
+
+        /* The peers dial our first ListenAddress */
+        if (la->sockaddr.ss_family == AF_INET6)
+            port = ntohs(((struct sockaddr_in6 *)&la->sockaddr)->sin6_port);
+        else
+            port = ntohs(((struct sockaddr_in *)&la->sockaddr)->sin_port);
+        s->discovery = discovery_new(s, port);
+    }
+
+    /* If we don't have any PeerAddress nor discovery it's finished */
+    if (v_sockaddr_size(serv_opts.peer_addrs) == 0
+        && v_peername_size(serv_opts.peer_names) == 0
+        && s->discovery == NULL)
         return 0;
+    return server_dial_start(s, serv_opts.peer_addrs, serv_opts.peer_names);
+}
+
+/* The options only read at startup */
+static struct
+{
+    char const  *name;
+    size_t      offset;
+} const reload_restart[] = {
+    {"Tunnel", offsetof(struct options, tunnel)},
+    {"TunnelIndex", offsetof(struct options, tunnel_index)},
+    {"Mode", offsetof(struct options, mode)},
+    {"Compression", offsetof(struct options, compression)},
+    {"Encryption", offsetof(struct options, encryption)},
+    {"DTLS", offsetof(struct options, dtls)},
+    {"HandshakeThreads", offsetof(struct options, handshake_threads)},
+    {"MSSClamp", offsetof(struct options, mss_clamp)},
+    {"AggregationDelay", offsetof(struct options, aggregate_delay)},
+    {"TunnelMTU", offsetof(struct options, tunnel_mtu)},
+    {"UDPMTU", offsetof(struct options, udp_mtu)},
+    {"Offload", offsetof(struct options, offload)},
+    {"ZeroCopyThreshold", offsetof(struct options, zerocopy_threshold)},
+    {"HolePunching", offsetof(struct options, hole_punching)},
+    {"Multipath", offsetof(struct options, multipath)},
+    {"ReorderDelay", offsetof(struct options, reorder_delay)},
+    {"Routing", offsetof(struct options, routing)},
+    {"Discovery", offsetof(struct options, discovery)},
+    {"KeepaliveInterval", offsetof(struct options, keepalive_interval)},
+    {"KeepaliveMisses", offsetof(struct options, keepalive_misses)},
+};
+
+static int
+reload_strcmp(char const *a,
+              char const *b)
+{
+    if (a == NULL || b == NULL)
+        return a != b;
+    return strcmp(a, b);
+}
 
-    it_peer = v_sockaddr_begin(serv_opts.peer_addrs);
-    ite_peer = v_sockaddr_end(serv_opts.peer_addrs);
-    for (;it_peer != ite_peer; it_peer = v_sockaddr_next(it_peer))
+static int
+reload_has_addr(struct vector_sockaddr *v,
+                struct cfg_sockaddress *addr)
+{
+    struct cfg_sockaddress *it = NULL;
+    struct cfg_sockaddress *ite = NULL;
+
+    for (it = v_sockaddr_begin(v), ite = v_sockaddr_end(v);
+         it != ite;
+         it = v_sockaddr_next(it))
     {
-        struct mc *mc_peer = NULL;
-#ifdef USE_TCLT
-        peer p;
-        char *cmd;
+        if (it->len == addr->len
+            && evutil_sockaddr_cmp((struct sockaddr *)&it->sockaddr,
+                                   (struct sockaddr *)&addr->sockaddr, 1) == 0)
+            return 1;
+    }
+    return 0;
+}
 
-        /* TODO : Real information */
-        p.name = strdup("");
-        p.name = strdup("");
-        p.name = strdup("");
-#endif
-        mc_peer = mc_peer_connect(s, evbase,
-                        (struct sockaddr *)&it_peer->sockaddr,
-                        it_peer->len);
-#ifdef USE_TCLT
-        if (mc_peer != NULL && s->mc_client.bev)
+/* Stop the TCP listener of a ListenAddress */
+static void
+reload_unlisten(struct server *s,
+                struct cfg_sockaddress *addr)
+{
+    struct evconnlistener **it = NULL;
+    struct evconnlistener **ite = NULL;
+    char name[INET6_ADDRSTRLEN];
+
+    for (it = v_evl_begin(s->srv_list), ite = v_evl_end(s->srv_list);
+         it != ite;
+         it = v_evl_next(it))
+    {
+        struct sockaddr_storage ss;
+        socklen_t len = sizeof(ss);
+
+        if (getsockname(evconnlistener_get_fd(*it),
+                        (struct sockaddr *)&ss, &len) == -1
+            || evutil_sockaddr_cmp((struct sockaddr *)&ss,
+                                   (struct sockaddr *)&addr->sockaddr, 1) != 0)
+            continue;
+        log_info("[RELOAD] no longer listening on %s",
+                 address_presentation((struct sockaddr *)&addr->sockaddr,
+                                      addr->len, name, sizeof(name)));
+        evconnlistener_free(*it);
+        v_evl_erase(s->srv_list, it);
+        return;
+    }
+}
+
+/*
+ * Apply a new configuration without a restart. Only the listeners and the
+ * peers which changed are added or removed, the established meta-connexions
+ * and udp peers are left alone. The options only read at startup keep their
+ * running value.
+ */
+int
+server_reload(struct server *s,
+              char *buf,
+              size_t len)
+{
+    struct options fresh;
+    struct vector_sockaddr *addrs;
+    struct vector_peername *names;
+    struct cfg_sockaddress *it = NULL;
+    struct cfg_sockaddress *ite = NULL;
+    size_t i;
+    int added = 0;
+    /* Before the device is set, the new listeners are started with it */
+    int running = (s->device_fib != NULL);
+
+    if (tnt_parse_options(&fresh, buf, len) == -1)
+    {
+        log_warnx("[RELOAD] invalid configuration, nothing changed");
+        free_options(&fresh);
+        return -1;
+    }
+    for (i = 0; i < sizeof(reload_restart) / sizeof(*reload_restart); ++i)
+    {
+        size_t off = reload_restart[i].offset;
+
+        if (*(int *)((char *)&serv_opts + off) != *(int *)((char *)&fresh + off))
+            log_notice("[RELOAD] %s changed, it needs a restart",
+                       reload_restart[i].name);
+    }
+    if (reload_strcmp(fresh.addr, serv_opts.addr) != 0
+        || reload_strcmp(fresh.key_path, serv_opts.key_path) != 0
+        || reload_strcmp(fresh.cert_path, serv_opts.cert_path) != 0
+        || reload_strcmp(fresh.nameserver, serv_opts.nameserver) != 0)
+        log_notice("[RELOAD] Address, PrivateKey, CertFile and Nameserver "
+                   "need a restart");
+    for (it = v_sockaddr_begin(fresh.client_addrs),
+         ite = v_sockaddr_end(fresh.client_addrs);
+         it != ite;
+         it = v_sockaddr_next(it))
+    {
+        if (!reload_has_addr(serv_opts.client_addrs, it))
         {
-            cmd = tclt_add_peer(&p);
-            bufferevent_write(s->mc_client.bev, cmd, strlen(cmd));
-            free(cmd);
+            log_notice("[RELOAD] ClientAddress changed, it needs a restart");
+            break;
         }
-#endif
     }
+    serv_opts.debug = fresh.debug;
+    serv_opts.reconnect_max = fresh.reconnect_max;
+    serv_opts.max_dials = fresh.max_dials;
+
+    /*
+     * The udp socket stays, the peers reached through it still use it, and
+     * server_listen takes it back if the address comes back
+     */
+    for (it = v_sockaddr_begin(serv_opts.listen_addrs),
+         ite = v_sockaddr_end(serv_opts.listen_addrs);
+         it != ite;
+         it = v_sockaddr_next(it))
+    {
+        if (!reload_has_addr(fresh.listen_addrs, it))
+            reload_unlisten(s, it);
+    }
+    for (it = v_sockaddr_begin(fresh.listen_addrs),
+         ite = v_sockaddr_end(fresh.listen_addrs);
+         it != ite;
+         it = v_sockaddr_next(it))
+    {
+        struct evconnlistener *evl;
+        char name[INET6_ADDRSTRLEN];
+
+        if (reload_has_addr(serv_opts.listen_addrs, it))
+            continue;
+        evl = server_listen(s, it, running);
+        if (evl == NULL)
+            continue;
+        log_info("[RELOAD] listening on %s",
+                 address_presentation((struct sockaddr *)&it->sockaddr,
+                                      it->len, name, sizeof(name)));
+        v_evl_push(s->srv_list, evl);
+        ++added;
+    }
+
+    if (s->dial != NULL)
+        (void)dial_reload(s->dial, fresh.peer_addrs, fresh.peer_names);
+    else if (v_sockaddr_size(fresh.peer_addrs) != 0
+             || v_peername_size(fresh.peer_names) != 0)
+        (void)server_dial_start(s, fresh.peer_addrs, fresh.peer_names);
+
+    /* Keep the new lists, the old ones go with the rest of fresh */
+    addrs = serv_opts.listen_addrs;
+    serv_opts.listen_addrs = fresh.listen_addrs;
+    fresh.listen_addrs = addrs;
+    addrs = serv_opts.peer_addrs;
+    serv_opts.peer_addrs = fresh.peer_addrs;
+    fresh.peer_addrs = addrs;
+    names = serv_opts.peer_names;
+    serv_opts.peer_names = fresh.peer_names;
+    fresh.peer_names = names;
+    free_options(&fresh);
+    log_info("[RELOAD] configuration reloaded, %d new listeners", added);
     return 0;
 }
 
@@ -536,10 +1008,20 @@ void server_delete(struct server *s)
     /* Start by the servers */
     v_evl_foreach(s->srv_list, evconnlistener_free);
     server_udp_exit(s->udp);
+    if (s->dial_fib != NULL)
+        sched_fiber_delete(s->dial_fib);
+    dial_delete(s->dial);
+    discovery_delete(s->discovery);
 
     /* Clean the vectors */
     v_mc_foreach(s->pending_peers, (void (*)(struct mc const *))mc_close);
     v_mc_foreach(s->peers, (void (*)(struct mc const *))mc_close);
+    hs_pool_delete(s->hs_pool);
+    if (s->gro != NULL)
+    {
+        offload_gro_free(s->gro);
+        free(s->gro);
+    }
     v_frame_foreach(s->frames_to_send, frame_free);
 
     /* Free the actual vector memory */
@@ -550,7 +1032,10 @@ void server_delete(struct server *s)
 
     /* Free the SSL_CTX if we allocated it */
     if (s->server_ctx != NULL)
+    {
         SSL_CTX_free(s->server_ctx);
+        tls_session_exit();
+    }
 
     /* We need a way to know if there is a client or not */
     /*mc_close(&s->mc_client);*/
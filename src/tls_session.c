@@ -0,0 +1,333 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+#include <string.h>
+#include <time.h>
+
+#if defined Unix
+# include <pthread.h>
+#endif
+
+#include <event2/util.h>
+
+#include "networking.h"
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+#else
+# include <openssl/hmac.h>
+#endif
+
+#include "tls_session.h"
+#include "log.h"
+
+/*
+ * Session resumption for the meta-connexions.
+ *
+ * As a server we issue tickets, encrypted with a key rotated every
+ * TLS_TICKET_KEY_LIFETIME seconds; the previous key is still accepted, and
+ * the ticket renewed. The internal cache is kept for the clients which
+ * don't use tickets.
+ *
+ * As a client we keep the last session of every peer we connected to, so a
+ * reconnection only costs an abbreviated handshake.
+ *
+ * The callbacks run on the handshake workers, hence the lock.
+ */
+
+struct tls_ticket_key
+{
+    unsigned char   name[16];
+    unsigned char   aes_key[32];
+    unsigned char   hmac_key[32];
+    time_t          created;
+    int             valid;
+};
+
+/* The current key, and the previous one */
+static struct tls_ticket_key    ticket_keys[2];
+static struct vector_tls_sess   *tls_sessions = NULL;
+
+#if defined Unix
+static pthread_mutex_t          tls_lock = PTHREAD_MUTEX_INITIALIZER;
+# define TLS_LOCK()             pthread_mutex_lock(&tls_lock)
+# define TLS_UNLOCK()           pthread_mutex_unlock(&tls_lock)
+#else
+# define TLS_LOCK()
+# define TLS_UNLOCK()
+#endif
+
+static int
+tls_ticket_key_new(struct tls_ticket_key *k,
+                   time_t now)
+{
+    if (RAND_bytes(k->name, sizeof(k->name)) != 1
+        || RAND_bytes(k->aes_key, sizeof(k->aes_key)) != 1
+        || RAND_bytes(k->hmac_key, sizeof(k->hmac_key)) != 1)
+    {
+        k->valid = 0;
+        return -1;
+    }
+    k->created = now;
+    k->valid = 1;
+    return 0;
+}
+
+static void
+tls_ticket_rotate(time_t now)
+{
+    if (ticket_keys[0].valid && now - ticket_keys[0].created
+                                < TLS_TICKET_KEY_LIFETIME)
+        return ;
+    memcpy(&ticket_keys[1], &ticket_keys[0], sizeof(ticket_keys[1]));
+    if (tls_ticket_key_new(&ticket_keys[0], now) == -1)
+        log_warnx("[TLS] unable to generate a new ticket key");
+    else
+        log_debug("[TLS] ticket key rotated");
+}
+
+/*
+ * Pick the key of a ticket, returns the index of the key in ticket_keys, or
+ * -1 if none is able to open it.
+ */
+static int
+tls_ticket_find(unsigned char const *name)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i)
+    {
+        if (ticket_keys[i].valid
+            && CRYPTO_memcmp(ticket_keys[i].name, name,
+                             sizeof(ticket_keys[i].name)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int
+tls_ticket_set_mac(EVP_MAC_CTX *hctx,
+                   struct tls_ticket_key *k)
+{
+    OSSL_PARAM params[3];
+
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                  k->hmac_key,
+                                                  sizeof(k->hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+static int
+tls_ticket_set_mac(HMAC_CTX *hctx,
+                   struct tls_ticket_key *k)
+{
+    return HMAC_Init_ex(hctx, k->hmac_key, sizeof(k->hmac_key),
+                        EVP_sha256(), NULL);
+}
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# define TLS_MAC_CTX EVP_MAC_CTX
+#else
+# define TLS_MAC_CTX HMAC_CTX
+#endif
+
+static int
+tls_ticket_encrypt(unsigned char *iv,
+                   unsigned char *key_name,
+                   EVP_CIPHER_CTX *ctx,
+                   TLS_MAC_CTX *hctx)
+{
+    struct tls_ticket_key *k = &ticket_keys[0];
+
+    if (k->valid == 0)
+        return -1;
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+        return -1;
+    memcpy(key_name, k->name, sizeof(k->name));
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL,
+                           k->aes_key, iv) != 1
+        || tls_ticket_set_mac(hctx, k) != 1)
+        return -1;
+    return 1;
+}
+
+static int
+tls_ticket_decrypt(SSL *ssl,
+                   unsigned char *iv,
+                   unsigned char const *key_name,
+                   EVP_CIPHER_CTX *ctx,
+                   TLS_MAC_CTX *hctx)
+{
+    struct tls_ticket_key *k;
+    int i;
+
+    i = tls_ticket_find(key_name);
+    if (i == -1)
+        return 0;
+    k = &ticket_keys[i];
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL,
+                           k->aes_key, iv) != 1
+        || tls_ticket_set_mac(hctx, k) != 1)
+        return -1;
+    /*
+     * Issued with the previous key: still good, but give it a fresh one.
+     * TLSv1.3 clients don't reuse a ticket, they always need a new one.
+     */
+    if (i != 0 || SSL_version(ssl) >= TLS1_3_VERSION)
+        return 2;
+    return 1;
+}
+
+/*
+ * Returns 1 if the ticket is fine, 2 if it should be renewed, 0 to fall back
+ * to a full handshake and -1 on error, as OpenSSL expects.
+ */
+static int
+tls_ticket_cb(SSL *ssl,
+              unsigned char *key_name,
+              unsigned char *iv,
+              EVP_CIPHER_CTX *ctx,
+              TLS_MAC_CTX *hctx,
+              int enc)
+{
+    int ret;
+
+    TLS_LOCK();
+    tls_ticket_rotate(time(NULL));
+    if (enc)
+        ret = tls_ticket_encrypt(iv, key_name, ctx, hctx);
+    else
+        ret = tls_ticket_decrypt(ssl, iv, key_name, ctx, hctx);
+    TLS_UNLOCK();
+    return ret;
+}
+
+static int
+find_session(struct tls_session const *ts, void *ctx)
+{
+    return endpoint_cmp(&ts->remote, ctx) == 0;
+}
+
+/*
+ * Called by OpenSSL for every new session, we only keep those of the
+ * connexions we initiated. Returns 1 if we took the reference.
+ */
+static int
+tls_new_session_cb(SSL *ssl,
+                   SSL_SESSION *session)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    struct endpoint remote;
+    struct tls_session *it;
+    struct tls_session ts;
+
+    if (SSL_is_server(ssl) || tls_sessions == NULL)
+        return 0;
+    if (getpeername(SSL_get_fd(ssl), (struct sockaddr *)&ss, &len) == -1)
+        return 0;
+    endpoint_init(&remote, (struct sockaddr *)&ss, len);
+
+    TLS_LOCK();
+    it = v_tls_sess_find_if(tls_sessions, find_session, &remote);
+    if (it != v_tls_sess_end(tls_sessions))
+    {
+        SSL_SESSION_free(it->session);
+        it->session = session;
+    }
+    else
+    {
+        endpoint_copy(&ts.remote, &remote);
+        ts.session = session;
+        v_tls_sess_push(tls_sessions, &ts);
+    }
+    TLS_UNLOCK();
+    return 1;
+}
+
+int
+tls_session_init(SSL_CTX *ctx)
+{
+    static char const sid_ctx[] = "tNETacle-meta";
+
+    if (tls_ticket_key_new(&ticket_keys[0], time(NULL)) == -1)
+    {
+        log_warnx("[TLS] unable to generate the ticket key");
+        return -1;
+    }
+    tls_sessions = v_tls_sess_new();
+
+    /* Without an id context, resuming with a verified client is an error */
+    SSL_CTX_set_session_id_context(ctx, (unsigned char const *)sid_ctx,
+                                   sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER
+                                        | SSL_SESS_CACHE_CLIENT);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, 2 * TLS_TICKET_KEY_LIFETIME);
+    SSL_CTX_sess_set_new_cb(ctx, tls_new_session_cb);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_cb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_ticket_cb);
+#endif
+    return 0;
+}
+
+/* Offer the last session we had with remote, if any */
+void
+tls_session_resume(SSL *ssl,
+                   struct sockaddr const *remote,
+                   socklen_t len)
+{
+    struct endpoint e;
+    struct tls_session *it;
+
+    if (tls_sessions == NULL)
+        return ;
+    endpoint_init(&e, remote, len);
+    TLS_LOCK();
+    it = v_tls_sess_find_if(tls_sessions, find_session, &e);
+    if (it != v_tls_sess_end(tls_sessions)
+        && SSL_SESSION_is_resumable(it->session))
+        SSL_set_session(ssl, it->session);
+    TLS_UNLOCK();
+}
+
+static void
+free_session(struct tls_session const *ts)
+{
+    SSL_SESSION_free(ts->session);
+}
+
+void
+tls_session_exit(void)
+{
+    if (tls_sessions != NULL)
+    {
+        v_tls_sess_foreach(tls_sessions, free_session);
+        v_tls_sess_delete(tls_sessions);
+        tls_sessions = NULL;
+    }
+    OPENSSL_cleanse(ticket_keys, sizeof(ticket_keys));
+}
@@ -27,6 +27,12 @@
 #if defined Unix
 # include <unistd.h>
 #endif
+#if defined Linux && defined USE_LIBTUNTAP
+# include <fcntl.h>
+# include <sys/ioctl.h>
+# include <net/if.h>
+# include <linux/if_tun.h>
+#endif
 
 #include <event2/util.h>
 
@@ -34,6 +40,7 @@
 #include "options.h"
 #include "tun.h"
 #include "log.h"
+#include "offload.h"
 
 /* Will search the first available tap device with both libraries */
 struct device *
@@ -146,3 +153,65 @@ tnt_ttc_get_mtu(struct device *dev) {
 #endif
 }
 
+int
+tnt_ttc_set_mtu(struct device *dev, int mtu) {
+#if defined USE_LIBTUNTAP
+	return tuntap_set_mtu(dev, mtu);
+#elif defined USE_TAPCFG
+	return tapcfg_iface_set_mtu(dev, mtu);
+#endif
+}
+
+/*
+ * Enable the checksum and segmentation offloads. libtuntap doesn't ask for
+ * the IFF_VNET_HDR flag, and it can only be given when attaching to the
+ * device: the device is kept alive while we attach to it again.
+ */
+int
+tnt_ttc_set_offload(struct device *dev) {
+#if defined Linux && defined USE_LIBTUNTAP
+	struct ifreq ifr;
+	unsigned int offloads;
+	int hdr_size = OFFLOAD_HDR_SIZE;
+	int fd;
+
+	(void)memset(&ifr, 0, sizeof ifr);
+	if (ioctl(dev->tun_fd, TUNGETIFF, &ifr) == -1)
+		return -1;
+	if (ifr.ifr_flags & IFF_VNET_HDR)
+		return 0;
+	if ((fd = open("/dev/net/tun", O_RDWR)) == -1)
+		return -1;
+	if (ioctl(dev->tun_fd, TUNSETPERSIST, 1) == -1) {
+		close(fd);
+		return -1;
+	}
+	close(dev->tun_fd);
+	dev->tun_fd = fd;
+
+	ifr.ifr_flags &= ~IFF_PERSIST;
+	ifr.ifr_flags |= IFF_VNET_HDR;
+	if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+		/* Take the device back as it was */
+		ifr.ifr_flags &= ~IFF_VNET_HDR;
+		(void)ioctl(fd, TUNSETIFF, &ifr);
+		(void)ioctl(fd, TUNSETPERSIST, 0);
+		return -1;
+	}
+	(void)ioctl(fd, TUNSETPERSIST, 0);
+	(void)ioctl(fd, TUNSETVNETHDRSZ, &hdr_size);
+
+	/* Older kernels don't know about USO, TSO is the one that matters */
+	offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+#if defined TUN_F_USO4
+	if (ioctl(fd, TUNSETOFFLOAD, offloads | TUN_F_USO4 | TUN_F_USO6) == 0)
+		return 0;
+#endif
+	if (ioctl(fd, TUNSETOFFLOAD, offloads) == -1)
+		log_notice("the device only has the offload header");
+	return 0;
+#else
+	(void)dev;
+	return -1;
+#endif
+}
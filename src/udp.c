@@ -19,6 +19,7 @@
 
 #if defined Unix
 # include <unistd.h>
+# include <sys/uio.h>
 #endif
 
 #include <event2/event.h>
@@ -41,286 +42,2155 @@
 #include "tntsched.h"
 #include "subset.h"
 #include "dtls.h"
+#include "crypto.h"
+#include "options.h"
+#include "pmtu.h"
+#include "mss.h"
+#include "bond.h"
+#include "route.h"
+#include "keepalive.h"
+
+extern struct options serv_opts;
+
+/* A slot holds the largest frame the device may give, sealed */
+#define UDP_SLOT_SIZE   (device_frame_max()             \
+                         + PACKET_HDR_MAX               \
+                         + CRYPTO_OVERHEAD)
+#define UDP_SLOT(b, i)  ((b)->slots + (i) * (b)->slot_size)
+#define UDP_PLAIN(b, i) ((b)->plain + (i) * (b)->slot_size)
+
+/* What a train of datagrams may carry, the UDP and IP headers aside */
+#define UDP_GSO_BYTES_MAX   (65535 - 8 - 40)
+
+/* Seconds before trying the offload again once the interface refused it */
+#define UDP_GSO_RETRY       60
+
+static void
+udp_burst_delete(struct udp_burst *b)
+{
+    if (b == NULL)
+        return ;
+    free(b->slots);
+    free(b->plain);
+    free(b);
+}
+
+static struct udp_burst *
+udp_burst_new(void)
+{
+    struct udp_burst *b = tnt_new(struct udp_burst);
+
+    if (b == NULL)
+        return NULL;
+    b->slot_size = UDP_SLOT_SIZE;
+    b->zc_buf = -1;
+    b->slots = malloc(CRYPTO_BURST_MAX * b->slot_size);
+    b->plain = malloc(CRYPTO_BURST_MAX * b->slot_size);
+    if (b->slots == NULL || b->plain == NULL)
+    {
+        udp_burst_delete(b);
+        return NULL;
+    }
+    return b;
+}
+
+/* The datagram i of a burst being sent */
+static unsigned char *
+udp_burst_dgram(struct udp_burst *b,
+                size_t i,
+                size_t *len)
+{
+    struct crypto_op *op = &b->ops[i];
+
+    if (op->cs == NULL)
+    {
+        *len = op->in_len;
+        return (unsigned char *)op->in;
+    }
+    *len = op->aad_len + op->out_len;
+    return UDP_SLOT(b, i);
+}
+
+#if !defined Windows
+/* Take note of the sends the kernel is done with, on every socket */
+static void
+udp_zc_reap(struct udp *udp)
+{
+    struct udp_zc *zc = udp->zc;
+    struct udp_transport **it = NULL;
+    struct udp_transport **ite = NULL;
+    unsigned int lo;
+    unsigned int hi;
+
+    for (it = v_transport_begin(udp->transports),
+         ite = v_transport_end(udp->transports);
+         it != ite;
+         it = v_transport_next(it))
+    {
+        struct udp_zc_ring *ring = (*it)->zc;
+
+        if (ring == NULL)
+            continue;
+        while (tnt_udp_zerocopy_done((*it)->fd, &lo, &hi) == 1)
+        {
+            unsigned int id;
+
+            for (id = lo; id != hi + 1; ++id)
+            {
+                unsigned short *owner = &ring->owner[id % UDP_ZC_INFLIGHT];
+
+                if (*owner != 0)
+                    --zc->bufs[*owner - 1].pending;
+                *owner = 0;
+            }
+        }
+    }
+}
+
+/* Give the kernel some time to release our buffers */
+static void
+udp_zc_wait(void *async_ctx,
+            struct udp *udp)
+{
+    struct timeval tv;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 1000;
+    async_wait(async_ctx, &tv);
+    udp_zc_reap(udp);
+}
+
+/* Should the count datagrams from first be sent without copy? */
+static int
+udp_zc_wanted(struct udp *udp,
+              struct udp_burst *b,
+              size_t first,
+              size_t count)
+{
+    size_t total = 0;
+    size_t i;
+
+    if (udp->zc == NULL || b->zc_buf == -1 || b->via[first]->zc == NULL)
+        return 0;
+    /* The clear datagrams may live outside of the slots */
+    for (i = first; i < first + count; ++i)
+    {
+        size_t len;
+
+        if (b->ops[i].cs == NULL)
+            return 0;
+        (void)udp_burst_dgram(b, i, &len);
+        total += len;
+    }
+    return total >= udp->zc->threshold;
+}
+
+/* The zerocopy send just done on t holds the slots of b */
+static void
+udp_zc_track(void *async_ctx,
+             struct udp *udp,
+             struct udp_transport *t,
+             struct udp_burst *b)
+{
+    struct udp_zc_ring *ring = t->zc;
+    unsigned short *owner = &ring->owner[ring->next_id % UDP_ZC_INFLIGHT];
+
+    /* A send older by a whole ring is still held, wait for it */
+    while (*owner != 0)
+        udp_zc_wait(async_ctx, udp);
+    *owner = (unsigned short)(b->zc_buf + 1);
+    ++udp->zc->bufs[b->zc_buf].pending;
+    ++ring->next_id;
+}
+
+/*
+ * The burst was flushed: if the kernel still reads some of its slots, give
+ * it free ones from the pool, waiting for some if they are all held.
+ */
+static void
+udp_zc_release(void *async_ctx,
+               struct udp *udp,
+               struct udp_burst *b)
+{
+    struct udp_zc *zc = udp->zc;
+    struct udp_zc_buf *cur;
+
+    if (zc == NULL || b->zc_buf == -1)
+        return ;
+    udp_zc_reap(udp);
+    cur = &zc->bufs[b->zc_buf];
+    while (cur->pending > 0)
+    {
+        size_t i;
+
+        for (i = 0; i < zc->count; ++i)
+        {
+            if (!zc->bufs[i].used && zc->bufs[i].pending == 0)
+                break;
+        }
+        if (i == zc->count && zc->count < UDP_ZC_BUFS_MAX)
+        {
+            zc->bufs[i].slots = malloc(CRYPTO_BURST_MAX * b->slot_size);
+            zc->bufs[i].pending = 0;
+            zc->bufs[i].used = 0;
+            if (zc->bufs[i].slots != NULL)
+                ++zc->count;
+        }
+        if (i < zc->count)
+        {
+            cur->used = 0;
+            zc->bufs[i].used = 1;
+            b->slots = zc->bufs[i].slots;
+            b->zc_buf = (int)i;
+            return ;
+        }
+        udp_zc_wait(async_ctx, udp);
+    }
+}
+
+/* Can the trains of t leave at once, now? */
+static int
+udp_gso_usable(struct udp_transport *t)
+{
+    struct timeval now;
+
+    if (!t->gso)
+        return 0;
+    if (!evutil_timerisset(&t->gso_retry))
+        return 1;
+    evutil_gettimeofday(&now, NULL);
+    if (evutil_timercmp(&now, &t->gso_retry, <))
+        return 0;
+    evutil_timerclear(&t->gso_retry);
+    log_info("[UDP] segmentation offload resumed on %s",
+             endpoint_presentation(&t->endpoint));
+    return 1;
+}
+
+/*
+ * Send count datagrams of the burst, starting at first, in a single call.
+ * The kernel splits the train every segment bytes. The large ones are sent
+ * without copy.
+ */
+static int
+udp_send_train(void *async_ctx,
+               struct udp *udp,
+               struct udp_burst *b,
+               size_t first,
+               size_t count,
+               size_t segment)
+{
+    struct udp_transport *t = b->via[first];
+    struct iovec iov[CRYPTO_BURST_MAX];
+    unsigned char control[TNT_UDP_CONTROL_SIZE];
+    struct msghdr msg;
+    int flags = 0;
+    size_t i;
+
+    memset(&msg, 0, sizeof(msg));
+    for (i = 0; i < count; ++i)
+        iov[i].iov_base = udp_burst_dgram(b, first + i, &iov[i].iov_len);
+    msg.msg_name = (void *)endpoint_addr(&b->peers[first]);
+    msg.msg_namelen = endpoint_addrlen(&b->peers[first]);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    if (count > 1
+        && tnt_udp_gso_control(&msg, control, sizeof(control),
+                               (unsigned short)segment) == -1)
+        return -1;
+    if (udp_zc_wanted(udp, b, first, count))
+        flags = TNT_MSG_ZEROCOPY;
+    if (async_sendmsg(async_ctx, t->fd, &msg, flags) == -1)
+    {
+        int err = EVUTIL_SOCKET_ERROR();
+
+        /*
+         * The interface, which depends on the route taken, can't do it: send
+         * one by one for a while. EINVAL only concerns this very train.
+         */
+        if (count > 1 && (err == EIO || err == ENOPROTOOPT
+                          || err == EOPNOTSUPP))
+        {
+            struct timeval now;
+            struct timeval delay = {UDP_GSO_RETRY, 0};
+
+            log_notice("[UDP] segmentation offload unavailable on %s, "
+                       "suspended for %d seconds",
+                       endpoint_presentation(&t->endpoint), UDP_GSO_RETRY);
+            evutil_gettimeofday(&now, NULL);
+            evutil_timeradd(&now, &delay, &t->gso_retry);
+        }
+        return -1;
+    }
+    if (flags != 0)
+        udp_zc_track(async_ctx, udp, t, b);
+    return 0;
+}
+#endif
+
+/*
+ * Were we woken by the zerocopy completions rather than by a datagram?
+ * They are read then.
+ */
+static int
+udp_zc_woken(struct udp_transport *t)
+{
+#if !defined Windows
+    if (t->zc != NULL && EVUTIL_SOCKET_ERROR() == TNET_EAGAIN)
+    {
+        udp_zc_reap(t->udp);
+        return 1;
+    }
+#else
+    (void)t;
+#endif
+    return 0;
+}
+
+/*
+ * How many datagrams, starting at first, may leave as a single train: same
+ * peer and socket, same size but for the last one which may be shorter.
+ */
+static size_t
+udp_train_length(struct udp_burst *b,
+                 size_t first,
+                 size_t *segment)
+{
+    size_t total;
+    size_t i;
+
+    (void)udp_burst_dgram(b, first, segment);
+    total = *segment;
+    for (i = first + 1; i < b->count; ++i)
+    {
+        size_t len;
+
+        (void)udp_burst_dgram(b, i, &len);
+        if (b->ops[i].err == -1 || len > *segment
+            || total + len > UDP_GSO_BYTES_MAX
+            || b->via[i] != b->via[first]
+            || endpoint_cmp(&b->peers[i], &b->peers[first]) != 0)
+            break;
+        total += len;
+        if (len < *segment)
+        {
+            ++i;
+            break;
+        }
+    }
+    return i - first;
+}
+
+/*
+ * Seal everything queued in the burst, then push it on the wire.
+ * The whole burst is sealed before the first send, so the crypto states it
+ * points to are not used across a yield.
+ */
+static void
+udp_flush_burst(void *async_ctx,
+                struct udp *udp,
+                struct udp_burst *b)
+{
+    size_t i;
+
+    crypto_seal_burst(b->ops, b->count);
+    /* A copy can't go without its original */
+    for (i = 0; i < b->count; ++i)
+    {
+        if (b->mirror[i] != 0)
+            b->ops[i].err = b->ops[b->mirror[i] - 1].err;
+    }
+    for (i = 0; i < b->count; )
+    {
+        struct crypto_op *op = &b->ops[i];
+        struct udp_transport *t = b->via[i];
+        unsigned char *dgram;
+        size_t len;
+        size_t count = 1;
+        int err;
+
+        if (op->err == -1)
+        {
+            log_warnx("[DATA] unable to seal a frame for %s",
+                      endpoint_presentation(&b->peers[i]));
+            ++i;
+            continue;
+        }
+#if !defined Windows
+        if (t->gso || t->zc != NULL)
+        {
+            size_t segment;
+
+            if (udp_gso_usable(t))
+                count = udp_train_length(b, i, &segment);
+            else
+                (void)udp_burst_dgram(b, i, &segment);
+            if ((count > 1 || udp_zc_wanted(udp, b, i, count))
+                && udp_send_train(async_ctx, udp, b, i, count, segment) == 0)
+            {
+                i += count;
+                continue;
+            }
+            /* Send them one by one */
+            count = 1;
+        }
+#endif
+        dgram = udp_burst_dgram(b, i, &len);
+        err = async_sendto(async_ctx,
+                           t->fd,
+                           dgram,
+                           len,
+                           0,
+                           endpoint_addr(&b->peers[i]),
+                           endpoint_addrlen(&b->peers[i]));
+        if (err == -1)
+        {
+            log_warn("[%s] error while sending to %s",
+                     (op->cs != NULL) ? "DATA" : "UDP",
+                     endpoint_presentation(&b->peers[i]));
+        }
+        i += count;
+    }
+    b->count = 0;
+#if !defined Windows
+    udp_zc_release(async_ctx, udp, b);
+#endif
+}
+
+/*
+ * Queue the datagram set up at b->count for the peer, on the paths picked by
+ * the multipath policy. The copies for the other paths point to the
+ * datagram as it will be once sealed.
+ */
+static void
+udp_burst_commit(void *async_ctx,
+                 struct udp *udp,
+                 struct udp_burst *b,
+                 struct udp_peer *peer)
+{
+    struct bond_path *paths[BOND_PATHS_MAX];
+    struct crypto_op const *orig = &b->ops[b->count];
+    size_t first = b->count;
+    size_t n = bond_pick(peer, paths);
+    size_t i;
+
+    b->mirror[first] = 0;
+    if (n == 0)
+    {
+        endpoint_copy(&b->peers[first], &peer->peer_addr);
+        b->via[first] = peer->transport;
+        ++b->count;
+    }
+    else
+    {
+        if (first + n > CRYPTO_BURST_MAX)
+            n = CRYPTO_BURST_MAX - first;
+        for (i = 0; i < n; ++i)
+        {
+            struct crypto_op *op = &b->ops[first + i];
+
+            if (i > 0)
+            {
+                op->cs = NULL;
+                if (orig->cs != NULL)
+                {
+                    op->in = UDP_SLOT(b, first);
+                    op->in_len = orig->aad_len + orig->in_len
+                               + CRYPTO_OVERHEAD;
+                }
+                else
+                {
+                    op->in = orig->in;
+                    op->in_len = orig->in_len;
+                }
+                op->err = 0;
+                b->mirror[first + i] = first + 1;
+            }
+            endpoint_copy(&b->peers[first + i], &paths[i]->addr);
+            b->via[first + i] = paths[i]->transport;
+        }
+        b->count += n;
+    }
+    if (b->count == CRYPTO_BURST_MAX)
+        udp_flush_burst(async_ctx, udp, b);
+}
+
+/* Queue a datagram to send as is */
+static void
+udp_burst_queue_clear(void *async_ctx,
+                      struct udp *udp,
+                      struct udp_burst *b,
+                      struct udp_peer *peer,
+                      unsigned char const *dgram,
+                      size_t len)
+{
+    struct crypto_op *op = &b->ops[b->count];
+
+    op->cs = NULL;
+    op->in = dgram;
+    op->in_len = len;
+    op->err = 0;
+    udp_burst_commit(async_ctx, udp, b, peer);
+}
+
+/*
+ * How many bytes of frames, headers included, an aggregate for peer may
+ * hold. 0 if the peer doesn't get aggregates: without a known path MTU, we
+ * don't know if it would understand them.
+ */
+static size_t
+udp_agg_room(struct udp_peer const *peer)
+{
+    int family = endpoint_addr(&peer->peer_addr)->sa_family;
+    size_t room;
+
+    if (serv_opts.aggregate_delay == 0 || !peer->pmtu.answered)
+        return 0;
+    room = pmtu_payload_max(&peer->pmtu, family, sizeof(struct packet_hdr));
+    if (peer->crypto.enabled)
+        room -= CRYPTO_OVERHEAD;
+    /* The size of an aggregate has one bit less */
+    if (room > PACKET_SIZE_MASK)
+        room = PACKET_SIZE_MASK;
+    if (serv_opts.udp_mtu > 0 && room > (size_t)serv_opts.udp_mtu)
+        room = (size_t)serv_opts.udp_mtu;
+    return room;
+}
+
+/*
+ * Sending a full burst yields, and the peers vector may change meanwhile:
+ * once peers_gen moved past gen, the peer is looked for again by its
+ * address. Returns NULL if it is gone.
+ */
+static struct udp_peer *
+udp_peer_again(struct udp *udp,
+               struct udp_peer *peer,
+               unsigned int *gen,
+               struct endpoint const *addr)
+{
+    if (*gen == udp->peers_gen)
+        return peer;
+    *gen = udp->peers_gen;
+    return udp_find_peer(udp, addr);
+}
+
+/*
+ * Send the aggregate of the peer, through the burst if it is to be sealed.
+ * The aggregate is emptied before anything yields, another fiber may fill it
+ * again meanwhile.
+ */
+static void
+udp_agg_flush(void *async_ctx,
+              struct udp *udp,
+              struct udp_burst *b,
+              struct udp_peer *peer)
+{
+    struct udp_agg *agg = peer->agg;
+    unsigned char *dgram;
+    size_t hdr_len;
+    size_t len;
+
+    if (agg == NULL || agg->count == 0)
+        return;
+    if (agg->count == 1)
+    {
+        unsigned int size;
+        unsigned int flags;
+
+        /* A lone frame already has its header, send it as is */
+        dgram = agg->buf + sizeof(struct packet_hdr);
+        len = agg->len;
+        hdr_len = packet_hdr_read(dgram, len, &size, &flags);
+    }
+    else
+    {
+        dgram = agg->buf;
+        hdr_len = packet_hdr_write(dgram, (unsigned int)agg->len,
+                                   PACKET_AGGREGATE);
+        len = hdr_len + agg->len;
+    }
+    agg->count = 0;
+    agg->len = 0;
+
+    if (peer->crypto.enabled)
+    {
+        struct crypto_op *op = &b->ops[b->count];
+        unsigned char *slot = UDP_SLOT(b, b->count);
+        unsigned char *plain = UDP_PLAIN(b, b->count);
+
+        memcpy(slot, dgram, hdr_len);
+        memcpy(plain, dgram + hdr_len, len - hdr_len);
+        op->cs = &peer->crypto;
+        op->aad = slot;
+        op->aad_len = hdr_len;
+        op->in = plain;
+        op->in_len = len - hdr_len;
+        op->out = slot + hdr_len;
+        udp_burst_commit(async_ctx, udp, b, peer);
+    }
+    else
+    {
+        unsigned char *slot = UDP_SLOT(b, b->count);
+
+        memcpy(slot, dgram, len);
+        udp_burst_queue_clear(async_ctx, udp, b, peer, slot, len);
+    }
+}
+
+/*
+ * Add a frame to the aggregate of the peer.
+ * Returns -1 if it must be sent on its own, the caller looks for the peer
+ * again then.
+ */
+static int
+udp_agg_append(void *async_ctx,
+               struct udp *udp,
+               struct udp_burst *b,
+               struct udp_peer *peer,
+               struct frame const *f)
+{
+    size_t room = udp_agg_room(peer);
+    size_t need = (unsigned char *)f->frame - (unsigned char *)f->raw_packet
+                + f->size;
+    struct udp_agg *agg = peer->agg;
+    unsigned char *p;
+
+    /* Only the small frames are worth waiting for */
+    if (room == 0 || need > room / 2)
+        return -1;
+    if (agg == NULL)
+    {
+        agg = tnt_new_impl(sizeof(*agg) + sizeof(struct packet_hdr)
+                           + serv_opts.udp_mtu);
+        if (agg == NULL)
+            return -1;
+        agg->buf = (unsigned char *)(agg + 1);
+        peer->agg = agg;
+    }
+    if (agg->len + need > room)
+    {
+        unsigned int gen = udp->peers_gen;
+
+        udp_agg_flush(async_ctx, udp, b, peer);
+        /* The aggregate may have gone with its peer */
+        if (udp->peers_gen != gen || agg->len + need > room)
+            return -1;
+    }
+    if (agg->count == 0)
+    {
+        struct timeval now;
+        struct timeval delay;
+
+        evutil_gettimeofday(&now, NULL);
+        delay.tv_sec = serv_opts.aggregate_delay / 1000000;
+        delay.tv_usec = serv_opts.aggregate_delay % 1000000;
+        evutil_timeradd(&now, &delay, &agg->deadline);
+    }
+    /* With its own header, a routed one keeps its route */
+    p = agg->buf + sizeof(struct packet_hdr) + agg->len;
+    memcpy(p, f->raw_packet, need);
+    agg->len += need;
+    /* The broadcast fiber owns the deadlines, let it know about this one */
+    if (++agg->count == 1)
+        async_wake(udp->udp_brd_fib, /*unused*/0);
+    return 0;
+}
+
+/*
+ * Flush the aggregates whose deadline passed.
+ * Returns 1 and sets next to the time left before the earliest pending one,
+ * 0 if there is none.
+ */
+static int
+udp_agg_flush_expired(void *async_ctx,
+                      struct udp *udp,
+                      struct udp_burst *b,
+                      struct timeval *next)
+{
+    struct timeval now;
+    int armed = 0;
+    size_t i;
+
+    if (serv_opts.aggregate_delay == 0)
+        return 0;
+    evutil_gettimeofday(&now, NULL);
+    /* Walked by index, the vector may move while a full burst is sent */
+    for (i = 0; i < v_udp_size(udp->udp_peers); ++i)
+    {
+        struct udp_peer *it = v_udp_begin(udp->udp_peers) + i;
+        struct udp_agg *agg = it->agg;
+
+        if (agg == NULL || agg->count == 0)
+            continue;
+        if (!evutil_timercmp(&now, &agg->deadline, <))
+        {
+            udp_agg_flush(async_ctx, udp, b, it);
+            continue;
+        }
+        if (armed == 0 || evutil_timercmp(&agg->deadline, next, <))
+        {
+            *next = agg->deadline;
+            armed = 1;
+        }
+    }
+    if (b->count > 0)
+        udp_flush_burst(async_ctx, udp, b);
+    if (armed)
+        evutil_timersub(next, &now, next);
+    return armed;
+}
+
+/*
+ * Queue the frames for a peer. The frames must already carry their header.
+ *
+ * The frames are queued in the burst: the ones for peers with a data channel
+ * key are sealed together, the others are sent as is. The small ones may
+ * wait a bit in the aggregate of the peer instead.
+ * A full burst is sent on the way, the peer may be gone when it returns.
+ */
+static void
+udp_queue_frames(void *async_ctx,
+                 struct udp *udp,
+                 struct udp_burst *b,
+                 struct udp_peer *it,
+                 struct frame *frames,
+                 size_t count)
+{
+    unsigned int gen = udp->peers_gen;
+    struct endpoint to;
+    size_t i;
+
+    endpoint_copy(&to, &it->peer_addr);
+    for (i = 0; i < count; ++i)
+    {
+        struct frame *f = &frames[i];
+        size_t hdr_len = (unsigned char *)f->frame
+                       - (unsigned char *)f->raw_packet;
+        size_t wire_len = hdr_len + f->size;
+        int sealed;
+
+        if ((it = udp_peer_again(udp, it, &gen, &to)) == NULL)
+            return;
+        if (it->crypto.enabled)
+            wire_len += CRYPTO_OVERHEAD;
+        /* With DF set, the path would drop it silently */
+        if (!pmtu_frame_fits(&it->pmtu,
+                             endpoint_addr(&it->peer_addr)->sa_family,
+                             wire_len))
+        {
+            ++it->pmtu.oversize;
+            log_debug("[PMTU] drop a %d bytes frame, too big for %s",
+                      f->size, endpoint_presentation(&it->peer_addr));
+            continue;
+        }
+        if (!it->crypto.enabled && udp->require_keys)
+        {
+            /* No data channel yet, its handshake may be running */
+            continue;
+        }
+        if (udp_agg_append(async_ctx, udp, b, it, f) == 0)
+            continue;
+        /* The frames must leave in order, the small ones first */
+        if ((it = udp_peer_again(udp, it, &gen, &to)) == NULL)
+            return;
+        udp_agg_flush(async_ctx, udp, b, it);
+        if ((it = udp_peer_again(udp, it, &gen, &to)) == NULL)
+            return;
+        sealed = it->crypto.enabled;
+        if (sealed)
+        {
+            struct crypto_op *op = &b->ops[b->count];
+            unsigned char *slot = UDP_SLOT(b, b->count);
+
+            memcpy(slot, f->raw_packet, hdr_len);
+            op->cs = &it->crypto;
+            op->aad = slot;
+            op->aad_len = hdr_len;
+            op->in = f->frame;
+            op->in_len = f->size;
+            op->out = slot + hdr_len;
+            udp_burst_commit(async_ctx, udp, b, it);
+        }
+        else
+        {
+            udp_burst_queue_clear(async_ctx, udp, b, it,
+                                  f->raw_packet, wire_len);
+        }
+        log_debug("[%s] sending %d(%-#2x) bytes to %s",
+                  sealed ? "DATA" : "UDP",
+                  f->size, f->size,
+                  endpoint_presentation(&to));
+    }
+}
+
+/*
+ * Queue the frames for every peer, but skip if not NULL, and the neighbours
+ * of skip which got them from it.
+ */
+static void
+udp_queue_flood(void *async_ctx,
+                struct udp *udp,
+                struct udp_burst *b,
+                struct frame *frames,
+                size_t count,
+                struct endpoint const *skip)
+{
+    struct udp_peer *from = NULL;
+    unsigned int gen = udp->peers_gen;
+    size_t next;
+    size_t i;
+
+    /* A spoke only ever talks to its hub, whatever the size of the network */
+    if (serv_opts.mode == TNT_DAEMONMODE_SPOKE)
+    {
+        struct udp_peer *it = v_udp_begin(udp->udp_peers);
+
+        if (it != v_udp_end(udp->udp_peers) && !it->keepalive.dead
+            && (skip == NULL || endpoint_cmp(&it->peer_addr, skip) != 0))
+            udp_queue_frames(async_ctx, udp, b, it, frames, count);
+        return;
+    }
+    if (skip != NULL)
+        from = udp_find_peer(udp, skip);
+    /* Walked by index, the vector may move while a full burst is sent */
+    for (i = 0; i < v_udp_size(udp->udp_peers); i = next)
+    {
+        struct udp_peer *it = v_udp_begin(udp->udp_peers) + i;
+        struct udp_peer *again;
+        struct endpoint to;
+
+        next = i + 1;
+        /* If it's not the peer we received the data from, nor a dead one */
+        if (it == from || it->keepalive.dead
+            || (skip != NULL && endpoint_cmp(&it->peer_addr, skip) == 0))
+            continue;
+        /* Nor one of its own peers, they have it already */
+        if (from != NULL && flood_covers(&from->flood, &it->flood))
+            continue;
+        endpoint_copy(&to, &it->peer_addr);
+        udp_queue_frames(async_ctx, udp, b, it, frames, count);
+        if (udp->peers_gen == gen)
+            continue;
+        /* Go on after it, or from where it was if it is gone */
+        gen = udp->peers_gen;
+        again = udp_find_peer(udp, &to);
+        if (again != NULL)
+            next = (size_t)(again - v_udp_begin(udp->udp_peers)) + 1;
+        else
+            next = i;
+        if (skip != NULL)
+            from = udp_find_peer(udp, skip);
+    }
+}
+
+/*
+ * Queue a frame from skip, or from us if NULL, for the spoke behind its
+ * destination, or for all of them if it is unknown. Never for skip.
+ * Returns 1 if the frame is for us as well, 0 otherwise.
+ */
+static int
+udp_hub_queue(void *async_ctx,
+              struct udp *udp,
+              struct udp_burst *b,
+              struct frame *f,
+              struct endpoint const *skip)
+{
+    int layer2 = (serv_opts.tunnel == TNT_TUNMODE_ETHERNET);
+    struct host_addr src;
+    struct host_addr dst;
+    struct endpoint const *to;
+    struct udp_peer *peer;
+    uint32_t now;
+
+    if (host_addresses(f->frame, f->size, layer2, &src, &dst) == -1)
+    {
+        udp_queue_flood(async_ctx, udp, b, f, 1, skip);
+        return 1;
+    }
+    now = flood_now();
+    hub_learn(udp->hub, &src, skip, now);
+    to = hub_lookup(udp->hub, &dst, now);
+    if (to == NULL)
+    {
+        udp_queue_flood(async_ctx, udp, b, f, 1, skip);
+        return 1;
+    }
+    if (to->addrlen == 0)
+        return 1;
+    /* Never reflected to its source */
+    if (skip != NULL && endpoint_cmp(to, skip) == 0)
+        return 0;
+    peer = udp_find_peer(udp, to);
+    if (peer == NULL)
+    {
+        /* The spoke left, its hosts may be elsewhere now */
+        udp_queue_flood(async_ctx, udp, b, f, 1, skip);
+        return 1;
+    }
+    /* Nor through another of its paths */
+    if (skip != NULL && peer->bond != NULL && bond_has_path(peer->bond, skip))
+        return 0;
+    if (peer->keepalive.dead)
+        return 0;
+    udp_queue_frames(async_ctx, udp, b, peer, f, 1);
+    return 0;
+}
+
+static struct udp_peer *
+udp_peer_by_id(struct udp *udp,
+               uint64_t id)
+{
+    struct udp_peer *it = NULL;
+    struct udp_peer *ite = NULL;
+
+    for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+         it != ite;
+         it = v_udp_next(it))
+    {
+        if (it->flood.id == id)
+            return it;
+    }
+    return NULL;
+}
+
+/*
+ * Queue a routed frame from skip, or from us if NULL, for the next hop
+ * towards its destination, or flood it if there is none. The hosts are
+ * learnt from the frames of the other nodes, ours are routed to the node
+ * behind their destination address.
+ * Returns 1 if the frame is for us as well, 0 otherwise.
+ */
+static int
+udp_route_queue(void *async_ctx,
+                struct udp *udp,
+                struct udp_burst *b,
+                struct frame *f,
+                struct endpoint const *skip)
+{
+    int layer2 = (serv_opts.tunnel == TNT_TUNMODE_ETHERNET);
+    unsigned char *hdr = f->raw_packet;
+    struct host_addr src;
+    struct host_addr dst;
+    struct packet_route r;
+    struct udp_peer *peer;
+    unsigned int size;
+    unsigned int flags;
+    int known;
+    uint32_t now;
+
+    (void)packet_hdr_read(hdr, (size_t)((unsigned char *)f->frame - hdr),
+                          &size, &flags);
+    /* Nothing tells where it goes */
+    if (!(flags & PACKET_ROUTED))
+    {
+        udp_queue_flood(async_ctx, udp, b, f, 1, skip);
+        return 1;
+    }
+    packet_route_get(hdr, &r);
+    known = (host_addresses(f->frame, f->size, layer2, &src, &dst) == 0);
+    now = flood_now();
+    if (skip == NULL)
+    {
+        if (known)
+            r.dst = route_lookup(udp->route, &dst, now);
+    }
+    else
+    {
+        if (known && r.src != udp->route->self)
+            route_learn(udp->route, &src, r.src, now);
+        if (r.dst == udp->route->self)
+            return 1;
+        if (r.ttl <= 1)
+        {
+            log_debug("[ROUTE] drop a frame for %016llx, out of hops",
+                      (unsigned long long)r.dst);
+            return 0;
+        }
+        --r.ttl;
+    }
+    peer = NULL;
+    if (r.dst != 0)
+        peer = udp_peer_by_id(udp, route_next_hop(udp->route, r.dst));
+    if (peer != NULL && peer->keepalive.dead)
+        peer = NULL;
+    /* Never back to where it came from */
+    if (peer != NULL && skip != NULL
+        && (endpoint_cmp(&peer->peer_addr, skip) == 0
+            || (peer->bond != NULL && bond_has_path(peer->bond, skip))))
+        peer = NULL;
+    if (peer == NULL)
+    {
+        /* No way to its node, every node gets it */
+        r.dst = 0;
+        packet_route_set(hdr, &r);
+        udp_queue_flood(async_ctx, udp, b, f, 1, skip);
+        return 1;
+    }
+    packet_route_set(hdr, &r);
+    udp_queue_frames(async_ctx, udp, b, peer, f, 1);
+    return 0;
+}
+
+/*
+ * Send the frames to every peer but skip, if not NULL, or only to the one
+ * behind their destination on a hub, or towards it with routing.
+ */
+static void
+udp_send_frames(void *async_ctx,
+                struct udp *udp,
+                struct udp_burst *b,
+                struct frame *frames,
+                size_t count,
+                struct endpoint const *skip)
+{
+    size_t i;
+
+    if (udp->hub != NULL)
+    {
+        for (i = 0; i < count; ++i)
+            (void)udp_hub_queue(async_ctx, udp, b, &frames[i], skip);
+    }
+    else if (udp->route != NULL)
+    {
+        for (i = 0; i < count; ++i)
+            (void)udp_route_queue(async_ctx, udp, b, &frames[i], skip);
+    }
+    else
+        udp_queue_flood(async_ctx, udp, b, frames, count, skip);
+    if (b->count > 0)
+        udp_flush_burst(async_ctx, udp, b);
+}
+
+/*
+ * With a single peer, nothing is relayed and no frame can come back: the
+ * duplicates are not worth looking for. Neither in a star.
+ */
+static int
+udp_flooding(struct udp const *udp)
+{
+    if (!udp_routed_frames(udp))
+        return 0;
+    return v_udp_size(udp->udp_peers) > 1;
+}
+
+/*
+ * In a mesh, our frames may come back to us, or reach a node twice, through
+ * a loop: they carry the routed header which tells them apart. A star has
+ * no loop.
+ */
+int
+udp_routed_frames(struct udp const *udp)
+{
+    return udp->hub == NULL && serv_opts.mode != TNT_DAEMONMODE_SPOKE;
+}
+
+/*
+ * Returns 1 if the frame is a copy of one we already had, or one of ours,
+ * otherwise remember it and return 0.
+ */
+static int
+udp_flood_seen(struct udp *udp,
+               struct frame const *f)
+{
+    unsigned char const *hdr = f->raw_packet;
+    struct packet_route r;
+    unsigned int size;
+    unsigned int flags;
+
+    (void)packet_hdr_read(hdr, (size_t)((unsigned char *)f->frame - hdr),
+                          &size, &flags);
+    /* Nothing tells its copies apart */
+    if (!(flags & PACKET_ROUTED))
+        return 0;
+    packet_route_get(hdr, &r);
+    if (r.src == udp->flood->self)
+    {
+        ++udp->flood->dropped;
+        return 1;
+    }
+    return flood_seen(udp->flood, r.src, r.seq, flood_now());
+}
+
+static int
+find_udp_peer(struct udp_peer const *p, void *ctx)
+{
+    struct endpoint const *e = ctx;
+
+    return endpoint_cmp(&p->peer_addr, e) == 0
+        || (p->bond != NULL && bond_has_path(p->bond, e));
+}
+
+struct udp_peer *
+udp_find_peer(struct udp *udp,
+              struct endpoint const *remote)
+{
+    struct udp_peer *it;
+
+    it = v_udp_find_if(udp->udp_peers, find_udp_peer, (void *)remote);
+    if (it == v_udp_end(udp->udp_peers))
+        return NULL;
+    return it;
+}
+
+/* The socket bound on the address of local, whatever its port, or NULL */
+struct udp_transport *
+udp_transport_find(struct udp *udp,
+                   struct sockaddr const *local)
+{
+    struct udp_transport **it = NULL;
+    struct udp_transport **ite = NULL;
+
+    for (it = v_transport_begin(udp->transports),
+         ite = v_transport_end(udp->transports);
+         it != ite;
+         it = v_transport_next(it))
+    {
+        struct sockaddr const *bound = endpoint_addr(&(*it)->endpoint);
+
+        if (bound->sa_family == local->sa_family
+            && evutil_sockaddr_cmp(bound, local, 0) == 0)
+            return *it;
+    }
+    return NULL;
+}
+
+/*
+ * The socket to reach a peer from: the one bound on local if there is one,
+ * else the first one of the family, else the first one.
+ */
+struct udp_transport *
+udp_transport_for(struct udp *udp,
+                  struct sockaddr const *local,
+                  int family)
+{
+    struct udp_transport **it = NULL;
+    struct udp_transport **ite = NULL;
+    struct udp_transport *same_family = NULL;
+
+    for (it = v_transport_begin(udp->transports),
+         ite = v_transport_end(udp->transports);
+         it != ite;
+         it = v_transport_next(it))
+    {
+        struct sockaddr const *bound = endpoint_addr(&(*it)->endpoint);
+
+        if (bound->sa_family != family)
+            continue;
+        if (local != NULL && evutil_sockaddr_cmp(bound, local, 0) == 0)
+            return *it;
+        if (same_family == NULL)
+            same_family = *it;
+    }
+    if (same_family != NULL)
+        return same_family;
+    if (v_transport_size(udp->transports) == 0)
+        return NULL;
+    return v_transport_at(udp->transports, 0);
+}
+
+/*
+ * Add a peer, reached through t, or through the socket which fits its family
+ * best if NULL.
+ */
+struct udp_peer *
+udp_register_new_peer(struct udp *udp,
+                      struct udp_transport *t,
+                      struct endpoint *remote,
+                      int ssl_flags)
+{
+    struct udp_peer tmp_udp; 
+    struct udp_peer *p;
+    struct endpoint *e = &tmp_udp.peer_addr;
+
+    if (t == NULL)
+        t = udp_transport_for(udp, NULL, endpoint_addr(remote)->sa_family);
+    if (t == NULL)
+        return NULL;
+    memset(&tmp_udp, 0, sizeof(tmp_udp));
+    endpoint_copy(e, remote);
+    tmp_udp.transport = t;
+    tmp_udp.ssl_flags = ssl_flags;
+    keepalive_init(&tmp_udp.keepalive, udp);
+    pmtu_init(&tmp_udp.pmtu, endpoint_addr(remote)->sa_family);
+    if (ssl_flags & DTLS_ENABLE)
+    {
+        int err = dtls_new_peer(udp, &tmp_udp);
+        if (err == -1)
+            log_warnx("[DTLS] failed to create ssl state for this peer");
+    }
+    log_info("[%s] peering with %s from port %d",
+             (ssl_flags & DTLS_ENABLE) ? "DTLS" : "UDP",
+             endpoint_presentation(remote),
+             udp_get_port(t));
+    p = v_udp_insert(udp->udp_peers, &tmp_udp);
+    ++udp->peers_gen;
+    /* Let the handshake engine send the first flight */
+    if ((ssl_flags & DTLS_ENABLE) && udp->dtls_running)
+        async_wake(udp->udp_dtls_fib, /*unused*/0);
+    if (udp->pmtu_running)
+        async_wake(udp->udp_pmtu_fib, /*unused*/0);
+    return p;
+}
+
+static void
+_broadcast_udp_to_peers(struct server *s, void *async_ctx)
+{
+    struct udp          *udp = s->udp;
+    struct vector_frame *frames = s->frames_to_send;
+    struct frame        *fit = NULL;
+    struct frame        *fite = NULL;
+    int                 routed = udp_routed_frames(udp);
+
+    /*
+     * Take the pending frames for us, the device fiber keeps queuing in the
+     * other vector while we are sending these ones.
+     */
+    s->frames_to_send = udp->brd_frames;
+    udp->brd_frames = frames;
+
+    /* The header doesn't depend on the peer, write it once per frame */
+    for (fit = v_frame_begin(frames), fite = v_frame_end(frames);
+         fit != fite;
+         fit = v_frame_next(fit))
+    {
+        /* Enough space have been allocated in front of the frame */
+        if (routed)
+        {
+            struct packet_route r;
+
+            /* With routing, the destination is found when it is sent */
+            r.src = udp->flood->self;
+            r.dst = 0;
+            r.ttl = ROUTE_TTL;
+            r.seq = ++udp->flood->seq;
+            frame_set_routed_hdr(fit, &r);
+        }
+        else
+            frame_set_hdr(fit);
+    }
+    udp_send_frames(async_ctx, udp, udp->tx_burst,
+                    v_frame_begin(frames), v_frame_size(frames), NULL);
+    v_frame_foreach(frames, frame_free);
+    v_frame_clean(frames);
+}
 
 void
-forward_udp_frame_to_other_peers(void *async_ctx,
-                                 struct udp *udp,
-                                 struct frame *current_frame,
-                                 struct sockaddr *current_sockaddr,
-                                 unsigned int
-                                 current_socklen) 
+broadcast_udp(void *ctx)
+{
+    struct server *s = (struct server *)sched_get_userptr(ctx);
+    struct udp *udp = s->udp;
+
+    while (1)
+    {
+        struct timeval next;
+        int armed;
+
+        armed = udp_agg_flush_expired(ctx, udp, udp->tx_burst, &next);
+        /* A wake may have been lost while we were sending */
+        if (v_frame_size(s->frames_to_send) == 0)
+            async_wait(ctx, armed ? &next : NULL);
+        _broadcast_udp_to_peers(s, ctx);
+    }
+}
+
+void
+broadcast_udp_to_peers(struct server *s)
+{
+    struct fiber *F = s->udp->udp_brd_fib;
+
+    async_wake(F, /*unused*/0);
+}
+
+#if !defined Windows
+/*
+ * Read a train of datagrams coalesced by the kernel, waiting for it only if
+ * wait is set. Returns -1 if nothing was read.
+ */
+static int
+udp_gro_read(void *async_ctx,
+             struct udp_transport *t,
+             int wait)
 {
-    struct udp_peer *it = NULL;
-    struct udp_peer *ite = NULL;
-    struct endpoint current_endp;
+    struct udp_gro *g = t->gro;
+    struct sockaddr_storage sockaddr;
+    unsigned char control[TNT_UDP_CONTROL_SIZE];
+    struct iovec iov;
+    struct msghdr msg;
+    ssize_t n;
 
-    endpoint_init(&current_endp, current_sockaddr, current_socklen);
-    (void)current_socklen;
-    for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
-        it != ite;
-        it = v_udp_next(it))
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = g->buf;
+    iov.iov_len = UDP_GRO_BUF_SIZE;
+    msg.msg_name = &sockaddr;
+    msg.msg_namelen = sizeof(sockaddr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (wait)
     {
-        int err;
+        do
+            n = async_recvmsg(async_ctx, t->fd, &msg, 0);
+        while (n == -1 && udp_zc_woken(t));
+    }
+    else
+        n = recvmsg(t->fd, &msg, 0);
+    if (n == -1)
+        return -1;
+    g->len = (size_t)n;
+    g->off = 0;
+    g->segment = tnt_udp_gro_segment(&msg);
+    if (g->segment == 0)
+        g->segment = g->len;
+    endpoint_init(&g->from, (struct sockaddr *)&sockaddr, msg.msg_namelen);
+    return 0;
+}
+
+/*
+ * Same as udp_recv_burst, with the receive offload. The datagrams of a train
+ * are split in the slots, what doesn't fit in the burst waits for the next
+ * one.
+ */
+static int
+udp_recv_burst_gro(void *async_ctx,
+                   struct udp_transport *t,
+                   struct udp_burst *b)
+{
+    struct udp_gro *g = t->gro;
 
-        /* If it's not the peer we received the data from. */
-        if (endpoint_cmp(&it->peer_addr, &current_endp) == 0)
+    b->count = 0;
+    if (g->off == g->len && udp_gro_read(async_ctx, t, 1) == -1)
+        return -1;
+    while (b->count < CRYPTO_BURST_MAX)
+    {
+        size_t len;
+
+        if (g->off == g->len && udp_gro_read(async_ctx, t, 0) == -1)
+            break;
+        len = g->len - g->off;
+        if (len > g->segment)
+            len = g->segment;
+        /* Larger than any frame we may send, it can't be ours */
+        if (len <= b->slot_size)
         {
-            continue;
+            memcpy(UDP_SLOT(b, b->count), g->buf + g->off, len);
+            b->lens[b->count] = len;
+            endpoint_copy(&b->peers[b->count], &g->from);
+            b->via[b->count] = t;
+            ++b->count;
         }
-        
-        err = async_sendto(async_ctx,
-                           udp->fd,
-                           current_frame->raw_packet,
-                           current_frame->size + sizeof(struct packet_hdr),
+        g->off += len;
+    }
+    return (int)b->count;
+}
+#endif
+
+/*
+ * Wait for a datagram on t, then drain the socket without blocking so a whole
+ * burst is handled at once.
+ * Returns the number of datagrams read, -1 on error.
+ */
+static int
+udp_recv_burst(void *async_ctx,
+               struct udp_transport *t,
+               struct udp_burst *b)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t socklen = sizeof(sockaddr);
+    ssize_t n;
+
+#if !defined Windows
+    if (t->gro != NULL)
+        return udp_recv_burst_gro(async_ctx, t, b);
+#endif
+    b->count = 0;
+    do
+    {
+        socklen = sizeof(sockaddr);
+        n = async_recvfrom(async_ctx,
+                           t->fd,
+                           (char *)UDP_SLOT(b, 0),
+                           b->slot_size,
                            0,
-                           endpoint_addr(&it->peer_addr),
-                           endpoint_addrlen(&it->peer_addr));
+                           (struct sockaddr *)&sockaddr,
+                           &socklen);
+    } while (n == -1 && udp_zc_woken(t));
+    while (n != -1)
+    {
+        b->lens[b->count] = (size_t)n;
+        endpoint_init(&b->peers[b->count], (struct sockaddr *)&sockaddr,
+                      socklen);
+        b->via[b->count] = t;
+        if (++b->count == CRYPTO_BURST_MAX)
+            break;
+        socklen = sizeof(sockaddr);
+        n = recvfrom(t->fd,
+                     (char *)UDP_SLOT(b, b->count),
+                     b->slot_size,
+                     0,
+                     (struct sockaddr *)&sockaddr,
+                     &socklen);
+    }
+    if (b->count == 0)
+        return -1;
+    return (int)b->count;
+}
 
-        if (err == -1)
+
+/*
+ * Turn the datagrams of the burst into frames.
+ * The sealed ones are opened in one go, frames[i].frame is left to NULL for
+ * the datagrams that must be dropped.
+ */
+static void
+udp_open_burst(struct udp *udp,
+               struct udp_burst *b,
+               struct frame *frames)
+{
+    size_t idx[CRYPTO_BURST_MAX];
+    struct udp_peer *from[CRYPTO_BURST_MAX];
+    size_t nops = 0;
+    size_t i;
+
+    for (i = 0; i < b->count; ++i)
+    {
+        unsigned char *slot = UDP_SLOT(b, i);
+        struct udp_peer *peer;
+        unsigned int size;
+        unsigned int flags;
+        size_t hdr_len;
+
+        memset(&frames[i], 0, sizeof(frames[i]));
+        if (b->lens[i] < sizeof(struct packet_hdr))
+            continue;
+        /* DTLS records share the socket, their first byte tells them apart */
+        if (dtls_is_record(slot, b->lens[i]))
         {
-            log_warn("[%s] error while sending to %s",
-                     (it->ssl_flags & DTLS_ENABLE) ? "DTLS" : "UDP",
-                     endpoint_presentation(&it->peer_addr));
-            break;
+            dtls_input(udp, &b->peers[i], slot, b->lens[i]);
+            continue;
+        }
+        if (keepalive_is_control(slot, b->lens[i]))
+        {
+            keepalive_input(b->via[i], &b->peers[i], slot, b->lens[i]);
+            continue;
+        }
+        if (punch_is_control(slot, b->lens[i]))
+        {
+            punch_input(b->via[i], &b->peers[i], slot, b->lens[i]);
+            continue;
+        }
+        if (pmtu_is_control(slot, b->lens[i]))
+        {
+            pmtu_input(udp, &b->peers[i], slot, b->lens[i]);
+            continue;
+        }
+        hdr_len = packet_hdr_read(slot, b->lens[i], &size, &flags);
+        if (hdr_len == 0)
+            continue;
+
+        peer = udp_find_peer(udp, &b->peers[i]);
+        if (peer != NULL && peer->crypto.enabled)
+        {
+            struct crypto_op *op = &b->ops[nops];
+
+            op->cs = &peer->crypto;
+            op->aad = slot;
+            op->aad_len = hdr_len;
+            op->in = slot + hdr_len;
+            op->in_len = b->lens[i] - hdr_len;
+            op->out = UDP_PLAIN(b, i) + hdr_len;
+            from[nops] = peer;
+            idx[nops++] = i;
+        }
+        else if (udp->require_keys)
+        {
+            /* We expect sealed data, and have no key for this one */
+            log_debug("[DATA] drop %d bytes from unkeyed peer %s",
+                      b->lens[i], endpoint_presentation(&b->peers[i]));
+        }
+        else if (size == b->lens[i] - hdr_len)
+        {
+            if (peer != NULL)
+                keepalive_heard(peer);
+            frames[i].size = size;
+            frames[i].raw_packet = slot;
+            frames[i].frame = slot + hdr_len;
+        }
+    }
+
+    crypto_open_burst(b->ops, nops);
+    for (i = 0; i < nops; ++i)
+    {
+        struct crypto_op *op = &b->ops[i];
+        size_t slot_idx = idx[i];
+        unsigned int size;
+        unsigned int flags;
+        enum replay_verdict verdict;
+
+        (void)packet_hdr_read(op->aad, op->aad_len, &size, &flags);
+        if (op->err == -1 || op->out_len != size)
+        {
+            log_debug("[DATA] drop a forged frame from %s",
+                      endpoint_presentation(&b->peers[slot_idx]));
+            continue;
         }
-        log_debug("[%s] forwarding %d(%-#2x) bytes to %s",
-                  (it->ssl_flags & DTLS_ENABLE) ? "DTLS" : "UDP",
-                  current_frame->size, current_frame->size,
-                  endpoint_presentation(&it->peer_addr));
+        /* Only authenticated frames may move the replay window */
+        verdict = replay_check(&from[i]->replay, op->seq);
+        if (verdict != REPLAY_OK)
+        {
+            log_debug("[DATA] drop %s frame %llu from %s",
+                      replay_verdict_str(verdict),
+                      (unsigned long long)op->seq,
+                      endpoint_presentation(&b->peers[slot_idx]));
+            continue;
+        }
+        keepalive_heard(from[i]);
+        memcpy(UDP_PLAIN(b, slot_idx), op->aad, op->aad_len);
+        b->seqs[slot_idx] = op->seq;
+        frames[slot_idx].size = (unsigned int)op->out_len;
+        frames[slot_idx].raw_packet = UDP_PLAIN(b, slot_idx);
+        frames[slot_idx].frame = op->out;
     }
 }
 
-struct udp_peer *
-udp_register_new_peer(struct udp *udp,
-                      struct endpoint *remote,
-                      int ssl_flags)
+static void
+udp_deliver_frame(void *ctx,
+                  struct server *s,
+                  struct udp *udp,
+                  struct udp_burst *fwd,
+                  struct frame *current_frame,
+                  struct endpoint const *from_addr)
 {
-    struct udp_peer tmp_udp; 
-    struct endpoint *e = &tmp_udp.peer_addr;
+    int layer2 = (serv_opts.tunnel == TNT_TUNMODE_ETHERNET);
 
-    memset(&tmp_udp, 0, sizeof(tmp_udp));
-    endpoint_copy(e, remote);
-    tmp_udp.ssl_flags = ssl_flags;
-    if (ssl_flags == DTLS_ENABLE)
+    log_debug("[UDP] recving %d(%-#2x) from %s",
+              current_frame->size,
+              current_frame->size,
+              endpoint_presentation(from_addr));
+
+    /* A copy which came through another path */
+    if (udp_flooding(udp) && udp_flood_seen(udp, current_frame))
     {
-        int err = dtls_new_peer(udp->ctx, &tmp_udp);
-        if (err == -1)
-            log_warnx("[DTLS] failed to create ssl state for this peer");
+        log_debug("[FLOOD] drop a duplicate frame from %s",
+                  endpoint_presentation(from_addr));
+        return;
     }
-    log_info("[%s] peering with %s ",
-             (ssl_flags & DTLS_ENABLE) ? "DTLS" : "UDP",
-             endpoint_presentation(remote));
-    return v_udp_insert(udp->udp_peers, &tmp_udp);
+
+    /* The answer to a SYN must fit the path it came from */
+    if (serv_opts.mss_clamp)
+    {
+        struct udp_peer *from = udp_find_peer(udp, from_addr);
+        int mtu = (from != NULL) ? pmtu_device_mtu(udp, from) : 0;
+
+        if (mtu != 0)
+            (void)mss_clamp(current_frame->frame, current_frame->size,
+                            layer2, mtu);
+    }
+
+    /* And forward it to anyone else but except current peer*/
+    if (udp->hub != NULL || udp->route != NULL)
+    {
+        int local;
+
+        if (udp->hub != NULL)
+            local = udp_hub_queue(ctx, udp, fwd, current_frame, from_addr);
+        else
+            local = udp_route_queue(ctx, udp, fwd, current_frame, from_addr);
+        if (fwd->count > 0)
+            udp_flush_burst(ctx, udp, fwd);
+        /* It was for one of the spokes, or another node, only */
+        if (!local)
+            return;
+    }
+    else if (serv_opts.mode != TNT_DAEMONMODE_SPOKE)
+    {
+        udp_send_frames(ctx, udp, fwd, current_frame, 1, from_addr);
+    }
+    /* Write the current frame on the device, maybe coalesced */
+    device_write(ctx, s, current_frame);
 }
 
+/*
+ * Split an aggregate. Each of its frames is preceded by its own header,
+ * the frames are delivered until the first malformed one.
+ */
 static void
-_broadcast_udp_to_peers(struct server *s, void *async_ctx)
+udp_deliver_aggregate(void *ctx,
+                      struct server *s,
+                      struct udp *udp,
+                      struct udp_burst *fwd,
+                      struct frame *aggregate,
+                      struct endpoint const *from_addr)
+{
+    unsigned char *p = aggregate->frame;
+    unsigned char *end = p + aggregate->size;
+    struct frame sub;
+    int ret;
+
+    while ((ret = packet_aggregate_next(&p, end, &sub)) == 1)
+        udp_deliver_frame(ctx, s, udp, fwd, &sub, from_addr);
+    if (ret == -1)
+        log_debug("[UDP] malformed aggregate from %s",
+                  endpoint_presentation(from_addr));
+}
+
+/* Deliver an opened datagram, a single frame or an aggregate */
+static void
+udp_deliver_dgram(void *ctx,
+                  struct server *s,
+                  struct udp *udp,
+                  struct udp_burst *fwd,
+                  struct frame *f,
+                  struct endpoint const *from_addr)
+{
+    size_t hdr_len = (unsigned char *)f->frame
+                   - (unsigned char *)f->raw_packet;
+    unsigned int size;
+    unsigned int flags = 0;
+
+    (void)packet_hdr_read(f->raw_packet, hdr_len + f->size, &size, &flags);
+    if (flags & PACKET_AGGREGATE)
+        udp_deliver_aggregate(ctx, s, udp, fwd, f, from_addr);
+    else
+        udp_deliver_frame(ctx, s, udp, fwd, f, from_addr);
+}
+
+/*
+ * Deliver the held datagrams of the peer behind from_addr which may go now.
+ * The caller set the draining flag, which is cleared once they are all out.
+ * Delivering yields: the peer is looked for again every time.
+ */
+static void
+udp_bond_drain(void *ctx,
+               struct server *s,
+               struct udp *udp,
+               struct udp_burst *fwd,
+               struct endpoint const *from_addr)
+{
+    while (1)
+    {
+        struct udp_peer *peer = udp_find_peer(udp, from_addr);
+        struct bond_held h;
+        struct timeval now;
+        struct frame f;
+        unsigned int flags;
+        size_t hdr_len;
+
+        if (peer == NULL || peer->bond == NULL)
+            return;
+        evutil_gettimeofday(&now, NULL);
+        if (bond_reorder_pop(&peer->bond->reorder, &now, &h) == 0)
+        {
+            peer->bond->reorder.draining = 0;
+            return;
+        }
+        hdr_len = packet_hdr_read(h.buf, h.len, &f.size, &flags);
+        f.raw_packet = h.buf;
+        f.frame = h.buf + hdr_len;
+        udp_deliver_dgram(ctx, s, udp, fwd, &f, from_addr);
+        free(h.buf);
+    }
+}
+
+/*
+ * Deliver an opened datagram of a multipath peer in order: it is held while
+ * the ones before it may still come through a slower path.
+ */
+static void
+udp_bond_deliver(void *ctx,
+                 struct server *s,
+                 struct udp *udp,
+                 struct udp_burst *fwd,
+                 struct frame *f,
+                 struct endpoint const *from_addr,
+                 uint64_t seq)
+{
+    struct udp_peer *peer = udp_find_peer(udp, from_addr);
+    size_t len = (unsigned char *)f->frame - (unsigned char *)f->raw_packet
+               + f->size;
+    struct bond_reorder *r;
+    struct timeval now;
+    int verdict;
+
+    if (peer == NULL || peer->bond == NULL || serv_opts.reorder_delay == 0)
+    {
+        udp_deliver_dgram(ctx, s, udp, fwd, f, from_addr);
+        return;
+    }
+    r = &peer->bond->reorder;
+    evutil_gettimeofday(&now, NULL);
+    verdict = bond_reorder_push(r, seq, f->raw_packet, len, &now);
+    if (verdict == 2 && !r->draining)
+    {
+        /* No room left: the ones held go first, then it is pushed again */
+        r->draining = 1;
+        udp_bond_drain(ctx, s, udp, fwd, from_addr);
+        peer = udp_find_peer(udp, from_addr);
+        if (peer == NULL || peer->bond == NULL)
+        {
+            udp_deliver_dgram(ctx, s, udp, fwd, f, from_addr);
+            return;
+        }
+        r = &peer->bond->reorder;
+        evutil_gettimeofday(&now, NULL);
+        verdict = bond_reorder_push(r, seq, f->raw_packet, len, &now);
+    }
+    if (verdict == 0)
+    {
+        /* The bonding fiber owns the deadlines, let it know about this one */
+        if (r->count == 1 && udp->bond_running)
+            async_wake(udp->udp_bond_fib, /*unused*/0);
+        return;
+    }
+    r->draining = 1;
+    udp_deliver_dgram(ctx, s, udp, fwd, f, from_addr);
+    udp_bond_drain(ctx, s, udp, fwd, from_addr);
+}
+
+/*
+ * Deliver the held datagrams whose gap was not filled in time.
+ * Returns 1 and sets next to the earliest deadline left, 0 if there is none.
+ */
+int
+udp_bond_release(void *ctx,
+                 struct server *s,
+                 struct timeval *next)
 {
-    struct frame *fit = v_frame_begin(s->frames_to_send);
-    struct frame *fite = v_frame_end(s->frames_to_send);
-    struct udp   *udp = s->udp;
+    struct udp *udp = s->udp;
 
-    /* For all the frames*/
-    for (;fit != fite; fit = v_frame_next(fit))
+    while (1)
     {
         struct udp_peer *it = NULL;
         struct udp_peer *ite = NULL;
+        struct udp_peer *expired = NULL;
+        struct endpoint from;
+        struct timeval now;
+        int armed = 0;
+
+        evutil_gettimeofday(&now, NULL);
+        for (it = v_udp_begin(udp->udp_peers), ite = v_udp_end(udp->udp_peers);
+             it != ite;
+             it = v_udp_next(it))
+        {
+            struct timeval deadline;
 
-        it = v_udp_begin(udp->udp_peers);
-        ite = v_udp_end(udp->udp_peers);
-        /* For all the peers*/
-        for (;it != ite; it = v_udp_next(it))
-        {
-            int err;
-            struct packet_hdr hdr;
-
-            memset(&hdr, 0, sizeof (struct packet_hdr));
-
-            /* Header configuration for the packet */
-            /* Convert the size to netword presentation*/
-            hdr.size = htons(fit->size);
-            /* Copy the header to the packet */
-            /* Enough space have been allocated for header and the frame */
-            memcpy(fit->raw_packet, &hdr, sizeof(hdr));
-            err = async_sendto(async_ctx,
-                               udp->fd,
-                               fit->raw_packet,
-                               fit->size + sizeof(struct packet_hdr),
-                               0,
-                               endpoint_addr(&it->peer_addr),
-                               endpoint_addrlen(&it->peer_addr));
-
-            if (err == -1)
+            if (it->bond == NULL
+                || !bond_reorder_next(&it->bond->reorder, &deadline))
+                continue;
+            if (evutil_timercmp(&now, &deadline, <))
             {
-                log_warn("[%s] error while sending to %s",
-                         (it->ssl_flags & DTLS_ENABLE) ? "DTLS" : "UDP",
-                         endpoint_presentation(&it->peer_addr));
+                if (armed == 0 || evutil_timercmp(&deadline, next, <))
+                {
+                    *next = deadline;
+                    armed = 1;
+                }
+            }
+            else if (!it->bond->reorder.draining)
+            {
+                expired = it;
                 break;
             }
-            log_debug("[%s] sending %d(%-#2x) bytes to %s",
-                      (it->ssl_flags & DTLS_ENABLE) ? "DTLS" : "UDP",
-                      fit->size, fit->size,
-                      endpoint_presentation(&it->peer_addr));
         }
+        if (expired == NULL)
+            return armed;
+        /* The vector may change while they are delivered, look again after */
+        expired->bond->reorder.draining = 1;
+        endpoint_copy(&from, &expired->peer_addr);
+        udp_bond_drain(ctx, s, udp, udp->bond_burst, &from);
     }
-    v_frame_foreach(s->frames_to_send, frame_free);
-    v_frame_clean(s->frames_to_send);
 }
 
+/*
+ * The receive fiber of a socket. The frames it forwards go through its own
+ * burst, the sending fibers may be using the others.
+ */
 void
-broadcast_udp(void *ctx)
+server_udp(void *ctx)
 {
-    struct server *s = (struct server *)sched_get_userptr(ctx);
+    struct udp_transport *t = (struct udp_transport *)sched_get_userptr(ctx);
+    struct server *s = t->server;
+    struct udp *udp = t->udp;
+    struct udp_burst *b = t->rx_burst;
+    struct frame frames[CRYPTO_BURST_MAX];
+    size_t i;
 
-    while (1)
+    while (udp_recv_burst(ctx, t, b) != -1)
     {
-        async_yield(ctx, /*unused*/0);
-        _broadcast_udp_to_peers(s, ctx);
+        udp_open_burst(udp, b, frames);
+        for (i = 0; i < b->count; ++i)
+        {
+            struct frame *current_frame = &frames[i];
+
+            if (current_frame->frame == NULL)
+                continue;
+
+            /* The opened ones were moved to the clear slots */
+            if (udp->udp_bond_fib != NULL
+                && current_frame->raw_packet == UDP_PLAIN(b, i))
+                udp_bond_deliver(ctx, s, udp, t->fwd_burst, current_frame,
+                                 &b->peers[i], b->seqs[i]);
+            else
+                udp_deliver_dgram(ctx, s, udp, t->fwd_burst, current_frame,
+                                  &b->peers[i]);
+        }
+        /* The burst is over, don't hold its segments any longer */
+        device_flush(ctx, s);
     }
+    sched_fiber_exit(ctx, 1);
 }
 
 void
-broadcast_udp_to_peers(struct server *s)
+udp_peer_free(struct udp_peer const *u)
 {
-    struct fiber *F = s->udp->udp_brd_fib;
-
-    async_wake(F, /*unused*/0);
+    if (u->crypto.enabled)
+    {
+        log_info("[DATA] %s: %llu late, %llu duplicate, "
+                 "%llu out of window frames dropped",
+                 endpoint_presentation(&u->peer_addr),
+                 (unsigned long long)u->replay.late,
+                 (unsigned long long)u->replay.duplicate,
+                 (unsigned long long)u->replay.out_of_window);
+    }
+    if (u->pmtu.oversize > 0)
+    {
+        log_info("[PMTU] %s: %llu frames too big for the path dropped",
+                 endpoint_presentation(&u->peer_addr),
+                 (unsigned long long)u->pmtu.oversize);
+    }
+    dtls_free((struct udp_peer *)u);
+    crypto_free((struct crypto_state *)&u->crypto);
+    flood_peer_free((struct flood_peer *)&u->flood);
+    bond_free(u->bond);
+    free(u->agg);
 }
 
-void
-server_udp(void *ctx)
+static void
+udp_transport_delete(struct udp_transport *t)
 {
-    struct server *s = (struct server *)sched_get_userptr(ctx);
-    struct frame current_frame;
-    struct sockaddr_storage sockaddr;
-    unsigned int socklen = sizeof sockaddr;
-    evutil_socket_t udp_fd;
-    evutil_socket_t tap_fd;
-    int err;
-    struct endpoint e;
-
-    memset(&e, 0, sizeof(e));
-    udp_fd = s->udp->fd;
-    tap_fd = s->tap_fd;
-    memset(&current_frame, 0, sizeof current_frame);
-    while((err = frame_recvfrom(ctx,
-                                udp_fd,
-                                &current_frame,
-                                (struct sockaddr *)&sockaddr,
-                                &socklen)) != -1)
-    {
-        endpoint_init(&e, (struct sockaddr *)&sockaddr, socklen);
-        log_debug("[UDP] recving %d(%-#2x) from %s",
-                  current_frame.size,
-                  current_frame.size,
-                  endpoint_presentation(&e));
-
-        /* And forward it to anyone else but except current peer*/
-        forward_udp_frame_to_other_peers(ctx,
-                                         s->udp,
-                                         &current_frame,
-                                         endpoint_addr(&e),
-                                         endpoint_addrlen(&e));
-#if defined Windows
-        /*
-         * Send to current frame to the windows thread handling the tun/tap
-         * devices and clean the evbuffer
-         */
-        send_buffer_to_device_thread(s, &current_frame);
-#else
-        /* Write the current frame on the device and clean the evbuffer*/
-        async_write(ctx,
-                    tap_fd,
-                    current_frame.frame,
-                    current_frame.size);
-#endif
-        frame_free(&current_frame);
-    }
-    sched_fiber_exit(ctx, 1);
+    if (t->fd != -1)
+        (void)close((int)t->fd);
+    if (t->recv_fib != NULL)
+        sched_fiber_delete(t->recv_fib);
+    udp_burst_delete(t->fwd_burst);
+    udp_burst_delete(t->rx_burst);
+    if (t->gro != NULL)
+        free(t->gro->buf);
+    free(t->gro);
+    free(t->zc);
+    free(t);
 }
 
+/*
+ * Stop peering with peer. The senders holding a peer across a yield look for
+ * it again once peers_gen moved.
+ */
 void
-udp_peer_free(struct udp_peer const *u)
+udp_remove_peer(struct udp *udp,
+                struct udp_peer *peer)
 {
-    if (u->_bio_backend != NULL)
-        BIO_free(u->_bio_backend);
-    if (u->bio != NULL)
-        BIO_free(u->bio);
-    if (u->ssl != NULL)
-        SSL_free(u->ssl);
+    udp_peer_free(peer);
+    v_udp_erase(udp->udp_peers, peer);
+    ++udp->peers_gen;
 }
 
 void
 server_udp_exit(struct udp *udp)
 {
-    (void)close((int)udp->fd);
     SSL_CTX_free(udp->ctx);
     v_udp_foreach(udp->udp_peers, udp_peer_free);
     v_udp_delete(udp->udp_peers);
+    v_frame_foreach(udp->brd_frames, frame_free);
+    v_frame_delete(udp->brd_frames);
+    if (udp->zc != NULL)
+    {
+        size_t i;
+
+        /* The ones attached to a burst go with it */
+        for (i = 0; i < udp->zc->count; ++i)
+        {
+            if (!udp->zc->bufs[i].used)
+                free(udp->zc->bufs[i].slots);
+        }
+        free(udp->zc);
+    }
+    udp_burst_delete(udp->tx_burst);
+    v_transport_foreach(udp->transports, udp_transport_delete);
+    v_transport_delete(udp->transports);
+    flood_delete(udp->flood);
+    hub_delete(udp->hub);
+    dtls_sessions_free(udp->dtls_sessions);
+    if (udp->udp_dtls_fib != NULL)
+        sched_fiber_delete(udp->udp_dtls_fib);
+    sched_fiber_delete(udp->udp_pmtu_fib);
+    if (udp->udp_punch_fib != NULL)
+        sched_fiber_delete(udp->udp_punch_fib);
+    v_punch_delete(udp->punch_cands);
+    if (udp->udp_bond_fib != NULL)
+        sched_fiber_delete(udp->udp_bond_fib);
+    udp_burst_delete(udp->bond_burst);
+    if (udp->udp_route_fib != NULL)
+        sched_fiber_delete(udp->udp_route_fib);
+    if (udp->udp_keepalive_fib != NULL)
+        sched_fiber_delete(udp->udp_keepalive_fib);
+    route_delete(udp->route);
     sched_fiber_delete(udp->udp_brd_fib);
-    sched_fiber_delete(udp->udp_recv_fib);
 }
 
-int
-server_udp_init(struct server *s,
-                struct udp *udp,
-                struct endpoint *e)
+/* Lend the slots of b to the zerocopy pool */
+static void
+udp_zc_register(struct udp *udp,
+                struct udp_burst *b)
+{
+    struct udp_zc *zc = udp->zc;
+
+    if (zc == NULL || zc->count == UDP_ZC_BUFS_MAX)
+        return;
+    zc->bufs[zc->count].slots = b->slots;
+    zc->bufs[zc->count].used = 1;
+    b->zc_buf = (int)zc->count;
+    ++zc->count;
+}
+
+/*
+ * Open a socket on the address of e, on a random port, with its own receive
+ * fiber. The frames it receives go to the peers of udp.
+ */
+struct udp_transport *
+udp_transport_add(struct udp *udp,
+                  struct server *s,
+                  struct endpoint *e)
 {
     int             err;
-    struct endpoint tmp_endpoint;
+    struct udp_transport *t;
     evutil_socket_t tmp_sock = 0;
 
-    tmp_sock = tnt_udp_socket(endpoint_addr(e)->sa_family);
-    endpoint_copy(&tmp_endpoint, e);
+    t = tnt_new(struct udp_transport);
+    if (t == NULL)
+        return NULL;
+    t->udp = udp;
+    t->server = s;
+    t->fd = tnt_udp_socket(endpoint_addr(e)->sa_family);
+    tmp_sock = t->fd;
+    endpoint_copy(&t->endpoint, e);
 
     if (tmp_sock == -1)
     {
         log_warn("[INIT] [UDP] socket creation failed:");
-        return -1;
+        udp_transport_delete(t);
+        return NULL;
     }
-    endpoint_set_port(&tmp_endpoint, 0); /* Means random port */
+    /* The path MTU discovery needs the datagrams to be dropped, not split */
+    if (tnt_udp_set_dontfrag(tmp_sock, endpoint_addr(e)->sa_family) == -1)
+        log_notice("[INIT] [UDP] can't set the DF bit, the path MTU will "
+                   "be overestimated");
+    endpoint_set_port(&t->endpoint, 0); /* Means random port */
     err = bind(tmp_sock,
-               endpoint_addr(&tmp_endpoint),
-               tmp_endpoint.addrlen);
+               endpoint_addr(&t->endpoint),
+               t->endpoint.addrlen);
 
     if (err == -1)
     {
         log_warn("[INIT] [UDP] binding: ");
-        return -1;
+        udp_transport_delete(t);
+        return NULL;
     }
 
-    endpoint_assign_sockname(tmp_sock, &tmp_endpoint);
+    endpoint_assign_sockname(tmp_sock, &t->endpoint);
     log_debug("[INIT] [UDP] udp listen on %s",
-              endpoint_presentation(&tmp_endpoint));
+              endpoint_presentation(&t->endpoint));
 
     err = evutil_make_socket_nonblocking(tmp_sock);
     if (err == -1)
     {
-        return -1;
+        udp_transport_delete(t);
+        return NULL;
+    }
+    t->fwd_burst = udp_burst_new();
+    t->rx_burst = udp_burst_new();
+    if (t->fwd_burst == NULL || t->rx_burst == NULL)
+    {
+        log_warnx("[INIT] [UDP] unable to allocate the bursts");
+        udp_transport_delete(t);
+        return NULL;
+    }
+    /* The offloads are used when the kernel has them */
+    t->gso = (tnt_udp_enable_gso(tmp_sock) == 0);
+    if (tnt_udp_enable_gro(tmp_sock) == 0)
+    {
+        t->gro = tnt_new(struct udp_gro);
+        if (t->gro != NULL)
+            t->gro->buf = malloc(UDP_GRO_BUF_SIZE);
+        if (t->gro == NULL || t->gro->buf == NULL)
+        {
+            log_warnx("[INIT] [UDP] unable to allocate the offload buffer");
+            udp_transport_delete(t);
+            return NULL;
+        }
+    }
+    log_debug("[INIT] [UDP] segmentation offload %s, receive offload %s",
+              t->gso ? "on" : "off", t->gro != NULL ? "on" : "off");
+    if (udp->zc != NULL)
+    {
+        if (tnt_udp_enable_zerocopy(tmp_sock) == -1)
+            log_notice("[INIT] [UDP] zerocopy unavailable on %s",
+                       endpoint_presentation(&t->endpoint));
+        else if ((t->zc = tnt_new(struct udp_zc_ring)) != NULL)
+            udp_zc_register(udp, t->fwd_burst);
     }
-    endpoint_copy(&udp->udp_endpoint, &tmp_endpoint);
-    udp->fd = tmp_sock;
+    t->recv_fib = sched_new_fiber(s->ev_sched, server_udp, (intptr_t)t);
+    v_transport_push(udp->transports, t);
+    return t;
+}
+
+/*
+ * The state shared by the sockets: the peers, and the fibers sending to
+ * them. The sockets are added with udp_transport_add.
+ */
+int
+server_udp_init(struct server *s,
+                struct udp *udp)
+{
     udp->udp_peers = v_udp_new();
-    udp->udp_recv_fib = sched_new_fiber(s->ev_sched, server_udp, (intptr_t)s);
+    udp->transports = v_transport_new();
+    udp->brd_frames = v_frame_new();
+    udp->tx_burst = udp_burst_new();
+    if (udp->tx_burst == NULL)
+    {
+        log_warnx("[INIT] [UDP] unable to allocate the bursts");
+        return -1;
+    }
+    udp->flood = flood_new();
+    if (udp->flood == NULL)
+    {
+        log_warnx("[INIT] [UDP] unable to allocate the flood cache");
+        return -1;
+    }
+    if (serv_opts.mode == TNT_DAEMONMODE_HUB)
+    {
+        udp->hub = hub_new();
+        if (udp->hub == NULL)
+        {
+            log_warnx("[INIT] [UDP] unable to allocate the hub table");
+            return -1;
+        }
+    }
+    if (serv_opts.zerocopy_threshold > 0
+        && (udp->zc = tnt_new(struct udp_zc)) != NULL)
+    {
+        udp->zc->threshold = (size_t)serv_opts.zerocopy_threshold;
+        udp_zc_register(udp, udp->tx_burst);
+    }
     udp->udp_brd_fib = sched_new_fiber(s->ev_sched, broadcast_udp, (intptr_t)s);
-    udp->ctx = create_udp_ctx();
+    udp->udp_pmtu_fib = sched_new_fiber(s->ev_sched, server_pmtu, (intptr_t)s);
+    udp->require_keys = (s->server_ctx != NULL);
+    udp->dtls_sessions = v_dtls_sess_new();
+    /* A punched path has no meta-connexion session to key it */
+    if (serv_opts.dtls || (serv_opts.hole_punching && udp->require_keys))
+    {
+        udp->ctx = create_udp_ctx(s->server_ctx);
+        if (udp->ctx != NULL)
+            udp->udp_dtls_fib = sched_new_fiber(s->ev_sched, server_dtls,
+                                                (intptr_t)s);
+    }
+    udp->punch_cands = v_punch_new();
+    if (serv_opts.hole_punching)
+    {
+        /* A direct path has no meta-connexion to key it */
+        if (udp->require_keys && udp->udp_dtls_fib == NULL)
+            log_notice("[INIT] [PUNCH] hole punching needs a DTLS context, "
+                       "disabled");
+        else if (udp->hub != NULL || serv_opts.mode == TNT_DAEMONMODE_SPOKE)
+            log_notice("[INIT] [PUNCH] no hole punching in a star, disabled");
+        else
+            udp->udp_punch_fib = sched_new_fiber(s->ev_sched, server_punch,
+                                                 (intptr_t)s);
+    }
+    if (serv_opts.multipath != TNT_MULTIPATH_OFF)
+    {
+        udp->bond_burst = udp_burst_new();
+        if (udp->bond_burst == NULL)
+        {
+            log_warnx("[INIT] [UDP] unable to allocate the bursts");
+            return -1;
+        }
+        udp_zc_register(udp, udp->bond_burst);
+        udp->udp_bond_fib = sched_new_fiber(s->ev_sched, server_bond,
+                                            (intptr_t)s);
+    }
+    if (serv_opts.routing)
+    {
+        if (udp->hub != NULL || serv_opts.mode == TNT_DAEMONMODE_SPOKE)
+            log_notice("[INIT] [ROUTE] no routing in a star, disabled");
+        else
+        {
+            udp->route = route_new(udp->flood->self);
+            if (udp->route == NULL)
+            {
+                log_warnx("[INIT] [UDP] unable to allocate the routes");
+                return -1;
+            }
+            udp->udp_route_fib = sched_new_fiber(s->ev_sched, server_route,
+                                                 (intptr_t)s);
+        }
+    }
+    if (keepalive_setup(udp) > 0)
+        udp->udp_keepalive_fib = sched_new_fiber(s->ev_sched, server_keepalive,
+                                                 (intptr_t)s);
     return 0;
 }
 
 void
 server_udp_launch(struct udp *u)
 {
+    struct udp_transport **it = NULL;
+    struct udp_transport **ite = NULL;
+
     if (u->udp_brd_fib != NULL)
         sched_fiber_launch(u->udp_brd_fib);
-    if (u->udp_recv_fib != NULL)
-        sched_fiber_launch(u->udp_recv_fib);
+    for (it = v_transport_begin(u->transports),
+         ite = v_transport_end(u->transports);
+         it != ite;
+         it = v_transport_next(it))
+    {
+        if ((*it)->recv_fib != NULL)
+            sched_fiber_launch((*it)->recv_fib);
+    }
+    if (u->udp_dtls_fib != NULL && !u->dtls_running)
+    {
+        u->dtls_running = 1;
+        sched_fiber_launch(u->udp_dtls_fib);
+    }
+    if (u->udp_pmtu_fib != NULL && !u->pmtu_running)
+    {
+        u->pmtu_running = 1;
+        sched_fiber_launch(u->udp_pmtu_fib);
+    }
+    if (u->udp_punch_fib != NULL && !u->punch_running)
+    {
+        u->punch_running = 1;
+        sched_fiber_launch(u->udp_punch_fib);
+    }
+    if (u->udp_bond_fib != NULL && !u->bond_running)
+    {
+        u->bond_running = 1;
+        sched_fiber_launch(u->udp_bond_fib);
+    }
+    if (u->udp_route_fib != NULL && !u->route_running)
+    {
+        u->route_running = 1;
+        sched_fiber_launch(u->udp_route_fib);
+    }
+    if (u->udp_keepalive_fib != NULL && !u->keepalive_running)
+    {
+        u->keepalive_running = 1;
+        sched_fiber_launch(u->udp_keepalive_fib);
+    }
     /*if (u->udp_demux != NULL)
         sched_fiber_launch(u->udp_demux);*/
 }
 
 struct udp *
-server_udp_new(struct server *s,
-               struct endpoint *e)
+server_udp_new(struct server *s)
 {
     int err;
     struct udp *udp;
@@ -330,7 +2200,7 @@ server_udp_new(struct server *s,
     {
         return NULL;
     }
-    err = server_udp_init(s, udp, e);
+    err = server_udp_init(s, udp);
     if (err == -1)
     {
         free(udp);
@@ -339,60 +2209,8 @@ server_udp_new(struct server *s,
     return udp;
 }
 
-int
-frame_recvfrom(void *ctx,
-               evutil_socket_t fd,
-               struct frame *frame,
-               struct sockaddr *saddr,
-               unsigned int *socklen)
-{
-    int err = 0;
-    struct packet_hdr hdr;
-    unsigned short local_size;
-
-    err = async_recvfrom(ctx,
-                         fd,
-                         (char *)&hdr,
-                         sizeof(struct packet_hdr),
-                         MSG_PEEK,
-                         saddr,
-                         (int *)socklen);
-    /*
-    ** Sometimes, on some OS, recvfrom return EMSGSIZE when the size of the
-    ** peeked buffer is not enough to read the entire datagram.
-    ** So we need to check for this specific case.
-    */
-    if (err == -1)
-    {
-        int local_err = EVUTIL_SOCKET_ERROR();
-
-#if defined Windows
-#define MSG_TOO_LONG WSAEMSGSIZE
-#else
-#define MSG_TOO_LONG EMSGSIZE
-#endif
-        if (local_err != MSG_TOO_LONG)
-        {
-            /* So there is a real error */
-            return err;
-        }
-#undef MSG_TOO_LONG
-    }
-    local_size = ntohs(hdr.size);
-    frame_alloc(frame, local_size);
-    err = async_recv(ctx,
-                     fd,
-                     (char *)frame->raw_packet,
-                     frame->size + sizeof(struct packet_hdr),
-                     0);
-    return err;
-}
-
 unsigned short
-udp_get_port(struct udp *udp)
+udp_get_port(struct udp_transport *t)
 {
-    return endpoint_port(&udp->udp_endpoint);
+    return endpoint_port(&t->endpoint);
 }
-
-
-
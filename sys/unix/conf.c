@@ -83,3 +83,50 @@ tnt_parse_file(const char *file) {
     return 0;
 }
 
+
+/*
+ * Read the whole configuration file, to parse it elsewhere.
+ * The returned buffer must be freed.
+ */
+char *
+tnt_read_file(const char *file, size_t *len) {
+    int fd;
+    char *buf;
+    struct stat st;
+    ssize_t n;
+    size_t off = 0;
+
+    if (file == NULL) {
+        file = _PATH_DEFAULT_CONFIG_FILE;
+    }
+
+    if ((fd = open(file, O_RDONLY)) == -1) {
+        log_warn("%s: can't open", file);
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1) {
+        log_warn("%s: can't stat", file);
+        (void)close(fd);
+        return NULL;
+    }
+    if ((buf = malloc(st.st_size + 1)) == NULL) {
+        (void)close(fd);
+        return NULL;
+    }
+    while (off < (size_t)st.st_size) {
+        n = read(fd, buf + off, st.st_size - off);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    (void)close(fd);
+    if (off != (size_t)st.st_size) {
+        log_warnx("%s: short read", file);
+        free(buf);
+        return NULL;
+    }
+    *len = off;
+    return buf;
+}
@@ -51,12 +51,20 @@ struct imsg_data {
     struct imsgbuf *ibuf;
     struct event_base *evbase;
     struct server *server;
+    char *reload; /* The configuration being received */
+    size_t reload_len;
     int is_ready_read;
     int is_ready_write;
 };
 
 volatile sig_atomic_t chld_quit;
 
+/* Largest configuration accepted on reload */
+#define TNT_RELOAD_MAX  (1024 * 1024)
+
+/* Our end of the pipe to the privileged process */
+static struct imsgbuf *priv_ibuf = NULL;
+
 int tnt_dispatch_imsg(struct imsg_data *);
 
 static void
@@ -221,6 +229,7 @@ tnt_fork(int imsg_fds[2]) {
     sigint = event_new(evbase, SIGINT, EV_SIGNAL, &chld_sighdlr, evbase);
 
     signal(SIGPIPE, SIG_IGN);
+    /* The privileged process reads the configuration again for us */
     signal(SIGHUP, SIG_IGN);
     signal(SIGCHLD, SIG_DFL);
 
@@ -228,8 +237,11 @@ tnt_fork(int imsg_fds[2]) {
         log_errx(1, "failed to init the server socket");
 
     data.ibuf = &ibuf;
+    priv_ibuf = &ibuf;
     data.evbase = evbase;
     data.server = &server;
+    data.reload = NULL;
+    data.reload_len = 0;
     imsg_event = init_pipe_endpoint(imsg_fds, &data);
 
     event_add(sigterm, NULL);
@@ -247,9 +259,11 @@ tnt_fork(int imsg_fds[2]) {
     /* cleanely exit */
     msgbuf_write(&ibuf.w);
     msgbuf_clear(&ibuf.w);
+    priv_ibuf = NULL;
 
     /* Shutdown the server */
     server_delete(&server);
+    free(data.reload);
 
     /*
      * It may look like we freed this one twice,
@@ -268,6 +282,19 @@ tnt_fork(int imsg_fds[2]) {
     exit(TNT_OK);
 }
 
+/*
+ * Only the privileged process can configure the device, ask it to.
+ */
+void
+tnt_set_device_mtu(int mtu) {
+    if (priv_ibuf == NULL)
+        return;
+    imsg_compose(priv_ibuf, IMSG_SET_MTU, 0, 0, -1, &mtu, sizeof mtu);
+    /* The imsg event is edge triggered, don't wait for other traffic */
+    if (msgbuf_write(&priv_ibuf->w) == -1)
+        log_warn("msgbuf_write");
+}
+
 /*
  * The purpose of this function is to handle requests sent by the
  * root privileged process.
@@ -276,7 +303,9 @@ int
 tnt_dispatch_imsg(struct imsg_data *data) {
     struct imsg imsg;
     ssize_t n;
+    ssize_t datalen;
     int device_fd;
+    char *p;
     struct imsgbuf *ibuf = data->ibuf;
 
     n = imsg_read(ibuf);
@@ -304,6 +333,35 @@ tnt_dispatch_imsg(struct imsg_data *data) {
                 imsg_compose(ibuf, IMSG_SET_IP, 0, 0, -1,
                              serv_opts.addr , strlen(serv_opts.addr));
                 break;
+            case IMSG_RELOAD_DATA:
+                /* Past TNT_RELOAD_MAX the rest is dropped until the end */
+                datalen = imsg.hdr.len - IMSG_HEADER_SIZE;
+                if (data->reload_len + datalen > TNT_RELOAD_MAX)
+                    p = NULL;
+                else
+                    p = realloc(data->reload, data->reload_len + datalen);
+                if (p == NULL) {
+                    if (data->reload_len <= TNT_RELOAD_MAX)
+                        log_warnx("unable to receive the configuration");
+                    free(data->reload);
+                    data->reload = NULL;
+                    data->reload_len = TNT_RELOAD_MAX + 1;
+                    break;
+                }
+                (void)memcpy(p + data->reload_len, imsg.data, datalen);
+                data->reload = p;
+                data->reload_len += datalen;
+                break;
+            case IMSG_RELOAD_END:
+                log_info("receive IMSG_RELOAD_END: %lu bytes",
+                         (unsigned long)data->reload_len);
+                if (data->reload != NULL)
+                    server_reload(data->server, data->reload,
+                                  data->reload_len);
+                free(data->reload);
+                data->reload = NULL;
+                data->reload_len = 0;
+                break;
             default:
                 break;
         }
@@ -59,6 +59,7 @@ volatile sig_atomic_t sigchld_recv;
 extern struct options serv_opts;
 static struct device *dev;
 pid_t chld_pid = -1; /* Usefull for the signal handler */
+static const char *conf_file = NULL; /* Read again on SIGHUP */
 
 static void usage(void);
 static int dispatch_imsg(struct imsgbuf *);
@@ -107,6 +108,40 @@ sig_gen_hdlr(evutil_socket_t sig, short events, void *args) {
     event_base_loopbreak(evbase);
 }
 
+/*
+ * The unprivileged process is chrooted and can't read the configuration
+ * file, send it over. It only applies what changed.
+ */
+static void
+sighup_hdlr(evutil_socket_t sig, short events, void *args) {
+    struct imsg_data *data = args;
+    char *buf;
+    size_t len;
+    size_t off;
+    size_t chunk;
+    (void)sig;
+    (void)events;
+
+    log_info("received signal sighup, reloading the configuration");
+    if ((buf = tnt_read_file(conf_file, &len)) == NULL)
+        return;
+    for (off = 0; off < len; off += chunk) {
+        chunk = len - off;
+        if (chunk > MAX_IMSGSIZE - IMSG_HEADER_SIZE)
+            chunk = MAX_IMSGSIZE - IMSG_HEADER_SIZE;
+        if (imsg_compose(data->ibuf, IMSG_RELOAD_DATA, 0, 0, -1,
+                         buf + off, chunk) == -1)
+            break;
+    }
+    if (off == len)
+        imsg_compose(data->ibuf, IMSG_RELOAD_END, 0, 0, -1, NULL, 0);
+    else
+        log_warnx("unable to send the configuration");
+    free(buf);
+    if (msgbuf_write(&data->ibuf->w) == -1)
+        log_warn("msgbuf_write");
+}
+
 static void
 imsg_callback_handler(evutil_socket_t fd, short events, void *args) {
     (void)fd;
@@ -139,6 +174,7 @@ main(int argc, char *argv[]) {
     struct event *sigint = NULL;
     struct event *sigterm = NULL;
     struct event *sigchld = NULL;
+    struct event *sighup = NULL;
     struct event_config *evcfg;
 
     /* Parse configuration file and then command line switches */
@@ -154,6 +190,7 @@ main(int argc, char *argv[]) {
                 fprintf(stderr, "%s: invalid file\n", optarg);
                 return 1;
             }
+            conf_file = optarg;
         break;
         case 'h':
         default:
@@ -212,6 +249,8 @@ main(int argc, char *argv[]) {
     sigint = event_new(evbase, SIGINT, EV_SIGNAL, &sig_gen_hdlr, evbase);
     sigterm = event_new(evbase, SIGTERM, EV_SIGNAL, &sig_gen_hdlr, evbase);
     sigchld = event_new(evbase, SIGCHLD, EV_SIGNAL, &sig_gen_hdlr, evbase);
+    sighup = event_new(evbase, SIGHUP, EV_SIGNAL | EV_PERSIST, &sighup_hdlr,
+                       &data);
 
     if (close(imsg_fds[1]))
         log_notice("close");
@@ -231,6 +270,7 @@ main(int argc, char *argv[]) {
     event_add(sigint, NULL);
     event_add(sigterm, NULL);
     event_add(sigchld, NULL);
+    event_add(sighup, NULL);
 
     /*
      * if we received a sigchild now, we don't need to start the event loop
@@ -253,6 +293,7 @@ main(int argc, char *argv[]) {
     event_free(sigint);
     event_free(sigterm);
     event_free(sigchld);
+    event_free(sighup);
     event_base_free(evbase);
     if (dev != NULL)
         tnt_ttc_close(dev);
@@ -275,6 +316,7 @@ dispatch_imsg(struct imsgbuf *ibuf) {
     ssize_t n;
     ssize_t datalen;
     int fd;
+    int mtu;
     char buf[128];
 
     n = imsg_read(ibuf);
@@ -305,6 +347,13 @@ dispatch_imsg(struct imsgbuf *ibuf) {
             case IMSG_CREATE_DEV:
                 dev = tnt_ttc_open(serv_opts.tunnel);
                 if (dev != NULL) {
+                    if (serv_opts.tunnel_mtu != 0
+                        && tnt_ttc_set_mtu(dev, serv_opts.tunnel_mtu) == -1)
+                        log_notice("can't set the mtu to %d",
+                                   serv_opts.tunnel_mtu);
+                    if (serv_opts.offload
+                        && tnt_ttc_set_offload(dev) == -1)
+                        log_notice("can't enable the device offloads");
                     fd = tnt_ttc_get_fd(dev);
                     imsg_compose(ibuf, IMSG_CREATE_DEV, 0, 0, fd,
                                  NULL, 0);
@@ -326,6 +375,22 @@ dispatch_imsg(struct imsgbuf *ibuf) {
                 tnt_ttc_set_ip(dev, buf);
                 tnt_ttc_up(dev);
                 break;
+            case IMSG_SET_MTU:
+                if (dev == NULL) {
+                    log_warnx("can't set mtu, use IMSG_CREATE_DEV first");
+                    break;
+                }
+                datalen = imsg.hdr.len - IMSG_HEADER_SIZE;
+                if (datalen != sizeof mtu) {
+                    log_warnx("invalid IMSG_SET_MTU");
+                    break;
+                }
+                (void)memcpy(&mtu, imsg.data, sizeof mtu);
+
+                log_info("receive IMSG_SET_MTU: %i", mtu);
+                if (tnt_ttc_set_mtu(dev, mtu) == -1)
+                    log_warnx("can't set the mtu of the device to %i", mtu);
+                break;
             default:
                 break;
         }
@@ -13,8 +13,15 @@
  * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 **/
 
+#include <string.h>
+
 #include "tntsocket.h"
 
+#if defined Linux
+# include <netinet/udp.h>
+# include <linux/errqueue.h>
+#endif
+
 evutil_socket_t tnt_tcp_socket(sa_family_t p)
 {
     int sock;
@@ -38,3 +45,197 @@ evutil_socket_t tnt_udp_socket(sa_family_t p)
     }
     return -1;
 }
+
+/*
+ * Set the DF bit on everything sent by this socket. On Linux, PROBE also
+ * makes the kernel ignore the path MTU it learnt from ICMP, we do our own.
+ */
+int tnt_udp_set_dontfrag(evutil_socket_t sock, sa_family_t p)
+{
+#if defined IP_MTU_DISCOVER
+# if defined IP_PMTUDISC_PROBE
+    int val = IP_PMTUDISC_PROBE;
+    int val6 = IPV6_PMTUDISC_PROBE;
+# else
+    int val = IP_PMTUDISC_DO;
+    int val6 = IPV6_PMTUDISC_DO;
+# endif
+
+    if (p == AF_INET6)
+        return setsockopt(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER,
+                          &val6, sizeof(val6));
+    return setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+#elif defined IP_DONTFRAG
+    int on = 1;
+
+    if (p == AF_INET6)
+        return setsockopt(sock, IPPROTO_IPV6, IPV6_DONTFRAG, &on, sizeof(on));
+    return setsockopt(sock, IPPROTO_IP, IP_DONTFRAG, &on, sizeof(on));
+#else
+    (void)sock;
+    (void)p;
+    return -1;
+#endif
+}
+
+/*
+ * UDP segmentation offload: a train of datagrams of a same size, for a same
+ * destination, is given to the kernel at once with the size in a control
+ * message. The option set here is only the default size, none.
+ */
+int tnt_udp_enable_gso(evutil_socket_t sock)
+{
+#if defined UDP_SEGMENT
+    int none = 0;
+
+    return setsockopt(sock, IPPROTO_UDP, UDP_SEGMENT, &none, sizeof(none));
+#else
+    (void)sock;
+    return -1;
+#endif
+}
+
+/*
+ * UDP receive offload: the datagrams of a same train are coalesced, a
+ * control message tells their size.
+ */
+int tnt_udp_enable_gro(evutil_socket_t sock)
+{
+#if defined UDP_GRO
+    int on = 1;
+
+    return setsockopt(sock, IPPROTO_UDP, UDP_GRO, &on, sizeof(on));
+#else
+    (void)sock;
+    return -1;
+#endif
+}
+
+int tnt_udp_gso_control(struct msghdr *msg,
+                        void *buf,
+                        size_t len,
+                        unsigned short segment)
+{
+#if defined UDP_SEGMENT
+    struct cmsghdr *cm;
+
+    if (len < CMSG_SPACE(sizeof(segment)))
+        return -1;
+    memset(buf, 0, CMSG_SPACE(sizeof(segment)));
+    msg->msg_control = buf;
+    msg->msg_controllen = CMSG_SPACE(sizeof(segment));
+    cm = CMSG_FIRSTHDR(msg);
+    cm->cmsg_level = IPPROTO_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(segment));
+    memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+    return 0;
+#else
+    (void)msg;
+    (void)buf;
+    (void)len;
+    (void)segment;
+    return -1;
+#endif
+}
+
+/* The size of the datagrams coalesced in msg, 0 if there was no need */
+unsigned int tnt_udp_gro_segment(struct msghdr const *msg)
+{
+#if defined UDP_GRO
+    struct cmsghdr *cm;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm != NULL;
+         cm = CMSG_NXTHDR((struct msghdr *)msg, cm))
+    {
+        if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO)
+        {
+            int segment;
+
+            memcpy(&segment, CMSG_DATA(cm), sizeof(segment));
+            return (unsigned int)segment;
+        }
+    }
+#else
+    (void)msg;
+#endif
+    return 0;
+}
+
+/* Let the kernel send from our buffers, for the sends flagged so */
+int tnt_udp_enable_zerocopy(evutil_socket_t sock)
+{
+#if defined SO_ZEROCOPY && defined MSG_ZEROCOPY
+    int on = 1;
+
+    return setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+#else
+    (void)sock;
+    return -1;
+#endif
+}
+
+/*
+ * Receive the datagrams sent to an IPv4 group, on the default interface.
+ * Ours don't leave the link, and are looped back to the host.
+ */
+int tnt_udp_join_multicast(evutil_socket_t sock, struct in_addr const *group)
+{
+    struct ip_mreq mreq;
+    unsigned char ttl = 1;
+    unsigned char loop = 1;
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_multiaddr = *group;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) == -1)
+        return -1;
+    (void)setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    return setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+}
+
+/*
+ * Read a zerocopy completion from the error queue: the kernel is done with
+ * the buffers of the sends lo to hi, counted from 0.
+ * Returns 1 if one was read, 0 if the queue is empty.
+ */
+int tnt_udp_zerocopy_done(evutil_socket_t sock,
+                          unsigned int *lo,
+                          unsigned int *hi)
+{
+#if defined SO_EE_ORIGIN_ZEROCOPY
+    unsigned char control[64];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_ERRQUEUE) == -1)
+        return 0;
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+    {
+        struct sock_extended_err ee;
+
+        if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+              || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+            continue;
+        memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+        if (ee.ee_errno != 0 || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            continue;
+        *lo = ee.ee_info;
+        *hi = ee.ee_data;
+        return 1;
+    }
+    /* Something else, read it anyway so it doesn't stay in the way */
+    *lo = 1;
+    *hi = 0;
+    return 1;
+#else
+    (void)sock;
+    (void)lo;
+    (void)hi;
+    return 0;
+#endif
+}
@@ -47,6 +47,7 @@ typedef struct IOData {
 } IODATA, *PIODATA;
 
 static IODATA IOCPData;
+static struct device *tnt_device = NULL;
 
 void init_options(struct options *);
 void broadcast_to_peers(struct server *s);
@@ -307,7 +308,7 @@ DWORD IOCPFunc(void *lpParam)
 static void
 free_frame(struct frame const *f)
 {
-    free(f->raw_packet);
+    frame_free(f);
 }
 
 static void
@@ -319,15 +320,20 @@ pipe_read_cb(struct bufferevent *bev, void *data)
 
     while (evbuffer_get_length(input) > 0)
     {
-        short *size_ptr = (short *)evbuffer_pullup(input, sizeof(short));
-        short frame_size = *size_ptr;
+        unsigned short *size_ptr;
+        unsigned short frame_size;
         unsigned char *frame_ptr;
 
-        if (frame_size > evbuffer_get_length(input))
+        if (evbuffer_get_length(input) < sizeof(frame_size))
+            break ;
+        size_ptr = (unsigned short *)evbuffer_pullup(input,
+                                                     sizeof(frame_size));
+        frame_size = *size_ptr;
+        if (sizeof(frame_size) + frame_size > evbuffer_get_length(input))
             break ;
         
-        evbuffer_drain(input, sizeof(short));
-        frame_alloc(&tmp, *size_ptr);
+        evbuffer_drain(input, sizeof(frame_size));
+        frame_alloc(&tmp, frame_size);
         frame_ptr = evbuffer_pullup(input, frame_size);
         memcpy(tmp.frame, frame_ptr, frame_size);
         tmp.size = frame_size;
@@ -338,6 +344,15 @@ pipe_read_cb(struct bufferevent *bev, void *data)
     broadcast_udp_to_peers(s);
 }
 
+void
+tnt_set_device_mtu(int mtu)
+{
+    if (tnt_device == NULL)
+        return;
+    if (tnt_ttc_set_mtu(tnt_device, mtu) == -1)
+        log_notice("Can't set the mtu of the interface to %d", mtu);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -381,6 +396,12 @@ main(int argc, char *argv[])
     if ((interfce = tnt_ttc_open(TNT_TUNMODE_ETHERNET)) == NULL) {
         log_err(-1, "Failed to open a tap interface");
     }
+    tnt_device = interfce;
+    if (serv_opts.tunnel_mtu != 0
+        && tnt_ttc_set_mtu(interfce, serv_opts.tunnel_mtu) == -1) {
+        log_notice("Can't set the mtu of the interface to %d",
+                   serv_opts.tunnel_mtu);
+    }
     event_set_log_callback(tnet_libevent_log);
     /*
     Arty: There's definitely a workaround for those signals on windows, we'll
@@ -453,6 +474,7 @@ main(int argc, char *argv[])
     WaitForSingleObject(hIOCPThread, INFINITE);
     CloseHandle(hIOCPThread);
 
+    tnt_device = NULL;
     tnt_ttc_close(interfce);
     //event_free(sigterm);
     //event_free(sigint);
@@ -13,8 +13,11 @@
  * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 **/
 
+#include <string.h>
+
 #include "wincompat.h"
 #include "tntsocket.h"
+#include <Ws2tcpip.h>
 
 evutil_socket_t tnt_tcp_socket(sa_family_t saf)
 {
@@ -43,3 +46,55 @@ evutil_socket_t tnt_udp_socket(sa_family_t saf)
     }
     return -1;
 }
+
+int tnt_udp_set_dontfrag(evutil_socket_t sock, sa_family_t saf)
+{
+    DWORD on = 1;
+
+#if defined IPV6_DONTFRAG
+    if (saf == AF_INET6)
+	return setsockopt(sock, IPPROTO_IPV6, IPV6_DONTFRAG,
+			  (char const *)&on, sizeof(on));
+#endif
+    if (saf != AF_INET)
+	return -1;
+    return setsockopt(sock, IPPROTO_IP, IP_DONTFRAGMENT,
+		      (char const *)&on, sizeof(on));
+}
+
+/* The UDP offloads of Windows need WSASendMsg, they are not used */
+int tnt_udp_enable_gso(evutil_socket_t sock)
+{
+    (void)sock;
+    return -1;
+}
+
+int tnt_udp_enable_gro(evutil_socket_t sock)
+{
+    (void)sock;
+    return -1;
+}
+
+int tnt_udp_enable_zerocopy(evutil_socket_t sock)
+{
+    (void)sock;
+    return -1;
+}
+
+int tnt_udp_join_multicast(evutil_socket_t sock, struct in_addr const *group)
+{
+    struct ip_mreq mreq;
+    DWORD ttl = 1;
+    DWORD loop = 1;
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_multiaddr = *group;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		   (char const *)&mreq, sizeof(mreq)) != 0)
+	return -1;
+    (void)setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP,
+		     (char const *)&loop, sizeof(loop));
+    return setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL,
+		      (char const *)&ttl, sizeof(ttl));
+}
@@ -0,0 +1,132 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+/*
+ * Seal and open throughput of the data channel, on one core: the same
+ * packets handled one call each, then in bursts of CRYPTO_BURST_MAX.
+ *
+ *   crypto_bench [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crypto.h"
+
+int debug = 0;
+
+static size_t const sizes[] = {64, 512, 1400, 8192};
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Bytes sealed, then opened, in about seconds */
+static double
+bench(struct crypto_state *tx,
+      struct crypto_state *rx,
+      struct crypto_op *ops,
+      unsigned char *in,
+      unsigned char *out,
+      unsigned char *back,
+      size_t size,
+      size_t burst,
+      double seconds)
+{
+    unsigned char aad[4] = {0};
+    double start = now();
+    double elapsed;
+    size_t bytes = 0;
+    size_t i;
+
+    do
+    {
+        for (i = 0; i < CRYPTO_BURST_MAX; ++i)
+        {
+            ops[i].cs = tx;
+            ops[i].aad = aad;
+            ops[i].aad_len = sizeof(aad);
+            ops[i].in = in + i * size;
+            ops[i].in_len = size;
+            ops[i].out = out + i * (size + CRYPTO_OVERHEAD);
+        }
+        for (i = 0; i < CRYPTO_BURST_MAX; i += burst)
+            (void)crypto_seal_burst(ops + i, burst);
+        for (i = 0; i < CRYPTO_BURST_MAX; ++i)
+        {
+            ops[i].cs = rx;
+            ops[i].in = out + i * (size + CRYPTO_OVERHEAD);
+            ops[i].in_len = size + CRYPTO_OVERHEAD;
+            ops[i].out = back + i * size;
+        }
+        for (i = 0; i < CRYPTO_BURST_MAX; i += burst)
+        {
+            if (crypto_open_burst(ops + i, burst) != burst)
+            {
+                fprintf(stderr, "open failed\n");
+                exit(1);
+            }
+        }
+        bytes += CRYPTO_BURST_MAX * size;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    return bytes / elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+    unsigned char key[CRYPTO_KEY_SIZE] = {1};
+    unsigned char salt[CRYPTO_SALT_SIZE] = {2};
+    struct crypto_state tx;
+    struct crypto_state rx;
+    struct crypto_op ops[CRYPTO_BURST_MAX];
+    double seconds = (argc > 1) ? atof(argv[1]) : 1.0;
+    size_t max = sizes[sizeof(sizes) / sizeof(*sizes) - 1];
+    unsigned char *in = calloc(CRYPTO_BURST_MAX, max);
+    unsigned char *out = calloc(CRYPTO_BURST_MAX, max + CRYPTO_OVERHEAD);
+    unsigned char *back = calloc(CRYPTO_BURST_MAX, max);
+    size_t i;
+
+    if (in == NULL || out == NULL || back == NULL
+        || crypto_init(&tx, key, salt, key, salt) == -1
+        || crypto_init(&rx, key, salt, key, salt) == -1)
+        return 1;
+    printf("%8s %16s %16s\n", "bytes", "per packet", "burst");
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i)
+    {
+        double one = bench(&tx, &rx, ops, in, out, back, sizes[i], 1,
+                           seconds);
+        double all = bench(&tx, &rx, ops, in, out, back, sizes[i],
+                           CRYPTO_BURST_MAX, seconds);
+
+        /* Each byte was sealed and opened */
+        printf("%8lu %11.2f Gbps %11.2f Gbps\n", (unsigned long)sizes[i],
+               one * 8 / 1e9, all * 8 / 1e9);
+    }
+    crypto_free(&tx);
+    crypto_free(&rx);
+    free(in);
+    free(out);
+    free(back);
+    return 0;
+}
@@ -0,0 +1,231 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+/*
+ * Send throughput of a burst of datagrams, on one core: one sendto each,
+ * one sendmmsg for the whole burst, then trains given at once with
+ * UDP_SEGMENT as udp_send_train does. Nothing is read on the other side,
+ * only the sending cost is measured.
+ *
+ *   gso_bench [seconds [address port]]
+ *
+ * The default address is a socket of ours on the loopback, whose large MTU
+ * lets the kernel skip the segmentation. Give a host across a real
+ * interface to measure that too.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tntsocket.h"
+
+#define BURST       64
+#define TRAIN_MAX   (65535 - 8 - 40)
+
+int debug = 0;
+
+static size_t const sizes[] = {512, 1400, 8192};
+
+static unsigned char payload[BURST * 8192];
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Bytes sent in a burst, -1 on error */
+static long
+send_one(int fd,
+         struct sockaddr_in const *to,
+         size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < BURST; ++i)
+    {
+        if (sendto(fd, payload + i * size, size, 0,
+                   (struct sockaddr const *)to, sizeof(*to)) == -1
+            && errno != ENOBUFS && errno != EAGAIN)
+            return -1;
+    }
+    return BURST * size;
+}
+
+static long
+send_mmsg(int fd,
+          struct sockaddr_in const *to,
+          size_t size)
+{
+    struct mmsghdr msgs[BURST];
+    struct iovec iov[BURST];
+    size_t i;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < BURST; ++i)
+    {
+        iov[i].iov_base = payload + i * size;
+        iov[i].iov_len = size;
+        msgs[i].msg_hdr.msg_name = (void *)to;
+        msgs[i].msg_hdr.msg_namelen = sizeof(*to);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    if (sendmmsg(fd, msgs, BURST, 0) == -1
+        && errno != ENOBUFS && errno != EAGAIN)
+        return -1;
+    return BURST * size;
+}
+
+/* As many trains as the burst needs, each under TRAIN_MAX bytes */
+static long
+send_gso(int fd,
+         struct sockaddr_in const *to,
+         size_t size)
+{
+    size_t per_train = TRAIN_MAX / size;
+    struct iovec iov[BURST];
+    unsigned char control[TNT_UDP_CONTROL_SIZE];
+    struct msghdr msg;
+    size_t i;
+    size_t n;
+
+    for (i = 0; i < BURST; ++i)
+    {
+        iov[i].iov_base = payload + i * size;
+        iov[i].iov_len = size;
+    }
+    for (i = 0; i < BURST; i += n)
+    {
+        n = (BURST - i < per_train) ? BURST - i : per_train;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void *)to;
+        msg.msg_namelen = sizeof(*to);
+        msg.msg_iov = iov + i;
+        msg.msg_iovlen = n;
+        if (n > 1 && tnt_udp_gso_control(&msg, control, sizeof(control),
+                                         (unsigned short)size) == -1)
+            return -1;
+        if (sendmsg(fd, &msg, 0) == -1
+            && errno != ENOBUFS && errno != EAGAIN)
+            return -1;
+    }
+    return BURST * size;
+}
+
+/* Bytes per second sent by fn in about seconds, -1 if it failed */
+static double
+bench(long (*fn)(int, struct sockaddr_in const *, size_t),
+      int fd,
+      struct sockaddr_in const *to,
+      size_t size,
+      double seconds)
+{
+    double start = now();
+    double elapsed;
+    double bytes = 0;
+
+    do
+    {
+        long n = fn(fd, to, size);
+
+        if (n == -1)
+            return -1;
+        bytes += n;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    return bytes / elapsed;
+}
+
+static void
+print_rate(double rate)
+{
+    if (rate < 0)
+        printf(" %16s", "n/a");
+    else
+        printf(" %11.2f Gbps", rate * 8 / 1e9);
+}
+
+int
+main(int argc, char *argv[])
+{
+    double seconds = (argc > 1) ? atof(argv[1]) : 1.0;
+    struct sockaddr_in to;
+    socklen_t len = sizeof(to);
+    int sink = -1;
+    int fd;
+    int gso;
+    size_t i;
+
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    if (argc > 3)
+    {
+        if (inet_pton(AF_INET, argv[2], &to.sin_addr) != 1)
+        {
+            fprintf(stderr, "%s: not an IPv4 address\n", argv[2]);
+            return 1;
+        }
+        to.sin_port = htons((unsigned short)atoi(argv[3]));
+    }
+    else
+    {
+        to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sink = tnt_udp_socket(AF_INET);
+        if (sink == -1
+            || bind(sink, (struct sockaddr *)&to, sizeof(to)) == -1
+            || getsockname(sink, (struct sockaddr *)&to, &len) == -1)
+        {
+            perror("sink");
+            return 1;
+        }
+    }
+    fd = tnt_udp_socket(AF_INET);
+    if (fd == -1)
+    {
+        perror("socket");
+        return 1;
+    }
+    gso = (tnt_udp_enable_gso(fd) == 0);
+    if (!gso)
+        fprintf(stderr, "UDP_SEGMENT unavailable\n");
+
+    printf("%8s %16s %16s %16s\n", "bytes", "sendto", "sendmmsg",
+           "UDP_SEGMENT");
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i)
+    {
+        printf("%8lu", (unsigned long)sizes[i]);
+        print_rate(bench(send_one, fd, &to, sizes[i], seconds));
+        print_rate(bench(send_mmsg, fd, &to, sizes[i], seconds));
+        print_rate(gso ? bench(send_gso, fd, &to, sizes[i], seconds) : -1);
+        printf("\n");
+    }
+    close(fd);
+    if (sink != -1)
+        close(sink);
+    return 0;
+}
@@ -0,0 +1,262 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+/*
+ * The reordering of a bonded peer: the datagrams held across a gap and
+ * delivered in order once it is filled, the late ones, the gaps given up
+ * on after their deadline, a sender starting over, and a full buffer
+ * which must still deliver everything in order.
+ *
+ *   bond_test
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/util.h>
+
+#include "networking.h"
+
+#include "tnetacle.h"
+#include "tntsched.h"
+#include "endpoint.h"
+#include "options.h"
+#include "server.h"
+#include "udp.h"
+#include "mc.h"
+#include "bond.h"
+
+int debug = 0;
+struct options serv_opts;
+
+static int failed;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            ++failed;                                                       \
+        }                                                                   \
+    } while (0)
+
+/* What bond.c calls of the rest of the daemon, its fiber is not run */
+
+intptr_t
+sched_get_userptr(struct fiber_args *args)
+{
+    (void)args;
+    return 0;
+}
+
+void
+async_wait(struct fiber_args *args,
+           struct timeval const *tv)
+{
+    (void)args;
+    (void)tv;
+}
+
+char *
+mc_presentation(struct mc *mc,
+                char *name,
+                int size)
+{
+    (void)mc;
+    evutil_snprintf(name, (size_t)size, "mc");
+    return name;
+}
+
+int
+udp_bond_release(void *ctx,
+                 struct server *s,
+                 struct timeval *next)
+{
+    (void)ctx;
+    (void)s;
+    (void)next;
+    return 0;
+}
+
+/* The datagram is its own sequence number */
+static int
+push(struct bond_reorder *r,
+     uint64_t seq,
+     struct timeval const *now)
+{
+    return bond_reorder_push(r, seq, (unsigned char const *)&seq,
+                             sizeof(seq), now);
+}
+
+/* Returns the sequence number popped, 0 if none */
+static uint64_t
+pop(struct bond_reorder *r,
+    struct timeval const *now)
+{
+    struct bond_held h;
+    uint64_t seq;
+
+    if (bond_reorder_pop(r, now, &h) == 0)
+        return 0;
+    CHECK(h.len == sizeof(seq));
+    memcpy(&seq, h.buf, sizeof(seq));
+    CHECK(seq == h.seq);
+    free(h.buf);
+    return seq;
+}
+
+static void
+drain(struct bond_reorder *r)
+{
+    struct timeval never = {0x7fffffff, 0};
+
+    while (pop(r, &never) != 0)
+        ;
+}
+
+static void
+test_order(struct timeval const *now)
+{
+    struct bond_reorder r;
+
+    memset(&r, 0, sizeof(r));
+    /* The first one starts the sequence, wherever it is */
+    CHECK(push(&r, 100, now) == 1);
+    CHECK(push(&r, 101, now) == 1);
+    CHECK(r.next == 102);
+
+    /* 102 is late: 105, 103 and 104 wait for it */
+    CHECK(push(&r, 105, now) == 0);
+    CHECK(push(&r, 103, now) == 0);
+    CHECK(push(&r, 104, now) == 0);
+    CHECK(r.count == 3);
+    CHECK(pop(&r, now) == 0);
+    CHECK(push(&r, 102, now) == 1);
+    CHECK(pop(&r, now) == 103);
+    CHECK(pop(&r, now) == 104);
+    CHECK(pop(&r, now) == 105);
+    CHECK(pop(&r, now) == 0);
+    CHECK(r.next == 106);
+
+    /* Already gone, it is delivered as is */
+    CHECK(push(&r, 50, now) == 1);
+    CHECK(r.next == 106);
+
+    /* While the held ones go, the next one waits its turn */
+    CHECK(push(&r, 107, now) == 0);
+    r.draining = 1;
+    CHECK(push(&r, 106, now) == 0);
+    CHECK(pop(&r, now) == 106);
+    CHECK(pop(&r, now) == 107);
+    r.draining = 0;
+    CHECK(r.next == 108);
+}
+
+static void
+test_deadline(struct timeval const *now)
+{
+    struct timeval later = *now;
+    struct timeval deadline;
+    struct bond_reorder r;
+
+    memset(&r, 0, sizeof(r));
+    CHECK(push(&r, 1, now) == 1);
+    CHECK(bond_reorder_next(&r, &deadline) == 0);
+    CHECK(push(&r, 4, now) == 0);
+    later.tv_usec += 1000;
+    CHECK(push(&r, 3, &later) == 0);
+    CHECK(bond_reorder_next(&r, &deadline) == 1);
+    CHECK(deadline.tv_sec == now->tv_sec
+          && deadline.tv_usec == now->tv_usec + serv_opts.reorder_delay);
+
+    /* 2 is given up on once the oldest one waited long enough */
+    CHECK(pop(&r, &later) == 0);
+    CHECK(pop(&r, &deadline) == 3);
+    CHECK(pop(&r, &deadline) == 4);
+    CHECK(r.next == 5);
+    CHECK(push(&r, 2, &deadline) == 1);
+    CHECK(r.next == 5);
+
+    /* So far behind, the sender started over */
+    r.next = (uint64_t)1 << 20;
+    CHECK(push(&r, 7, now) == 1);
+    CHECK(r.next == 8);
+}
+
+/* A full buffer still delivers in order */
+static void
+test_full(struct timeval const *now)
+{
+    struct bond_reorder r;
+    uint64_t seq;
+    uint64_t last;
+
+    memset(&r, 0, sizeof(r));
+    CHECK(push(&r, 1, now) == 1);
+    for (seq = 3; seq < 3 + BOND_REORDER_MAX; ++seq)
+        CHECK(push(&r, seq, now) == 0);
+    CHECK(r.count == BOND_REORDER_MAX);
+
+    /* Past them all: 2 is given up on, they go first */
+    CHECK(push(&r, seq, now) == 2);
+    CHECK(r.next == 3);
+    last = 2;
+    while (r.count > 0)
+    {
+        uint64_t popped = pop(&r, now);
+
+        CHECK(popped == last + 1);
+        if (popped != last + 1)
+            break;
+        last = popped;
+    }
+    CHECK(push(&r, seq, now) == 1);
+    CHECK(r.next == seq + 1);
+
+    /* Before them all, it goes, the gap up to them still waits */
+    drain(&r);
+    memset(&r, 0, sizeof(r));
+    CHECK(push(&r, 1, now) == 1);
+    for (seq = 10; seq < 10 + BOND_REORDER_MAX; ++seq)
+        CHECK(push(&r, seq, now) == 0);
+    CHECK(push(&r, 5, now) == 1);
+    CHECK(r.next == 6);
+    CHECK(pop(&r, now) == 0);
+    CHECK(push(&r, 100, now) == 2);
+    CHECK(r.next == 10);
+    CHECK(pop(&r, now) == 10);
+    drain(&r);
+}
+
+int
+main(void)
+{
+    struct timeval now;
+
+    serv_opts.reorder_delay = 20000;
+    now.tv_sec = 1000;
+    now.tv_usec = 0;
+    test_order(&now);
+    test_deadline(&now);
+    test_full(&now);
+    if (failed != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,550 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+/*
+ * The dialing of the PeerAddress, against a stub DNS server on the
+ * loopback: the names resolved, the IPv6 fallback, the failures, the new
+ * address kept for the next dial, the backoff after the failed dials, the
+ * nodes found by the discovery, and the peers hung up by a reload.
+ * The meta-connexions are faked, only their addresses are looked at.
+ *
+ *   dial_test
+ *
+ * dial.c is included, its static functions are the ones to check.
+ */
+
+#include "../../src/dial.c"
+
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+
+#include <stdio.h>
+
+int debug = 0;
+struct options serv_opts;
+
+static int failed;
+static int wakes;
+static int closed;
+static struct sockaddr_in closed_addr;
+static struct in_addr moved_addr;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            ++failed;                                                       \
+        }                                                                   \
+    } while (0)
+
+/* What dial.c calls of the rest of the daemon */
+
+struct mc *
+mc_peer_connect(struct server *s,
+                struct event_base *evbase,
+                struct sockaddr *sock,
+                int socklen)
+{
+    (void)s;
+    (void)evbase;
+    (void)sock;
+    (void)socklen;
+    return NULL;
+}
+
+void
+mc_close(struct mc *self)
+{
+    (void)self;
+    ++closed;
+}
+
+void
+server_mc_close(struct server *s,
+                struct mc *mc)
+{
+    (void)s;
+    memcpy(&closed_addr, mc->p.address, sizeof(closed_addr));
+    ++closed;
+}
+
+char *
+address_presentation(struct sockaddr *sock,
+                     int socklen,
+                     char *name,
+                     int namelen)
+{
+    (void)sock;
+    (void)socklen;
+    evutil_snprintf(name, namelen, "peer");
+    return name;
+}
+
+void
+async_wake(struct fiber *F,
+           intptr_t data)
+{
+    (void)F;
+    (void)data;
+    ++wakes;
+}
+
+void
+async_wait(struct fiber_args *args,
+           struct timeval const *tv)
+{
+    (void)args;
+    (void)tv;
+}
+
+intptr_t
+sched_get_userptr(struct fiber_args *args)
+{
+    (void)args;
+    return 0;
+}
+
+void
+sched_fiber_exit(struct fiber_args *args,
+                 int value)
+{
+    (void)args;
+    (void)value;
+}
+
+/*
+ * The stub server, the case of the names is randomized by evdns:
+ *  - good.test has an IPv4 address, with a TTL below DIAL_TTL_MIN
+ *  - v6.test only an IPv6 one, with a TTL above DIAL_TTL_MAX
+ *  - moved.test has moved_addr
+ *  - bad.test doesn't exist
+ */
+static void
+stub_answer(struct evdns_server_request *req,
+            void *arg)
+{
+    int rcode = 0;
+    int i;
+
+    (void)arg;
+    for (i = 0; i < req->nquestions; ++i)
+    {
+        struct evdns_server_question *q = req->questions[i];
+
+        if (evutil_ascii_strcasecmp(q->name, "bad.test") == 0)
+            rcode = DNS_ERR_NOTEXIST;
+        else if (evutil_ascii_strcasecmp(q->name, "good.test") == 0
+                 && q->type == EVDNS_TYPE_A)
+        {
+            struct in_addr a;
+
+            evutil_inet_pton(AF_INET, "192.0.2.7", &a);
+            evdns_server_request_add_a_reply(req, q->name, 1, &a, 5);
+        }
+        else if (evutil_ascii_strcasecmp(q->name, "v6.test") == 0
+                 && q->type == EVDNS_TYPE_AAAA)
+        {
+            struct in6_addr a;
+
+            evutil_inet_pton(AF_INET6, "2001:db8::1", &a);
+            evdns_server_request_add_aaaa_reply(req, q->name, 1, &a, 100000);
+        }
+        else if (evutil_ascii_strcasecmp(q->name, "moved.test") == 0
+                 && q->type == EVDNS_TYPE_A)
+            evdns_server_request_add_a_reply(req, q->name, 1, &moved_addr, 60);
+    }
+    evdns_server_request_respond(req, rcode);
+}
+
+static struct dial_target *
+find_target(struct dial *d,
+            char const *host)
+{
+    size_t i;
+
+    for (i = 0; i < d->count; ++i)
+    {
+        if (d->targets[i]->host != NULL
+            && strcmp(d->targets[i]->host, host) == 0)
+            return d->targets[i];
+    }
+    return NULL;
+}
+
+/* Resolve t, until the server answers */
+static void
+resolve(struct event_base *base,
+        struct dial *d,
+        struct dial_target *t)
+{
+    dial_resolve(d, t);
+    while (t->req != NULL)
+        event_base_loop(base, EVLOOP_ONCE);
+}
+
+/* Seconds from now to tv */
+static long
+from_now(struct timeval const *tv)
+{
+    struct timeval now;
+
+    evutil_gettimeofday(&now, NULL);
+    return (long)(tv->tv_sec - now.tv_sec);
+}
+
+static void
+check_ipv4(struct dial_target const *t,
+           char const *addr)
+{
+    struct sockaddr_in const *sin = (struct sockaddr_in const *)&t->addr;
+    struct in_addr a;
+
+    evutil_inet_pton(AF_INET, addr, &a);
+    CHECK(t->len == sizeof(*sin));
+    CHECK(sin->sin_family == AF_INET);
+    CHECK(sin->sin_addr.s_addr == a.s_addr);
+    CHECK(ntohs(sin->sin_port) == t->port);
+}
+
+static void
+test_resolve(struct event_base *base,
+             struct dial *d)
+{
+    struct dial_target *t;
+    int before;
+
+    t = find_target(d, "good.test");
+    resolve(base, d, t);
+    check_ipv4(t, "192.0.2.7");
+    CHECK(t->state == DIAL_WAITING);
+    CHECK(from_now(&t->expire) >= DIAL_TTL_MIN - 1);
+    CHECK(from_now(&t->expire) <= DIAL_TTL_MIN);
+
+    t = find_target(d, "v6.test");
+    resolve(base, d, t);
+    CHECK(t->len == sizeof(struct sockaddr_in6));
+    CHECK(t->addr.ss_family == AF_INET6);
+    CHECK(ntohs(((struct sockaddr_in6 *)&t->addr)->sin6_port) == t->port);
+    CHECK(t->state == DIAL_WAITING);
+    CHECK(from_now(&t->expire) >= DIAL_TTL_MAX - 1);
+    CHECK(from_now(&t->expire) <= DIAL_TTL_MAX);
+
+    /* Nothing to dial, tried again later */
+    t = find_target(d, "bad.test");
+    before = wakes;
+    resolve(base, d, t);
+    CHECK(t->len == 0);
+    CHECK(t->state == DIAL_RESOLVING);
+    CHECK(wakes > before);
+    CHECK(from_now(&t->expire) >= DIAL_RESOLVE_RETRY - 1);
+    CHECK(from_now(&t->expire) <= DIAL_RESOLVE_RETRY);
+}
+
+/* A peer which moved is dialed at its new address once the old one is lost */
+static void
+test_moved(struct event_base *base,
+           struct server *s,
+           struct dial *d)
+{
+    struct dial_target *t = find_target(d, "moved.test");
+    struct timeval now;
+    struct mc mc;
+
+    evutil_inet_pton(AF_INET, "192.0.2.10", &moved_addr);
+    resolve(base, d, t);
+    check_ipv4(t, "192.0.2.10");
+
+    memset(&mc, 0, sizeof(mc));
+    mc.p.address = (struct sockaddr *)&t->addr;
+    mc.p.len = t->len;
+    v_mc_push(s->peers, &mc);
+    evutil_gettimeofday(&now, NULL);
+    (void)dial_update(s, &now);
+    CHECK(t->state == DIAL_CONNECTED);
+
+    evutil_inet_pton(AF_INET, "192.0.2.11", &moved_addr);
+    resolve(base, d, t);
+    check_ipv4(t, "192.0.2.10");
+    CHECK(t->fresh_len == sizeof(struct sockaddr_in));
+
+    v_mc_clean(s->peers);
+    (void)dial_update(s, &now);
+    check_ipv4(t, "192.0.2.11");
+    CHECK(t->fresh_len == 0);
+    CHECK(t->state == DIAL_WAITING);
+    CHECK(t->failures == 0);
+}
+
+/* The delay before the next dial, from half of it to all of it */
+static void
+check_backoff(struct dial_target const *t,
+              struct timeval const *now)
+{
+    int shift = (t->failures < DIAL_SHIFT_MAX) ? t->failures : DIAL_SHIFT_MAX;
+    long delay = (DIAL_BASE * 1000L) << shift;
+    struct timeval tv;
+    long ms;
+
+    if (delay > serv_opts.reconnect_max * 1000L)
+        delay = serv_opts.reconnect_max * 1000L;
+    evutil_timersub(&t->due, now, &tv);
+    ms = (long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    CHECK(ms >= delay / 2 && ms <= delay);
+}
+
+static void
+test_backoff(struct server *s,
+             struct dial *d)
+{
+    struct dial_target *t = d->targets[0];
+    struct timeval now;
+    struct mc mc;
+    int i;
+
+    evutil_gettimeofday(&now, NULL);
+    CHECK(t->host == NULL && t->state == DIAL_WAITING);
+    check_backoff(t, &now);
+
+    /* Refused at once: not connected, nor connecting any more */
+    for (i = 1; i <= DIAL_SHIFT_MAX + 2; ++i)
+    {
+        t->state = DIAL_PENDING;
+        (void)dial_update(s, &now);
+        CHECK(t->failures == i);
+        CHECK(t->state == DIAL_WAITING);
+        check_backoff(t, &now);
+    }
+
+    /* Connecting, until DIAL_TIMEOUT */
+    memset(&mc, 0, sizeof(mc));
+    mc.p.address = (struct sockaddr *)&t->addr;
+    mc.p.len = t->len;
+    v_mc_push(s->pending_peers, &mc);
+    t->failures = 0;
+    CHECK(dial_update(s, &now) == 1);
+    CHECK(t->state == DIAL_PENDING);
+    CHECK(from_now(&t->due) >= DIAL_TIMEOUT - 1);
+
+    now.tv_sec += DIAL_TIMEOUT + 1;
+    closed = 0;
+    CHECK(dial_update(s, &now) == 0);
+    CHECK(closed == 1);
+    CHECK(v_mc_size(s->pending_peers) == 0);
+    CHECK(t->failures == 1);
+    CHECK(t->state == DIAL_WAITING);
+    check_backoff(t, &now);
+
+    /* Back, the backoff starts over */
+    v_mc_push(s->peers, &mc);
+    (void)dial_update(s, &now);
+    CHECK(t->state == DIAL_CONNECTED);
+    CHECK(t->failures == 0);
+    v_mc_clean(s->peers);
+}
+
+/* Discovered nodes: dialed once, kept on reload, forgotten if they fail */
+static void
+test_discovered(struct server *s,
+                struct dial *d,
+                struct vector_sockaddr *addrs,
+                struct vector_peername *hosts)
+{
+    struct sockaddr_in sin;
+    struct dial_target *t = NULL;
+    struct timeval now;
+    size_t count = d->count;
+    size_t i;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(4242);
+    evutil_inet_pton(AF_INET, "192.0.2.30", &sin.sin_addr);
+    CHECK(dial_discovered(d, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+    CHECK(dial_discovered(d, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+    CHECK(d->count == count + 1);
+
+    CHECK(dial_reload(d, addrs, hosts) == 0);
+    CHECK(d->count == count + 1);
+    for (i = 0; i < d->count; ++i)
+    {
+        if (d->targets[i]->discovered)
+            t = d->targets[i];
+    }
+    CHECK(t != NULL);
+    if (t == NULL)
+        return;
+    CHECK(t->state == DIAL_WAITING);
+
+    evutil_gettimeofday(&now, NULL);
+    for (i = 0; i < DIAL_FORGET; ++i)
+    {
+        t->state = DIAL_PENDING;
+        (void)dial_update(s, &now);
+    }
+    CHECK(d->count == count);
+
+    /* Not past DIAL_DISCOVERED_MAX */
+    for (i = 0; i <= DIAL_DISCOVERED_MAX; ++i)
+    {
+        sin.sin_port = htons((unsigned short)(5000 + i));
+        CHECK(dial_discovered(d, (struct sockaddr *)&sin, sizeof(sin))
+              == ((i < DIAL_DISCOVERED_MAX) ? 0 : -1));
+    }
+}
+
+/* A reload hangs up the peer removed, not another one on the same address */
+static void
+test_reload(struct server *s,
+            struct dial *d,
+            struct vector_sockaddr *addrs,
+            struct vector_peername *hosts)
+{
+    struct vector_sockaddr *more = v_sockaddr_new();
+    struct cfg_sockaddress ca;
+    struct sockaddr_in other;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ca.sockaddr;
+    struct dial_target *t = NULL;
+    struct mc mc;
+    size_t i;
+
+    memset(&ca, 0, sizeof(ca));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(4242);
+    evutil_inet_pton(AF_INET, "192.0.2.50", &sin->sin_addr);
+    ca.len = sizeof(*sin);
+    for (i = 0; i < v_sockaddr_size(addrs); ++i)
+        v_sockaddr_push(more, v_sockaddr_begin(addrs) + i);
+    v_sockaddr_push(more, &ca);
+    CHECK(dial_reload(d, more, hosts) == 0);
+    for (i = 0; i < d->count; ++i)
+    {
+        if (d->targets[i]->host == NULL && d->targets[i]->len == (socklen_t)ca.len
+            && evutil_sockaddr_cmp((struct sockaddr *)&d->targets[i]->addr,
+                                   (struct sockaddr *)sin, 1) == 0)
+            t = d->targets[i];
+    }
+    CHECK(t != NULL);
+    if (t != NULL)
+        t->state = DIAL_CONNECTED;
+
+    /* Another node behind the same address, connected first */
+    memcpy(&other, sin, sizeof(other));
+    other.sin_port = htons(4343);
+    memset(&mc, 0, sizeof(mc));
+    mc.p.address = (struct sockaddr *)&other;
+    mc.p.len = sizeof(other);
+    v_mc_push(s->peers, &mc);
+    mc.p.address = (struct sockaddr *)sin;
+    v_mc_push(s->peers, &mc);
+
+    closed = 0;
+    CHECK(dial_reload(d, addrs, hosts) == 0);
+    CHECK(closed == 1);
+    CHECK(closed_addr.sin_port == htons(4242));
+    v_mc_clean(s->peers);
+    v_sockaddr_delete(more);
+}
+
+int
+main(void)
+{
+    static char const *names[] = {"good.test", "v6.test", "bad.test",
+                                  "moved.test"};
+    struct event_base *base = event_base_new();
+    struct vector_sockaddr *addrs = v_sockaddr_new();
+    struct vector_peername *hosts = v_peername_new();
+    struct cfg_sockaddress ca;
+    struct sockaddr_in sin;
+    struct evdns_server_port *port;
+    struct server s;
+    struct dial *d;
+    socklen_t len = sizeof(sin);
+    evutil_socket_t fd;
+    char ns[32];
+    size_t i;
+
+    /* The stub server */
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (base == NULL || fd == -1
+        || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1
+        || getsockname(fd, (struct sockaddr *)&sin, &len) == -1
+        || evutil_make_socket_nonblocking(fd) == -1)
+    {
+        perror("stub server");
+        return 1;
+    }
+    port = evdns_add_server_port_with_base(base, fd, 0, stub_answer, NULL);
+    evutil_snprintf(ns, sizeof(ns), "127.0.0.1:%d", ntohs(sin.sin_port));
+
+    serv_opts.reconnect_max = 300;
+    serv_opts.max_dials = 4;
+    serv_opts.nameserver = ns;
+
+    memset(&ca, 0, sizeof(ca));
+    memcpy(&ca.sockaddr, &sin, sizeof(sin));
+    evutil_inet_pton(AF_INET, "192.0.2.20",
+                     &((struct sockaddr_in *)&ca.sockaddr)->sin_addr);
+    ca.len = sizeof(sin);
+    v_sockaddr_push(addrs, &ca);
+    for (i = 0; i < sizeof(names) / sizeof(*names); ++i)
+    {
+        struct cfg_peername pn;
+
+        pn.host = (char *)names[i];
+        pn.port = 4242;
+        v_peername_push(hosts, &pn);
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.evbase = base;
+    s.peers = v_mc_new();
+    s.pending_peers = v_mc_new();
+    s.dial_fib = (struct fiber *)&s;
+    d = dial_new(&s, addrs, hosts);
+    if (d == NULL)
+    {
+        fprintf(stderr, "dial_new failed\n");
+        return 1;
+    }
+    s.dial = d;
+
+    test_resolve(base, d);
+    test_moved(base, &s, d);
+    test_backoff(&s, d);
+    test_discovered(&s, d, addrs, hosts);
+    test_reload(&s, d, addrs, hosts);
+
+    dial_delete(d);
+    evdns_close_server_port(port);
+    evutil_closesocket(fd);
+    v_mc_delete(s.peers);
+    v_mc_delete(s.pending_peers);
+    v_sockaddr_delete(addrs);
+    v_peername_delete(hosts);
+    event_base_free(base);
+    if (failed != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,165 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+/*
+ * The flooding: the copies of a frame dropped while they are remembered,
+ * the sequence numbers and the millisecond clock wrapping around, the
+ * ways of a set evicted oldest first, and the coverage of a peer by the
+ * neighbours of another.
+ *
+ *   flood_test
+ *
+ * flood.c is included, its hash is needed to fill a set of the cache.
+ */
+
+#include "../../src/flood.c"
+
+#include <stdio.h>
+
+int debug = 0;
+
+static int failed;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            ++failed;                                                       \
+        }                                                                   \
+    } while (0)
+
+static size_t
+set_of(uint64_t origin,
+       uint32_t seq)
+{
+    return flood_mix((origin ^ seq) * FLOOD_M1) % FLOOD_CACHE_SETS;
+}
+
+static void
+test_seen(struct flood *f,
+          uint32_t now)
+{
+    uint64_t dropped = f->dropped;
+
+    CHECK(flood_seen(f, 42, 1, now) == 0);
+    CHECK(flood_seen(f, 42, 1, now) == 1);
+    CHECK(flood_seen(f, 42, 1, now + FLOOD_CACHE_TTL - 1) == 1);
+    CHECK(f->dropped == dropped + 2);
+    /* Another number, or another origin */
+    CHECK(flood_seen(f, 42, 2, now) == 0);
+    CHECK(flood_seen(f, 43, 1, now) == 0);
+    /* The numbers wrap */
+    CHECK(flood_seen(f, 42, UINT32_MAX, now) == 0);
+    CHECK(flood_seen(f, 42, 0, now) == 0);
+    CHECK(flood_seen(f, 42, UINT32_MAX, now) == 1);
+    /* Forgotten after the TTL */
+    CHECK(flood_seen(f, 42, 1, now + FLOOD_CACHE_TTL) == 0);
+    CHECK(flood_seen(f, 42, 1, now + FLOOD_CACHE_TTL) == 1);
+}
+
+/*
+ * FLOOD_CACHE_WAYS frames of a same set are all remembered, one more
+ * evicts the oldest one.
+ */
+static void
+test_ways(struct flood *f,
+          uint32_t now)
+{
+    uint32_t seqs[FLOOD_CACHE_WAYS + 1];
+    uint64_t origin = 7;
+    uint32_t seq;
+    size_t set = set_of(origin, 0);
+    int n = 0;
+    int i;
+
+    for (seq = 0; n < FLOOD_CACHE_WAYS + 1; ++seq)
+    {
+        if (set_of(origin, seq) == set)
+            seqs[n++] = seq;
+    }
+    for (i = 0; i < FLOOD_CACHE_WAYS; ++i)
+        CHECK(flood_seen(f, origin, seqs[i], now + (uint32_t)i) == 0);
+    for (i = 0; i < FLOOD_CACHE_WAYS; ++i)
+        CHECK(flood_seen(f, origin, seqs[i], now + FLOOD_CACHE_WAYS) == 1);
+    CHECK(flood_seen(f, origin, seqs[FLOOD_CACHE_WAYS],
+                     now + FLOOD_CACHE_WAYS) == 0);
+    CHECK(flood_seen(f, origin, seqs[0], now + FLOOD_CACHE_WAYS) == 0);
+    CHECK(flood_seen(f, origin, seqs[2], now + FLOOD_CACHE_WAYS) == 1);
+}
+
+static void
+test_covers(void)
+{
+    unsigned char value[4 * 8];
+    struct flood_peer from;
+    struct flood_peer to;
+
+    memset(&from, 0, sizeof(from));
+    memset(&to, 0, sizeof(to));
+    mp_put_u64(value, 1);
+    mp_put_u64(value + 8, 30);
+    mp_put_u64(value + 16, 10);
+    mp_put_u64(value + 24, 20);
+    CHECK(flood_peer_set(&from, value, sizeof(value)) == 0);
+    CHECK(from.id == 1 && from.count == 3);
+    CHECK(from.neighbours[0] == 10 && from.neighbours[2] == 30);
+    /* Not told yet */
+    CHECK(flood_covers(&from, &to) == 0);
+    to.id = 20;
+    CHECK(flood_covers(&from, &to) == 1);
+    to.id = 25;
+    CHECK(flood_covers(&from, &to) == 0);
+    CHECK(flood_peer_set(&from, value, 12) == -1);
+    CHECK(flood_peer_set(&from, value, 0) == -1);
+    /* No neighbours */
+    CHECK(flood_peer_set(&from, value, 8) == 0);
+    CHECK(from.count == 0 && from.neighbours == NULL);
+    to.id = 10;
+    CHECK(flood_covers(&from, &to) == 0);
+    flood_peer_free(&from);
+}
+
+int
+main(void)
+{
+    /* Before and after the clock wraps, and around it */
+    static uint32_t const clocks[] = {1000, 0x80000000U, UINT32_MAX - 2};
+    size_t i;
+
+    for (i = 0; i < sizeof(clocks) / sizeof(*clocks); ++i)
+    {
+        struct flood *f = flood_new();
+
+        if (f == NULL)
+        {
+            fprintf(stderr, "flood_new failed\n");
+            return 1;
+        }
+        CHECK(f->self != 0);
+        test_seen(f, clocks[i]);
+        test_ways(f, clocks[i]);
+        flood_delete(f);
+    }
+    test_covers();
+    if (failed != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
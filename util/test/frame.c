@@ -0,0 +1,258 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+/*
+ * The header codec: the short and extended headers around PACKET_SHORT_MAX
+ * up to the largest superframe, their first byte out of the DTLS range,
+ * the truncated headers, the routed headers and their route. The split of the aggregates: the short, extended
+ * and routed frames it carries, the aggregate cut anywhere, and the frames
+ * which can't be in one: empty, or an aggregate again.
+ *
+ *   frame_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "frame.h"
+#include "offload.h"
+
+int debug = 0;
+
+static int failed;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            ++failed;                                                       \
+        }                                                                   \
+    } while (0)
+
+static void
+test_header(void)
+{
+    unsigned char p[PACKET_HDR_MAX];
+    unsigned int size;
+    unsigned int flags;
+    unsigned int i;
+
+    for (i = 0; i <= OFFLOAD_PACKET_MAX; ++i)
+    {
+        size_t len = packet_hdr_write(p, i, 0);
+
+        CHECK(len == packet_hdr_len(i));
+        CHECK(len == (i < PACKET_SHORT_MAX ? 2 : PACKET_HDR_EXT));
+        /* Never mistaken for a DTLS record */
+        CHECK(p[0] < 20 || p[0] > 63);
+        CHECK(packet_hdr_read(p, len, &size, &flags) == len);
+        CHECK(size == i && flags == 0);
+        /* One byte short */
+        CHECK(packet_hdr_read(p, len - 1, &size, &flags) == 0);
+        if (failed > 0)
+            return;
+    }
+
+    /* The aggregates keep the 15 low bits of their size */
+    CHECK(packet_hdr_write(p, 1400, PACKET_AGGREGATE) == 2);
+    CHECK(p[0] >= 0x80);
+    CHECK(packet_hdr_read(p, 2, &size, &flags) == 2);
+    CHECK(size == 1400 && flags == PACKET_AGGREGATE);
+    CHECK(packet_hdr_write(p, PACKET_SIZE_MASK, PACKET_AGGREGATE) == 2);
+    CHECK(packet_hdr_read(p, 2, &size, &flags) == 2);
+    CHECK(size == PACKET_SIZE_MASK);
+
+    /* Nothing to read */
+    CHECK(packet_hdr_read(p, 0, &size, &flags) == 0);
+}
+
+static void
+test_routed(void)
+{
+    static unsigned int const sizes[] = {0, 60, PACKET_SHORT_MAX,
+                                         OFFLOAD_PACKET_MAX};
+    struct packet_route r;
+    struct packet_route got;
+    struct frame f;
+    unsigned int size;
+    unsigned int flags;
+    size_t i;
+
+    r.src = 0x0102030405060708ULL;
+    r.dst = UINT64_MAX;
+    r.ttl = 255;
+    r.seq = 0xfedcba98U;
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i)
+    {
+        unsigned char *p;
+
+        CHECK(frame_alloc(&f, sizes[i]) == 0);
+        frame_set_routed_hdr(&f, &r);
+        p = f.raw_packet;
+        CHECK(p + PACKET_HDR_MAX == f.frame);
+        CHECK(p[0] < 20 || p[0] > 63);
+        CHECK(packet_hdr_read(p, PACKET_HDR_MAX, &size, &flags)
+              == PACKET_HDR_MAX);
+        CHECK(size == sizes[i] && flags == PACKET_ROUTED);
+        /* The route cut short */
+        CHECK(packet_hdr_read(p, PACKET_HDR_MAX - 1, &size, &flags) == 0);
+        memset(&got, 0, sizeof(got));
+        packet_route_get(p, &got);
+        CHECK(got.src == r.src && got.dst == r.dst);
+        CHECK(got.ttl == r.ttl && got.seq == r.seq);
+        frame_free(&f);
+    }
+}
+
+/* The frames of the aggregate, and where each one ends in it */
+static unsigned int const sizes[] = {1, 100, PACKET_SHORT_MAX, 60};
+static unsigned int const routed[] = {0, 0, 0, PACKET_ROUTED};
+#define FRAMES  (sizeof(sizes) / sizeof(*sizes))
+
+static size_t ends[FRAMES];
+
+/* The body of an aggregate, its own header left out */
+static size_t
+make_aggregate(unsigned char *buf)
+{
+    unsigned char *p = buf;
+    size_t i;
+
+    for (i = 0; i < FRAMES; ++i)
+    {
+        size_t hdr_len = packet_hdr_write(p, sizes[i], routed[i]);
+
+        memset(p + hdr_len, (int)i + 1, sizes[i]);
+        p += hdr_len + sizes[i];
+        ends[i] = (size_t)(p - buf);
+    }
+    return (size_t)(p - buf);
+}
+
+/* Copied to a buffer of its exact size, any overread is caught */
+static int
+split(unsigned char const *buf, size_t len, size_t *count)
+{
+    unsigned char *copy = malloc(len + 1);
+    unsigned char *p = copy;
+    struct frame sub;
+    int ret;
+
+    memcpy(copy, buf, len);
+    *count = 0;
+    while ((ret = packet_aggregate_next(&p, copy + len, &sub)) == 1)
+    {
+        unsigned char const *f = sub.frame;
+
+        CHECK(*count < FRAMES);
+        if (*count >= FRAMES)
+            break;
+        CHECK(sub.size == sizes[*count]);
+        CHECK(f[0] == *count + 1 && f[sub.size - 1] == *count + 1);
+        CHECK((unsigned char *)sub.frame + sub.size == copy + ends[*count]);
+        ++*count;
+    }
+    free(copy);
+    return ret;
+}
+
+static void
+test_split(void)
+{
+    unsigned char buf[FRAMES * (PACKET_HDR_MAX + PACKET_SHORT_MAX)];
+    size_t len = make_aggregate(buf);
+    size_t count;
+
+    CHECK(split(buf, len, &count) == 0);
+    CHECK(count == FRAMES);
+    /* Nothing in it */
+    CHECK(split(buf, 0, &count) == 0);
+    CHECK(count == 0);
+}
+
+/* Cut anywhere, only the frames entirely in it come out */
+static void
+test_truncated(void)
+{
+    unsigned char buf[FRAMES * (PACKET_HDR_MAX + PACKET_SHORT_MAX)];
+    size_t len = make_aggregate(buf);
+    size_t cut;
+
+    for (cut = 1; cut < len; ++cut)
+    {
+        size_t whole = 0;
+        size_t count;
+        int ret;
+
+        while (whole < FRAMES && ends[whole] <= cut)
+            ++whole;
+        ret = split(buf, cut, &count);
+        CHECK(count == whole);
+        CHECK(ret == ((whole > 0 && ends[whole - 1] == cut) ? 0 : -1));
+    }
+}
+
+static void
+test_malformed(void)
+{
+    unsigned char buf[FRAMES * (PACKET_HDR_MAX + PACKET_SHORT_MAX)];
+    size_t len = make_aggregate(buf);
+    unsigned char *p;
+    struct frame sub;
+    size_t count;
+
+    /* An aggregate in the aggregate, after the first frame */
+    (void)packet_hdr_write(buf + ends[0], 100, PACKET_AGGREGATE);
+    CHECK(split(buf, len, &count) == -1);
+    CHECK(count == 1);
+
+    /* An empty frame */
+    make_aggregate(buf);
+    (void)packet_hdr_write(buf, 0, 0);
+    CHECK(split(buf, len, &count) == -1);
+    CHECK(count == 0);
+
+    /* The size of a frame running past the aggregate */
+    make_aggregate(buf);
+    (void)packet_hdr_write(buf + ends[FRAMES - 2], 61, PACKET_ROUTED);
+    CHECK(split(buf, len, &count) == -1);
+    CHECK(count == FRAMES - 1);
+
+    /* Once done, it stays done */
+    p = buf + len;
+    CHECK(packet_aggregate_next(&p, buf + len, &sub) == 0);
+    CHECK(p == buf + len);
+}
+
+int
+main(void)
+{
+    test_header();
+    test_routed();
+    test_split();
+    test_truncated();
+    test_malformed();
+    if (failed != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
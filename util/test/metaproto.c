@@ -0,0 +1,276 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+/*
+ * The framing of the meta-connexion protocol: the integers in network byte
+ * order, the messages split across reads or across chains, the largest
+ * value, the unknown types skipped, and the truncated messages or the
+ * unknown versions which close the meta-connexion.
+ *
+ *   metaproto_test
+ */
+
+#include <event2/buffer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metaproto.h"
+
+int debug = 0;
+
+static int failed;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            ++failed;                                                       \
+        }                                                                   \
+    } while (0)
+
+/* What the handlers saw */
+struct seen
+{
+    int             calls;
+    int             type;
+    size_t          len;
+    unsigned char   first;
+    unsigned char   last;
+    int             refuse;
+};
+
+static int
+seen_value(struct seen *s, int type, unsigned char const *value, size_t len)
+{
+    ++s->calls;
+    s->type = type;
+    s->len = len;
+    s->first = len > 0 ? value[0] : 0;
+    s->last = len > 0 ? value[len - 1] : 0;
+    return s->refuse ? -1 : 0;
+}
+
+static int
+on_hello(void *ctx, unsigned char const *value, size_t len)
+{
+    return seen_value(ctx, MP_HELLO, value, len);
+}
+
+static int
+on_udp_port(void *ctx, unsigned char const *value, size_t len)
+{
+    return seen_value(ctx, MP_UDP_PORT, value, len);
+}
+
+static int
+on_neighbours(void *ctx, unsigned char const *value, size_t len)
+{
+    return seen_value(ctx, MP_NEIGHBOURS, value, len);
+}
+
+/* MP_PUNCH and the others are left without a handler */
+static struct mp_dispatch const table[MP_TYPE_MAX] = {
+    [MP_HELLO] = {on_hello, 0},
+    [MP_UDP_PORT] = {on_udp_port, 2},
+    [MP_NEIGHBOURS] = {on_neighbours, 8},
+};
+
+static void
+test_integers(void)
+{
+    unsigned char b[8];
+
+    mp_put_u16(b, 0xbeef);
+    CHECK(b[0] == 0xbe && b[1] == 0xef);
+    CHECK(mp_get_u16(b) == 0xbeef);
+    mp_put_u32(b, 0xdeadbeefU);
+    CHECK(b[0] == 0xde && b[3] == 0xef);
+    CHECK(mp_get_u32(b) == 0xdeadbeefU);
+    mp_put_u64(b, 0x0102030405060708ULL);
+    CHECK(b[0] == 0x01 && b[7] == 0x08);
+    CHECK(mp_get_u64(b) == 0x0102030405060708ULL);
+    mp_put_u64(b, UINT64_MAX);
+    CHECK(mp_get_u64(b) == UINT64_MAX);
+}
+
+static void
+test_messages(void)
+{
+    struct evbuffer *buf = evbuffer_new();
+    unsigned char port[2] = {0x10, 0x92};
+    struct seen s;
+
+    memset(&s, 0, sizeof(s));
+    CHECK(mp_add(buf, MP_HELLO, NULL, 0) == 0);
+    CHECK(mp_add(buf, MP_UDP_PORT, port, sizeof(port)) == 0);
+    CHECK(evbuffer_get_length(buf) == 2 * MP_HDR_SIZE + sizeof(port));
+    CHECK(mp_parse(buf, table, &s) == 0);
+    CHECK(s.calls == 2);
+    CHECK(s.type == MP_UDP_PORT && s.len == 2);
+    CHECK(s.first == 0x10 && s.last == 0x92);
+    CHECK(evbuffer_get_length(buf) == 0);
+    evbuffer_free(buf);
+}
+
+/* A message read a few bytes at a time */
+static void
+test_partial(void)
+{
+    struct evbuffer *out = evbuffer_new();
+    struct evbuffer *in = evbuffer_new();
+    unsigned char value[16];
+    unsigned char b;
+    struct seen s;
+
+    memset(&s, 0, sizeof(s));
+    memset(value, 0x42, sizeof(value));
+    value[sizeof(value) - 1] = 0x43;
+    mp_add(out, MP_NEIGHBOURS, value, sizeof(value));
+    while (evbuffer_remove(out, &b, 1) == 1)
+    {
+        evbuffer_add(in, &b, 1);
+        CHECK(mp_parse(in, table, &s) == 0);
+        if (evbuffer_get_length(out) > 0)
+        {
+            CHECK(s.calls == 0);
+            CHECK(evbuffer_get_length(in) > 0);
+        }
+    }
+    CHECK(s.calls == 1);
+    CHECK(s.len == sizeof(value) && s.last == 0x43);
+    CHECK(evbuffer_get_length(in) == 0);
+    evbuffer_free(out);
+    evbuffer_free(in);
+}
+
+/* The largest value, spread over several chains */
+static void
+test_max(void)
+{
+    struct evbuffer *buf = evbuffer_new();
+    unsigned char *value = malloc(MP_MAX_VALUE + 1);
+    unsigned char hdr[MP_HDR_SIZE];
+    size_t off;
+    struct seen s;
+
+    memset(&s, 0, sizeof(s));
+    memset(value, 0x11, MP_MAX_VALUE + 1);
+    value[MP_MAX_VALUE - 1] = 0x22;
+    CHECK(mp_add(buf, MP_NEIGHBOURS, value, MP_MAX_VALUE + 1) == -1);
+    CHECK(evbuffer_get_length(buf) == 0);
+
+    hdr[0] = MP_VERSION;
+    hdr[1] = MP_NEIGHBOURS;
+    mp_put_u16(hdr + 2, MP_MAX_VALUE);
+    evbuffer_add(buf, hdr, sizeof(hdr));
+    for (off = 0; off < MP_MAX_VALUE; off += 1000)
+    {
+        size_t n = MP_MAX_VALUE - off < 1000 ? MP_MAX_VALUE - off : 1000;
+
+        evbuffer_add(buf, value + off, n);
+    }
+    CHECK(mp_parse(buf, table, &s) == 0);
+    CHECK(s.calls == 1);
+    CHECK(s.len == MP_MAX_VALUE && s.first == 0x11 && s.last == 0x22);
+    CHECK(evbuffer_get_length(buf) == 0);
+    free(value);
+    evbuffer_free(buf);
+}
+
+/* Unknown types, or types without a handler, are skipped */
+static void
+test_unknown(void)
+{
+    struct evbuffer *buf = evbuffer_new();
+    unsigned char value[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    unsigned char hdr[MP_HDR_SIZE];
+    struct seen s;
+
+    memset(&s, 0, sizeof(s));
+    hdr[0] = MP_VERSION;
+    hdr[1] = MP_TYPE_MAX;
+    mp_put_u16(hdr + 2, sizeof(value));
+    evbuffer_add(buf, hdr, sizeof(hdr));
+    evbuffer_add(buf, value, sizeof(value));
+    hdr[1] = 0xff;
+    mp_put_u16(hdr + 2, 0);
+    evbuffer_add(buf, hdr, sizeof(hdr));
+    mp_add(buf, MP_PUNCH, value, sizeof(value));
+    /* Type 0 is not a message either */
+    hdr[1] = 0;
+    mp_put_u16(hdr + 2, 1);
+    evbuffer_add(buf, hdr, sizeof(hdr));
+    evbuffer_add(buf, value, 1);
+    mp_add(buf, MP_HELLO, NULL, 0);
+    CHECK(mp_parse(buf, table, &s) == 0);
+    CHECK(s.calls == 1 && s.type == MP_HELLO);
+    CHECK(evbuffer_get_length(buf) == 0);
+    evbuffer_free(buf);
+}
+
+static void
+test_refused(void)
+{
+    struct evbuffer *buf = evbuffer_new();
+    unsigned char value[8] = {0};
+    unsigned char hdr[MP_HDR_SIZE];
+    struct seen s;
+
+    /* Shorter than the minimal length of its type */
+    memset(&s, 0, sizeof(s));
+    mp_add(buf, MP_NEIGHBOURS, value, 7);
+    CHECK(mp_parse(buf, table, &s) == -1);
+    CHECK(s.calls == 0);
+    evbuffer_drain(buf, evbuffer_get_length(buf));
+
+    /* Another version, before its value is even there */
+    hdr[0] = MP_VERSION + 1;
+    hdr[1] = MP_HELLO;
+    mp_put_u16(hdr + 2, 100);
+    evbuffer_add(buf, hdr, sizeof(hdr));
+    CHECK(mp_parse(buf, table, &s) == -1);
+    CHECK(s.calls == 0);
+    evbuffer_drain(buf, evbuffer_get_length(buf));
+
+    /* The handler closes, the next message is not read */
+    s.refuse = 1;
+    mp_add(buf, MP_HELLO, NULL, 0);
+    mp_add(buf, MP_UDP_PORT, value, 2);
+    CHECK(mp_parse(buf, table, &s) == -1);
+    CHECK(s.calls == 1 && s.type == MP_HELLO);
+    evbuffer_free(buf);
+}
+
+int
+main(void)
+{
+    test_integers();
+    test_messages();
+    test_partial();
+    test_max();
+    test_unknown();
+    test_refused();
+    if (failed != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
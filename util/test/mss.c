@@ -0,0 +1,286 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+/*
+ * The MSS clamping: the IPv4 and IPv6 SYN, behind an ethernet and a VLAN
+ * header or not, the option at an odd offset, the TCP checksum still valid
+ * once patched, and the segments left alone: no SYN, a smaller MSS, a later
+ * fragment, or options running past the header.
+ *
+ *   mss_test
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mss.h"
+
+static int failed;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            ++failed;                                                       \
+        }                                                                   \
+    } while (0)
+
+#define TCP_LEN     28  /* The header with 8 bytes of options */
+
+static uint32_t
+sum16(uint32_t sum, unsigned char const *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2)
+        sum += (uint32_t)((p[i] << 8) | p[i + 1]);
+    if (len & 1)
+        sum += (uint32_t)(p[len - 1] << 8);
+    return sum;
+}
+
+static uint16_t
+fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+/* The TCP checksum over the pseudo header, computed from scratch */
+static uint16_t
+tcp_csum(unsigned char const *ip, int v6)
+{
+    unsigned char const *tcp = ip + (v6 ? 40 : 20);
+    uint32_t sum;
+
+    if (v6)
+        sum = sum16(0, ip + 8, 32);
+    else
+        sum = sum16(0, ip + 12, 8);
+    sum += 6 + TCP_LEN;
+    return fold(sum16(sum, tcp, TCP_LEN));
+}
+
+/*
+ * A SYN advertising mss, with its options starting by pad NOPs.
+ * Returns the offset of the MSS value in the TCP header.
+ */
+static size_t
+make_syn(unsigned char *ip, int v6, uint16_t mss, int pad)
+{
+    unsigned char *tcp = ip + (v6 ? 40 : 20);
+    unsigned char *opt = tcp + 20;
+    uint16_t csum;
+    int i;
+
+    memset(ip, 0, (v6 ? 40 : 20) + TCP_LEN);
+    if (v6)
+    {
+        ip[0] = 0x60;
+        ip[5] = TCP_LEN;
+        ip[6] = 6;
+        ip[7] = 64;
+        ip[8] = 0x20;
+        ip[9] = 0x01;
+        ip[23] = 1;
+        ip[24] = 0x20;
+        ip[25] = 0x01;
+        ip[39] = 2;
+    }
+    else
+    {
+        ip[0] = 0x45;
+        ip[3] = 20 + TCP_LEN;
+        ip[8] = 64;
+        ip[9] = 6;
+        ip[12] = 192;
+        ip[14] = 2;
+        ip[15] = 1;
+        ip[16] = 192;
+        ip[18] = 2;
+        ip[19] = 2;
+    }
+    tcp[0] = 0xc3;
+    tcp[1] = 0x50;
+    tcp[3] = 80;
+    tcp[4] = 0x12;
+    tcp[7] = 0x34;
+    tcp[12] = (TCP_LEN / 4) << 4;
+    tcp[13] = 0x02;
+    tcp[14] = 0xff;
+    for (i = 0; i < pad; ++i)
+        *opt++ = 1;
+    opt[0] = 2;
+    opt[1] = 4;
+    opt[2] = (unsigned char)(mss >> 8);
+    opt[3] = (unsigned char)mss;
+    csum = (uint16_t)~tcp_csum(ip, v6);
+    tcp[16] = (unsigned char)(csum >> 8);
+    tcp[17] = (unsigned char)csum;
+    return 20 + (size_t)pad + 2;
+}
+
+static uint16_t
+get_mss(unsigned char const *ip, int v6, size_t off)
+{
+    unsigned char const *p = ip + (v6 ? 40 : 20) + off;
+
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void
+test_ipv4(void)
+{
+    unsigned char ip[20 + TCP_LEN];
+    size_t off;
+    int pad;
+
+    /* Even and odd offsets, the checksum patched both ways */
+    for (pad = 0; pad < 4; ++pad)
+    {
+        off = make_syn(ip, 0, 1460, pad);
+        CHECK(tcp_csum(ip, 0) == 0xffff);
+        CHECK(mss_clamp(ip, sizeof(ip), 0, 1400) == 1);
+        CHECK(get_mss(ip, 0, off) == 1360);
+        CHECK(tcp_csum(ip, 0) == 0xffff);
+    }
+
+    /* A smaller MSS is kept */
+    off = make_syn(ip, 0, 1200, 0);
+    CHECK(mss_clamp(ip, sizeof(ip), 0, 1400) == 0);
+    CHECK(get_mss(ip, 0, off) == 1200);
+    /* The same one too */
+    make_syn(ip, 0, 1360, 0);
+    CHECK(mss_clamp(ip, sizeof(ip), 0, 1400) == 0);
+}
+
+static void
+test_ipv6(void)
+{
+    unsigned char ip[40 + TCP_LEN];
+    size_t off;
+    int pad;
+
+    for (pad = 0; pad < 2; ++pad)
+    {
+        off = make_syn(ip, 1, 1440, pad);
+        CHECK(tcp_csum(ip, 1) == 0xffff);
+        CHECK(mss_clamp(ip, sizeof(ip), 0, 1400) == 1);
+        CHECK(get_mss(ip, 1, off) == 1340);
+        CHECK(tcp_csum(ip, 1) == 0xffff);
+    }
+    /* The payload length runs past the packet */
+    make_syn(ip, 1, 1440, 0);
+    CHECK(mss_clamp(ip, sizeof(ip) - 1, 0, 1400) == 0);
+}
+
+static void
+test_ethernet(void)
+{
+    unsigned char frame[18 + 20 + TCP_LEN];
+    size_t off;
+
+    memset(frame, 0, sizeof(frame));
+    frame[12] = 0x08;
+    off = make_syn(frame + 14, 0, 1460, 1);
+    CHECK(mss_clamp(frame, 14 + 20 + TCP_LEN, 1, 1400) == 1);
+    CHECK(get_mss(frame + 14, 0, off) == 1360);
+    CHECK(tcp_csum(frame + 14, 0) == 0xffff);
+
+    memset(frame, 0, sizeof(frame));
+    frame[12] = 0x81;
+    frame[16] = 0x08;
+    off = make_syn(frame + 18, 0, 1460, 1);
+    CHECK(mss_clamp(frame, sizeof(frame), 1, 1400) == 1);
+    CHECK(get_mss(frame + 18, 0, off) == 1360);
+    CHECK(tcp_csum(frame + 18, 0) == 0xffff);
+
+    /* Neither IPv4 nor IPv6 */
+    frame[16] = 0x08;
+    frame[17] = 0x06;
+    CHECK(mss_clamp(frame, sizeof(frame), 1, 1400) == 0);
+    /* Shorter than the headers */
+    CHECK(mss_clamp(frame, 13, 1, 1400) == 0);
+    CHECK(mss_clamp(frame, 17, 1, 1400) == 0);
+}
+
+/* The segments to leave alone */
+static void
+test_untouched(void)
+{
+    unsigned char ip[20 + TCP_LEN];
+    unsigned char orig[sizeof(ip)];
+
+    /* Not a SYN */
+    make_syn(ip, 0, 1460, 0);
+    ip[20 + 13] = 0x10;
+    memcpy(orig, ip, sizeof(ip));
+    CHECK(mss_clamp(ip, sizeof(ip), 0, 1400) == 0);
+    CHECK(memcmp(ip, orig, sizeof(ip)) == 0);
+
+    /* A later fragment */
+    make_syn(ip, 0, 1460, 0);
+    ip[7] = 0xb9;
+    CHECK(mss_clamp(ip, sizeof(ip), 0, 1400) == 0);
+
+    /* An option whose length runs past the header */
+    make_syn(ip, 0, 1460, 0);
+    ip[20 + 21] = 9;
+    CHECK(mss_clamp(ip, sizeof(ip), 0, 1400) == 0);
+    /* Or too short to move on */
+    ip[20 + 21] = 1;
+    CHECK(mss_clamp(ip, sizeof(ip), 0, 1400) == 0);
+
+    /* The end of the options before the MSS */
+    make_syn(ip, 0, 1460, 1);
+    ip[20 + 20] = 0;
+    CHECK(mss_clamp(ip, sizeof(ip), 0, 1400) == 0);
+
+    /* A data offset past the segment */
+    make_syn(ip, 0, 1460, 0);
+    ip[20 + 12] = 0xf0;
+    CHECK(mss_clamp(ip, sizeof(ip), 0, 1400) == 0);
+
+    /* An IP total length past the packet */
+    make_syn(ip, 0, 1460, 0);
+    CHECK(mss_clamp(ip, sizeof(ip) - 1, 0, 1400) == 0);
+
+    /* Not TCP, or an MTU leaving no room for a segment */
+    make_syn(ip, 0, 1460, 0);
+    CHECK(mss_clamp(ip, sizeof(ip), 0, 40) == 0);
+    ip[9] = 17;
+    CHECK(mss_clamp(ip, sizeof(ip), 0, 1400) == 0);
+    CHECK(mss_clamp(ip, 0, 0, 1400) == 0);
+}
+
+int
+main(void)
+{
+    test_ipv4();
+    test_ipv6();
+    test_ethernet();
+    test_untouched();
+    if (failed != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,144 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+/*
+ * The anti-replay window: in order and reordered sequence numbers, the
+ * duplicates, the ones late or out of the window, the top jumping past the
+ * whole ring, and the end of the 64-bit space.
+ *
+ *   replay_test
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "replay.h"
+
+static int failed;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            ++failed;                                                       \
+        }                                                                   \
+    } while (0)
+
+static void
+test_order(void)
+{
+    struct replay_window w;
+    uint64_t seq;
+
+    replay_init(&w);
+    for (seq = 0; seq < 1000; ++seq)
+        CHECK(replay_check(&w, seq) == REPLAY_OK);
+    CHECK(replay_check(&w, 999) == REPLAY_DUPLICATE);
+    CHECK(replay_check(&w, 0) == REPLAY_DUPLICATE);
+    CHECK(w.duplicate == 2);
+
+    /* Reordered, within the window */
+    replay_init(&w);
+    CHECK(replay_check(&w, 10) == REPLAY_OK);
+    CHECK(replay_check(&w, 5) == REPLAY_OK);
+    CHECK(replay_check(&w, 7) == REPLAY_OK);
+    CHECK(replay_check(&w, 5) == REPLAY_DUPLICATE);
+    CHECK(replay_check(&w, 6) == REPLAY_OK);
+    CHECK(w.top == 10);
+}
+
+static void
+test_edges(void)
+{
+    struct replay_window w;
+    uint64_t top = 3 * REPLAY_WINDOW_SIZE;
+
+    replay_init(&w);
+    CHECK(replay_check(&w, top) == REPLAY_OK);
+    /* The oldest one the window still holds, then the first behind it */
+    CHECK(replay_check(&w, top - REPLAY_WINDOW_SIZE + 1) == REPLAY_OK);
+    CHECK(replay_check(&w, top - REPLAY_WINDOW_SIZE + 1) == REPLAY_DUPLICATE);
+    CHECK(replay_check(&w, top - REPLAY_WINDOW_SIZE) == REPLAY_LATE);
+    CHECK(replay_check(&w, top - 2 * REPLAY_WINDOW_SIZE + 1) == REPLAY_LATE);
+    CHECK(replay_check(&w, top - 2 * REPLAY_WINDOW_SIZE)
+          == REPLAY_OUT_OF_WINDOW);
+    CHECK(replay_check(&w, 0) == REPLAY_OUT_OF_WINDOW);
+    CHECK(w.late == 2);
+    CHECK(w.out_of_window == 2);
+    /* None of them moved the window */
+    CHECK(w.top == top);
+}
+
+/* The bits of the old words must not come back once the ring wrapped */
+static void
+test_wrap(void)
+{
+    struct replay_window w;
+    uint64_t ring = (uint64_t)REPLAY_RING_WORDS * 64;
+    uint64_t seq;
+
+    replay_init(&w);
+    CHECK(replay_check(&w, 5) == REPLAY_OK);
+    /* Same word and bit of the ring, one turn later */
+    CHECK(replay_check(&w, 5 + ring) == REPLAY_OK);
+    CHECK(replay_check(&w, 5 + ring) == REPLAY_DUPLICATE);
+    /* Far past the whole ring */
+    CHECK(replay_check(&w, 5 + 100 * ring) == REPLAY_OK);
+    CHECK(replay_check(&w, 4 + 100 * ring) == REPLAY_OK);
+
+    /* Every word crossed one by one */
+    replay_init(&w);
+    for (seq = 0; seq < 3 * ring; seq += 64)
+        CHECK(replay_check(&w, seq) == REPLAY_OK);
+    for (seq = 3 * ring - REPLAY_WINDOW_SIZE + 1; seq < 3 * ring; ++seq)
+    {
+        enum replay_verdict v = replay_check(&w, seq);
+
+        CHECK(v == ((seq % 64 == 0) ? REPLAY_DUPLICATE : REPLAY_OK));
+    }
+}
+
+/* The last sequence numbers of the space */
+static void
+test_end(void)
+{
+    struct replay_window w;
+
+    replay_init(&w);
+    CHECK(replay_check(&w, UINT64_MAX - 1) == REPLAY_OK);
+    CHECK(replay_check(&w, UINT64_MAX) == REPLAY_OK);
+    CHECK(replay_check(&w, UINT64_MAX) == REPLAY_DUPLICATE);
+    CHECK(replay_check(&w, UINT64_MAX - 2) == REPLAY_OK);
+    CHECK(replay_check(&w, 0) == REPLAY_OUT_OF_WINDOW);
+    CHECK(w.top == UINT64_MAX);
+}
+
+int
+main(void)
+{
+    test_order();
+    test_edges();
+    test_wrap();
+    test_end();
+    if (failed != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,281 @@
+/**
+ * Copyright (c) 2012, PICHOT Fabien Paul Leonard <pichot.fabien@gmail.com>
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+**/
+
+/*
+ * The link-state routing: the lowest cost next hop over the link states,
+ * the links only one of their ends advertises, the nodes whose link state
+ * is unknown, the newer link states replacing the older ones across the
+ * wrap of their sequence numbers, the invalid ones, the forgotten nodes,
+ * and the hosts learnt behind a node.
+ *
+ *   route_test
+ *
+ * route.c is included, its static functions are the ones to check.
+ */
+
+#include "../../src/route.c"
+
+#include <stdio.h>
+
+int debug = 0;
+
+static int failed;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            ++failed;                                                       \
+        }                                                                   \
+    } while (0)
+
+/* What route.c calls of the rest of the daemon, its fiber is not run */
+
+intptr_t
+sched_get_userptr(struct fiber_args *args)
+{
+    (void)args;
+    return 0;
+}
+
+void
+async_wait(struct fiber_args *args,
+           struct timeval const *tv)
+{
+    (void)args;
+    (void)tv;
+}
+
+struct probe_metric *
+keepalive_path(struct udp_peer *peer,
+               size_t path)
+{
+    (void)peer;
+    (void)path;
+    return NULL;
+}
+
+void
+server_advertise_link_state(struct server *s,
+                            struct mc *skip,
+                            unsigned char const *value,
+                            size_t len)
+{
+    (void)s;
+    (void)skip;
+    (void)value;
+    (void)len;
+}
+
+struct link
+{
+    uint64_t    id;
+    uint32_t    cost;
+};
+
+#define SELF    1
+
+static size_t
+make_lsa(unsigned char *buf,
+         uint64_t origin,
+         uint32_t seq,
+         struct link const *links,
+         size_t count)
+{
+    size_t i;
+
+    mp_put_u64(buf, origin);
+    mp_put_u32(buf + 8, seq);
+    for (i = 0; i < count; ++i)
+    {
+        mp_put_u64(buf + ROUTE_LSA_HDR + i * ROUTE_LSA_LINK, links[i].id);
+        mp_put_u32(buf + ROUTE_LSA_HDR + i * ROUTE_LSA_LINK + 8,
+                   links[i].cost);
+    }
+    return ROUTE_LSA_HDR + count * ROUTE_LSA_LINK;
+}
+
+static int
+input(struct route *r,
+      uint64_t origin,
+      uint32_t seq,
+      struct link const *links,
+      size_t count)
+{
+    unsigned char buf[ROUTE_LSA_HDR + 8 * ROUTE_LSA_LINK];
+
+    return route_lsa_input(r, buf, make_lsa(buf, origin, seq, links, count));
+}
+
+/* As route_originate does it */
+static void
+originate(struct route *r,
+          struct link const *links,
+          size_t count,
+          uint32_t now)
+{
+    unsigned char *value = malloc(ROUTE_LSA_HDR + count * ROUTE_LSA_LINK);
+    size_t len = make_lsa(value, SELF, ++r->seq, links, count);
+
+    route_lsa_store(r, SELF, r->seq, value, len, now);
+    route_compute(r);
+}
+
+static uint32_t
+cost_to(struct route const *r,
+        uint64_t dst)
+{
+    size_t i;
+
+    for (i = 0; i < r->count; ++i)
+    {
+        if (r->table[i].dst == dst)
+            return r->table[i].cost;
+    }
+    return 0;
+}
+
+/*
+ *   1 --10-- 2 --10-- 3 --5-- 4
+ *    \______100______/
+ *
+ * 1 also claims a link to 5 which 5 doesn't, 4 one to 1 which 1 doesn't,
+ * 3 one to 6 which never told anything.
+ */
+static void
+test_paths(struct route *r)
+{
+    static struct link const l1[] = {{2, 10}, {3, 100}, {5, 1}};
+    static struct link const l2[] = {{1, 10}, {3, 10}};
+    static struct link const l3[] = {{1, 100}, {2, 10}, {4, 5}, {6, 1}};
+    static struct link const l4[] = {{3, 5}, {1, 1}};
+    static struct link const l5[] = {{4, 1}};
+
+    originate(r, l1, 3, 0);
+    /* Alone, nothing is reachable */
+    CHECK(r->count == 0);
+    CHECK(input(r, 2, 1, l2, 2) == 1);
+    CHECK(route_next_hop(r, 2) == 2 && cost_to(r, 2) == 10);
+    CHECK(input(r, 3, 1, l3, 4) == 1);
+    CHECK(input(r, 4, 1, l4, 2) == 1);
+    CHECK(input(r, 5, 1, l5, 1) == 1);
+
+    CHECK(route_next_hop(r, 3) == 2 && cost_to(r, 3) == 20);
+    CHECK(route_next_hop(r, 4) == 2 && cost_to(r, 4) == 25);
+    /* Only one end of 1-5 advertises it, 5-4 neither */
+    CHECK(route_next_hop(r, 5) == 0);
+    CHECK(route_next_hop(r, 6) == 0);
+    CHECK(route_next_hop(r, SELF) == 0);
+    CHECK(r->count == 3);
+
+    /* 2-3 goes down at 2 only, it is not used any more */
+    CHECK(input(r, 2, 2, l2, 1) == 1);
+    CHECK(route_next_hop(r, 3) == 3 && cost_to(r, 3) == 100);
+    CHECK(route_next_hop(r, 4) == 3 && cost_to(r, 4) == 105);
+}
+
+static void
+test_input(struct route *r)
+{
+    static struct link const l2[] = {{1, 10}, {3, 10}};
+    unsigned char buf[ROUTE_LSA_HDR + ROUTE_LSA_LINK];
+
+    /* The same one again, or an older one */
+    CHECK(input(r, 2, 2, l2, 2) == 0);
+    CHECK(input(r, 2, 1, l2, 2) == 0);
+    CHECK(route_next_hop(r, 3) == 3);
+    /* Ours, back through another path */
+    CHECK(input(r, SELF, r->seq + 1, l2, 2) == 0);
+
+    /* The sequence numbers wrap */
+    CHECK(input(r, 2, 0x80000000U, l2, 1) == 1);
+    CHECK(input(r, 2, UINT32_MAX, l2, 1) == 1);
+    CHECK(route_next_hop(r, 3) == 3);
+    CHECK(input(r, 2, 0, l2, 2) == 1);
+    CHECK(route_next_hop(r, 3) == 2);
+    CHECK(input(r, 2, UINT32_MAX, l2, 1) == 0);
+
+    /* Invalid */
+    make_lsa(buf, 2, 10, l2, 1);
+    CHECK(route_lsa_input(r, buf, ROUTE_LSA_HDR - 1) == -1);
+    CHECK(route_lsa_input(r, buf, sizeof(buf) - 1) == -1);
+    make_lsa(buf, 0, 10, l2, 1);
+    CHECK(route_lsa_input(r, buf, sizeof(buf)) == -1);
+    CHECK(route_next_hop(r, 3) == 2);
+}
+
+static void
+test_expire(struct route *r)
+{
+    static uint64_t const gone[] = {2, 4, 5};
+    uint32_t later = ROUTE_MAX_AGE * 1000;
+    size_t i;
+
+    for (i = 0; i < sizeof(gone) / sizeof(*gone); ++i)
+        route_lsa_find(r, gone[i])->expire = later;
+    route_lsa_find(r, 3)->expire = later + 1;
+    route_lsa_find(r, SELF)->expire = 0;
+    CHECK(route_expire(r, later - 1) == 0);
+    CHECK(route_expire(r, later) == 1);
+    CHECK(route_lsa_find(r, 2) == NULL && route_lsa_find(r, 4) == NULL);
+    CHECK(route_lsa_find(r, 3) != NULL);
+    /* Ours is never forgotten */
+    CHECK(route_lsa_find(r, SELF) != NULL);
+    route_compute(r);
+    CHECK(route_next_hop(r, 2) == 0 && route_next_hop(r, 4) == 0);
+    CHECK(route_next_hop(r, 3) == 3);
+}
+
+static void
+test_hosts(struct route *r)
+{
+    struct host_addr a;
+
+    memset(&a, 0, sizeof(a));
+    a.len = 6;
+    memcpy(a.bytes, "\x02\x00\x00\x00\x00\x01", 6);
+    CHECK(route_lookup(r, &a, 0) == 0);
+    route_learn(r, &a, 3, 0);
+    CHECK(route_lookup(r, &a, 1) == 3);
+    /* It moved */
+    route_learn(r, &a, 4, 2);
+    CHECK(route_lookup(r, &a, 3) == 4);
+}
+
+int
+main(void)
+{
+    struct route *r = route_new(SELF);
+
+    if (r == NULL)
+    {
+        fprintf(stderr, "route_new failed\n");
+        return 1;
+    }
+    test_paths(r);
+    test_input(r);
+    test_expire(r);
+    test_hosts(r);
+    route_delete(r);
+    if (failed != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}